@@ -19,6 +19,7 @@
 #define PyBytes_AS_STRING            PyString_AS_STRING
 #define PyBytes_GET_SIZE             PyString_GET_SIZE
 #define PyBytes_CheckExact           PyString_CheckExact
+#define PyBytes_Type                 PyString_Type
 #define PyObject_HashNotImplemented  0
 #endif
 #if PY_VERSION_HEX < 0x02070000
@@ -28,14 +29,41 @@
 #define _PyObject_GC_MAY_BE_TRACKED(obj) \
     (PyObject_IS_GC(obj) && (!PyTuple_CheckExact(obj) || _PyObject_GC_IS_TRACKED(obj)))
 #endif
+#if PY_VERSION_HEX >= 0x03090000
+/* the private macros became functions, with public versions */
+#undef _PyObject_GC_IS_TRACKED
+#undef _PyObject_GC_MAY_BE_TRACKED
+#define _PyObject_GC_IS_TRACKED(o) PyObject_GC_IsTracked((PyObject *)(o))
+#define _PyObject_GC_MAY_BE_TRACKED(obj) \
+    (PyObject_IS_GC(obj) && (!PyTuple_CheckExact(obj) || PyObject_GC_IsTracked(obj)))
+#endif
 #if PY_VERSION_HEX < 0x03020000
 typedef long Py_hash_t;
 #define PyArg_ValidateKeywordArguments(kwds) 1
 #endif
+#if PY_VERSION_HEX >= 0x03030000
+#define HAVE_COMPACT_UNICODE /* PEP 393 */
+#endif
+#if PY_VERSION_HEX < 0x030B0000
+#define PyBytes_CACHED_HASH(ob) (((PyBytesObject *)(ob))->ob_shash)
+#else
+#define PyBytes_CACHED_HASH(ob) -1 /* ob_shash is deprecated, PyObject_Hash reads it */
+#endif
+#if PY_VERSION_HEX >= 0x03080000
+#define HAVE_FASTCALL /* METH_FASTCALL is public */
+#endif
+#if PY_VERSION_HEX >= 0x03090000
+#define HAVE_TYPE_VECTORCALL /* calling a type uses its tp_vectorcall */
+#endif
+#if PY_MAJOR_VERSION < 3 || defined(_PyHASH_MODULUS)
+#define HAVE_INT_LOOKUP /* int hash is reproducible in C */
+#endif
 #if PY_MAJOR_VERSION < 3
 #define PyDict_GetItemWithError PyDict_GetItem
 #else
 #define PyInt_Check                  PyLong_Check
+#define PyInt_CheckExact             PyLong_CheckExact
+#define PyInt_Type                   PyLong_Type
 #define PyInt_FromLong               PyLong_FromLong
 #define PyInt_FromSize_t             PyLong_FromSize_t
 #define PyInt_FromSsize_t            PyLong_FromSsize_t
@@ -45,12 +73,22 @@ typedef long Py_hash_t;
 #define PyString_Concat              PyUnicode_Append
 #define _PyString_Join               PyUnicode_Join
 #define Py_TPFLAGS_CHECKTYPES 0
+#define Py_TPFLAGS_HAVE_NEWBUFFER 0
 #endif
 
 /* Behavioral constants */
 
-#define SPARSEBLOCK_SIZE 48
-#define INITIAL_ITEMS 32 /* Largest power of 2 that fits in one sparseblock. */
+#ifndef SPARSEBLOCK_SIZE
+#define SPARSEBLOCK_SIZE 48 /* Can be anything from 32 to 64. */
+#endif
+#if SPARSEBLOCK_SIZE < 32 || SPARSEBLOCK_SIZE > 64
+#error "SPARSEBLOCK_SIZE must fit the 64-bit bitmap and hold INITIAL_ITEMS"
+#endif
+#if SPARSEBLOCK_SIZE == 64
+#define INITIAL_ITEMS 64 /* Largest power of 2 that fits in one sparseblock. */
+#else
+#define INITIAL_ITEMS 32
+#endif
 
 #ifdef COLLECT_EX_STATS
 #define EX_STATS(stmt) stmt
@@ -64,28 +102,71 @@ typedef struct {
     PyObject *value;
 } dictentry;
 
+typedef unsigned PY_LONG_LONG bitmap_t;
+
 /* Sparse chunk of hash space holding SPARSEBLOCK_SIZE items.
-   Each item is allocated on demand, item allocation status is marked in the bitmap. */
+   Each item is allocated on demand, item allocation status is marked in the bitmap,
+   the number of items is the bitmap population count.
+   Item array grows by 2 entries at a time. In hash caching dicts, entries are followed
+   by the array of their hashes (of the same capacity). SparseSet item arrays hold
+   only the keys, see KEYBLOCK_KEYS. */
 typedef struct {
     dictentry *items;
-    unsigned short num_items;
-    unsigned char bitmap[(SPARSEBLOCK_SIZE + 7) / 8];
+    bitmap_t bitmap;
 } sparseblock;
 
 typedef struct _sparsedictobject SparseDictObject;
+typedef struct _arenaobject arenaobject;
+typedef dictentry *(*lookupfunc)(SparseDictObject *self, PyObject *key, Py_hash_t hash, int insert);
 struct _sparsedictobject {
     PyObject_HEAD
 
-    dictentry *(*lookup)(SparseDictObject *self, PyObject *key, Py_hash_t hash, int insert);
+    lookupfunc lookup;
     Py_ssize_t num_blocks;  /* Chunks of hash space by SPARSEBLOCK_SIZE items. */
     Py_ssize_t num_items;   /* Total number of alocated items in all blocks. */
     Py_ssize_t num_deleted; /* Number of deleted items (allocated, but have NULL key). */
     Py_ssize_t _max_items;   /* Max items possible without resizing the blocks array. Lower bits hold the flags. */
     Py_ssize_t next_index;  /* Index in hash space to resume search for nondeleted items. Used by popitem. */
+    int options;            /* OPTION_* bits set by configure() and the constructor. */
     sparseblock *blocks;
     sparseblock static_blocks[1]; /* Spare block to avoid allocations for "empty" state. */
 
+    /* Incremental resize state. The old table is migrated to blocks block by block,
+       num_items and num_deleted count the items of both tables (old items that are moved
+       are counted as deleted). */
+    sparseblock *old_blocks;    /* NULL if there's no resize in progress. */
+    Py_ssize_t old_num_blocks;
+    Py_ssize_t old_max_items;
+    Py_ssize_t migrate_index;   /* Old blocks below it are migrated (items freed, bitmaps kept). */
+    Py_ssize_t old_num_items;   /* num_items when the migration started. */
+    Py_ssize_t old_size;        /* Upper bound of the nondeleted items in the old blocks. */
+    Py_ssize_t num_pins;        /* Live iterators. Migration does not advance while they exist. */
+    Py_ssize_t num_lookups;     /* Lookups in progress, __eq__ can run in them. See dict_compact. */
+
+    /* Item arrays shared with snapshots (copy-on-write), see dict_own_block.
+       Dicts sharing blocks don't migrate, they resize at once. */
+    PyObject **shared;          /* Per block: the sharedblock holding its item array, or NULL. */
+    Py_ssize_t num_shared;      /* Blocks with a sharedblock, the array is freed when none are left. */
+
+    Py_ssize_t num_compactions;     /* Tombstone compaction statistics. */
+    Py_ssize_t compact_bytes_freed;
+
+    size_t rh_version; /* Changed by Robin Hood inserts, deletes and rebuilds. */
+
+    /* Bloom filter of the keys, NULL unless OPTION_BLOOM is set. Deletes don't clear
+       the bits, the filter is rebuilt with the table and when it has seen too many inserts. */
+    bitmap_t *bloom;
+    size_t bloom_mask;           /* Number of words - 1. */
+    Py_ssize_t bloom_added;      /* Keys added since the filter was built. */
+    Py_ssize_t bloom_rejects;    /* Lookups answered by the filter. */
+    Py_ssize_t bloom_false_positives; /* Lookups the filter let through that missed. */
+
+    /* Contents of the values with value type 'bytes', NULL until the first one. */
+    arenaobject *arena;
+    int arena_pending; /* Inserts with a value in the arena and not in an entry yet. */
+
     EX_STATS(size_t total_collisions;)
+    EX_STATS(size_t total_fingerprint_skips;)
     EX_STATS(size_t total_resizes;)
 };
 
@@ -95,98 +176,491 @@ struct _sparsedictobject {
 #define FLAG_DISABLE_RESIZE  2 /* Used in resize and equals. */
 #define FLAGS_MASK           3
 
-/* sparseblock methods */
+/* Persistent per-dict options, unlike flags they survive the resize. */
+#define OPTION_HASH_CACHE    1 /* Store key hashes alongside the entries. */
+#define OPTION_INCREMENTAL_RESIZE 2 /* Migrate to the resized table a few blocks at a time. */
+#define OPTION_AUTO_COMPACT  4 /* Compact deleted entries after deletes. */
+#define OPTION_ROBIN_HOOD    8 /* Robin Hood engine: linear probing without deleted entries. */
+#define OPTION_FINGERPRINTS 16 /* Store a byte of the key hash alongside the entries. */
+#define OPTION_BLOOM        32 /* Answer lookups of missing keys from a Bloom filter. */
+#define OPTION_VALUE_I8     64 /* Values are stored as raw int64, set by the constructor. */
+#define OPTION_VALUE_F8    128 /* Values are stored as raw doubles, set by the constructor. */
+#define OPTION_KEY_I8      256 /* Keys are stored as raw int64, set by the constructor. */
+#define OPTION_VALUE_BYTES 512 /* Values are bytes stored in the arena, set by the constructor. */
+#define OPTIONS_VALUE_TYPE   (OPTION_VALUE_I8 | OPTION_VALUE_F8 | OPTION_VALUE_BYTES)
+#define OPTIONS_BLOCK_LAYOUT (OPTION_HASH_CACHE | OPTION_FINGERPRINTS) /* Options that change the item arrays. */
+#define OPTIONS_LAYOUT       (OPTIONS_BLOCK_LAYOUT | OPTION_ROBIN_HOOD) /* Options that change the entry layout. */
+#define OPTIONS_ALL          1023
+
+/* Item array allocator
+
+   Item arrays come in a handful of sizes (block capacity times entry size) and large
+   tables have millions of them, so instead of the general purpose heap they are carved
+   from SLAB_SIZE aligned slabs of equal slots, one pool of slabs per size class.
+   The slab owning an array is found by masking the array address. Slabs that become
+   empty go to a small cache shared by all size classes (blocks keep moving to the next
+   size class as they fill up), the rest are returned to the system.
+   Compile with -DNO_SLAB_ALLOC to allocate item arrays with PyMem instead. */
+
+#define SLAB_SIZE        (64 * 1024)
+#define SLAB_GRANULE     16   /* Slot sizes are rounded up to a multiple of it. */
+#define SLAB_MAX_SLOT    4096 /* Largest item array of any layout must fit. */
+#define SLAB_NUM_CLASSES (SLAB_MAX_SLOT / SLAB_GRANULE)
+
+/* Size of the per item data following the entries in the given block layout:
+   the cached hash, the fingerprint or nothing. */
+#define SPARSEBLOCK_TAG_SIZE(layout) \
+    (((layout) & OPTION_HASH_CACHE) ? sizeof(Py_hash_t) : ((layout) & OPTION_FINGERPRINTS) ? 1 : 0)
+
+/* Item array size for num_items entries of entry_size bytes, followed by their hashes
+   or fingerprints. SparseDict entries are dictentry, SparseSet ones just the key. */
+#define SPARSEBLOCK_ARRAY_SIZE(num_items, entry_size, layout) \
+    (SPARSEBLOCK_CAPACITY(num_items) * ((entry_size) + SPARSEBLOCK_TAG_SIZE(layout)))
+#define SPARSEBLOCK_ITEMS_SIZE(num_items, layout) SPARSEBLOCK_ARRAY_SIZE(num_items, sizeof(dictentry), layout)
+
+static size_t items_bytes = 0; /* Memory held by live item arrays, slot rounding included. */
+
+#ifndef NO_SLAB_ALLOC
+#ifdef MS_WINDOWS
+#include <windows.h>
+#elif defined(HAVE_MMAP)
+#include <sys/mman.h>
+#endif
 
-#define BIT_TEST(bitmap, i)  (bitmap[i / 8] &   (1 << (i % 8)))
-#define BIT_SET(bitmap, i)   (bitmap[i / 8] |=  (1 << (i % 8)))
-#define BIT_RESET(bitmap, i) (bitmap[i / 8] &= ~(1 << (i % 8)))
-
-/* 1-bit count (aka population count) in a byte. */
-static const unsigned char popcnt8[256] = {
-    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    4, 5, 5, 6, 5, 6, 6, 7, 5, 6, 6, 7, 6, 7, 7, 8,
+typedef struct _slab slab;
+struct _slab {
+    slab *prev, *next;  /* Links in the pool's list of slabs with free slots. */
+    void *free_slots;   /* Freed slots, linked through their first word. */
+    char *fresh;        /* Slots from here to the end were never used. */
+    char *end;
+    size_t slot_size;
+    Py_ssize_t num_used;
 };
 
+#define SLAB_MAX_EMPTY   16 /* Empty slabs cached for reuse. */
+
+typedef struct {
+    slab *partial; /* Slabs with free slots, allocations are served from the first one. */
+} slabpool;
+
+#define SLAB_HEADER_SIZE (((sizeof(slab) + SLAB_GRANULE - 1) / SLAB_GRANULE) * SLAB_GRANULE)
+#define SLAB_OF(p)       ((slab *)((size_t)(p) & ~(size_t)(SLAB_SIZE - 1)))
+#define SLAB_FULL(s)     ((s)->free_slots == NULL && (s)->fresh == (s)->end)
+
+static slabpool slab_pools[SLAB_NUM_CLASSES + 1];
+static slab *empty_slabs = NULL; /* Cached empty slabs, linked through next. */
+static int num_empty_slabs = 0;
+static Py_ssize_t num_slabs = 0; /* Including the cached ones. */
+
+Py_LOCAL_INLINE(void)
+slab_reset(slab *s)
+{
+    s->free_slots = NULL;
+    s->num_used = 0;
+    s->fresh = (char *)s + SLAB_HEADER_SIZE;
+    s->end = s->fresh + (SLAB_SIZE - SLAB_HEADER_SIZE) / s->slot_size * s->slot_size;
+}
+
+Py_LOCAL(slab *)
+slab_new(size_t slot_size)
+{
+    void *p;
+
+    if (empty_slabs != NULL) {
+        p = empty_slabs;
+        empty_slabs = empty_slabs->next;
+        --num_empty_slabs;
+        ((slab *)p)->slot_size = slot_size;
+        slab_reset((slab *)p);
+        return (slab *)p;
+    }
+#if defined(MS_WINDOWS)
+    /* VirtualAlloc regions are aligned to the 64K allocation granularity. */
+    p = VirtualAlloc(NULL, SLAB_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#elif defined(HAVE_MMAP) && defined(MAP_ANONYMOUS)
+    {
+        /* Map twice the size and unmap the misaligned head and the tail. */
+        char *region = (char *)mmap(NULL, 2 * SLAB_SIZE, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        size_t head;
+        if (region == MAP_FAILED)
+            return NULL;
+        head = (SLAB_SIZE - (size_t)region % SLAB_SIZE) % SLAB_SIZE;
+        if (head != 0)
+            munmap(region, head);
+        munmap(region + head + SLAB_SIZE, SLAB_SIZE - head);
+        p = region + head;
+    }
+#else
+    if (posix_memalign(&p, SLAB_SIZE, SLAB_SIZE) != 0)
+        p = NULL;
+#endif
+    if (p != NULL) {
+        ((slab *)p)->slot_size = slot_size;
+        slab_reset((slab *)p);
+        ++num_slabs;
+    }
+    return (slab *)p;
+}
+
+Py_LOCAL(void)
+slab_release(slab *s)
+{
+    if (num_empty_slabs < SLAB_MAX_EMPTY) {
+        s->next = empty_slabs;
+        empty_slabs = s;
+        ++num_empty_slabs;
+        return;
+    }
+    --num_slabs;
+#if defined(MS_WINDOWS)
+    VirtualFree(s, 0, MEM_RELEASE);
+#elif defined(HAVE_MMAP) && defined(MAP_ANONYMOUS)
+    munmap(s, SLAB_SIZE);
+#else
+    free(s);
+#endif
+}
+#endif /* NO_SLAB_ALLOC */
+
+/* Memory actually taken by an item array of the given size. */
+Py_LOCAL_INLINE(size_t)
+items_alloc_size(size_t size)
+{
+#ifdef NO_SLAB_ALLOC
+    return size;
+#else
+    return (size + SLAB_GRANULE - 1) & ~(size_t)(SLAB_GRANULE - 1);
+#endif
+}
+
+/* Allocate an item array. Returns NULL on failure, without setting an exception. */
+Py_LOCAL(void *)
+items_alloc(size_t size)
+{
+    void *p;
+#ifndef NO_SLAB_ALLOC
+    slabpool *pool;
+    slab *s;
+#endif
+
+    size = items_alloc_size(size);
+    assert(size > 0);
+#ifdef NO_SLAB_ALLOC
+    p = PyMem_MALLOC(size);
+    if (p == NULL)
+        return NULL;
+#else
+    assert(size <= SLAB_MAX_SLOT);
+    pool = &slab_pools[size / SLAB_GRANULE];
+    s = pool->partial;
+    if (s == NULL) {
+        if ((s = slab_new(size)) == NULL)
+            return NULL;
+        s->prev = s->next = NULL;
+        pool->partial = s;
+    }
+    assert(s->slot_size == size);
+
+    if (s->free_slots != NULL) {
+        p = s->free_slots;
+        s->free_slots = *(void **)p;
+    }
+    else {
+        p = s->fresh;
+        s->fresh += size;
+    }
+    ++s->num_used;
+    if (SLAB_FULL(s)) {
+        /* Full slabs are off the list until one of their slots is freed. */
+        pool->partial = s->next;
+        if (s->next != NULL)
+            s->next->prev = NULL;
+    }
+#endif
+    items_bytes += size;
+    return p;
+}
+
+/* Free an item array of the given size (as passed to items_alloc). NULL is ignored. */
+Py_LOCAL(void)
+items_free(void *p, size_t size)
+{
+#ifndef NO_SLAB_ALLOC
+    slabpool *pool;
+    slab *s;
+#endif
+
+    if (p == NULL)
+        return;
+    size = items_alloc_size(size);
+    items_bytes -= size;
+#ifdef NO_SLAB_ALLOC
+    PyMem_FREE(p);
+#else
+    pool = &slab_pools[size / SLAB_GRANULE];
+    s = SLAB_OF(p);
+    assert(s->slot_size == size && s->num_used > 0);
+
+    if (SLAB_FULL(s)) {
+        s->prev = NULL;
+        s->next = pool->partial;
+        if (pool->partial != NULL)
+            pool->partial->prev = s;
+        pool->partial = s;
+    }
+    *(void **)p = s->free_slots;
+    s->free_slots = p;
+
+    if (--s->num_used == 0) {
+        if (s->prev != NULL)
+            s->prev->next = s->next;
+        else
+            pool->partial = s->next;
+        if (s->next != NULL)
+            s->next->prev = s->prev;
+        slab_release(s);
+    }
+#endif
+}
+
+/* sparseblock methods */
+
+#define BIT(i)               ((bitmap_t)1 << (i))
+#define BIT_TEST(bitmap, i)  ((bitmap) & BIT(i))
+#define BIT_SET(bitmap, i)   ((bitmap) |= BIT(i))
+#define BIT_RESET(bitmap, i) ((bitmap) &= ~BIT(i))
+
+#if (defined(__GNUC__) && defined(__x86_64__)) || (defined(_MSC_VER) && defined(_M_X64))
+#define HAVE_POPCNT_DISPATCH
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+static int have_popcnt = 0; /* CPU supports POPCNT instruction, set by popcount_init. */
+#endif
+
+Py_LOCAL(void)
+popcount_init(void)
+{
+#ifdef HAVE_POPCNT_DISPATCH
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    have_popcnt = (info[2] >> 23) & 1;
+#else
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        have_popcnt = (ecx >> 23) & 1;
+#endif
+#endif
+}
+
+/* 1-bit count (aka population count) of the bitmap. */
+Py_LOCAL_INLINE(int)
+popcount(bitmap_t x)
+{
+#if defined(__POPCNT__)
+    /* Compiled for a CPU with POPCNT, no need to check. */
+    return __builtin_popcountll(x);
+#else
+#if defined(HAVE_POPCNT_DISPATCH)
+    if (have_popcnt) {
+#ifdef _MSC_VER
+        return (int)__popcnt64(x);
+#else
+        bitmap_t count;
+        __asm__ ("popcnt %1, %0" : "=r" (count) : "r" (x));
+        return (int)count;
+#endif
+    }
+#elif defined(__GNUC__)
+    return __builtin_popcountll(x);
+#endif
+    x = x - ((x >> 1) & 0x5555555555555555ull);
+    x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0full;
+    return (int)((x * 0x0101010101010101ull) >> 56);
+#endif
+}
+
+/* Hint the CPU to start loading the cache line at address p. Never faults. */
+#if defined(__GNUC__)
+#define PREFETCH(p) __builtin_prefetch(p)
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#define PREFETCH(p) _mm_prefetch((const char *)(p), _MM_HINT_T0)
+#else
+#define PREFETCH(p) ((void)0)
+#endif
+
+/* Integer hash based on PRNG. Used as a post-processing step for not so uniform Python's hashes. */
+Py_LOCAL_INLINE(size_t)
+hash_mix(Py_hash_t hash)
+{
+    /* On 32-bit platforms, only lower 32 bits are used. */
+    return (size_t)(2862933555777941757ull * (unsigned PY_LONG_LONG)hash + 3037000493ul);
+}
+
+/* Number of allocated items in the block. */
+#define SPARSEBLOCK_NUM_ITEMS(block) popcount((block)->bitmap)
+
+/* Allocated size of the item array holding num_items entries. */
+#define SPARSEBLOCK_CAPACITY(num_items) (((num_items) + 1) & ~1)
+
+/* Hashes or fingerprints following the entries of entry_size bytes. */
+#define SPARSEBLOCK_TAGS(block, entry_size) \
+    ((char *)(block)->items + SPARSEBLOCK_CAPACITY(SPARSEBLOCK_NUM_ITEMS(block)) * (entry_size))
+
+/* Key slot of the n-th entry of entry_size bytes in the item array. Entries start with the key. */
+#define SPARSEBLOCK_SLOT(items, n, entry_size) ((PyObject **)((char *)(items) + (n) * (entry_size)))
+
+/* Cached hashes of the block entries, valid only in hash caching dicts. */
+#define SPARSEBLOCK_HASHES(block) ((Py_hash_t *)SPARSEBLOCK_TAGS(block, sizeof(dictentry)))
+
+/* Fingerprints of the block entries, in place of the hashes in fingerprinting dicts.
+   The index uses the low bits of the mixed hash, the fingerprint takes the high ones. */
+#define SPARSEBLOCK_FINGERPRINTS(block) ((unsigned char *)SPARSEBLOCK_HASHES(block))
+#define FINGERPRINT(hash) ((unsigned char)(hash_mix(hash) >> (8 * sizeof(size_t) - 8)))
+
 /* Check that sparseblock is healthy. */
 #define SPARSEBLOCK_INVARIANT(block, index) \
     do { \
-        Py_ssize_t num_items = 0; \
         assert(index >= 0 && index < SPARSEBLOCK_SIZE); \
         assert((block) != NULL); \
-        assert((block)->num_items == 0 || (block)->items != NULL); \
-        assert((block)->num_items >= 0 && (block)->num_items <= SPARSEBLOCK_SIZE); \
-        for (i = 0; i < SPARSEBLOCK_SIZE / 8; ++i) \
-            num_items += popcnt8[(block)->bitmap[i]]; \
-        assert(num_items == (block)->num_items); \
+        assert((block)->bitmap == 0 || (block)->items != NULL); \
+        assert(((block)->bitmap >> (SPARSEBLOCK_SIZE - 1) >> 1) == 0); \
     } while (0)
 
-/* Find the item at index. If the item is not allocated, return NULL. */
-Py_LOCAL_INLINE(dictentry *)
-sparseblock_find(sparseblock *block, Py_ssize_t index)
+/* Find the entry of entry_size bytes at index, returning its key slot.
+   If the item is not allocated, return NULL. */
+Py_LOCAL_INLINE(PyObject **)
+sparseblock_find_slot(sparseblock *block, Py_ssize_t index, size_t entry_size)
 {
-    int i, offset = 0;
-
     SPARSEBLOCK_INVARIANT(block, index);
 
     if (!BIT_TEST(block->bitmap, index))
         return NULL;
-
-    for (i = 0; index > 8; ++i, index -= 8)
-        offset += popcnt8[block->bitmap[i]];
-    offset += popcnt8[block->bitmap[i] & ((1 << index)-1)];
-
-    return &block->items[offset];
+    /* Offset is the count of allocated items (bitmap bits) below index. */
+    return SPARSEBLOCK_SLOT(block->items, popcount(block->bitmap & (BIT(index) - 1)), entry_size);
 }
 
-/* Allocate new item at the previously unallocated index. Returns NULL on failure. */
-Py_LOCAL_INLINE(dictentry *)
-sparseblock_insert(sparseblock *block, Py_ssize_t index)
+/* Allocate new entry of entry_size bytes at the previously unallocated index, returning
+   its key slot. Returns NULL on failure. If the layout has OPTION_HASH_CACHE or
+   OPTION_FINGERPRINTS set, the item array has the hash or fingerprint array attached and
+   the new item's one is stored there. */
+Py_LOCAL_INLINE(PyObject **)
+sparseblock_insert_slot(sparseblock *block, Py_ssize_t index, Py_hash_t hash, int layout, size_t entry_size)
 {
-    int i, num_items, offset = 0;
-    dictentry *items;
+    int num_items, offset;
+    size_t tag_size = SPARSEBLOCK_TAG_SIZE(layout);
+    char *items, *new_items, *tags, *old_tags;
 
     SPARSEBLOCK_INVARIANT(block, index);
     assert(!BIT_TEST(block->bitmap, index)); /* not allocated yet? */
-    assert(block->num_items < SPARSEBLOCK_SIZE); /* enough space for another element? */
 
-    items = block->items;
-    num_items = block->num_items + 1;
-    /* Realloc only every other insert */
+    items = (char *)block->items;
+    num_items = SPARSEBLOCK_NUM_ITEMS(block) + 1;
+    assert(num_items <= SPARSEBLOCK_SIZE); /* enough space for another element? */
+    offset = popcount(block->bitmap & (BIT(index) - 1));
+
+    /* Move to the next size class every other insert, leaving the gap at offset while copying. */
     if (num_items & 1) {
-        items = PyMem_RESIZE(items, dictentry, num_items + 1);
-        if (items == NULL) {
+        new_items = (char *)items_alloc(SPARSEBLOCK_ARRAY_SIZE(num_items, entry_size, layout));
+        if (new_items == NULL) {
             PyErr_NoMemory();
             return NULL;
         }
-        block->items = items;
+        if (items != NULL) {
+            memcpy(new_items, items, offset * entry_size);
+            memcpy(new_items + (offset + 1) * entry_size, items + offset * entry_size,
+                   (num_items - 1 - offset) * entry_size);
+            if (tag_size) {
+                /* Hash (fingerprint) arrays start right after the entries. */
+                old_tags = items + (num_items - 1) * entry_size;
+                tags = new_items + (num_items + 1) * entry_size;
+                memcpy(tags, old_tags, offset * tag_size);
+                memcpy(tags + (offset + 1) * tag_size, old_tags + offset * tag_size,
+                       (num_items - 1 - offset) * tag_size);
+            }
+            items_free(items, SPARSEBLOCK_ARRAY_SIZE(num_items - 1, entry_size, layout));
+        }
+        block->items = (dictentry *)new_items;
+        items = new_items;
+        BIT_SET(block->bitmap, index);
+    }
+    else {
+        BIT_SET(block->bitmap, index);
+        /* Shift to make place for new item. */
+        memmove(items + (offset + 1) * entry_size, items + offset * entry_size,
+                (num_items - 1 - offset) * entry_size);
+        if (tag_size) {
+            tags = SPARSEBLOCK_TAGS(block, entry_size);
+            memmove(tags + (offset + 1) * tag_size, tags + offset * tag_size,
+                    (num_items - 1 - offset) * tag_size);
+        }
     }
-    block->num_items = (unsigned short) num_items;
-    BIT_SET(block->bitmap, index);
+    if (layout & OPTION_HASH_CACHE)
+        ((Py_hash_t *)SPARSEBLOCK_TAGS(block, entry_size))[offset] = hash;
+    else if (layout & OPTION_FINGERPRINTS)
+        ((unsigned char *)SPARSEBLOCK_TAGS(block, entry_size))[offset] = FINGERPRINT(hash);
 
-    /* Count allocated nodes (bitmap bits) upto index. */
-    for (i = 0; index > 8; ++i, index -= 8)
-        offset += popcnt8[block->bitmap[i]];
-    offset += popcnt8[block->bitmap[i] & ((1 << index)-1)];
+    return SPARSEBLOCK_SLOT(items, offset, entry_size);
+}
+
+/* Find the item at index. If the item is not allocated, return NULL. */
+#define sparseblock_find(block, index) ((dictentry *)sparseblock_find_slot(block, index, sizeof(dictentry)))
 
-    /* Shift to make place for new item. */
-    for (i = num_items - 1; i > offset; --i)
-        items[i] = items[i-1];
+/* Allocate new item at the previously unallocated index. Returns NULL on failure. */
+#define sparseblock_insert(block, index, hash, layout) \
+    ((dictentry *)sparseblock_insert_slot(block, index, hash, layout, sizeof(dictentry)))
 
-    return &items[offset];
+/* Free the items at the indexes set in the removed bitmap, moving the rest to a smaller
+   item array if it fits one. Returns -1 on memory error, the block is unchanged then. */
+Py_LOCAL(int)
+sparseblock_remove(sparseblock *block, bitmap_t removed, int layout)
+{
+    int i, j, k, num_items = SPARSEBLOCK_NUM_ITEMS(block);
+    int new_num_items = num_items - popcount(removed);
+    dictentry *items = block->items, *new_items = items;
+    Py_hash_t *hashes, *new_hashes;
+    unsigned char *fingerprints, *new_fingerprints;
+
+    assert((block->bitmap & removed) == removed);
+    if (SPARSEBLOCK_CAPACITY(new_num_items) != SPARSEBLOCK_CAPACITY(num_items)) {
+        new_items = NULL;
+        if (new_num_items > 0) {
+            new_items = (dictentry *)items_alloc(SPARSEBLOCK_ITEMS_SIZE(new_num_items, layout));
+            if (new_items == NULL) {
+                PyErr_NoMemory();
+                return -1;
+            }
+        }
+    }
+    /* Same capacity means the same place for the hashes, compact in place then. */
+    hashes = (Py_hash_t *)(items + SPARSEBLOCK_CAPACITY(num_items));
+    new_hashes = new_items != NULL ? (Py_hash_t *)(new_items + SPARSEBLOCK_CAPACITY(new_num_items)) : NULL;
+    fingerprints = (unsigned char *)hashes;
+    new_fingerprints = (unsigned char *)new_hashes;
+    for (i = 0, j = 0, k = 0; i < SPARSEBLOCK_SIZE; ++i) {
+        if (!BIT_TEST(block->bitmap, i))
+            continue;
+        if (!BIT_TEST(removed, i)) {
+            new_items[k] = items[j];
+            if (layout & OPTION_HASH_CACHE)
+                new_hashes[k] = hashes[j];
+            else if (layout & OPTION_FINGERPRINTS)
+                new_fingerprints[k] = fingerprints[j];
+            ++k;
+        }
+        ++j;
+    }
+    if (new_items != items)
+        items_free(items, SPARSEBLOCK_ITEMS_SIZE(num_items, layout));
+    block->items = new_items;
+    block->bitmap &= ~removed;
+    return 0;
 }
 
 /* SparseDict macros */
@@ -198,14 +672,26 @@ PyTypeObject SparseDictIterItem_Type;
 PyTypeObject SparseDictKeys_Type;
 PyTypeObject SparseDictValues_Type;
 PyTypeObject SparseDictItems_Type;
+PyTypeObject SparseDictMapped_Type;
+PyTypeObject SparseDictMappedIter_Type;
+PyTypeObject SparseDictSharedBlock_Type;
+PyTypeObject SparseDictArena_Type;
+PyTypeObject SparseSet_Type;
+PyTypeObject SparseSetIter_Type;
 
 #define SparseDict_Check(op) PyObject_TypeCheck(op, &SparseDict_Type)
 #define SparseDict_CheckExact(op) (Py_TYPE(op) == &SparseDict_Type)
 #define SparseDictViewSet_Check(op) \
     (Py_TYPE(op) == &SparseDictKeys_Type || Py_TYPE(op) == &SparseDictItems_Type)
+#define SparseSet_Check(op) PyObject_TypeCheck(op, &SparseSet_Type)
 
 #define SparseDict_MAX_ITEMS(sdict) ((sdict)->_max_items & ~FLAGS_MASK)
 #define SparseDict_SIZE(sdict) ((sdict)->num_items - (sdict)->num_deleted)
+#define SparseDict_HASH_CACHE(sdict) ((sdict)->options & OPTION_HASH_CACHE)
+#define SparseDict_LAYOUT(sdict) ((sdict)->options & OPTIONS_BLOCK_LAYOUT)
+#define SparseDict_MIGRATING(sdict) ((sdict)->old_blocks != NULL)
+/* Allocated items the table will have when the migration is finished (upper bound). */
+#define SparseDict_LOAD(sdict) ((sdict)->num_items - (sdict)->old_num_items + (sdict)->old_size)
 
 #define SparseDict_INIT_NONZERO(sdict) \
     do { \
@@ -219,8 +705,18 @@ PyTypeObject SparseDictItems_Type;
         (sdict)->num_items = 0; \
         (sdict)->num_deleted = 0; \
         (sdict)->next_index = 0; \
+        (sdict)->old_blocks = NULL; \
+        (sdict)->old_num_blocks = 0; \
+        (sdict)->old_max_items = 0; \
+        (sdict)->migrate_index = 0; \
+        (sdict)->old_num_items = 0; \
+        (sdict)->old_size = 0; \
+        (sdict)->shared = NULL; \
+        (sdict)->num_shared = 0; \
         EX_STATS((sdict)->total_collisions = 0); \
+        EX_STATS((sdict)->total_fingerprint_skips = 0); \
         EX_STATS((sdict)->total_resizes = 0); \
+        ++(sdict)->rh_version; \
         memset((sdict)->static_blocks, 0, sizeof(sparseblock)); \
         SparseDict_INIT_NONZERO(sdict); \
     } while (0)
@@ -234,1625 +730,7689 @@ PyTypeObject SparseDictItems_Type;
         assert((sdict)->blocks != NULL); \
         assert(SparseDict_MAX_ITEMS(sdict) >= INITIAL_ITEMS); \
         assert((SparseDict_MAX_ITEMS(sdict) & (SparseDict_MAX_ITEMS(sdict) - 1)) == 0); /* power of 2 */ \
-        assert((sdict)->num_items <= SparseDict_MAX_ITEMS(sdict)); \
+        assert((sdict)->num_items - (sdict)->old_num_items <= SparseDict_MAX_ITEMS(sdict)); \
         assert((sdict)->num_deleted <= (sdict)->num_items); \
+        assert((sdict)->migrate_index <= (sdict)->old_num_blocks); \
+        assert(SparseDict_MIGRATING(sdict) || (sdict)->old_num_blocks == 0); \
     } while (0)
 
-/* Iterator over allocated items in all blocks. Cannot be nested. Do not use continue. */
+/* Empty block standing for the migrated old blocks. */
+static sparseblock empty_block = {NULL, 0};
+
+/* Block i of both tables: new blocks first, then the old ones (during incremental resize). */
+Py_LOCAL_INLINE(sparseblock *)
+dict_block(SparseDictObject *self, Py_ssize_t i)
+{
+    if (i < self->num_blocks)
+        return &self->blocks[i];
+    i -= self->num_blocks;
+    return i < self->migrate_index ? &empty_block : &self->old_blocks[i];
+}
+
+/* Iterator over allocated items in all blocks of both tables. Cannot be nested. Do not use continue. */
 #define SparseDict_FOR(sdict, entry) \
     { \
         Py_ssize_t i__; \
         int j__, num_items__; \
+        sparseblock *block__; \
         dictentry *items__, entry; \
-        for (i__ = 0; i__ < (sdict)->num_blocks; ++i__) { \
-            items__ = (sdict)->blocks[i__].items; \
-            num_items__ = (sdict)->blocks[i__].num_items; \
+        for (i__ = 0; i__ < (sdict)->num_blocks + (sdict)->old_num_blocks; ++i__) { \
+            block__ = dict_block(sdict, i__); \
+            items__ = block__->items; \
+            num_items__ = SPARSEBLOCK_NUM_ITEMS(block__); \
             for (j__ = 0; j__ < num_items__; ++j__) { \
                 entry = items__[j__]; \
                 if (entry.key != NULL) {
 
+/* Cached hash of the current SparseDict_FOR entry. */
+#define SparseDict_FOR_HASH(sdict) (SPARSEBLOCK_HASHES(block__)[j__])
+
 #define SparseDict_ENDFOR(sdict, destructive) \
                 } \
             } \
-            if (destructive) PyMem_FREE(items__); \
+            if (destructive) \
+                items_free(items__, SPARSEBLOCK_ITEMS_SIZE(num_items__, SparseDict_LAYOUT(sdict))); \
         } \
         if (destructive && ((sdict)->blocks != (sdict)->static_blocks)) \
             PyMem_FREE((sdict)->blocks); \
+        if (destructive) \
+            PyMem_FREE((sdict)->old_blocks); \
     }
 
 /* Delay GC tracking until the first trackable item is inserted. */
 #define MAINTAIN_TRACKING(sdict, key, value) \
     do { \
         if (!_PyObject_GC_IS_TRACKED(sdict)) \
-            if (_PyObject_GC_MAY_BE_TRACKED(key) || _PyObject_GC_MAY_BE_TRACKED(value)) \
+            if ((!SparseDict_KEY_TYPE(sdict) && _PyObject_GC_MAY_BE_TRACKED(key)) || \
+                    (!SparseDict_VALUE_TYPE(sdict) && _PyObject_GC_MAY_BE_TRACKED(value))) \
                 PyObject_GC_Track(sdict); \
     } while (0)
 
-/* Forward */
-static PyObject *dictiter_new(SparseDictObject *dict, PyTypeObject *type);
-static PyObject *dictview_new(SparseDictObject *dict, PyTypeObject *type);
+/* Typed values
 
-/* Dummy "deleted" entry used by dict_lookup to distinguish "not found" from error (NULL). */
-static dictentry entry_not_found = {NULL, NULL};
+   With a value type, the value field of the entries holds the bits of an int64 ('i8'),
+   a double ('f8') or the place of a bytes value in the arena ('bytes', see below) instead
+   of a reference, values are boxed when read. Such entries have no value references to
+   count or to visit. The type is set by the constructor. */
 
-/* SparseDict method helpers */
+#define SparseDict_VALUE_TYPE(sdict) ((sdict)->options & OPTIONS_VALUE_TYPE)
+#define TYPED_VALUES (SIZEOF_VOID_P >= 8) /* The value field must fit the scalars. */
 
-Py_LOCAL(int) dict_resize(SparseDictObject *self, Py_ssize_t new_max_items);
-Py_LOCAL(int) dict_resize_delta(SparseDictObject *self, Py_ssize_t delta);
+typedef union {
+    PyObject *object;
+    PY_LONG_LONG i8;
+    double f8;
+} valuebits;
 
-/* Integer hash based on PRNG. Used as a post-processing step for not so uniform Python's hashes. */
-Py_LOCAL_INLINE(size_t)
-hash_mix(Py_hash_t hash)
+/* New reference to the value an entry stores with value type typed (0 for objects). */
+Py_LOCAL_INLINE(PyObject *)
+value_box(int typed, PyObject *stored)
 {
-    /* On 32-bit platforms, only lower 32 bits are used. */
-    return (size_t)(2862933555777941757ull * (unsigned PY_LONG_LONG)hash + 3037000493ul);
+    valuebits bits;
+
+    if (!typed) {
+        Py_INCREF(stored);
+        return stored;
+    }
+    bits.object = stored;
+    if (typed == OPTION_VALUE_F8)
+        return PyFloat_FromDouble(bits.f8);
+#if PY_MAJOR_VERSION < 3
+    if (bits.i8 >= LONG_MIN && bits.i8 <= LONG_MAX)
+        return PyInt_FromLong((long)bits.i8);
+#endif
+    return PyLong_FromLongLong(bits.i8);
 }
 
-/* Same as _PyString_Equal but using the public API. */
-Py_LOCAL_INLINE(int)
-string_equal(PyObject *arg1, PyObject *arg2)
+/* What an entry stores for value with value type typed: value itself (borrowed) for
+   objects, its bits otherwise. Returns -1 with TypeError or OverflowError set if value
+   doesn't convert. */
+Py_LOCAL(int)
+value_unbox(int typed, PyObject *value, PyObject **stored)
 {
-    PyBytesObject *s1 = (PyBytesObject *)arg1;
-    PyBytesObject *s2 = (PyBytesObject *)arg2;
-
-    assert(PyBytes_CheckExact(arg1));
-    assert(PyBytes_CheckExact(arg2));
+    valuebits bits;
+    PyObject *index;
+    int overflow;
 
-    if (PyBytes_GET_SIZE(s1) != PyBytes_GET_SIZE(s2))
-        return 0;
-    if (PyBytes_AS_STRING(s1)[0] != PyBytes_AS_STRING(s2)[0])
+    if (!typed) {
+        *stored = value;
         return 0;
-    return memcmp(PyBytes_AS_STRING(s1),
-                  PyBytes_AS_STRING(s2),
-                  PyBytes_GET_SIZE(s1)) == 0;
+    }
+    bits.object = NULL;
+    if (typed == OPTION_VALUE_F8) {
+        bits.f8 = PyFloat_AsDouble(value); /* float(), without parsing strings */
+        if (bits.f8 == -1.0 && PyErr_Occurred())
+            return -1;
+    }
+    else {
+        index = PyNumber_Index(value); /* no floats */
+        if (index == NULL)
+            return -1;
+        bits.i8 = PyLong_AsLongLongAndOverflow(index, &overflow);
+        Py_DECREF(index);
+        if (bits.i8 == -1 && PyErr_Occurred())
+            return -1;
+        if (overflow) {
+            PyErr_SetString(PyExc_OverflowError, "value does not fit value_type 'i8'");
+            return -1;
+        }
+    }
+    *stored = bits.object;
+    return 0;
 }
 
-/* Set a key error with the specified argument, wrapping it in a
- * tuple automatically so that tuple keys are not unpacked as the
- * exception arguments. */
-Py_LOCAL_INLINE(void)
-set_key_error(PyObject *arg)
+#define VALUE_INCREF(typed, value) do { if (!(typed)) Py_INCREF(value); } while (0)
+#define VALUE_DECREF(typed, value) do { if (!(typed)) Py_DECREF(value); } while (0)
+
+/* Bytes values
+
+   With value type 'bytes' the contents of the values are appended to the arena of the
+   dict, the value field holds their offset and length. Replaced and deleted values stay
+   in the arena until dict_resize compacts it. get_view returns memoryviews of the arena:
+   an arena with exported buffers is neither moved nor freed, the dict copies its values
+   to a new one instead and the views keep the old one alive. */
+
+#define ARENA_LEN_BITS 24
+#define ARENA_MAX_LEN  (((Py_ssize_t)1 << ARENA_LEN_BITS) - 1)
+#define ARENA_MAX_SIZE ((PY_LONG_LONG)1 << (64 - ARENA_LEN_BITS))
+#define ARENA_MIN_SIZE 1024
+#define ARENA_OFFSET(stored) ((Py_ssize_t)((size_t)(stored) >> ARENA_LEN_BITS))
+#define ARENA_LEN(stored)    ((Py_ssize_t)((size_t)(stored) & ARENA_MAX_LEN))
+#define ARENA_STORED(offset, len) ((PyObject *)(((size_t)(offset) << ARENA_LEN_BITS) | (size_t)(len)))
+
+struct _arenaobject {
+    PyObject_HEAD
+    char *data;
+    Py_ssize_t size;    /* Allocated bytes. */
+    Py_ssize_t used;    /* End of the last value. */
+    Py_ssize_t exports; /* Buffers held by memoryviews. */
+};
+
+Py_LOCAL(arenaobject *)
+arena_new(Py_ssize_t size)
 {
-    PyObject *tuple;
-    tuple = PyTuple_Pack(1, arg);
-    if (!tuple)
-        return; /* caller will expect error to be set anyway */
-    PyErr_SetObject(PyExc_KeyError, tuple);
-    Py_DECREF(tuple);
+    arenaobject *arena = PyObject_New(arenaobject, &SparseDictArena_Type);
+    if (arena == NULL)
+        return NULL;
+    arena->data = (char *)PyMem_MALLOC(size);
+    arena->size = size;
+    arena->used = 0;
+    arena->exports = 0;
+    if (arena->data == NULL) {
+        Py_DECREF(arena);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    return arena;
 }
 
-/* Next nondeleted item search. Used in popitem() and iterators. */
-Py_LOCAL_INLINE(dictentry *)
-dict_next(SparseDictObject *self, Py_ssize_t *index, int wrap)
+static void
+arena_tp_dealloc(arenaobject *arena)
 {
-    dictentry *entry = NULL;
-    int j = (int)*index & 0x3f;
-    Py_ssize_t i = *index >> 6;
-    do {
-        for (; i < self->num_blocks; ++i) {
-            int num_items = self->blocks[i].num_items;
-            dictentry *items = self->blocks[i].items;
+    PyMem_FREE(arena->data);
+    PyObject_Del(arena);
+}
 
-            for (; j < num_items; ++j) {
-                entry = &items[j];
-                if (entry->key != NULL)
-                    goto Found;
-            }
-            j = 0;
-        }
-        i = 0;
-    } while (wrap);
-Found:
-    *index = (i << 6) | (j+1);
-    return entry;
+static int
+arena_getbuffer(arenaobject *arena, Py_buffer *view, int flags)
+{
+    if (PyBuffer_FillInfo(view, (PyObject *)arena, arena->data, arena->used, 1, flags) != 0)
+        return -1;
+    ++arena->exports;
+    return 0;
 }
 
-/* Search for an entry with the specified key.
-   If the key is not found and insert = 1, new entry is inserted and returned,
-   otherwise a dummy deleted entry is returned. if hash parameter is -1, it's recalculated
-   from the key. NULL return return means error. */
-static dictentry *
-dict_lookup(SparseDictObject *self, PyObject *key, Py_hash_t hash, int insert)
+static void
+arena_releasebuffer(arenaobject *arena, Py_buffer *view)
 {
-    /* NULL key will make it look like deleted entry. */
-    size_t i, num_probes = 0;
-    size_t max_items_mask = (size_t)SparseDict_MAX_ITEMS(self) - 1;
-    dictentry *entry, *freeslot = NULL;
-    sparseblock *blocks = self->blocks;
-    int cmp;
-    PyObject *old_key;
+    --arena->exports;
+}
 
-    if (hash == -1) {
-        if (PyBytes_CheckExact(key)) {
-            hash = ((PyBytesObject *)key)->ob_shash;
-            if (hash == -1)
-                hash = PyObject_Hash(key);
-        }
-        else {
-            hash = PyObject_Hash(key);
-            if (hash == -1)
-                return NULL;
-        }
-    }
-    i = hash_mix((size_t)hash) & max_items_mask;
-    for (;;) {
-        entry = sparseblock_find(&blocks[i / SPARSEBLOCK_SIZE], i % SPARSEBLOCK_SIZE);
-        if (entry == NULL) {
-            if (freeslot != NULL)
-                return freeslot;
-            if (!insert)
-                return &entry_not_found;
-
-            entry = sparseblock_insert(&blocks[i / SPARSEBLOCK_SIZE], i % SPARSEBLOCK_SIZE);
-            if (entry != NULL)
-                /* Mark as deleted to distinguish newly inserved from existing. */
-                entry->key = NULL;
-            return entry;
-        }
-        if (entry->key == key)
-            return entry;
-        if (entry->key != NULL) {
-            old_key = entry->key;
-            Py_INCREF(old_key);
-            cmp = PyObject_RichCompareBool(old_key, key, Py_EQ);
-            Py_DECREF(old_key);
-            if (cmp < 0)
-                return NULL;
-            if (self->blocks == blocks && entry->key == old_key) {
-                if (cmp > 0)
-                    return entry;
-            }
-            else {
-                /* richcmp has changed the dict, restart */
-                return dict_lookup(self, key, hash, insert);
-            }
-        }
-        else if (freeslot == NULL)
-            /* entry->key == NULL, deleted entry */
-            freeslot = entry;
-
-        /* Quadratic probing */
-        ++num_probes;
-        i = (i + num_probes) & max_items_mask;
-        EX_STATS(++self->total_collisions);
-    }
-    assert(0); /* NOT REACHED */
+/* New reference to the bytes value an entry stores in arena. */
+Py_LOCAL_INLINE(PyObject *)
+arena_box(arenaobject *arena, PyObject *stored)
+{
+    assert(ARENA_OFFSET(stored) + ARENA_LEN(stored) <= arena->used);
+    return PyBytes_FromStringAndSize(arena->data + ARENA_OFFSET(stored), ARENA_LEN(stored));
 }
 
-/* Special-case dict_lookup that assumes all keys in the dictionary are PyStringObjects. */
-static dictentry *
-dict_lookup_string(SparseDictObject *self, PyObject *key, Py_hash_t  hash, int insert)
+/* Length of value, -1 with TypeError or OverflowError set if it's not bytes or too long. */
+Py_LOCAL(Py_ssize_t)
+arena_value_len(PyObject *value)
 {
-    dictentry *entry, *freeslot = NULL;
-    sparseblock *blocks = self->blocks;
-    size_t i, num_probes = 0;
-    size_t max_items_mask = (size_t)SparseDict_MAX_ITEMS(self) - 1;
-
-    if (!PyBytes_CheckExact(key)) {
-        /* First non-string key, revert to universal lookup. */
-        self->lookup = dict_lookup;
-        return dict_lookup(self, key, hash, insert);
-    }
-    if (hash == -1) {
-        hash = ((PyBytesObject *)key)->ob_shash;
-        if (hash == -1)
-            hash = PyObject_Hash(key);
+    if (!PyBytes_Check(value)) {
+        PyErr_Format(PyExc_TypeError, "value_type 'bytes' requires bytes values, not '%.200s'",
+                     Py_TYPE(value)->tp_name);
+        return -1;
     }
-
-    i = hash_mix((size_t)hash) & max_items_mask;
-    for (;;) {
-        entry = sparseblock_find(&blocks[i / SPARSEBLOCK_SIZE], i % SPARSEBLOCK_SIZE);
-        if (entry == NULL) {
-            if (freeslot != NULL)
-                return freeslot;
-            if (!insert)
-                return &entry_not_found;
-
-            entry = sparseblock_insert(&blocks[i / SPARSEBLOCK_SIZE], i % SPARSEBLOCK_SIZE);
-            if (entry != NULL)
-                entry->key = NULL;
-            return entry;
-        }
-        else if (entry->key == key || (entry->key != NULL && string_equal(entry->key, key)))
-            return entry;
-        else if (entry->key == NULL && freeslot == NULL)
-            /* Deleted entry */
-            freeslot = entry;
-
-        /* Quadratic probing */
-        ++num_probes;
-        i = (i + num_probes) & max_items_mask;
-        EX_STATS(++self->total_collisions);
+    if (PyBytes_GET_SIZE(value) > ARENA_MAX_LEN) {
+        PyErr_SetString(PyExc_OverflowError, "value does not fit value_type 'bytes'");
+        return -1;
     }
-    assert(0); /* NOT REACHED */
+    return PyBytes_GET_SIZE(value);
 }
 
-/* Insert an item into the dictionary. Same semantics as PyDict_SetItem. */
+/* Gives the arena of self room for n more bytes. */
 Py_LOCAL(int)
-dict_insert(SparseDictObject *self, PyObject *key, PyObject *value)
+dict_arena_reserve(SparseDictObject *self, Py_ssize_t n)
 {
-    PyObject *old_value;
-    dictentry *entry;
-
-    if (dict_resize_delta(self, 1) != 0)
-        return -1;
+    arenaobject *arena = self->arena, *moved;
+    Py_ssize_t used = arena != NULL ? arena->used : 0, size = arena != NULL ? arena->size : 0;
+    char *data;
 
-    Py_INCREF(value);
-    Py_INCREF(key);
-    entry = (self->lookup)(self, key, -1, 1);
-    if (entry == NULL) {
-        Py_DECREF(key);
-        Py_DECREF(value);
+    if (arena != NULL && n <= size - used)
+        return 0;
+    if (n > ARENA_MAX_SIZE - used) {
+        PyErr_SetString(PyExc_OverflowError, "too many bytes for the value arena");
         return -1;
     }
-
-    MAINTAIN_TRACKING(self, key, value);
-    if (entry->key != NULL) {
-        old_value = entry->value;
-        entry->value = value;
-        Py_DECREF(old_value); /* which **CAN** re-enter */
-        Py_DECREF(key);
+    size = size * 2 > used + n ? size * 2 : used + n;
+    if (size < ARENA_MIN_SIZE)
+        size = ARENA_MIN_SIZE;
+    if (arena != NULL && arena->exports == 0) {
+        data = (char *)PyMem_REALLOC(arena->data, size);
+        if (data == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        arena->data = data;
+        arena->size = size;
+        return 0;
     }
-    else {
-        entry->key = key;
-        entry->value = value;
-        ++self->num_items;
+    moved = arena_new(size);
+    if (moved == NULL)
+        return -1;
+    if (arena != NULL) {
+        memcpy(moved->data, arena->data, used);
+        moved->used = used;
     }
+    self->arena = moved;
+    Py_XDECREF(arena);
     return 0;
 }
 
-/* Delete an item from the dictionary. Same semantics as PyDict_DelItem. */
+/* What an entry of self stores for the bytes value, appended to the arena, which has room. */
+Py_LOCAL_INLINE(PyObject *)
+dict_arena_append(SparseDictObject *self, PyObject *value)
+{
+    arenaobject *arena = self->arena;
+    Py_ssize_t offset = arena->used, len = PyBytes_GET_SIZE(value);
+
+    memcpy(arena->data + offset, PyBytes_AS_STRING(value), len);
+    arena->used += len;
+    return ARENA_STORED(offset, len);
+}
+
+/* value_unbox for the value type of self. Bytes are appended to the arena, see dict_insert_hash
+   about when that's safe. */
 Py_LOCAL(int)
-dict_delete(SparseDictObject *self, PyObject *key)
+dict_value_unbox(SparseDictObject *self, PyObject *value, PyObject **stored)
 {
-    dictentry *entry;
-    PyObject *old_key, *old_value;
+    Py_ssize_t len;
 
-    entry = (self->lookup)(self, key, -1, 0);
-    if (entry == NULL)
-        return -1;
-    if (entry->key == NULL) {
-        set_key_error(key);
+    if (SparseDict_VALUE_TYPE(self) != OPTION_VALUE_BYTES)
+        return value_unbox(SparseDict_VALUE_TYPE(self), value, stored);
+    len = arena_value_len(value);
+    if (len < 0 || dict_arena_reserve(self, len) != 0)
         return -1;
-    }
-    old_key = entry->key;
-    old_value = entry->value;
-    entry->key = NULL;
-    ++self->num_deleted;
-    self->_max_items |= FLAG_CONSIDER_SHRINK;
-    Py_DECREF(old_value);
-    Py_DECREF(old_key);
+    *stored = dict_arena_append(self, value);
     return 0;
 }
 
-/* This is caled to preallocate space for at least delta elements. */
-Py_LOCAL(int)
-dict_resize_delta(SparseDictObject *self, Py_ssize_t delta) {
-    /* Growth factor is 3/4 = 0.75, shrink factor is 5/16 = 0.3125 */
+/* value_box for the value type of sdict. */
+#define dict_value_box(sdict, stored) \
+    (SparseDict_VALUE_TYPE(sdict) == OPTION_VALUE_BYTES ? arena_box((sdict)->arena, stored) : \
+     value_box(SparseDict_VALUE_TYPE(sdict), stored))
 
-    Py_ssize_t new_max_items = SparseDict_MAX_ITEMS(self);
+/* Copies the values of self to a new arena if at least half of the old one is garbage.
+   Waits while an insert has a value in the arena and not in its entry yet. */
+Py_LOCAL(int)
+dict_compact_arena(SparseDictObject *self)
+{
+    arenaobject *arena = self->arena, *compacted;
+    Py_ssize_t b, live = 0;
+    int j;
 
-    if (delta <= 0)
+    if (arena == NULL || self->arena_pending != 0)
         return 0;
-
-    if (self->_max_items & FLAG_CONSIDER_SHRINK) {
-        self->_max_items &= ~FLAG_CONSIDER_SHRINK;
-        if (SparseDict_SIZE(self) < new_max_items * 5 / 16)
-            goto Resize;
-    }
-    if (self->num_items + delta <= new_max_items * 3 / 4)
+    assert(!SparseDict_MIGRATING(self) && self->num_shared == 0);
+    SparseDict_FOR(self, entry)
+        live += ARENA_LEN(entry.value);
+    SparseDict_ENDFOR(self, 0)
+    if (arena->used - live < ARENA_MIN_SIZE || live > arena->used / 2)
         return 0;
-
-Resize:
-    /* Find the size which fits nondeleted items below enlarge threshold. */
-    new_max_items = INITIAL_ITEMS;
-    while (SparseDict_SIZE(self) + delta > new_max_items * 3 / 4)
-        new_max_items *= 2;
-    if (new_max_items < SparseDict_MAX_ITEMS(self)) {
-        /* We're actually shrinking due to lots of deleted elements. Try to re-grow. */
-        if (SparseDict_SIZE(self) + delta >= new_max_items * 2 * 5 / 16)
-            /* Doubling the size won't hit shrink limit. */
-            new_max_items *= 2;
+    compacted = arena_new(live > ARENA_MIN_SIZE ? live : ARENA_MIN_SIZE);
+    if (compacted == NULL)
+        return -1;
+    for (b = 0; b < self->num_blocks; ++b) {
+        sparseblock *block = &self->blocks[b];
+        for (j = 0; j < SPARSEBLOCK_NUM_ITEMS(block); ++j) {
+            dictentry *entry = &block->items[j];
+            Py_ssize_t len = ARENA_LEN(entry->value);
+            if (entry->key == NULL)
+                continue;
+            memcpy(compacted->data + compacted->used, arena->data + ARENA_OFFSET(entry->value), len);
+            entry->value = ARENA_STORED(compacted->used, len);
+            compacted->used += len;
+        }
     }
-
-    return dict_resize(self, new_max_items);
+    self->arena = compacted;
+    Py_DECREF(arena);
+    return 0;
 }
 
-/* Resize the hashtable by allocating a new sparseblock array and reinserting
-   all non-deleted items. Returns 0 on success, -1 on error. */
-Py_LOCAL(int)
-dict_resize(SparseDictObject *self, Py_ssize_t new_max_items)
-{
-    Py_ssize_t max_items_mask = new_max_items - 1;
-    Py_ssize_t num_new_blocks = (new_max_items + SPARSEBLOCK_SIZE - 1) / SPARSEBLOCK_SIZE;
-    sparseblock *new_blocks;
-    Py_ssize_t i;
+/* Typed keys
 
-    SparseDict_INVARIANT(self);
+   With key type 'i8' the key field holds the bits of an int64 with the sign bit flipped,
+   so that only -2**63 (which is rejected) would look like a deleted entry. Such keys are
+   hashed as ints and compared by their bits, without calling back into Python, and boxed
+   when read. Lookups and the table code take keys as the entries store them, the methods
+   convert the keys they are given, see key_unbox. The type is set by the constructor. */
 
-    if (self->_max_items & FLAG_DISABLE_RESIZE) {
-        PyErr_SetString(PyExc_RuntimeError, "SparseDict: resize is not reentrant");
-        return -1;
-    }
-    self->_max_items |= FLAG_DISABLE_RESIZE;
+#define SparseDict_KEY_TYPE(sdict) ((sdict)->options & OPTION_KEY_I8)
+#ifdef HAVE_INT_LOOKUP
+#define TYPED_KEYS TYPED_VALUES
+#else
+#define TYPED_KEYS 0 /* The hash must match hash(int). */
+#endif
+#define KEY_I8_SIGN (((unsigned PY_LONG_LONG)1) << 63)
 
-    new_blocks = PyMem_NEW(sparseblock, num_new_blocks);
-    if (new_blocks == NULL) {
-        PyErr_NoMemory();
-        return -1;
-    }
-    memset(new_blocks, 0, num_new_blocks * sizeof(sparseblock));
+#define KEY_INCREF(typed, key) do { if (!(typed)) Py_INCREF(key); } while (0)
+#define KEY_DECREF(typed, key) do { if (!(typed)) Py_DECREF(key); } while (0)
 
-    SparseDict_FOR(self, entry)
-        dictentry *new_entry;
-        Py_hash_t hash;
-        size_t i, num_probes = 0;
-        PyObject *key = entry.key;
+/* Forward */
+static PyObject *dictiter_new(SparseDictObject *dict, PyTypeObject *type);
+static PyObject *dictview_new(SparseDictObject *dict, PyTypeObject *type);
+static PyObject *dict_py_save_mapped(SparseDictObject *self, PyObject *args);
+static PyObject *dict_py_open_mapped(PyObject *cls, PyObject *args);
+static PyObject *dict_py_dump(SparseDictObject *self, PyObject *fileobj);
+static PyObject *dict_py_load(PyObject *cls, PyObject *fileobj);
+static PyObject *new_typed; /* _sparsedict._new_typed, reconstructs pickled typed dicts. */
+typedef struct _sparsesetobject SparseSetObject;
+Py_LOCAL(int) set_find_key(SparseSetObject *self, PyObject *key, int remove);
+Py_LOCAL(int) set_add_key(SparseSetObject *self, PyObject *key);
 
-        if (PyBytes_CheckExact(key)) {
-            hash = ((PyBytesObject *)key)->ob_shash;
-            if (hash == -1)
-                hash = PyObject_Hash(key);
-        }
-        else {
-            hash = PyObject_Hash(key);
-            if (hash == -1)
-                goto Failed;
-        }
+/* Dummy "deleted" entry used by dict_lookup to distinguish "not found" from error (NULL). */
+static dictentry entry_not_found = {NULL, NULL};
 
-        i = hash_mix((size_t)hash) & max_items_mask;
-        while (BIT_TEST(new_blocks[i / SPARSEBLOCK_SIZE].bitmap, i % SPARSEBLOCK_SIZE)) {
-            ++num_probes;
-            i = (i + num_probes) & max_items_mask;
-        }
+/* Copy-on-write snapshots
 
-        new_entry = sparseblock_insert(&new_blocks[i / SPARSEBLOCK_SIZE], i % SPARSEBLOCK_SIZE);
-        if (new_entry == NULL)
-            goto Failed;
+   snapshot() shares the item arrays of the dict with the new one instead of copying them.
+   A shared array is owned by a sharedblock object: it holds the references of the entries
+   (the dicts visit it instead of them in tp_traverse) and frees the array when the last
+   dict lets go of it. Both dicts keep reading the shared arrays in place, and copy a block
+   before they first write to it. The writers are sparseblock_insert (the lookups for
+   insertion), value replacement in dict_insert, dict_erase and compaction, dict_rebuild
+   releases all shared blocks. */
 
-        *new_entry = entry;
-        /* Note: we do not use destructive iteration here. It has minimal impact on
-           memory usage during the resize but allows easy recover from hash and memory errors. */
-    SparseDict_ENDFOR(self, 0)
+typedef struct {
+    PyObject_HEAD
+    dictentry *items; /* NULL once the last dict took the array back. */
+    int num_items;
+    int layout;
+    int typed; /* Key and value types of the dicts (option bits), typed ones are not references. */
+} sharedblockobject;
+
+Py_LOCAL(PyObject *)
+sharedblock_new(sparseblock *block, int layout, int typed, int track)
+{
+    sharedblockobject *sb = PyObject_GC_New(sharedblockobject, &SparseDictSharedBlock_Type);
+    if (sb == NULL)
+        return NULL;
+    sb->items = block->items;
+    sb->num_items = SPARSEBLOCK_NUM_ITEMS(block);
+    sb->layout = layout;
+    sb->typed = typed;
+    if (track)
+        PyObject_GC_Track(sb);
+    return (PyObject *)sb;
+}
 
-    /* Free old blocks. */
-    for (i = 0; i < self->num_blocks; ++i)
-        PyMem_FREE(self->blocks[i].items);
-    if (self->blocks != self->static_blocks)
-        PyMem_FREE(self->blocks);
+static void
+sharedblock_tp_dealloc(sharedblockobject *sb)
+{
+    int j;
+
+    if (_PyObject_GC_IS_TRACKED(sb))
+        PyObject_GC_UnTrack(sb);
+    if (sb->items != NULL) {
+        for (j = 0; j < sb->num_items; ++j) {
+            if (sb->items[j].key != NULL) {
+                KEY_DECREF(sb->typed & OPTION_KEY_I8, sb->items[j].key);
+                VALUE_DECREF(sb->typed & OPTIONS_VALUE_TYPE, sb->items[j].value);
+            }
+        }
+        items_free(sb->items, SPARSEBLOCK_ITEMS_SIZE(sb->num_items, sb->layout));
+    }
+    PyObject_GC_Del(sb);
+}
 
-    /* Update self with new blocks. */
-    if (num_new_blocks == 1) {
-        self->static_blocks[0] = new_blocks[0];
-        self->blocks = self->static_blocks;
-        PyMem_FREE(new_blocks);
+static int
+sharedblock_tp_traverse(sharedblockobject *sb, visitproc visit, void *arg)
+{
+    int j;
+
+    if (sb->items != NULL) {
+        for (j = 0; j < sb->num_items; ++j) {
+            if (sb->items[j].key != NULL) {
+                if (!(sb->typed & OPTION_KEY_I8))
+                    Py_VISIT(sb->items[j].key);
+                if (!(sb->typed & OPTIONS_VALUE_TYPE))
+                    Py_VISIT(sb->items[j].value);
+            }
+        }
     }
+    return 0;
+}
+
+/* Give block b, which is shared, an item array of its own: a copy, or the shared array
+   itself if the snapshots are gone. *entry (if entry is not NULL) pointing into the shared
+   array is moved to the same place in the new one. Returns -1 on memory error. */
+Py_LOCAL(int)
+dict_own_block(SparseDictObject *self, Py_ssize_t b, dictentry **entry)
+{
+    sharedblockobject *sb = (sharedblockobject *)self->shared[b];
+    sparseblock *block = &self->blocks[b];
+    dictentry *items = block->items;
+    int j, num_items = SPARSEBLOCK_NUM_ITEMS(block);
+
+    assert(sb->items == block->items && sb->num_items == num_items);
+    if (Py_REFCNT(sb) == 1)
+        sb->items = NULL; /* Its references go with it. */
     else {
-        self->blocks = new_blocks;
+        size_t size = SPARSEBLOCK_ITEMS_SIZE(num_items, SparseDict_LAYOUT(self));
+        items = (dictentry *)items_alloc(size);
+        if (items == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        memcpy(items, block->items, size);
+        for (j = 0; j < num_items; ++j) {
+            if (items[j].key != NULL) {
+                KEY_INCREF(SparseDict_KEY_TYPE(self), items[j].key);
+                VALUE_INCREF(SparseDict_VALUE_TYPE(self), items[j].value);
+            }
+        }
+    }
+    if (entry != NULL && *entry >= block->items && *entry < block->items + num_items)
+        *entry = items + (*entry - block->items);
+    block->items = items;
+    self->shared[b] = NULL;
+    Py_DECREF(sb); /* Either not the last reference or without items, nothing runs. */
+    if (--self->num_shared == 0) {
+        PyMem_FREE(self->shared);
+        self->shared = NULL;
     }
-    self->_max_items = new_max_items; /* All flags are cleared */
-    self->num_blocks = num_new_blocks;
-    self->num_items -= self->num_deleted;
-    self->num_deleted = 0;
-    EX_STATS(++self->total_resizes);
-
-    SparseDict_INVARIANT(self);
     return 0;
-
-Failed:
-    /* Discard partial new_blocks. */
-    for (i = 0; i < num_new_blocks; ++i)
-        PyMem_FREE(new_blocks[i].items);
-    if (new_blocks != self->blocks)
-        PyMem_FREE(new_blocks);
-    return -1;
 }
 
+/* Own the blocks that a write to the entry found for hash goes to: the block of *entry or,
+   if run = 1, every block from the home slot of hash to the first free slot (the Robin Hood
+   insert and delete shift the entries there). entry can be NULL for run = 1. */
 Py_LOCAL(int)
-dict_merge_seq2(SparseDictObject *self, PyObject *seq2)
+dict_own_entry(SparseDictObject *self, dictentry **entry, Py_hash_t hash, int run)
 {
-    PyObject *it;       /* iter(seq2) */
-    Py_ssize_t i;       /* index into seq2 of current element */
-    PyObject *item;     /* seq2[i] */
-    PyObject *fast;     /* item as a 2-tuple or 2-list */
+    size_t max_items_mask = (size_t)SparseDict_MAX_ITEMS(self) - 1;
+    size_t i = hash_mix(hash) & max_items_mask, num_probes = 0;
+    int linear = self->options & OPTION_ROBIN_HOOD;
 
-    SparseDict_INVARIANT(self);
-    assert(seq2 != NULL);
+    assert(!SparseDict_MIGRATING(self));
+    while (self->num_shared != 0) {
+        Py_ssize_t b = i / SPARSEBLOCK_SIZE;
+        sparseblock *block = &self->blocks[b];
+        int found = entry != NULL && *entry >= block->items &&
+            *entry < block->items + SPARSEBLOCK_NUM_ITEMS(block);
 
-    it = PyObject_GetIter(seq2);
-    if (it == NULL)
-        return -1;
+        if ((found || run) && self->shared[b] != NULL && dict_own_block(self, b, entry) != 0)
+            return -1;
+        if ((found && !run) || !BIT_TEST(block->bitmap, i % SPARSEBLOCK_SIZE))
+            break;
+        ++num_probes;
+        i = (i + (linear ? 1 : num_probes)) & max_items_mask;
+    }
+    return 0;
+}
 
-    for (i = 0; ; ++i) {
-        PyObject *key, *value;
-        Py_ssize_t n;
+/* Let go of the shared blocks of a table that is being freed. Their bitmaps are cleared,
+   the destructive SparseDict_FOR skips them. */
+Py_LOCAL(void)
+dict_drop_shared(sparseblock *blocks, Py_ssize_t num_blocks, PyObject **shared)
+{
+    Py_ssize_t b;
 
-        fast = NULL;
-        item = PyIter_Next(it);
-        if (item == NULL) {
-            if (PyErr_Occurred())
-                goto Fail;
-            break;
+    if (shared == NULL)
+        return;
+    for (b = 0; b < num_blocks; ++b) {
+        if (shared[b] != NULL) {
+            blocks[b].items = NULL;
+            blocks[b].bitmap = 0;
         }
+    }
+    for (b = 0; b < num_blocks; ++b)
+        Py_XDECREF(shared[b]);
+    PyMem_FREE(shared);
+}
 
-        /* Convert item to sequence, and verify length 2. */
-        fast = PySequence_Fast(item, "");
-        if (fast == NULL) {
-            if (PyErr_ExceptionMatches(PyExc_TypeError))
-                PyErr_Format(PyExc_TypeError,
-                             "cannot convert dictionary update sequence element #%zd to a sequence",
-                             i);
-            goto Fail;
-        }
-        n = PySequence_Fast_GET_SIZE(fast);
-        if (n != 2) {
-            PyErr_Format(PyExc_ValueError,
-                         "dictionary update sequence element #%zd has length %zd; 2 is required",
-                         i, n);
-            goto Fail;
-        }
+/* SparseDict method helpers */
 
-        /* Update/merge with this (key, value) pair. */
-        key = PySequence_Fast_GET_ITEM(fast, 0);
-        value = PySequence_Fast_GET_ITEM(fast, 1);
-        if (dict_insert(self, key, value) < 0)
-            goto Fail;
-        Py_DECREF(fast);
-        Py_DECREF(item);
+Py_LOCAL(int) dict_resize(SparseDictObject *self, Py_ssize_t new_max_items);
+Py_LOCAL(int) dict_rebuild(SparseDictObject *self, Py_ssize_t new_max_items, int new_options);
+Py_LOCAL(int) dict_resize_delta(SparseDictObject *self, Py_ssize_t delta);
+Py_LOCAL(void) dict_after_delete(SparseDictObject *self);
+
+/* Same as _PyString_Equal but using the public API. */
+Py_LOCAL_INLINE(int)
+string_equal(PyObject *arg1, PyObject *arg2)
+{
+    PyBytesObject *s1 = (PyBytesObject *)arg1;
+    PyBytesObject *s2 = (PyBytesObject *)arg2;
+
+    assert(PyBytes_CheckExact(arg1));
+    assert(PyBytes_CheckExact(arg2));
+
+    if (PyBytes_GET_SIZE(s1) != PyBytes_GET_SIZE(s2))
+        return 0;
+    if (PyBytes_AS_STRING(s1)[0] != PyBytes_AS_STRING(s2)[0])
+        return 0;
+    return memcmp(PyBytes_AS_STRING(s1),
+                  PyBytes_AS_STRING(s2),
+                  PyBytes_GET_SIZE(s1)) == 0;
+}
+
+#ifdef HAVE_COMPACT_UNICODE
+/* Same as unicode_eq from CPython's dict implementation. */
+Py_LOCAL_INLINE(int)
+unicode_equal(PyObject *arg1, PyObject *arg2)
+{
+    Py_ssize_t len = PyUnicode_GET_LENGTH(arg1);
+
+    assert(PyUnicode_CheckExact(arg1) && PyUnicode_IS_READY(arg1));
+    assert(PyUnicode_CheckExact(arg2) && PyUnicode_IS_READY(arg2));
+
+    if (PyUnicode_GET_LENGTH(arg2) != len)
+        return 0;
+    if (PyUnicode_KIND(arg1) != PyUnicode_KIND(arg2))
+        return 0;
+    return memcmp(PyUnicode_DATA(arg1), PyUnicode_DATA(arg2), len * PyUnicode_KIND(arg1)) == 0;
+}
+#endif
+
+#ifdef HAVE_INT_LOOKUP
+/* Get the C value of an exact int key. Returns 0 if it doesn't fit in long long. */
+Py_LOCAL_INLINE(int)
+int_value(PyObject *key, PY_LONG_LONG *value)
+{
+#if PY_MAJOR_VERSION < 3
+    assert(PyInt_CheckExact(key));
+    *value = PyInt_AS_LONG(key);
+    return 1;
+#else
+    int overflow;
+    assert(PyLong_CheckExact(key));
+#if PY_VERSION_HEX >= 0x030C0000
+    if (PyUnstable_Long_IsCompact((PyLongObject *)key)) {
+        *value = PyUnstable_Long_CompactValue((PyLongObject *)key);
+        return 1;
+    }
+#else
+    /* Single digit ints, same as MEDIUM_VALUE in Objects/longobject.c */
+    if (Py_SIZE(key) >= -1 && Py_SIZE(key) <= 1) {
+        *value = Py_SIZE(key) * (PY_LONG_LONG)((PyLongObject *)key)->ob_digit[0];
+        return 1;
     }
+#endif
+    *value = PyLong_AsLongLongAndOverflow(key, &overflow);
+    return !overflow;
+#endif
+}
 
-    i = 0;
-    goto Return;
-Fail:
-    Py_XDECREF(item);
-    Py_XDECREF(fast);
-    i = -1;
-Return:
-    Py_DECREF(it);
-    return Py_SAFE_DOWNCAST(i, Py_ssize_t, int);
+/* Same as hash(int(value)). */
+Py_LOCAL_INLINE(Py_hash_t)
+int_hash(PY_LONG_LONG value)
+{
+    Py_hash_t hash;
+#if PY_MAJOR_VERSION < 3
+    hash = (Py_hash_t)value;
+#else
+    /* Reduction modulo the Mersenne prime, sign is preserved. See Python/pyhash.h */
+    unsigned PY_LONG_LONG x = value < 0 ? 0 - (unsigned PY_LONG_LONG)value : (unsigned PY_LONG_LONG)value;
+    hash = (Py_hash_t)(x % _PyHASH_MODULUS);
+    if (value < 0)
+        hash = -hash;
+#endif
+    if (hash == -1)
+        hash = -2;
+    return hash;
+}
+#endif
+
+/* Same as PyObject_Hash, but avoids the call for key types with cached or cheap hashes. */
+Py_LOCAL_INLINE(Py_hash_t)
+key_hash(PyObject *key)
+{
+    Py_hash_t hash;
+
+    if (PyBytes_CheckExact(key)) {
+        hash = PyBytes_CACHED_HASH(key);
+        if (hash != -1)
+            return hash;
+    }
+#ifdef HAVE_COMPACT_UNICODE
+    else if (PyUnicode_CheckExact(key)) {
+        hash = ((PyASCIIObject *)key)->hash;
+        if (hash != -1)
+            return hash;
+    }
+#endif
+#ifdef HAVE_INT_LOOKUP
+    else if (PyInt_CheckExact(key)) {
+        PY_LONG_LONG value;
+        if (int_value(key, &value))
+            return int_hash(value);
+    }
+#endif
+    return PyObject_Hash(key);
+}
+
+/* The int64 an entry of a dict with key type 'i8' stores. */
+Py_LOCAL_INLINE(PY_LONG_LONG)
+key_i8_value(PyObject *stored)
+{
+    valuebits bits;
+
+    bits.object = stored;
+    return (PY_LONG_LONG)((unsigned PY_LONG_LONG)bits.i8 ^ KEY_I8_SIGN);
+}
+
+/* What an entry of a dict with key type 'i8' stores for value, NULL for -2**63. */
+Py_LOCAL_INLINE(PyObject *)
+key_i8_stored(PY_LONG_LONG value)
+{
+    valuebits bits;
+
+    bits.i8 = (PY_LONG_LONG)((unsigned PY_LONG_LONG)value ^ KEY_I8_SIGN);
+    return bits.object;
+}
+
+/* Hash of a key as the entries of a dict with key type 'i8' store it, same as hash(int). */
+Py_LOCAL_INLINE(Py_hash_t)
+key_i8_hash(PyObject *stored)
+{
+#ifdef HAVE_INT_LOOKUP
+    return int_hash(key_i8_value(stored));
+#else
+    (void)stored;
+    return -2; /* Not reached without TYPED_KEYS. */
+#endif
 }
 
+/* Hash of a key as the entries of sdict store it. */
+#define dict_key_hash(sdict, key) (SparseDict_KEY_TYPE(sdict) ? key_i8_hash(key) : key_hash(key))
+
+/* New reference to the key an entry stores with key type typed (0 for objects). */
+Py_LOCAL_INLINE(PyObject *)
+key_box(int typed, PyObject *stored)
+{
+    valuebits bits;
+
+    if (!typed) {
+        Py_INCREF(stored);
+        return stored;
+    }
+    bits.i8 = key_i8_value(stored);
+    return value_box(OPTION_VALUE_I8, bits.object);
+}
+
+/* What an entry stores for key with key type typed: key itself (borrowed) for object keys,
+   its bits otherwise. Returns 1, or 0 if key is not an int the type can hold: a lookup
+   misses then (no error set), an insert (insert = 1) fails with TypeError or OverflowError.
+   Returns -1 on other errors. */
 Py_LOCAL(int)
-dict_merge(SparseDictObject *self, PyObject *arg)
+key_unbox(int typed, PyObject *key, PyObject **stored, int insert)
 {
-    SparseDict_INVARIANT(self);
+    PY_LONG_LONG value;
+    int overflow = 0;
 
-    if (SparseDict_Check(arg)) {
-        SparseDictObject *other = (SparseDictObject *)arg;
-        if (other == self || SparseDict_SIZE(other) == 0)
+    if (!typed) {
+        *stored = key;
+        return 1;
+    }
+#ifdef HAVE_INT_LOOKUP
+    if (!PyInt_CheckExact(key) || !int_value(key, &value))
+#endif
+    {
+        if (!PyInt_Check(key) && !PyLong_Check(key)) {
+            if (!insert)
+                return 0;
+            PyErr_Format(PyExc_TypeError, "key_type 'i8' requires int keys, not '%.200s'",
+                         Py_TYPE(key)->tp_name);
+            return -1;
+        }
+        value = PyLong_AsLongLongAndOverflow(key, &overflow);
+        if (value == -1 && PyErr_Occurred())
+            return -1;
+    }
+    if (overflow || value == PY_LLONG_MIN) {
+        if (!insert)
             return 0;
+        PyErr_SetString(PyExc_OverflowError, "key does not fit key_type 'i8'");
+        return -1;
+    }
+    *stored = key_i8_stored(value);
+    return 1;
+}
 
-        if (dict_resize_delta(self, SparseDict_SIZE(other) - SparseDict_SIZE(self)) != 0)
-            return -1;
+/* Set a key error with the specified argument, wrapping it in a
+ * tuple automatically so that tuple keys are not unpacked as the
+ * exception arguments. */
+Py_LOCAL_INLINE(void)
+set_key_error(PyObject *arg)
+{
+    PyObject *tuple;
+    tuple = PyTuple_Pack(1, arg);
+    if (!tuple)
+        return; /* caller will expect error to be set anyway */
+    PyErr_SetObject(PyExc_KeyError, tuple);
+    Py_DECREF(tuple);
+}
 
-        SparseDict_FOR(other, entry)
-            Py_INCREF(entry.key);
-            Py_INCREF(entry.value);
-            if (dict_insert(self, entry.key, entry.value) != 0)
+/* Methods taking a few positional arguments get them as an array: METH_FASTCALL where
+   available, elsewhere FASTCALL_WRAPPER defines a METH_VARARGS wrapper passing the
+   items of the args tuple. Register them with FASTCALL_METHOD and METH_FASTARGS. */
+#ifdef HAVE_FASTCALL
+#define METH_FASTARGS METH_FASTCALL
+#define FASTCALL_METHOD(func) (PyCFunction)(void (*)(void))func
+#define FASTCALL_WRAPPER(func)
+#else
+#define METH_FASTARGS METH_VARARGS
+#define FASTCALL_METHOD(func) (PyCFunction)func##_varargs
+#define FASTCALL_WRAPPER(func)                                                  \
+    static PyObject *                                                           \
+    func##_varargs(SparseDictObject *self, PyObject *args)                      \
+    {                                                                           \
+        return func(self, &PyTuple_GET_ITEM(args, 0), PyTuple_GET_SIZE(args));  \
+    }
+#endif
+
+/* Checks the number of positional arguments of name() like PyArg_UnpackTuple. */
+Py_LOCAL_INLINE(int)
+check_nargs(const char *name, Py_ssize_t nargs, Py_ssize_t min, Py_ssize_t max)
+{
+    if (nargs >= min && nargs <= max)
+        return 0;
+    PyErr_Format(PyExc_TypeError, "%s expected %s%zd argument%s, got %zd", name,
+                 min == max ? "" : nargs < min ? "at least " : "at most ",
+                 nargs < min ? min : max, (nargs < min ? min : max) == 1 ? "" : "s", nargs);
+    return -1;
+}
+
+/* Search position for dict_next is encoded as (block index << INDEX_SHIFT | item offset).
+   Item offset can be equal to SPARSEBLOCK_SIZE, hence the extra bit. */
+#define INDEX_SHIFT 7
+#define INDEX_MASK  ((1 << INDEX_SHIFT) - 1)
+
+/* Next nondeleted item search. Used in popitem() and iterators.
+   Index space covers both tables, see dict_block.
+   Returns NULL if there are no more items (never happens with wrap = 1 on nonempty dict). */
+Py_LOCAL_INLINE(dictentry *)
+dict_next(SparseDictObject *self, Py_ssize_t *index, int wrap)
+{
+    dictentry *entry;
+    int j = (int)(*index & INDEX_MASK);
+    Py_ssize_t i = *index >> INDEX_SHIFT;
+    do {
+        for (; i < self->num_blocks + self->old_num_blocks; ++i) {
+            sparseblock *block = dict_block(self, i);
+            int num_items = SPARSEBLOCK_NUM_ITEMS(block);
+            dictentry *items = block->items;
+
+            for (; j < num_items; ++j) {
+                entry = &items[j];
+                if (entry->key != NULL)
+                    goto Found;
+            }
+            j = 0;
+        }
+        i = 0;
+    } while (wrap);
+    *index = (self->num_blocks + self->old_num_blocks) << INDEX_SHIFT;
+    return NULL;
+Found:
+    *index = (i << INDEX_SHIFT) | (j+1);
+    return entry;
+}
+
+/* Where the search for a key stopped: the key slot if it was found, otherwise the
+   unallocated index ending its probe path and the first deleted slot on the way. */
+typedef struct {
+    PyObject **slot;
+    size_t index;
+    PyObject **freeslot;
+    sparseblock *freeslot_block;
+    EX_STATS(size_t num_probes;)
+    EX_STATS(size_t fingerprint_skips;)
+} tableprobe;
+
+#define PROBE_CHANGED (-2) /* Returned by table_probe when richcmp has changed the table. */
+
+/* The probe loop of dict_lookup and set_lookup. Searches the table *blocks_ref of
+   max_items_mask + 1 slots, entries of entry_size bytes with the tags of layout, for the key.
+   Returns 1 if found, 0 if missing, -1 on error, or PROBE_CHANGED if richcmp has changed
+   the table and the search has to restart. */
+Py_LOCAL_INLINE(int)
+table_probe(sparseblock *const *blocks_ref, size_t max_items_mask, size_t entry_size, int layout,
+            PyObject *key, Py_hash_t hash, tableprobe *probe)
+{
+    /* NULL key will make it look like deleted entry. */
+    size_t i, num_probes = 0;
+    sparseblock *block, *blocks = *blocks_ref;
+    PyObject **slot, *old_key;
+    dictentry *items, *freeslot_items = NULL;
+    bitmap_t freeslot_bitmap = 0;
+    int cmp, cache_hash = layout & OPTION_HASH_CACHE, fingerprints = layout & OPTION_FINGERPRINTS;
+    unsigned char fingerprint = 0;
+    size_t n;
+
+    probe->freeslot = NULL;
+    probe->freeslot_block = NULL;
+    EX_STATS(probe->num_probes = 0);
+    EX_STATS(probe->fingerprint_skips = 0);
+    if (fingerprints)
+        fingerprint = FINGERPRINT(hash);
+    i = hash_mix((size_t)hash) & max_items_mask;
+    for (;;) {
+        block = &blocks[i / SPARSEBLOCK_SIZE];
+        slot = sparseblock_find_slot(block, i % SPARSEBLOCK_SIZE, entry_size);
+        if (slot == NULL) {
+            probe->index = i;
+            return 0;
+        }
+        if (*slot == key) {
+            probe->slot = slot;
+            return 1;
+        }
+        if (*slot != NULL) {
+            /* Different hashes mean different keys, no need to compare. */
+            n = ((char *)slot - (char *)block->items) / entry_size;
+            if (cache_hash && ((Py_hash_t *)SPARSEBLOCK_TAGS(block, entry_size))[n] != hash)
+                goto Next;
+            if (fingerprints && ((unsigned char *)SPARSEBLOCK_TAGS(block, entry_size))[n] != fingerprint) {
+                EX_STATS(++probe->fingerprint_skips);
+                goto Next;
+            }
+            old_key = *slot;
+            items = block->items;
+            Py_INCREF(old_key);
+            cmp = PyObject_RichCompareBool(old_key, key, Py_EQ);
+            Py_DECREF(old_key);
+            if (cmp < 0)
                 return -1;
-        SparseDict_ENDFOR(other, 0)
+            /* Inserts (and migration steps of lookups) move item arrays. The freeslot
+               can be in another block, inserts there move it and may fill it. */
+            if (*blocks_ref != blocks || block->items != items || *slot != old_key)
+                return PROBE_CHANGED;
+            if (probe->freeslot != NULL && (probe->freeslot_block->items != freeslot_items ||
+                    probe->freeslot_block->bitmap != freeslot_bitmap || *probe->freeslot != NULL))
+                return PROBE_CHANGED;
+            if (cmp > 0) {
+                probe->slot = slot;
+                return 1;
+            }
+        }
+        else if (probe->freeslot == NULL) {
+            /* *slot == NULL, deleted entry */
+            probe->freeslot = slot;
+            probe->freeslot_block = block;
+            freeslot_items = block->items;
+            freeslot_bitmap = block->bitmap;
+        }
+
+    Next:
+        /* Quadratic probing */
+        ++num_probes;
+        i = (i + num_probes) & max_items_mask;
+        EX_STATS(++probe->num_probes);
     }
-    else if (PyDict_Check(arg)) {
-        Py_ssize_t other_size = PyDict_Size(arg);
-        Py_ssize_t pos = 0;
-        PyObject *key, *value;
+    assert(0); /* NOT REACHED */
+}
+
+/* Finish the search for a missing key. Returns the first deleted entry seen
+   on the probe path (freeslot, possibly NULL) or, if insert = 1, a newly allocated entry
+   at the index i where the search stopped. Returned entries are marked as deleted;
+   entries returned for insertion get their hash (fingerprint) updated. */
+Py_LOCAL_INLINE(dictentry *)
+dict_lookup_missing(SparseDictObject *self, size_t i, dictentry *freeslot,
+                    sparseblock *freeslot_block, Py_hash_t hash, int insert)
+{
+    sparseblock *block = &self->blocks[i / SPARSEBLOCK_SIZE];
+    dictentry *entry;
+
+    if (insert && self->num_shared != 0) {
+        Py_ssize_t b = (freeslot != NULL ? freeslot_block : block) - self->blocks;
+        if (self->shared[b] != NULL && dict_own_block(self, b, &freeslot) != 0)
+            return NULL;
+    }
+    if (freeslot != NULL) {
+        if (insert && SparseDict_HASH_CACHE(self))
+            SPARSEBLOCK_HASHES(freeslot_block)[freeslot - freeslot_block->items] = hash;
+        else if (insert && (self->options & OPTION_FINGERPRINTS))
+            SPARSEBLOCK_FINGERPRINTS(freeslot_block)[freeslot - freeslot_block->items] = FINGERPRINT(hash);
+        return freeslot;
+    }
+    if (!insert)
+        return &entry_not_found;
+
+    entry = sparseblock_insert(block, i % SPARSEBLOCK_SIZE, hash, SparseDict_LAYOUT(self));
+    if (entry != NULL)
+        /* Mark as deleted to distinguish newly inserved from existing. */
+        entry->key = NULL;
+    return entry;
+}
+
+/* Search for an entry with the specified key.
+   If the key is not found and insert = 1, new entry is inserted and returned,
+   otherwise a dummy deleted entry is returned. if hash parameter is -1, it's recalculated
+   from the key. NULL return return means error. */
+static dictentry *
+dict_lookup(SparseDictObject *self, PyObject *key, Py_hash_t hash, int insert)
+{
+    tableprobe probe;
+    int found;
+
+    if (hash == -1) {
+        hash = key_hash(key);
+        if (hash == -1)
+            return NULL;
+    }
+    found = table_probe(&self->blocks, (size_t)SparseDict_MAX_ITEMS(self) - 1, sizeof(dictentry),
+                        SparseDict_LAYOUT(self), key, hash, &probe);
+    EX_STATS(self->total_collisions += probe.num_probes);
+    EX_STATS(self->total_fingerprint_skips += probe.fingerprint_skips);
+    if (found == PROBE_CHANGED)
+        /* richcmp has changed the dict, restart */
+        return dict_lookup(self, key, hash, insert);
+    if (found < 0)
+        return NULL;
+    if (found)
+        return (dictentry *)probe.slot;
+    return dict_lookup_missing(self, probe.index, (dictentry *)probe.freeslot, probe.freeslot_block,
+                               hash, insert);
+}
+
+static dictentry *dict_lookup_string(SparseDictObject *self, PyObject *key, Py_hash_t hash, int insert);
+#ifdef HAVE_COMPACT_UNICODE
+static dictentry *dict_lookup_unicode(SparseDictObject *self, PyObject *key, Py_hash_t hash, int insert);
+#endif
+#ifdef HAVE_INT_LOOKUP
+static dictentry *dict_lookup_int(SparseDictObject *self, PyObject *key, Py_hash_t hash, int insert);
+#endif
+
+/* Special-case lookup for the type of key, universal lookup for other types. */
+Py_LOCAL_INLINE(lookupfunc)
+key_lookup(PyObject *key)
+{
+    if (PyBytes_CheckExact(key))
+        return dict_lookup_string;
+#ifdef HAVE_COMPACT_UNICODE
+    if (PyUnicode_CheckExact(key))
+        return dict_lookup_unicode;
+#endif
+#ifdef HAVE_INT_LOOKUP
+    if (PyInt_CheckExact(key))
+        return dict_lookup_int;
+#endif
+    return dict_lookup;
+}
+
+/* Called by special-case lookups on the first key of unexpected type.
+   Empty dict can switch to another special case, otherwise revert to universal lookup. */
+static dictentry *
+dict_lookup_other(SparseDictObject *self, PyObject *key, Py_hash_t hash, int insert)
+{
+    lookupfunc lookup = SparseDict_SIZE(self) == 0 ? key_lookup(key) : dict_lookup;
+
+    self->lookup = lookup;
+    return lookup(self, key, hash, insert);
+}
+
+/* Special-case dict_lookup that assumes all keys in the dictionary are PyStringObjects. */
+static dictentry *
+dict_lookup_string(SparseDictObject *self, PyObject *key, Py_hash_t  hash, int insert)
+{
+    dictentry *entry, *freeslot = NULL;
+    sparseblock *block, *freeslot_block = NULL;
+    sparseblock *blocks = self->blocks;
+    size_t i, num_probes = 0;
+    size_t max_items_mask = (size_t)SparseDict_MAX_ITEMS(self) - 1;
+    int cache_hash = SparseDict_HASH_CACHE(self);
+
+    if (!PyBytes_CheckExact(key))
+        /* First non-string key, revert to universal lookup. */
+        return dict_lookup_other(self, key, hash, insert);
+    if (hash == -1) {
+        hash = PyBytes_CACHED_HASH(key);
+        if (hash == -1)
+            hash = PyObject_Hash(key);
+    }
+
+    i = hash_mix((size_t)hash) & max_items_mask;
+    for (;;) {
+        block = &blocks[i / SPARSEBLOCK_SIZE];
+        entry = sparseblock_find(block, i % SPARSEBLOCK_SIZE);
+        if (entry == NULL)
+            return dict_lookup_missing(self, i, freeslot, freeslot_block, hash, insert);
+        else if (entry->key == key)
+            return entry;
+        else if (entry->key != NULL) {
+            if ((!cache_hash || SPARSEBLOCK_HASHES(block)[entry - block->items] == hash) &&
+                string_equal(entry->key, key))
+                return entry;
+        }
+        else if (freeslot == NULL) {
+            /* Deleted entry */
+            freeslot = entry;
+            freeslot_block = block;
+        }
+
+        /* Quadratic probing */
+        ++num_probes;
+        i = (i + num_probes) & max_items_mask;
+        EX_STATS(++self->total_collisions);
+    }
+    assert(0); /* NOT REACHED */
+}
+
+#ifdef HAVE_COMPACT_UNICODE
+/* Special-case dict_lookup that assumes all keys in the dictionary are exact str objects. */
+static dictentry *
+dict_lookup_unicode(SparseDictObject *self, PyObject *key, Py_hash_t hash, int insert)
+{
+    dictentry *entry, *freeslot = NULL;
+    sparseblock *block, *freeslot_block = NULL;
+    sparseblock *blocks = self->blocks;
+    size_t i, num_probes = 0;
+    size_t max_items_mask = (size_t)SparseDict_MAX_ITEMS(self) - 1;
+    int cache_hash = SparseDict_HASH_CACHE(self);
+
+    if (!PyUnicode_CheckExact(key))
+        /* First non-str key, revert to universal lookup. */
+        return dict_lookup_other(self, key, hash, insert);
+    if (PyUnicode_READY(key) == -1)
+        return NULL;
+    if (hash == -1) {
+        hash = ((PyASCIIObject *)key)->hash;
+        if (hash == -1)
+            hash = PyObject_Hash(key);
+    }
+
+    i = hash_mix((size_t)hash) & max_items_mask;
+    for (;;) {
+        block = &blocks[i / SPARSEBLOCK_SIZE];
+        entry = sparseblock_find(block, i % SPARSEBLOCK_SIZE);
+        if (entry == NULL)
+            return dict_lookup_missing(self, i, freeslot, freeslot_block, hash, insert);
+        else if (entry->key == key)
+            return entry;
+        else if (entry->key != NULL) {
+            /* str caches its hash, so comparing hashes first is always cheap. */
+            Py_hash_t entry_hash = cache_hash ?
+                SPARSEBLOCK_HASHES(block)[entry - block->items] : ((PyASCIIObject *)entry->key)->hash;
+            if ((entry_hash == hash || entry_hash == -1) && unicode_equal(entry->key, key))
+                return entry;
+        }
+        else if (freeslot == NULL) {
+            /* Deleted entry */
+            freeslot = entry;
+            freeslot_block = block;
+        }
+
+        /* Quadratic probing */
+        ++num_probes;
+        i = (i + num_probes) & max_items_mask;
+        EX_STATS(++self->total_collisions);
+    }
+    assert(0); /* NOT REACHED */
+}
+#endif
+
+#ifdef HAVE_INT_LOOKUP
+/* Special-case dict_lookup that assumes all keys in the dictionary are exact ints.
+   Values that fit in long long are hashed and compared unboxed. */
+static dictentry *
+dict_lookup_int(SparseDictObject *self, PyObject *key, Py_hash_t hash, int insert)
+{
+    dictentry *entry, *freeslot = NULL;
+    sparseblock *block, *freeslot_block = NULL;
+    sparseblock *blocks = self->blocks;
+    size_t i, num_probes = 0;
+    size_t max_items_mask = (size_t)SparseDict_MAX_ITEMS(self) - 1;
+    int cache_hash = SparseDict_HASH_CACHE(self);
+    PY_LONG_LONG value, entry_value;
+    int small;
+
+    if (!PyInt_CheckExact(key))
+        /* First non-int key, revert to universal lookup. */
+        return dict_lookup_other(self, key, hash, insert);
+    small = int_value(key, &value);
+    if (hash == -1)
+        hash = small ? int_hash(value) : PyObject_Hash(key);
+
+    i = hash_mix((size_t)hash) & max_items_mask;
+    for (;;) {
+        block = &blocks[i / SPARSEBLOCK_SIZE];
+        entry = sparseblock_find(block, i % SPARSEBLOCK_SIZE);
+        if (entry == NULL)
+            return dict_lookup_missing(self, i, freeslot, freeslot_block, hash, insert);
+        else if (entry->key == key)
+            return entry;
+        else if (entry->key != NULL) {
+            if (!cache_hash || SPARSEBLOCK_HASHES(block)[entry - block->items] == hash) {
+                if (small) {
+                    if (int_value(entry->key, &entry_value) && entry_value == value)
+                        return entry;
+                }
+                else {
+                    /* Comparing exact ints never calls back into Python. */
+                    int cmp = PyObject_RichCompareBool(entry->key, key, Py_EQ);
+                    if (cmp < 0)
+                        return NULL;
+                    if (cmp > 0)
+                        return entry;
+                }
+            }
+        }
+        else if (freeslot == NULL) {
+            /* Deleted entry */
+            freeslot = entry;
+            freeslot_block = block;
+        }
+
+        /* Quadratic probing */
+        ++num_probes;
+        i = (i + num_probes) & max_items_mask;
+        EX_STATS(++self->total_collisions);
+    }
+    assert(0); /* NOT REACHED */
+}
+#endif
+
+/* Lookup of the dicts with key type 'i8': the stored keys are equal if their bits are. */
+static dictentry *
+dict_lookup_i8(SparseDictObject *self, PyObject *key, Py_hash_t hash, int insert)
+{
+    dictentry *entry, *freeslot = NULL;
+    sparseblock *block, *freeslot_block = NULL;
+    sparseblock *blocks = self->blocks;
+    size_t i, num_probes = 0;
+    size_t max_items_mask = (size_t)SparseDict_MAX_ITEMS(self) - 1;
+
+    if (hash == -1)
+        hash = key_i8_hash(key);
+
+    i = hash_mix((size_t)hash) & max_items_mask;
+    for (;;) {
+        block = &blocks[i / SPARSEBLOCK_SIZE];
+        entry = sparseblock_find(block, i % SPARSEBLOCK_SIZE);
+        if (entry == NULL)
+            return dict_lookup_missing(self, i, freeslot, freeslot_block, hash, insert);
+        else if (entry->key == key)
+            return entry;
+        else if (entry->key == NULL && freeslot == NULL) {
+            /* Deleted entry */
+            freeslot = entry;
+            freeslot_block = block;
+        }
+
+        /* Quadratic probing */
+        ++num_probes;
+        i = (i + num_probes) & max_items_mask;
+        EX_STATS(++self->total_collisions);
+    }
+    assert(0); /* NOT REACHED */
+}
+
+/* Robin Hood engine
+
+   Linear probing, where an insert takes the slot of the first entry that is closer
+   to its home slot than the new key would be, and the rest of the run shifts forward.
+   Delete shifts the displaced entries that follow back, instead of leaving a deleted
+   entry, so probe chains don't grow with churn and a lookup stops at the first entry
+   closer to its home than the key being looked up.
+   Requires the hash cache, displacements are computed from the cached hashes. */
+
+/* Distance of slot i from the home slot of hash. */
+#define RH_DISTANCE(i, hash, mask) (((i) - (hash_mix(hash) & (mask))) & (mask))
+
+/* Entry at slot i (which must be allocated) and the address of its cached hash. */
+Py_LOCAL_INLINE(dictentry *)
+robinhood_slot(sparseblock *blocks, size_t i, Py_hash_t **hash)
+{
+    sparseblock *block = &blocks[i / SPARSEBLOCK_SIZE];
+    dictentry *entry = sparseblock_find(block, i % SPARSEBLOCK_SIZE);
+    assert(entry != NULL);
+    *hash = &SPARSEBLOCK_HASHES(block)[entry - block->items];
+    return entry;
+}
+
+/* Allocate the entry for hash at slot i, shifting the run that starts there forward
+   by one slot. Returns the entry (with NULL key) or NULL on memory error. */
+Py_LOCAL(dictentry *)
+robinhood_insert_at(sparseblock *blocks, size_t max_items_mask, size_t i, Py_hash_t hash)
+{
+    size_t end = i, prev;
+    dictentry *entry, *src;
+    Py_hash_t *entry_hash, *src_hash;
+
+    while (BIT_TEST(blocks[end / SPARSEBLOCK_SIZE].bitmap, end % SPARSEBLOCK_SIZE))
+        end = (end + 1) & max_items_mask;
+    if (sparseblock_insert(&blocks[end / SPARSEBLOCK_SIZE], end % SPARSEBLOCK_SIZE, hash, OPTION_HASH_CACHE) == NULL)
+        return NULL;
+    for (; end != i; end = prev) {
+        prev = (end - 1) & max_items_mask;
+        entry = robinhood_slot(blocks, end, &entry_hash);
+        src = robinhood_slot(blocks, prev, &src_hash);
+        *entry = *src;
+        *entry_hash = *src_hash;
+    }
+    entry = robinhood_slot(blocks, i, &entry_hash);
+    entry->key = NULL;
+    *entry_hash = hash;
+    return entry;
+}
+
+/* Same as robinhood_insert_at, but finds the slot. The key must not be in the table. */
+Py_LOCAL(dictentry *)
+robinhood_insert(sparseblock *blocks, size_t max_items_mask, Py_hash_t hash)
+{
+    size_t i = hash_mix(hash) & max_items_mask, dist = 0;
+    Py_hash_t *entry_hash;
+
+    while (BIT_TEST(blocks[i / SPARSEBLOCK_SIZE].bitmap, i % SPARSEBLOCK_SIZE)) {
+        robinhood_slot(blocks, i, &entry_hash);
+        if (RH_DISTANCE(i, *entry_hash, max_items_mask) < dist)
+            break;
+        i = (i + 1) & max_items_mask;
+        ++dist;
+    }
+    return robinhood_insert_at(blocks, max_items_mask, i, hash);
+}
+
+/* Lookup function of the Robin Hood engine, same semantics as dict_lookup.
+   The returned entry for insertion is already allocated and has the hash set. */
+static dictentry *
+dict_lookup_robinhood(SparseDictObject *self, PyObject *key, Py_hash_t hash, int insert)
+{
+    size_t max_items_mask = (size_t)SparseDict_MAX_ITEMS(self) - 1;
+    size_t i, dist = 0, version;
+    sparseblock *blocks = self->blocks, *block;
+    dictentry *entry;
+    Py_hash_t entry_hash;
+    PyObject *old_key;
+    int cmp;
+
+    if (hash == -1) {
+        hash = dict_key_hash(self, key);
+        if (hash == -1)
+            return NULL;
+    }
+    for (i = hash_mix(hash) & max_items_mask; ; i = (i + 1) & max_items_mask, ++dist) {
+        block = &blocks[i / SPARSEBLOCK_SIZE];
+        entry = sparseblock_find(block, i % SPARSEBLOCK_SIZE);
+        if (entry == NULL)
+            break;
+        entry_hash = SPARSEBLOCK_HASHES(block)[entry - block->items];
+        if (RH_DISTANCE(i, entry_hash, max_items_mask) < dist)
+            break;
+        if (entry_hash != hash || entry->key == NULL)
+            continue;
+        if (entry->key == key)
+            return entry;
+        if (SparseDict_KEY_TYPE(self))
+            continue; /* Typed keys are equal if their bits are. */
+        old_key = entry->key;
+        version = self->rh_version;
+        Py_INCREF(old_key);
+        cmp = PyObject_RichCompareBool(old_key, key, Py_EQ);
+        Py_DECREF(old_key);
+        if (cmp < 0)
+            return NULL;
+        if (self->rh_version != version || self->blocks != blocks)
+            /* richcmp has changed the dict, restart */
+            return dict_lookup_robinhood(self, key, hash, insert);
+        if (cmp > 0)
+            return entry;
+        EX_STATS(++self->total_collisions);
+    }
+    if (!insert)
+        return &entry_not_found;
+    if (self->num_shared != 0 && dict_own_entry(self, NULL, hash, 1) != 0)
+        return NULL;
+    entry = robinhood_insert_at(blocks, max_items_mask, i, hash);
+    ++self->rh_version;
+    return entry;
+}
+
+/* Remove the entry, found by a lookup for hash, by shifting the displaced entries
+   that follow it back one slot. If the item array of the last slot can't be shrunk
+   (out of memory), the slot is left as a deleted entry: it keeps the hash of its item,
+   so the probe sequences stay intact. */
+Py_LOCAL(void)
+robinhood_erase(SparseDictObject *self, dictentry *entry, Py_hash_t hash)
+{
+    size_t max_items_mask = (size_t)SparseDict_MAX_ITEMS(self) - 1;
+    size_t i = hash_mix(hash) & max_items_mask, next;
+    sparseblock *blocks = self->blocks;
+    dictentry *next_entry;
+    Py_hash_t *entry_hash, *next_hash;
+
+    while (robinhood_slot(blocks, i, &entry_hash) != entry)
+        i = (i + 1) & max_items_mask;
+    for (;;) {
+        next = (i + 1) & max_items_mask;
+        if (!BIT_TEST(blocks[next / SPARSEBLOCK_SIZE].bitmap, next % SPARSEBLOCK_SIZE))
+            break;
+        next_entry = robinhood_slot(blocks, next, &next_hash);
+        if (RH_DISTANCE(next, *next_hash, max_items_mask) == 0)
+            break;
+        *entry = *next_entry;
+        *entry_hash = *next_hash;
+        entry = next_entry;
+        entry_hash = next_hash;
+        i = next;
+    }
+    entry->key = NULL;
+    ++self->rh_version;
+    if (sparseblock_remove(&blocks[i / SPARSEBLOCK_SIZE], BIT(i % SPARSEBLOCK_SIZE), OPTION_HASH_CACHE) == 0) {
+        --self->num_items;
+        --self->num_deleted;
+    }
+    else
+        PyErr_Clear();
+}
+
+/* Bloom filter
+
+   Blocked Bloom filter: each key sets BLOOM_BITS bits of a single 64-bit word, so testing
+   a key costs one memory access. A lookup of a missing key walks the probe chain to its
+   end, dereferencing entries and keys on the way, the filter answers most of these
+   without touching the table. The filter has BLOOM_SLOTS_PER_WORD words per table
+   slot, 10-21 bits per key between the resizes. */
+
+#define BLOOM_BITS 4
+#define BLOOM_SLOTS_PER_WORD 8
+/* Inserts a filter of n words takes before it's rebuilt (at 8 bits per key). */
+#define BLOOM_CAPACITY(num_words) ((Py_ssize_t)(num_words) * 64 / 8)
+
+/* The slot index uses the low bits of the hash_mix product, the filter has its own mix. */
+Py_LOCAL_INLINE(unsigned PY_LONG_LONG)
+bloom_mix(Py_hash_t hash)
+{
+    unsigned PY_LONG_LONG h = (unsigned PY_LONG_LONG)hash;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    return h ^ (h >> 33);
+}
+
+/* Low 24 bits pick the bits, the rest the word. */
+#define BLOOM_WORD(h, mask) ((size_t)((h) >> 24) & (mask))
+#define BLOOM_KEY_BITS(h) (BIT((h) & 63) | BIT(((h) >> 6) & 63) | BIT(((h) >> 12) & 63) | BIT(((h) >> 18) & 63))
+
+Py_LOCAL_INLINE(void)
+bloom_add(bitmap_t *bloom, size_t mask, Py_hash_t hash)
+{
+    unsigned PY_LONG_LONG h = bloom_mix(hash);
+    bloom[BLOOM_WORD(h, mask)] |= BLOOM_KEY_BITS(h);
+}
+
+/* Returns 0 if the key with the hash is not in the filter. */
+Py_LOCAL_INLINE(int)
+bloom_test(bitmap_t *bloom, size_t mask, Py_hash_t hash)
+{
+    unsigned PY_LONG_LONG h = bloom_mix(hash);
+    bitmap_t bits = BLOOM_KEY_BITS(h);
+    return (bloom[BLOOM_WORD(h, mask)] & bits) == bits;
+}
+
+/* Number of filter words for a table of max_items slots. */
+Py_LOCAL_INLINE(size_t)
+bloom_num_words(Py_ssize_t max_items)
+{
+    return max_items >= BLOOM_SLOTS_PER_WORD ? (size_t)max_items / BLOOM_SLOTS_PER_WORD : 1;
+}
+
+/* Allocate an empty filter for a table of max_items slots. */
+Py_LOCAL(bitmap_t *)
+bloom_new(Py_ssize_t max_items)
+{
+    size_t num_words = bloom_num_words(max_items);
+    bitmap_t *bloom = PyMem_NEW(bitmap_t, num_words);
+    if (bloom == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    memset(bloom, 0, num_words * sizeof(bitmap_t));
+    return bloom;
+}
+
+/* Install a filter built for the table of max_items slots holding num_added keys. */
+Py_LOCAL(void)
+dict_set_bloom(SparseDictObject *self, bitmap_t *bloom, Py_ssize_t max_items, Py_ssize_t num_added)
+{
+    PyMem_FREE(self->bloom);
+    self->bloom = bloom;
+    self->bloom_mask = bloom ? bloom_num_words(max_items) - 1 : 0;
+    self->bloom_added = num_added;
+}
+
+/* Build the filter of the current keys (of both tables if migrating). Hashes are taken
+   from the hash cache or recalculated. If __hash__ changes the dict, the old filter is
+   kept: it has seen the keys inserted meanwhile. Returns -1 on error. */
+Py_LOCAL(int)
+dict_build_bloom(SparseDictObject *self)
+{
+    Py_ssize_t i, num_items = self->num_items, num_added = 0;
+    Py_ssize_t max_items = SparseDict_MAX_ITEMS(self);
+    sparseblock *blocks = self->blocks;
+    bitmap_t *bloom, *old_bloom = self->bloom;
+    int j, cache_hash = SparseDict_HASH_CACHE(self);
+    Py_hash_t hash;
+
+    if (self->_max_items & FLAG_DISABLE_RESIZE) {
+        PyErr_SetString(PyExc_RuntimeError, "SparseDict: resize is not reentrant");
+        return -1;
+    }
+    bloom = bloom_new(max_items);
+    if (bloom == NULL)
+        return -1;
+    self->_max_items |= FLAG_DISABLE_RESIZE;
+    for (i = 0; i < self->num_blocks + self->old_num_blocks; ++i) {
+        sparseblock *block = dict_block(self, i);
+        for (j = 0; j < SPARSEBLOCK_NUM_ITEMS(block); ++j) {
+            PyObject *key = block->items[j].key;
+            if (key == NULL)
+                continue;
+            if (cache_hash)
+                hash = SPARSEBLOCK_HASHES(block)[j];
+            else {
+                hash = dict_key_hash(self, key);
+                if (hash == -1)
+                    goto Failed;
+                if (self->num_items != num_items || self->blocks != blocks || self->bloom != old_bloom) {
+                    PyMem_FREE(bloom);
+                    self->_max_items &= ~FLAG_DISABLE_RESIZE;
+                    return 0;
+                }
+            }
+            bloom_add(bloom, bloom_num_words(max_items) - 1, hash);
+            ++num_added;
+        }
+    }
+    self->_max_items &= ~FLAG_DISABLE_RESIZE;
+    dict_set_bloom(self, bloom, max_items, num_added);
+    return 0;
+
+Failed:
+    PyMem_FREE(bloom);
+    self->_max_items &= ~FLAG_DISABLE_RESIZE;
+    return -1;
+}
+
+/* The filter has taken more inserts than it was sized for. */
+#define BLOOM_STALE(sdict) \
+    ((sdict)->bloom != NULL && (sdict)->bloom_added > BLOOM_CAPACITY((sdict)->bloom_mask + 1))
+
+/* Incremental resize
+
+   With OPTION_INCREMENTAL_RESIZE, dict_resize only allocates the new table. Old blocks
+   are migrated by every lookup (and so by every insert and delete), about MIGRATE_BUDGET
+   items at a time, and the keys found in the old table are moved right away.
+   Migrated blocks keep their bitmaps so that the old table probe sequences still work.
+   Migration requires the hash cache: it must not call back into Python. */
+
+#define MIGRATE_MIN_BLOCKS 64 /* Smaller tables are resized at once. */
+#define MIGRATE_BUDGET     (2 * SPARSEBLOCK_SIZE)
+#define MIGRATION_PAUSED(sdict) ((sdict)->num_pins > 0 || ((sdict)->_max_items & FLAG_DISABLE_RESIZE))
+
+/* Move an old table entry to the new table, which must not have its key. Marks the old
+   entry as deleted. Returns the new entry or NULL on memory error. */
+Py_LOCAL(dictentry *)
+dict_migrate_entry(SparseDictObject *self, dictentry *entry, Py_hash_t hash)
+{
+    size_t max_items_mask = (size_t)SparseDict_MAX_ITEMS(self) - 1;
+    size_t i = hash_mix((size_t)hash) & max_items_mask, num_probes = 0;
+    dictentry *new_entry;
+
+    while (BIT_TEST(self->blocks[i / SPARSEBLOCK_SIZE].bitmap, i % SPARSEBLOCK_SIZE)) {
+        ++num_probes;
+        i = (i + num_probes) & max_items_mask;
+    }
+    new_entry = sparseblock_insert(&self->blocks[i / SPARSEBLOCK_SIZE], i % SPARSEBLOCK_SIZE, hash, 1);
+    if (new_entry == NULL)
+        return NULL;
+    *new_entry = *entry;
+    entry->key = NULL;
+    /* The new item is counted as allocated and the old one as deleted until its block is migrated. */
+    ++self->num_items;
+    ++self->num_deleted;
+    --self->old_size;
+    return new_entry;
+}
+
+/* Migrate old blocks until about budget items are visited, or all of them if budget < 0.
+   Frees the old table when done. Returns 0 on success, -1 on memory error. */
+Py_LOCAL(int)
+dict_migrate(SparseDictObject *self, Py_ssize_t budget)
+{
+    assert(SparseDict_MIGRATING(self));
+    assert(SparseDict_HASH_CACHE(self));
+
+    while (self->migrate_index < self->old_num_blocks) {
+        sparseblock *block = &self->old_blocks[self->migrate_index];
+        int j, num_items = SPARSEBLOCK_NUM_ITEMS(block);
+
+        if (budget == 0)
+            return 0;
+        for (j = 0; j < num_items; ++j) {
+            if (block->items[j].key != NULL &&
+                dict_migrate_entry(self, &block->items[j], SPARSEBLOCK_HASHES(block)[j]) == NULL)
+                return -1;
+        }
+        items_free(block->items, SPARSEBLOCK_ITEMS_SIZE(num_items, OPTION_HASH_CACHE));
+        block->items = NULL;
+        ++self->migrate_index;
+        if (budget > 0)
+            budget = budget > num_items + 1 ? budget - num_items - 1 : 0;
+    }
+
+    /* Every item of the old table ended up deleted, either moved or by the user. */
+    self->num_items -= self->old_num_items;
+    self->num_deleted -= self->old_num_items;
+    self->old_num_items = 0;
+    PyMem_FREE(self->old_blocks);
+    self->old_blocks = NULL;
+    self->old_num_blocks = 0;
+    self->old_max_items = 0;
+    self->migrate_index = 0;
+    self->old_size = 0;
+    return 0;
+}
+
+/* Start the incremental resize to an empty table of new_max_items. */
+Py_LOCAL(int)
+dict_start_migration(SparseDictObject *self, Py_ssize_t new_max_items)
+{
+    Py_ssize_t num_new_blocks = (new_max_items + SPARSEBLOCK_SIZE - 1) / SPARSEBLOCK_SIZE;
+    sparseblock *new_blocks;
+
+    assert(!SparseDict_MIGRATING(self));
+    assert(self->blocks != self->static_blocks);
+
+    new_blocks = PyMem_NEW(sparseblock, num_new_blocks);
+    if (new_blocks == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    memset(new_blocks, 0, num_new_blocks * sizeof(sparseblock));
+
+    self->old_blocks = self->blocks;
+    self->old_num_blocks = self->num_blocks;
+    self->old_max_items = SparseDict_MAX_ITEMS(self);
+    self->migrate_index = 0;
+    self->old_num_items = self->num_items;
+    self->old_size = SparseDict_SIZE(self);
+    self->blocks = new_blocks;
+    self->num_blocks = num_new_blocks;
+    self->_max_items = new_max_items; /* All flags are cleared */
+    EX_STATS(++self->total_resizes);
+    return 0;
+}
+
+/* Search the part of the old table that is not migrated yet.
+   Returns the entry, &entry_not_found if the key is not there, or NULL on error. */
+Py_LOCAL(dictentry *)
+dict_lookup_old(SparseDictObject *self, PyObject *key, Py_hash_t hash)
+{
+    sparseblock *block, *blocks = self->old_blocks;
+    Py_ssize_t migrate_index = self->migrate_index;
+    size_t max_items_mask = (size_t)self->old_max_items - 1;
+    size_t i = hash_mix((size_t)hash) & max_items_mask, num_probes = 0;
+    dictentry *entry;
+    PyObject *old_key;
+    int cmp;
+
+    for (;;) {
+        block = &blocks[i / SPARSEBLOCK_SIZE];
+        if (!BIT_TEST(block->bitmap, i % SPARSEBLOCK_SIZE))
+            return &entry_not_found;
+        if ((Py_ssize_t)(i / SPARSEBLOCK_SIZE) >= migrate_index) {
+            entry = sparseblock_find(block, i % SPARSEBLOCK_SIZE);
+            if (entry->key == key)
+                return entry;
+            if (entry->key != NULL && !SparseDict_KEY_TYPE(self) &&
+                    SPARSEBLOCK_HASHES(block)[entry - block->items] == hash) {
+                old_key = entry->key;
+                Py_INCREF(old_key);
+                cmp = PyObject_RichCompareBool(old_key, key, Py_EQ);
+                Py_DECREF(old_key);
+                if (cmp < 0)
+                    return NULL;
+                if (self->old_blocks != blocks || self->migrate_index != migrate_index ||
+                    entry->key != old_key) {
+                    /* richcmp has changed the dict, restart */
+                    if (!SparseDict_MIGRATING(self))
+                        return &entry_not_found;
+                    return dict_lookup_old(self, key, hash);
+                }
+                if (cmp > 0)
+                    return entry;
+            }
+        }
+        ++num_probes;
+        i = (i + num_probes) & max_items_mask;
+    }
+    assert(0); /* NOT REACHED */
+}
+
+/* Lookup during incremental resize: advance the migration, then search the old table
+   and, if the key is not there, the new one. */
+Py_LOCAL(dictentry *)
+dict_lookup_migrating(SparseDictObject *self, PyObject *key, Py_hash_t hash, int insert)
+{
+    dictentry *entry;
+
+    if (!MIGRATION_PAUSED(self) && dict_migrate(self, MIGRATE_BUDGET) != 0)
+        return NULL;
+    if (SparseDict_MIGRATING(self)) {
+        if (hash == -1) {
+            hash = dict_key_hash(self, key);
+            if (hash == -1)
+                return NULL;
+        }
+        entry = dict_lookup_old(self, key, hash);
+        if (entry == NULL)
+            return NULL;
+        if (entry->key != NULL)
+            return MIGRATION_PAUSED(self) ? entry : dict_migrate_entry(self, entry, hash);
+    }
+    return (self->lookup)(self, key, hash, insert);
+}
+
+/* Entry point for all lookups, see dict_lookup for the semantics.
+   The key is as the entries store it, see key_unbox. */
+Py_LOCAL_INLINE(dictentry *)
+dict_find(SparseDictObject *self, PyObject *key, Py_hash_t hash, int insert)
+{
+    dictentry *entry;
+
+    if (self->bloom != NULL) {
+        if (hash == -1) {
+            hash = dict_key_hash(self, key);
+            if (hash == -1)
+                return NULL;
+        }
+        /* An empty home slot answers as well, and the block bitmaps are likelier cached. */
+        if (!insert && !SparseDict_MIGRATING(self)) {
+            size_t i = hash_mix(hash) & (SparseDict_MAX_ITEMS(self) - 1);
+            if (!BIT_TEST(self->blocks[i / SPARSEBLOCK_SIZE].bitmap, i % SPARSEBLOCK_SIZE))
+                return &entry_not_found;
+        }
+        if (!insert && !bloom_test(self->bloom, self->bloom_mask, hash)) {
+            ++self->bloom_rejects;
+            return &entry_not_found;
+        }
+    }
+    ++self->num_lookups;
+    if (SparseDict_MIGRATING(self))
+        entry = dict_lookup_migrating(self, key, hash, insert);
+    else
+        entry = (self->lookup)(self, key, hash, insert);
+    --self->num_lookups;
+    /* Lookup can run __eq__, the filter may have been rebuilt (without the key) or enabled. */
+    if (entry == NULL || self->bloom == NULL)
+        return entry;
+    if (insert) {
+        if (hash == -1 && (hash = dict_key_hash(self, key)) == -1) {
+            PyErr_Clear();
+            dict_set_bloom(self, NULL, 0, 0); /* until the next rebuild */
+            return entry;
+        }
+        bloom_add(self->bloom, self->bloom_mask, hash);
+        ++self->bloom_added;
+    }
+    else if (entry->key == NULL)
+        ++self->bloom_false_positives;
+    return entry;
+}
+
+/* dict_find for a lookup (insert = 0) of a key given by the user. With a key type, a key
+   the type can't hold is not found and the hash of key (which its type could define
+   differently) is not used. */
+Py_LOCAL_INLINE(dictentry *)
+dict_find_key(SparseDictObject *self, PyObject *key, Py_hash_t hash)
+{
+    int typed = SparseDict_KEY_TYPE(self);
+
+    if (typed) {
+        int found = key_unbox(typed, key, &key, 0);
+        if (found <= 0)
+            return found < 0 ? NULL : &entry_not_found;
+        hash = -1;
+    }
+    return dict_find(self, key, hash, 0);
+}
+
+/* Insert an item into the dictionary. Same semantics as PyDict_SetItem.
+   Hash is calculated if it's -1. */
+Py_LOCAL(int)
+dict_insert_hash(SparseDictObject *self, PyObject *key, Py_hash_t hash, PyObject *value)
+{
+    PyObject *old_value;
+    dictentry *entry;
+    int typed = SparseDict_VALUE_TYPE(self), key_typed = SparseDict_KEY_TYPE(self);
+
+    /* Before the table is touched: conversion can run Python code. */
+    if (key_typed) {
+        if (key_unbox(key_typed, key, &key, 1) <= 0)
+            return -1;
+        hash = -1;
+    }
+    if (typed && typed != OPTION_VALUE_BYTES && value_unbox(typed, value, &value) != 0)
+        return -1;
+    if (dict_resize_delta(self, 1) != 0)
+        return -1;
+    /* Replacing the value of a shared block needs the hash to find it. */
+    if (hash == -1 && self->num_shared != 0 && (hash = dict_key_hash(self, key)) == -1)
+        return -1;
+    /* Bytes go to the arena after the resize, which compacts it. The lookup can run Python
+       code, a compaction it causes has to wait until the value is in the entry. */
+    if (typed == OPTION_VALUE_BYTES && dict_value_unbox(self, value, &value) != 0)
+        return -1;
+
+    VALUE_INCREF(typed, value);
+    KEY_INCREF(key_typed, key);
+    ++self->arena_pending;
+    entry = dict_find(self, key, hash, 1);
+    --self->arena_pending;
+    if (entry == NULL || (entry->key != NULL && self->num_shared != 0 &&
+                          dict_own_entry(self, &entry, hash, 0) != 0)) {
+        KEY_DECREF(key_typed, key);
+        VALUE_DECREF(typed, value);
+        return -1;
+    }
+
+    MAINTAIN_TRACKING(self, key, value);
+    if (entry->key != NULL) {
+        old_value = entry->value;
+        entry->value = value;
+        VALUE_DECREF(typed, old_value); /* which **CAN** re-enter */
+        KEY_DECREF(key_typed, key);
+    }
+    else {
+        entry->key = key;
+        entry->value = value;
+        ++self->num_items;
+    }
+    return 0;
+}
+
+#define dict_insert(self, key, value) dict_insert_hash(self, key, -1, value)
+
+/* Mark the entry found for hash as deleted. The Robin Hood engine removes it instead,
+   moving other entries around: callers must take the key and value out first.
+   Returns -1 if a shared block can't be copied, the entry stays then. hash can be -1
+   without the Robin Hood engine if the block of the entry is not shared. */
+Py_LOCAL_INLINE(int)
+dict_erase(SparseDictObject *self, dictentry *entry, Py_hash_t hash)
+{
+    if (self->num_shared != 0 && hash != -1 &&
+            dict_own_entry(self, &entry, hash, self->options & OPTION_ROBIN_HOOD) != 0)
+        return -1;
+    entry->key = NULL;
+    ++self->num_deleted;
+    if (self->options & OPTION_ROBIN_HOOD)
+        robinhood_erase(self, entry, hash);
+    return 0;
+}
+
+/* Delete an item from the dictionary. Same semantics as PyDict_DelItem. */
+Py_LOCAL(int)
+dict_delete(SparseDictObject *self, PyObject *key)
+{
+    dictentry *entry;
+    PyObject *old_key, *old_value, *stored;
+    Py_hash_t hash = 0;
+    int found = key_unbox(SparseDict_KEY_TYPE(self), key, &stored, 0);
+
+    if (found < 0 || (found && (hash = dict_key_hash(self, stored)) == -1))
+        return -1;
+    entry = found ? dict_find(self, stored, hash, 0) : &entry_not_found;
+    if (entry == NULL)
+        return -1;
+    if (entry->key == NULL) {
+        set_key_error(key);
+        return -1;
+    }
+    old_key = entry->key;
+    old_value = entry->value;
+    if (dict_erase(self, entry, hash) != 0)
+        return -1;
+    self->_max_items |= FLAG_CONSIDER_SHRINK;
+    VALUE_DECREF(SparseDict_VALUE_TYPE(self), old_value);
+    KEY_DECREF(SparseDict_KEY_TYPE(self), old_key);
+    dict_after_delete(self);
+    return 0;
+}
+
+/* Resize policy of SparseDict and SparseSet: the table size that makes room for at least
+   delta more items, or 0 if the table (*_max_items with the flags) doesn't need resizing.
+   size counts the nondeleted items, load the deleted ones too. */
+Py_LOCAL(Py_ssize_t)
+table_resize_size(Py_ssize_t *_max_items, Py_ssize_t size, Py_ssize_t load, Py_ssize_t delta)
+{
+    /* Growth factor is 3/4 = 0.75, shrink factor is 5/16 = 0.3125 */
+
+    Py_ssize_t max_items = *_max_items & ~FLAGS_MASK, new_max_items;
+
+    if (delta <= 0)
+        return 0;
+
+    if (*_max_items & FLAG_CONSIDER_SHRINK) {
+        *_max_items &= ~FLAG_CONSIDER_SHRINK;
+        if (size < max_items * 5 / 16)
+            goto Resize;
+    }
+    if (load + delta <= max_items * 3 / 4)
+        return 0;
+
+Resize:
+    /* Find the size which fits nondeleted items below enlarge threshold. */
+    new_max_items = INITIAL_ITEMS;
+    while (size + delta > new_max_items * 3 / 4)
+        new_max_items *= 2;
+    if (new_max_items < max_items) {
+        /* We're actually shrinking due to lots of deleted elements. Try to re-grow. */
+        if (size + delta >= new_max_items * 2 * 5 / 16)
+            /* Doubling the size won't hit shrink limit. */
+            new_max_items *= 2;
+    }
+    return new_max_items;
+}
+
+/* This is caled to preallocate space for at least delta elements. */
+Py_LOCAL(int)
+dict_resize_delta(SparseDictObject *self, Py_ssize_t delta) {
+    Py_ssize_t new_max_items;
+
+    if (delta <= 0)
+        return 0;
+
+    new_max_items = table_resize_size(&self->_max_items, SparseDict_SIZE(self), SparseDict_LOAD(self), delta);
+    if (new_max_items != 0)
+        return dict_resize(self, new_max_items);
+    /* The filter is an optimization, it stays valid if it can't be rebuilt. */
+    if (BLOOM_STALE(self) && dict_build_bloom(self) != 0) {
+        PyErr_Clear();
+        self->bloom_added = 0;
+    }
+    return 0;
+}
+
+/* Resize the hashtable by allocating a new sparseblock array and reinserting
+   all non-deleted items. Returns 0 on success, -1 on error. */
+Py_LOCAL(int)
+dict_resize(SparseDictObject *self, Py_ssize_t new_max_items)
+{
+    if (self->_max_items & FLAG_DISABLE_RESIZE) {
+        PyErr_SetString(PyExc_RuntimeError, "SparseDict: resize is not reentrant");
+        return -1;
+    }
+    /* Previous incremental resize has to be finished first. */
+    if (SparseDict_MIGRATING(self) && dict_migrate(self, -1) != 0)
+        return -1;
+    /* Compaction only saves memory, the arena is complete without it. */
+    if (dict_compact_arena(self) != 0)
+        PyErr_Clear();
+    if ((self->options & OPTION_INCREMENTAL_RESIZE) && self->num_blocks >= MIGRATE_MIN_BLOCKS &&
+            self->num_shared == 0)
+        return dict_start_migration(self, new_max_items);
+    return dict_rebuild(self, new_max_items, self->options);
+}
+
+/* The rehash loop of dict_rebuild and set_resize. Copies the nondeleted entries of
+   entry_size bytes from the blocks (tags of layout) to new_blocks, a table of max_items_mask + 1
+   slots with new_options. Hashes are taken from the hash cache or recalculated, of i8 keys
+   if key_typed. The old blocks are left as they are, so that the caller can keep them after
+   a hash or memory error (-1). The hashes are also added to bloom, if it's not NULL. */
+Py_LOCAL(int)
+table_rehash(sparseblock *blocks, Py_ssize_t num_blocks, size_t entry_size, int layout, int key_typed,
+             sparseblock *new_blocks, size_t max_items_mask, int new_options, bitmap_t *bloom, size_t bloom_mask)
+{
+    Py_ssize_t k;
+    size_t i;
+    int j;
+
+    for (k = 0; k < num_blocks; ++k) {
+        sparseblock *block = &blocks[k];
+        int num_items = SPARSEBLOCK_NUM_ITEMS(block);
+        for (j = 0; j < num_items; ++j) {
+            PyObject **new_slot, **slot = SPARSEBLOCK_SLOT(block->items, j, entry_size);
+            Py_hash_t hash;
+            size_t num_probes = 0;
+
+            if (*slot == NULL)
+                continue;
+            if (layout & OPTION_HASH_CACHE)
+                hash = ((Py_hash_t *)SPARSEBLOCK_TAGS(block, entry_size))[j];
+            else {
+                hash = key_typed ? key_i8_hash(*slot) : key_hash(*slot);
+                if (hash == -1)
+                    return -1;
+            }
+
+            if (new_options & OPTION_ROBIN_HOOD)
+                new_slot = (PyObject **)robinhood_insert(new_blocks, max_items_mask, hash);
+            else {
+                i = hash_mix((size_t)hash) & max_items_mask;
+                while (BIT_TEST(new_blocks[i / SPARSEBLOCK_SIZE].bitmap, i % SPARSEBLOCK_SIZE)) {
+                    ++num_probes;
+                    i = (i + num_probes) & max_items_mask;
+                }
+                new_slot = sparseblock_insert_slot(&new_blocks[i / SPARSEBLOCK_SIZE], i % SPARSEBLOCK_SIZE,
+                                                   hash, new_options & OPTIONS_BLOCK_LAYOUT, entry_size);
+            }
+            if (new_slot == NULL)
+                return -1;
+
+            memcpy(new_slot, slot, entry_size);
+            if (bloom != NULL)
+                bloom_add(bloom, bloom_mask, hash);
+            /* Note: we do not free the old blocks as we go. It has minimal impact on
+               memory usage during the resize but allows easy recover from hash and memory errors. */
+        }
+    }
+    return 0;
+}
+
+/* Free the item arrays of the blocks, not the entries. */
+Py_LOCAL(void)
+table_free_items(sparseblock *blocks, Py_ssize_t num_blocks, size_t entry_size, int layout)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < num_blocks; ++i)
+        items_free(blocks[i].items, SPARSEBLOCK_ARRAY_SIZE(SPARSEBLOCK_NUM_ITEMS(&blocks[i]), entry_size, layout));
+}
+
+/* Replace the blocks array of a table (*blocks, static_block for one block tables) by
+   new_blocks, freeing the old one. The item arrays are not touched. */
+Py_LOCAL(void)
+table_set_blocks(sparseblock **blocks, sparseblock *static_block, sparseblock *new_blocks, Py_ssize_t num_new_blocks)
+{
+    if (*blocks != static_block)
+        PyMem_FREE(*blocks);
+    if (num_new_blocks == 1) {
+        *static_block = new_blocks[0];
+        *blocks = static_block;
+        PyMem_FREE(new_blocks);
+    }
+    else {
+        *blocks = new_blocks;
+    }
+}
+
+/* Same as dict_resize, but also switches the dict to new_options.
+   Hashes are taken from the old blocks if they have them, otherwise recalculated. */
+Py_LOCAL(int)
+dict_rebuild(SparseDictObject *self, Py_ssize_t new_max_items, int new_options)
+{
+    Py_ssize_t max_items_mask = new_max_items - 1;
+    Py_ssize_t num_new_blocks = (new_max_items + SPARSEBLOCK_SIZE - 1) / SPARSEBLOCK_SIZE;
+    sparseblock *new_blocks;
+    bitmap_t *new_bloom = NULL;
+    Py_ssize_t i;
+    int j, layout = SparseDict_LAYOUT(self);
+    int new_layout = new_options & OPTIONS_BLOCK_LAYOUT;
+
+    SparseDict_INVARIANT(self);
+
+    if (self->_max_items & FLAG_DISABLE_RESIZE) {
+        PyErr_SetString(PyExc_RuntimeError, "SparseDict: resize is not reentrant");
+        return -1;
+    }
+    if (SparseDict_MIGRATING(self) && dict_migrate(self, -1) != 0)
+        return -1;
+    self->_max_items |= FLAG_DISABLE_RESIZE;
+
+    new_blocks = PyMem_NEW(sparseblock, num_new_blocks);
+    if (new_blocks == NULL) {
+        self->_max_items &= ~FLAG_DISABLE_RESIZE;
+        PyErr_NoMemory();
+        return -1;
+    }
+    memset(new_blocks, 0, num_new_blocks * sizeof(sparseblock));
+    if (new_options & OPTION_BLOOM) {
+        new_bloom = bloom_new(new_max_items);
+        if (new_bloom == NULL)
+            goto Failed;
+    }
+
+    if (table_rehash(self->blocks, self->num_blocks, sizeof(dictentry), layout, SparseDict_KEY_TYPE(self),
+                     new_blocks, max_items_mask, new_options, new_bloom, bloom_num_words(new_max_items) - 1) != 0)
+        goto Failed;
+
+    /* Free old blocks. The items moved out of the shared ones need references of their own. */
+    for (i = 0; i < self->num_blocks; ++i) {
+        sparseblock *block = &self->blocks[i];
+        sharedblockobject *sb = self->shared != NULL ? (sharedblockobject *)self->shared[i] : NULL;
+        if (sb != NULL && Py_REFCNT(sb) > 1) {
+            for (j = 0; j < SPARSEBLOCK_NUM_ITEMS(block); ++j) {
+                if (block->items[j].key != NULL) {
+                    KEY_INCREF(SparseDict_KEY_TYPE(self), block->items[j].key);
+                    VALUE_INCREF(SparseDict_VALUE_TYPE(self), block->items[j].value);
+                }
+            }
+        }
+        else {
+            if (sb != NULL)
+                sb->items = NULL;
+            items_free(block->items, SPARSEBLOCK_ITEMS_SIZE(SPARSEBLOCK_NUM_ITEMS(block), layout));
+        }
+        Py_XDECREF(sb);
+    }
+    PyMem_FREE(self->shared);
+    self->shared = NULL;
+    self->num_shared = 0;
+
+    /* Update self with new blocks. */
+    table_set_blocks(&self->blocks, self->static_blocks, new_blocks, num_new_blocks);
+    self->_max_items = new_max_items; /* All flags are cleared */
+    if ((new_options ^ self->options) & (OPTION_ROBIN_HOOD | OPTION_KEY_I8))
+        self->lookup = (new_options & OPTION_ROBIN_HOOD) ? dict_lookup_robinhood :
+                       (new_options & OPTION_KEY_I8) ? dict_lookup_i8 : dict_lookup;
+    self->options = new_options;
+    ++self->rh_version;
+    self->num_blocks = num_new_blocks;
+    self->num_items -= self->num_deleted;
+    self->num_deleted = 0;
+    dict_set_bloom(self, new_bloom, new_max_items, self->num_items);
+    EX_STATS(++self->total_resizes);
+
+    SparseDict_INVARIANT(self);
+    return 0;
+
+Failed:
+    /* Discard partial new_blocks. */
+    table_free_items(new_blocks, num_new_blocks, sizeof(dictentry), new_layout);
+    PyMem_FREE(new_blocks);
+    PyMem_FREE(new_bloom);
+    self->_max_items &= ~FLAG_DISABLE_RESIZE;
+    return -1;
+}
+
+/* Memory taken by the item arrays, including the hash cache and allocator rounding.
+   Arrays shared with snapshots are counted if shared = 1, the rest if shared = 0. */
+Py_LOCAL(Py_ssize_t)
+dict_items_bytes(SparseDictObject *self, int shared)
+{
+    Py_ssize_t i, result = 0;
+    int layout = SparseDict_LAYOUT(self);
+
+    for (i = 0; i < self->num_blocks + self->old_num_blocks; ++i) {
+        int num_items = SPARSEBLOCK_NUM_ITEMS(dict_block(self, i));
+        int is_shared = self->num_shared != 0 && i < self->num_blocks && self->shared[i] != NULL;
+        if (num_items != 0 && is_shared == shared)
+            result += items_alloc_size(SPARSEBLOCK_ITEMS_SIZE(num_items, layout));
+    }
+    return result;
+}
+
+/* Tombstone compaction
+
+   Deleted entries keep their bitmap bits, as lookups have to probe past them, until
+   the next resize. Compaction frees those of them that are not on the probe path of
+   any item, without rehashing: the slots on the probe paths are marked first, then every
+   block with unmarked deleted entries gets a smaller item array. With OPTION_AUTO_COMPACT
+   it runs after deletes, once there are enough deleted entries. */
+
+#define COMPACT_MIN_DELETED (2 * SPARSEBLOCK_SIZE) /* Fewer deleted items are not worth a pass. */
+/* More deleted than live items. Compacting sooner costs more passes than it saves memory. */
+#define COMPACT_DUE(sdict) \
+    ((sdict)->num_deleted >= COMPACT_MIN_DELETED && (sdict)->num_deleted > (sdict)->num_items / 2)
+
+/* Compact the table. If more than 1/8 of the items remain deleted (their slots are on
+   probe paths), rehash it as well. The blocks array is not shrunk, that is left to
+   the next insert (FLAG_CONSIDER_SHRINK). Does nothing while the item positions are
+   pinned by iterators, or during a lookup (from __eq__): it may hold a deleted entry
+   to insert into. Returns the bytes freed or -1 on error. */
+Py_LOCAL(Py_ssize_t)
+dict_compact(SparseDictObject *self)
+{
+    Py_ssize_t k, num_items, num_deleted, new_max_items, freed;
+    Py_ssize_t before = dict_items_bytes(self, 0) + dict_items_bytes(self, 1);
+    size_t i, slot, max_items_mask, num_probes;
+    bitmap_t *marked, removed;
+    sparseblock *blocks;
+    dictentry *items;
+    Py_hash_t hash;
+    int j, n, cache_hash = SparseDict_HASH_CACHE(self), layout = SparseDict_LAYOUT(self);
+
+    if (self->num_deleted == 0 || MIGRATION_PAUSED(self) || self->num_lookups != 0)
+        return 0;
+    if (SparseDict_MIGRATING(self) && dict_migrate(self, -1) != 0)
+        return -1;
+    if (self->options & OPTION_ROBIN_HOOD) {
+        /* Only deletes that ran out of memory leave deleted entries, see robinhood_erase. */
+        if (dict_rebuild(self, SparseDict_MAX_ITEMS(self), self->options) != 0)
+            return -1;
+        goto Done;
+    }
+
+    blocks = self->blocks;
+    num_items = self->num_items;
+    num_deleted = self->num_deleted;
+    max_items_mask = SparseDict_MAX_ITEMS(self) - 1;
+    marked = PyMem_NEW(bitmap_t, self->num_blocks);
+    if (marked == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    memset(marked, 0, self->num_blocks * sizeof(bitmap_t));
+
+    self->_max_items |= FLAG_DISABLE_RESIZE;
+    for (k = 0; k < self->num_blocks; ++k) {
+        for (j = 0, n = 0; j < SPARSEBLOCK_SIZE; ++j) {
+            if (!BIT_TEST(blocks[k].bitmap, j))
+                continue;
+            items = blocks[k].items;
+            if (items[n].key != NULL) {
+                if (cache_hash)
+                    hash = SPARSEBLOCK_HASHES(&blocks[k])[n];
+                else {
+                    hash = dict_key_hash(self, items[n].key);
+                    if (hash == -1)
+                        goto Failed;
+                    /* __hash__ changed the dict, the marks may be stale. */
+                    if (self->num_items != num_items || self->num_deleted != num_deleted ||
+                            self->blocks != blocks) {
+                        PyMem_FREE(marked);
+                        self->_max_items &= ~FLAG_DISABLE_RESIZE;
+                        return 0;
+                    }
+                }
+                slot = k * SPARSEBLOCK_SIZE + j;
+                i = hash_mix((size_t)hash) & max_items_mask;
+                num_probes = 0;
+                /* The bound only matters for keys whose hash has changed, they can't be found anyway. */
+                while (i != slot && num_probes <= max_items_mask) {
+                    BIT_SET(marked[i / SPARSEBLOCK_SIZE], i % SPARSEBLOCK_SIZE);
+                    ++num_probes;
+                    i = (i + num_probes) & max_items_mask;
+                }
+            }
+            ++n;
+        }
+    }
+    self->_max_items &= ~FLAG_DISABLE_RESIZE;
+
+    for (k = 0; k < self->num_blocks; ++k) {
+        items = blocks[k].items;
+        removed = 0;
+        for (j = 0, n = 0; j < SPARSEBLOCK_SIZE; ++j) {
+            if (!BIT_TEST(blocks[k].bitmap, j))
+                continue;
+            if (items[n++].key == NULL && !BIT_TEST(marked[k], j))
+                BIT_SET(removed, j);
+        }
+        if (removed == 0)
+            continue;
+        if (self->num_shared != 0 && self->shared[k] != NULL && dict_own_block(self, k, NULL) != 0)
+            goto Failed;
+        if (sparseblock_remove(&blocks[k], removed, layout) != 0)
+            goto Failed;
+        self->num_items -= popcount(removed);
+        self->num_deleted -= popcount(removed);
+    }
+    PyMem_FREE(marked);
+
+    if (self->num_deleted > self->num_items / 8) {
+        new_max_items = INITIAL_ITEMS;
+        while (SparseDict_SIZE(self) > new_max_items * 3 / 4)
+            new_max_items *= 2;
+        if (dict_resize(self, new_max_items) != 0)
+            return -1;
+    }
+
+Done:
+    freed = before - dict_items_bytes(self, 0) - dict_items_bytes(self, 1);
+    if (freed < 0)
+        freed = 0; /* Incremental resize has just started, the old table is still there. */
+    self->compact_bytes_freed += freed;
+    ++self->num_compactions;
+    SparseDict_INVARIANT(self);
+    return freed;
+
+Failed:
+    PyMem_FREE(marked);
+    self->_max_items &= ~FLAG_DISABLE_RESIZE;
+    return -1;
+}
+
+/* Called after an item is deleted. Compaction is an optimization: it can not fail the delete,
+   its errors (they could only come from __hash__ or out of memory) are discarded. */
+Py_LOCAL(void)
+dict_after_delete(SparseDictObject *self)
+{
+    if ((self->options & OPTION_AUTO_COMPACT) && COMPACT_DUE(self) && !SparseDict_MIGRATING(self) &&
+            dict_compact(self) < 0)
+        PyErr_Clear();
+}
+
+Py_LOCAL(int)
+dict_merge_seq2(SparseDictObject *self, PyObject *seq2)
+{
+    PyObject *it;       /* iter(seq2) */
+    Py_ssize_t i;       /* index into seq2 of current element */
+    PyObject *item;     /* seq2[i] */
+    PyObject *fast;     /* item as a 2-tuple or 2-list */
+
+    SparseDict_INVARIANT(self);
+    assert(seq2 != NULL);
+
+    it = PyObject_GetIter(seq2);
+    if (it == NULL)
+        return -1;
+
+    for (i = 0; ; ++i) {
+        PyObject *key, *value;
+        Py_ssize_t n;
+
+        fast = NULL;
+        item = PyIter_Next(it);
+        if (item == NULL) {
+            if (PyErr_Occurred())
+                goto Fail;
+            break;
+        }
+
+        /* Convert item to sequence, and verify length 2. */
+        fast = PySequence_Fast(item, "");
+        if (fast == NULL) {
+            if (PyErr_ExceptionMatches(PyExc_TypeError))
+                PyErr_Format(PyExc_TypeError,
+                             "cannot convert dictionary update sequence element #%zd to a sequence",
+                             i);
+            goto Fail;
+        }
+        n = PySequence_Fast_GET_SIZE(fast);
+        if (n != 2) {
+            PyErr_Format(PyExc_ValueError,
+                         "dictionary update sequence element #%zd has length %zd; 2 is required",
+                         i, n);
+            goto Fail;
+        }
+
+        /* Update/merge with this (key, value) pair. */
+        key = PySequence_Fast_GET_ITEM(fast, 0);
+        value = PySequence_Fast_GET_ITEM(fast, 1);
+        if (dict_insert(self, key, value) < 0)
+            goto Fail;
+        Py_DECREF(fast);
+        Py_DECREF(item);
+    }
+
+    i = 0;
+    goto Return;
+Fail:
+    Py_XDECREF(item);
+    Py_XDECREF(fast);
+    i = -1;
+Return:
+    Py_DECREF(it);
+    return Py_SAFE_DOWNCAST(i, Py_ssize_t, int);
+}
+
+/* Tuple of the items of a one-dimensional array of native integers (array.array, numpy.ndarray),
+   NULL without an exception for any other object. */
+Py_LOCAL(PyObject *)
+int_array_as_tuple(PyObject *obj)
+{
+#if PY_VERSION_HEX >= 0x02060000
+    Py_buffer view;
+    PyObject *result = NULL, *item;
+    const char *format, *p;
+    Py_ssize_t i, n;
+
+    if (!PyObject_CheckBuffer(obj) || PyBytes_Check(obj) || PyByteArray_Check(obj) || PyUnicode_Check(obj))
+        return NULL;
+    if (PyObject_GetBuffer(obj, &view, PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) != 0) {
+        PyErr_Clear();
+        return NULL;
+    }
+    format = view.format != NULL ? view.format : "B";
+    if (format[0] == '@' || format[0] == '=')
+        ++format;
+    if (view.ndim != 1 || format[0] == '\0' || format[1] != '\0' || strchr("bBhHiIlLqQnN", format[0]) == NULL ||
+            (view.itemsize != 1 && view.itemsize != 2 && view.itemsize != 4 && view.itemsize != 8))
+        goto Done;
+
+    n = view.len / view.itemsize;
+    result = PyTuple_New(n);
+    if (result == NULL)
+        goto Done;
+    for (i = 0, p = (const char *)view.buf; i < n; ++i, p += view.itemsize) {
+        if (format[0] >= 'a') {
+            PY_LONG_LONG value;
+            signed char v8; short v16; int v32;
+            switch (view.itemsize) {
+            case 1: memcpy(&v8, p, 1); value = v8; break;
+            case 2: memcpy(&v16, p, 2); value = v16; break;
+            case 4: memcpy(&v32, p, 4); value = v32; break;
+            default: memcpy(&value, p, 8);
+            }
+            item = value >= LONG_MIN && value <= LONG_MAX ?
+                PyInt_FromLong((long)value) : PyLong_FromLongLong(value);
+        }
+        else {
+            unsigned PY_LONG_LONG value;
+            unsigned char v8; unsigned short v16; unsigned int v32;
+            switch (view.itemsize) {
+            case 1: memcpy(&v8, p, 1); value = v8; break;
+            case 2: memcpy(&v16, p, 2); value = v16; break;
+            case 4: memcpy(&v32, p, 4); value = v32; break;
+            default: memcpy(&value, p, 8);
+            }
+            item = value <= LONG_MAX ? PyInt_FromLong((long)value) : PyLong_FromUnsignedLongLong(value);
+        }
+        if (item == NULL) {
+            Py_CLEAR(result);
+            break;
+        }
+        PyTuple_SET_ITEM(result, i, item);
+    }
+Done:
+    PyBuffer_Release(&view);
+    return result;
+#else
+    return NULL;
+#endif
+}
+
+/* Same as PySequence_Tuple, but also unpacks native integer arrays. */
+Py_LOCAL(PyObject *)
+sequence_as_tuple(PyObject *obj)
+{
+    PyObject *result = int_array_as_tuple(obj);
+    if (result != NULL || PyErr_Occurred())
+        return result;
+    return PySequence_Tuple(obj);
+}
+
+/* Insert keys[i]: values[i] pairs. Equal keys are resolved as by a series of inserts.
+   The table is sized once for all the keys, which are then ordered (stable counting sort)
+   by their home block, so the inserts walk the table sequentially.
+   Empty dict is filled directly: first the slots of all keys are found in a scratch copy
+   of the block bitmaps, then every block gets its item array in one allocation. */
+Py_LOCAL(int)
+dict_merge_arrays(SparseDictObject *self, PyObject *keys_arg, PyObject *values_arg, const char *methname)
+{
+    PyObject *keys = NULL, *values = NULL, **key_items, **value_items, **stored = NULL, **stored_keys = NULL, *key;
+    Py_hash_t *hashes = NULL, hash;
+    Py_ssize_t *counts = NULL;
+    unsigned int *order = NULL, *owner = NULL, *last = NULL;
+    bitmap_t *bitmaps = NULL;
+    sparseblock *blocks;
+    lookupfunc lookup = NULL;
+    Py_ssize_t n, k, b, num_blocks, max_items, arena_bytes = 0;
+    size_t i, j, max_items_mask, num_probes;
+    int cmp, typed = SparseDict_VALUE_TYPE(self), key_typed = SparseDict_KEY_TYPE(self), result = -1;
+    int scalars = typed && typed != OPTION_VALUE_BYTES;
+
+    keys = sequence_as_tuple(keys_arg);
+    if (keys == NULL)
+        goto Done;
+    values = sequence_as_tuple(values_arg);
+    if (values == NULL)
+        goto Done;
+    n = PyTuple_GET_SIZE(keys);
+    if (PyTuple_GET_SIZE(values) != n) {
+        PyErr_Format(PyExc_ValueError, "%s(): keys and values must have the same length", methname);
+        goto Done;
+    }
+    key_items = &PyTuple_GET_ITEM(keys, 0);
+    value_items = &PyTuple_GET_ITEM(values, 0);
+    if (n == 0 || (size_t)n >= UINT_MAX) {
+        /* Nothing to do or too much for the scratch arrays. */
+        for (k = 0; k < n; ++k)
+            if (dict_insert(self, key_items[k], value_items[k]) != 0)
+                goto Done;
+        result = 0;
+        goto Done;
+    }
+
+    hashes = PyMem_NEW(Py_hash_t, n);
+    order = PyMem_NEW(unsigned int, n);
+    stored = scalars ? PyMem_NEW(PyObject *, n) : value_items;
+    stored_keys = key_typed ? PyMem_NEW(PyObject *, n) : key_items;
+    if (hashes == NULL || order == NULL || stored == NULL || stored_keys == NULL) {
+        PyErr_NoMemory();
+        goto Done;
+    }
+    /* Typed keys and values are converted up front, placing them can't fail then. Bytes
+       are only checked, they go to the arena when they are placed. */
+    for (k = 0; k < n && scalars; ++k)
+        if (value_unbox(typed, value_items[k], &stored[k]) != 0)
+            goto Done;
+    for (k = 0; k < n && typed == OPTION_VALUE_BYTES; ++k) {
+        Py_ssize_t len = arena_value_len(value_items[k]);
+        if (len < 0)
+            goto Done;
+        arena_bytes += len;
+    }
+    for (k = 0; k < n && key_typed; ++k)
+        if (key_unbox(key_typed, key_items[k], &stored_keys[k], 1) <= 0)
+            goto Done;
+    for (k = 0; k < n; ++k) {
+        hashes[k] = dict_key_hash(self, stored_keys[k]);
+        if (hashes[k] == -1)
+            goto Done;
+        if (key_typed)
+            lookup = dict_lookup_i8;
+        else if (k == 0)
+            lookup = key_lookup(key_items[k]);
+        else if (lookup != dict_lookup && key_lookup(key_items[k]) != lookup)
+            lookup = dict_lookup;
+    }
+
+    /* Hashing could run arbitrary code, so size the table only now. */
+    if (SparseDict_SIZE(self) == 0) {
+        max_items = INITIAL_ITEMS;
+        while (n > max_items * 3 / 4)
+            max_items *= 2;
+        if (dict_rebuild(self, max_items, self->options) != 0)
+            goto Done;
+    }
+    else if (dict_resize_delta(self, n) != 0)
+        goto Done;
+    blocks = self->blocks;
+    num_blocks = self->num_blocks;
+    max_items = SparseDict_MAX_ITEMS(self);
+    max_items_mask = max_items - 1;
+
+    counts = PyMem_NEW(Py_ssize_t, num_blocks + 1);
+    if (counts == NULL) {
+        PyErr_NoMemory();
+        goto Done;
+    }
+    memset(counts, 0, (num_blocks + 1) * sizeof(Py_ssize_t));
+    for (k = 0; k < n; ++k)
+        ++counts[(hash_mix((size_t)hashes[k]) & max_items_mask) / SPARSEBLOCK_SIZE + 1];
+    for (b = 0; b < num_blocks; ++b)
+        counts[b + 1] += counts[b];
+    for (k = 0; k < n; ++k)
+        order[counts[(hash_mix((size_t)hashes[k]) & max_items_mask) / SPARSEBLOCK_SIZE]++] = (unsigned int)k;
+
+    if (SparseDict_SIZE(self) != 0 || SparseDict_MIGRATING(self) || (self->options & OPTION_ROBIN_HOOD))
+        goto Insert;
+
+    /* Find the slots. owner[i] is the first key placed in slot i, last[k] the last of its duplicates. */
+    bitmaps = PyMem_NEW(bitmap_t, num_blocks);
+    owner = PyMem_NEW(unsigned int, max_items);
+    if (bitmaps == NULL || owner == NULL) {
+        PyErr_NoMemory();
+        goto Done;
+    }
+    memset(bitmaps, 0, num_blocks * sizeof(bitmap_t));
+    for (k = 0; k < n; ++k) {
+        unsigned int m = order[k];
+        key = stored_keys[m];
+        hash = hashes[m];
+        i = hash_mix((size_t)hash) & max_items_mask;
+        num_probes = 0;
+        while (BIT_TEST(bitmaps[i / SPARSEBLOCK_SIZE], i % SPARSEBLOCK_SIZE)) {
+            j = owner[i];
+            if (hashes[j] == hash) {
+                cmp = stored_keys[j] == key ? 1 : key_typed ? 0 :
+                    PyObject_RichCompareBool(stored_keys[j], key, Py_EQ);
+                if (cmp < 0)
+                    goto Done;
+                if (cmp > 0) {
+                    if (last == NULL) {
+                        last = PyMem_NEW(unsigned int, n);
+                        if (last == NULL) {
+                            PyErr_NoMemory();
+                            goto Done;
+                        }
+                        for (b = 0; b < n; ++b)
+                            last[b] = (unsigned int)b;
+                    }
+                    last[j] = m;
+                    break;
+                }
+            }
+            ++num_probes;
+            i = (i + num_probes) & max_items_mask;
+        }
+        if (!BIT_TEST(bitmaps[i / SPARSEBLOCK_SIZE], i % SPARSEBLOCK_SIZE)) {
+            BIT_SET(bitmaps[i / SPARSEBLOCK_SIZE], i % SPARSEBLOCK_SIZE);
+            owner[i] = m;
+        }
+    }
+
+    /* Comparisons could run arbitrary code too, fall back to inserts if the dict has changed. */
+    if (self->blocks != blocks || SparseDict_MAX_ITEMS(self) != max_items ||
+            self->num_items != 0 || SparseDict_MIGRATING(self))
+        goto Insert;
+    if (typed == OPTION_VALUE_BYTES && dict_arena_reserve(self, arena_bytes) != 0)
+        goto Done;
+
+    for (b = 0; b < num_blocks; ++b) {
+        int layout = SparseDict_LAYOUT(self), num_items = popcount(bitmaps[b]), offset = 0;
+        dictentry *items;
+
+        if (num_items == 0)
+            continue;
+        items = (dictentry *)items_alloc(SPARSEBLOCK_ITEMS_SIZE(num_items, layout));
+        if (items == NULL) {
+            PyErr_NoMemory();
+            goto Done;
+        }
+        blocks[b].items = items;
+        blocks[b].bitmap = bitmaps[b];
+        for (i = 0; i < SPARSEBLOCK_SIZE; ++i) {
+            PyObject *value;
+            if (!BIT_TEST(bitmaps[b], i))
+                continue;
+            k = owner[b * SPARSEBLOCK_SIZE + i];
+            key = stored_keys[k];
+            value = stored[last != NULL ? last[k] : k];
+            if (typed == OPTION_VALUE_BYTES)
+                value = dict_arena_append(self, value);
+            MAINTAIN_TRACKING(self, key, value);
+            KEY_INCREF(key_typed, key);
+            VALUE_INCREF(typed, value);
+            items[offset].key = key;
+            items[offset].value = value;
+            if (layout & OPTION_HASH_CACHE)
+                SPARSEBLOCK_HASHES(&blocks[b])[offset] = hashes[k];
+            else if (layout & OPTION_FINGERPRINTS)
+                SPARSEBLOCK_FINGERPRINTS(&blocks[b])[offset] = FINGERPRINT(hashes[k]);
+            if (self->bloom != NULL) {
+                bloom_add(self->bloom, self->bloom_mask, hashes[k]);
+                ++self->bloom_added;
+            }
+            ++offset;
+        }
+        self->num_items += num_items;
+    }
+    self->lookup = lookup;
+    result = 0;
+    goto Done;
+
+Insert:
+    for (k = 0; k < n; ++k)
+        if (dict_insert_hash(self, key_items[order[k]], hashes[order[k]], value_items[order[k]]) != 0)
+            goto Done;
+    result = 0;
+
+Done:
+    PyMem_FREE(last);
+    PyMem_FREE(owner);
+    PyMem_FREE(bitmaps);
+    PyMem_FREE(counts);
+    PyMem_FREE(order);
+    PyMem_FREE(hashes);
+    if (scalars)
+        PyMem_FREE(stored);
+    if (key_typed)
+        PyMem_FREE(stored_keys);
+    Py_XDECREF(values);
+    Py_XDECREF(keys);
+    return result;
+}
+
+Py_LOCAL(int)
+dict_merge(SparseDictObject *self, PyObject *arg)
+{
+    SparseDict_INVARIANT(self);
+
+    if (SparseDict_Check(arg)) {
+        SparseDictObject *other = (SparseDictObject *)arg;
+        if (other == self || SparseDict_SIZE(other) == 0)
+            return 0;
+
+        if (dict_resize_delta(self, SparseDict_SIZE(other) - SparseDict_SIZE(self)) != 0)
+            return -1;
+
+        /* Keys' __eq__ may look up other, keep its migration from moving the items. */
+        ++other->num_pins;
+        SparseDict_FOR(other, entry)
+            int status = -1;
+            /* Keys' __eq__ may delete the entry from other. */
+            PyObject *key = key_box(SparseDict_KEY_TYPE(other), entry.key);
+            PyObject *value = dict_value_box(other, entry.value);
+            if (key != NULL && value != NULL)
+                status = dict_insert(self, key, value);
+            Py_XDECREF(key);
+            Py_XDECREF(value);
+            if (status != 0) {
+                --other->num_pins;
+                return -1;
+            }
+        SparseDict_ENDFOR(other, 0)
+        --other->num_pins;
+    }
+    else if (PyDict_Check(arg)) {
+        Py_ssize_t other_size = PyDict_Size(arg);
+        Py_ssize_t pos = 0;
+        PyObject *key, *value;
+
+        if (other_size == 0)
+            return 0;
+        if (dict_resize_delta(self, other_size - SparseDict_SIZE(self)) != 0)
+            return -1;
+
+        while (PyDict_Next(arg, &pos, &key, &value)) {
+            int status;
+            Py_INCREF(key);
+            Py_INCREF(value);
+            status = dict_insert(self, key, value);
+            Py_DECREF(key);
+            Py_DECREF(value);
+            if (status != 0)
+                return -1;
+        }
+    }
+    else {
+        /* Do it the generic, slower way */
+        PyObject *keys = PyMapping_Keys(arg);
+        PyObject *iter;
+        PyObject *key, *value;
+        int status;
+
+        if (keys == NULL)
+            return -1;
+
+        iter = PyObject_GetIter(keys);
+        Py_DECREF(keys);
+        if (iter == NULL)
+            return -1;
+
+        while ((key = PyIter_Next(iter)) != NULL) {
+            value = PyObject_GetItem(arg, key);
+            if (value == NULL) {
+                Py_DECREF(iter);
+                Py_DECREF(key);
+                return -1;
+            }
+            status = dict_insert(self, key, value);
+            Py_DECREF(key);
+            Py_DECREF(value);
+            if (status < 0) {
+                Py_DECREF(iter);
+                return -1;
+            }
+        }
+        Py_DECREF(iter);
+        if (PyErr_Occurred())
+            /* Iterator completed, via error */
+            return -1;
+    }
+    return 0;
+}
+
+/* Merges arg (a mapping or an iterable of pairs, NULL if not given) and kwds into self. */
+Py_LOCAL(int)
+dict_update_arg(SparseDictObject *self, PyObject *arg, PyObject *kwds)
+{
+    int result = 0;
+
+    if (arg != NULL) {
+        if (PyObject_HasAttrString(arg, "keys"))
+            result = dict_merge(self, arg);
+        else
+            result = dict_merge_seq2(self, arg);
+    }
+
+    if (result == 0 && kwds != NULL) {
+        if (PyArg_ValidateKeywordArguments(kwds))
+            result = dict_merge(self, kwds);
+        else
+            result = -1;
+    }
+    return result;
+}
+
+Py_LOCAL_INLINE(int)
+dict_update_common(SparseDictObject *self, PyObject *args, PyObject *kwds, char *methname)
+{
+    PyObject *arg = NULL;
+
+    if (!PyArg_UnpackTuple(args, methname, 0, 1, &arg))
+        return -1;
+    return dict_update_arg(self, arg, kwds);
+}
+
+/* Return 1 if dicts equal, 0 if not, -1 if error.
+ * Gets out as soon as any difference is detected.
+ * Uses only Py_EQ comparison.
+ */
+/* Equality of two dicts of the same size and table size, walking their blocks in lockstep.
+   Blocks with the same bitmap have their entries at the same places, where a key has landed
+   in both tables unless their insertion histories differ; the keys that are not the same
+   object at the same place in other are looked up. Blocks shared by snapshots are skipped.
+   The dicts must have the same key type. Returns 1 if equal, 0 if not, -1 on error, 2 if a
+   comparison changed the tables (the caller starts over). */
+/* value (stored in self, boxed) == the value stored2 in other. Typed scalars with the same bits
+   are equal without boxing, as identical objects are in PyObject_RichCompareBool, so 'f8' NaNs
+   compare the same in shared blocks, in copies and in other 'f8' dicts. */
+Py_LOCAL(int)
+dict_value_equal(SparseDictObject *self, PyObject *value, PyObject *stored,
+                 SparseDictObject *other, PyObject *stored2)
+{
+    int typed = SparseDict_VALUE_TYPE(self), cmp;
+    PyObject *value2;
+
+    if (typed && typed != OPTION_VALUE_BYTES && typed == SparseDict_VALUE_TYPE(other) && stored == stored2)
+        return 1;
+    value2 = dict_value_box(other, stored2);
+    if (value2 == NULL)
+        return -1;
+    cmp = PyObject_RichCompareBool(value, value2, Py_EQ);
+    Py_DECREF(value2);
+    return cmp;
+}
+
+Py_LOCAL(int)
+dict_equal_blocks(SparseDictObject *self, SparseDictObject *other)
+{
+    Py_ssize_t b;
+    int j, cmp;
+    sparseblock *blocks = self->blocks, *other_blocks = other->blocks;
+
+    for (b = 0; b < self->num_blocks; ++b) {
+        sparseblock *block = &blocks[b], *other_block = &other_blocks[b];
+        dictentry *items = block->items, *other_items = other_block->items;
+        bitmap_t bitmap = block->bitmap, other_bitmap = other_block->bitmap;
+
+        if (items == other_items && bitmap == other_bitmap)
+            continue;
+        for (j = 0; j < SPARSEBLOCK_NUM_ITEMS(block); ++j) {
+            PyObject *key = items[j].key, *stored = items[j].value, *value;
+            dictentry *entry2 = NULL;
+
+            if (key == NULL)
+                continue;
+            value = dict_value_box(self, stored);
+            if (value == NULL)
+                return -1;
+            KEY_INCREF(SparseDict_KEY_TYPE(self), key);
+            if (bitmap == other_bitmap && other_items[j].key == key)
+                entry2 = &other_items[j];
+            else
+                entry2 = dict_find(other, key, SparseDict_HASH_CACHE(self) ? SPARSEBLOCK_HASHES(block)[j] : -1, 0);
+            KEY_DECREF(SparseDict_KEY_TYPE(self), key);
+            if (entry2 == NULL || entry2->key == NULL) {
+                Py_DECREF(value);
+                return entry2 == NULL ? -1 : 0;
+            }
+            cmp = dict_value_equal(self, value, stored, other, entry2->value);
+            Py_DECREF(value);
+            if (cmp <= 0)
+                return cmp;
+            /* __eq__ can change either dict. */
+            if (self->blocks != blocks || other->blocks != other_blocks || SparseDict_MIGRATING(other) ||
+                    block->items != items || block->bitmap != bitmap ||
+                    other_block->items != other_items || other_block->bitmap != other_bitmap)
+                return 2;
+        }
+    }
+    return 1;
+}
+
+Py_LOCAL(int)
+dict_equal(SparseDictObject *self, PyObject *arg)
+{
+    SparseDictObject *other = NULL;
+    int result = 1;
+
+    SparseDict_INVARIANT(self);
+
+    if (SparseDict_Check(arg)) {
+        other = (SparseDictObject *)arg;
+        if (SparseDict_SIZE(self) != SparseDict_SIZE(other))
+            return 0;
+    }
+    else if (PyDict_Check(arg)) {
+        if (SparseDict_SIZE(self) != PyDict_Size(arg))
+            return 0;
+    }
+    else {
+        /* Unsupported type. */
+        return 0;
+    }
+
+    self->_max_items |= FLAG_DISABLE_RESIZE;
+    /* Tables of the same size hold most keys at the same places. */
+    if (other != NULL && SparseDict_MAX_ITEMS(self) == SparseDict_MAX_ITEMS(other) &&
+            SparseDict_KEY_TYPE(self) == SparseDict_KEY_TYPE(other) &&
+            !SparseDict_MIGRATING(self) && !SparseDict_MIGRATING(other)) {
+        result = dict_equal_blocks(self, other);
+        if (result != 2)
+            goto Done;
+        result = 1;
+    }
+    SparseDict_FOR(self, entry)
+        PyObject *key = key_box(SparseDict_KEY_TYPE(self), entry.key);
+        PyObject *value = dict_value_box(self, entry.value);
+        PyObject *value2;
+        Py_hash_t hash = SparseDict_HASH_CACHE(self) ? SparseDict_FOR_HASH(self) : -1;
+
+        if (key == NULL || value == NULL) {
+            Py_XDECREF(key);
+            Py_XDECREF(value);
+            result = -1;
+            goto Done;
+        }
+        if (other != NULL) {
+            /* comparing with another SparseDict */
+            dictentry *entry2 = dict_find_key(other, key, hash);
+            Py_DECREF(key);
+            if (entry2 == NULL || entry2->key == NULL) {
+                Py_DECREF(value);
+                result = (entry2 == NULL) ? -1 : 0;
+                goto Done;
+            }
+            result = dict_value_equal(self, value, entry.value, other, entry2->value);
+        }
+        else {
+            /* comparing with PyDictObject */
+            value2 = PyDict_GetItemWithError(arg, key);
+            Py_DECREF(key);
+            if (value2 == NULL) {
+                Py_DECREF(value);
+                result = PyErr_Occurred() ? -1 : 0;
+                goto Done;
+            }
+            Py_INCREF(value2);
+            result = PyObject_RichCompareBool(value, value2, Py_EQ);
+            Py_DECREF(value2);
+        }
+        Py_DECREF(value);
+        if (result <= 0)  /* error or not equal */
+            goto Done;
+    SparseDict_ENDFOR(self, 0)
+
+Done:
+    self->_max_items &= ~FLAG_DISABLE_RESIZE;
+    return result;
+}
+
+/* SparseDict type methods */
+
+static SparseDictObject *
+dict_tp_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    SparseDictObject *self;
+
+    self = (SparseDictObject *)type->tp_alloc(type, 0);
+    if (self != NULL) {
+        /* tp_alloc zero-initialized out struct */
+        SparseDict_INIT_NONZERO(self);
+#ifdef HAVE_COMPACT_UNICODE
+        self->lookup = dict_lookup_unicode;
+#else
+        self->lookup = dict_lookup_string;
+#endif
+        /* The object has been implicitely tracked by tp_alloc */
+        if (type == &SparseDict_Type)
+            PyObject_GC_UnTrack(self);
+    }
+    return self;
+}
+
+/* Name of a key or value type (its option bit), None for objects. */
+Py_LOCAL(PyObject *)
+type_name(int typed)
+{
+    if (!typed) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    return PyString_FromString(typed == OPTION_VALUE_F8 ? "f8" : typed == OPTION_VALUE_BYTES ? "bytes" : "i8");
+}
+
+/* Sets the key type (key = 1: 'i8' or None) or the value type ('i8', 'f8', 'bytes' or None)
+   of self by name. Only an empty dict can change them. */
+Py_LOCAL(int)
+dict_set_type(SparseDictObject *self, PyObject *name, int key)
+{
+    static const int value_types[3] = {OPTION_VALUE_I8, OPTION_VALUE_F8, OPTION_VALUE_BYTES};
+    static const int key_types[1] = {OPTION_KEY_I8};
+    const int *types = key ? key_types : value_types;
+    const char *what = key ? "key_type" : "value_type";
+    int i, cmp, mask = key ? OPTION_KEY_I8 : OPTIONS_VALUE_TYPE, typed = name == Py_None ? 0 : -1;
+
+    for (i = 0; i < (key ? 1 : 3) && typed < 0 && (PyUnicode_Check(name) || PyBytes_Check(name)); ++i) {
+        PyObject *type = type_name(types[i]);
+        if (type == NULL)
+            return -1;
+        cmp = PyObject_RichCompareBool(name, type, Py_EQ);
+        Py_DECREF(type);
+        if (cmp < 0)
+            return -1;
+        if (cmp)
+            typed = types[i];
+    }
+    if (typed < 0) {
+        PyErr_Format(PyExc_ValueError, "%s must be %s or None", what, key ? "'i8'" : "'i8', 'f8', 'bytes'");
+        return -1;
+    }
+    if (typed && !(key ? TYPED_KEYS : TYPED_VALUES)) {
+        PyErr_Format(PyExc_ValueError, "%s is not supported on this platform", what);
+        return -1;
+    }
+    if (typed == (self->options & mask))
+        return 0;
+    if (SparseDict_SIZE(self) != 0 || self->arena_pending != 0) {
+        PyErr_Format(PyExc_ValueError, "can't change the %s of a nonempty SparseDict", what);
+        return -1;
+    }
+    self->options = (self->options & ~mask) | typed;
+    if (!key)
+        Py_CLEAR(self->arena);
+    if (key && !(self->options & OPTION_ROBIN_HOOD))
+        /* Deleted entries have no key to convert, the table can stay. */
+        self->lookup = typed ? dict_lookup_i8 : dict_lookup_other;
+    return 0;
+}
+
+/* SparseDict(arg, **kwds) of a new or existing dict, arg is NULL if not given. */
+Py_LOCAL(int)
+dict_init(SparseDictObject *self, PyObject *arg, PyObject *kwds)
+{
+    static const char *type_kwds[2] = {"key_type", "value_type"};
+    PyObject *name, *items_kwds = kwds;
+    int i, result = -1;
+
+    /* The types are taken by the constructor, they are not items. */
+    for (i = 0; i < 2 && kwds != NULL; ++i) {
+        name = PyDict_GetItemString(kwds, type_kwds[i]);
+        if (name == NULL)
+            continue;
+        if (dict_set_type(self, name, i == 0) != 0)
+            goto Done;
+        if (items_kwds == kwds && (items_kwds = PyDict_Copy(kwds)) == NULL)
+            goto Done;
+        if (PyDict_DelItemString(items_kwds, type_kwds[i]) != 0)
+            goto Done;
+    }
+
+    if (arg != NULL && PyInt_Check(arg)) {
+        Py_ssize_t size_hint = PyInt_AsSsize_t(arg);
+        if (size_hint == -1 && PyErr_Occurred())
+            goto Done;
+        if (dict_resize_delta(self, size_hint) != 0)
+            goto Done;
+        arg = NULL; /* a size, not items */
+    }
+
+    result = dict_update_arg(self, arg, items_kwds);
+Done:
+    if (items_kwds != kwds)
+        Py_XDECREF(items_kwds);
+    return result;
+}
+
+static int
+dict_tp_init(SparseDictObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *arg = NULL;
+
+    if (!PyArg_UnpackTuple(args, "SparseDict", 0, 1, &arg))
+        return -1;
+    return dict_init(self, arg, kwds);
+}
+
+#ifdef HAVE_TYPE_VECTORCALL
+/* SparseDict(...) without the args tuple and the kwargs dict of tp_new and tp_init.
+   Only called for SparseDict_Type, subclasses don't inherit tp_vectorcall. */
+static PyObject *
+dict_vectorcall(PyObject *type, PyObject *const *args, size_t nargsf, PyObject *kwnames)
+{
+    Py_ssize_t i, nargs = PyVectorcall_NARGS(nargsf);
+    SparseDictObject *self;
+    PyObject *kwds = NULL;
+
+    if (check_nargs("SparseDict", nargs, 0, 1) != 0)
+        return NULL;
+    self = dict_tp_new((PyTypeObject *)type, NULL, NULL);
+    if (self == NULL)
+        return NULL;
+    if (kwnames != NULL && PyTuple_GET_SIZE(kwnames) != 0) {
+        kwds = PyDict_New();
+        if (kwds == NULL)
+            goto Failed;
+        for (i = 0; i < PyTuple_GET_SIZE(kwnames); ++i) {
+            if (PyDict_SetItem(kwds, PyTuple_GET_ITEM(kwnames, i), args[nargs + i]) != 0)
+                goto Failed;
+        }
+    }
+    if (dict_init(self, nargs ? args[0] : NULL, kwds) != 0)
+        goto Failed;
+    Py_XDECREF(kwds);
+    return (PyObject *)self;
+
+Failed:
+    Py_XDECREF(kwds);
+    Py_DECREF(self);
+    return NULL;
+}
+#endif
+
+static void
+dict_tp_dealloc(SparseDictObject *self)
+{
+    SparseDict_INVARIANT(self);
+
+    if (_PyObject_GC_IS_TRACKED(self))
+        PyObject_GC_UnTrack(self);
+    /* XXX: Py_TRASHCAN_SAFE_BEGIN ? */
+
+    /* with refcnt of 0 we don't need to protect from modifications. */
+    dict_drop_shared(self->blocks, self->num_blocks, self->shared);
+    SparseDict_FOR(self, entry)
+        KEY_DECREF(SparseDict_KEY_TYPE(self), entry.key);
+        VALUE_DECREF(SparseDict_VALUE_TYPE(self), entry.value);
+        /* destructive FOR frees the blocks for us */
+    SparseDict_ENDFOR(self, 1)
+    PyMem_FREE(self->bloom);
+    Py_XDECREF(self->arena);
+
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *
+dict_tp_repr(SparseDictObject *self)
+{
+    Py_ssize_t i;
+    PyObject *s, *temp, *colon = NULL;
+    PyObject *pieces = NULL, *result = NULL;
+
+    i = Py_ReprEnter((PyObject *)self);
+    if (i != 0)
+        return i > 0 ? PyString_FromString("SparseDict(...)") : NULL;
+    ++self->num_pins; /* repr may look up self */
+
+    if (SparseDict_SIZE(self) == 0) {
+        result = PyString_FromString("SparseDict()");
+        goto Done;
+    }
+
+    pieces = PyList_New(0);
+    if (pieces == NULL)
+        goto Done;
+
+    colon = PyString_FromString(": ");
+    if (colon == NULL)
+        goto Done;
+
+    /* Do repr() on each key+value pair, and insert ": " between them.
+       Note that repr may mutate the dict. */
+    SparseDict_FOR(self, entry)
+        int status;
+        /* Prevent repr from deleting value during key format. */
+        PyObject *key, *value = dict_value_box(self, entry.value);
+        if (value == NULL)
+            goto Done;
+        key = key_box(SparseDict_KEY_TYPE(self), entry.key);
+        s = key == NULL ? NULL : PyObject_Repr(key);
+        PyString_Concat(&s, colon);
+        temp = PyObject_Repr(value);
+        PyString_Concat(&s, temp);
+        Py_XDECREF(temp);
+        Py_XDECREF(key);
+        Py_DECREF(value);
+        if (s == NULL)
+            goto Done;
+        status = PyList_Append(pieces, s);
+        Py_DECREF(s);  /* append created a new ref */
+        if (status < 0)
+            goto Done;
+    SparseDict_ENDFOR(self, 0)
+
+    /* Add "{}" decorations to the first and last items. */
+    assert(PyList_GET_SIZE(pieces) > 0);
+    s = PyString_FromString("SparseDict({");
+    if (s == NULL)
+        goto Done;
+    temp = PyList_GET_ITEM(pieces, 0);
+    PyString_Concat(&s, temp);
+    Py_XDECREF(temp);
+    PyList_SET_ITEM(pieces, 0, s);
+    if (s == NULL)
+        goto Done;
+
+    s = PyString_FromString("})");
+    if (s == NULL)
+        goto Done;
+    temp = PyList_GET_ITEM(pieces, PyList_GET_SIZE(pieces) - 1);
+    PyString_Concat(&temp, s);
+    Py_XDECREF(s);
+    PyList_SET_ITEM(pieces, PyList_GET_SIZE(pieces) - 1, temp);
+    if (temp == NULL)
+        goto Done;
+
+    /* Paste them all together with ", " between. */
+    s = PyString_FromString(", ");
+    if (s == NULL)
+        goto Done;
+    result = _PyString_Join(s, pieces);
+    Py_DECREF(s);
+
+Done:
+    Py_XDECREF(pieces);
+    Py_XDECREF(colon);
+    --self->num_pins;
+    Py_ReprLeave((PyObject *)self);
+    return result;
+}
+
+static PyObject *
+dict_tp_richcompare(PyObject *arg1, PyObject *arg2, int op)
+{
+    int cmp;
+    PyObject *result;
+
+    if (op == Py_EQ || op == Py_NE) {
+        if (SparseDict_Check(arg1))
+            cmp = dict_equal((SparseDictObject *)arg1, arg2);
+        else if (SparseDict_Check(arg2))
+            cmp = dict_equal((SparseDictObject *)arg2, arg1);
+        else
+            cmp = 0;
+
+        if (cmp < 0)
+            return NULL;
+        result = (cmp == (op == Py_EQ)) ? Py_True : Py_False;
+    }
+    else {
+#if PY_MAJOR_VERSION < 3
+        PyErr_SetString(PyExc_TypeError, "SparseDict does not support order comparison");
+        return NULL;
+#else
+        result = Py_NotImplemented;
+#endif
+    }
+    Py_INCREF(result);
+    return result;
+}
+
+static int
+dict_tp_traverse(SparseDictObject *self, visitproc visit, void *arg)
+{
+    Py_ssize_t b;
+    int j;
+
+    if (self->num_shared == 0) {
+        SparseDict_FOR(self, entry)
+            if (!SparseDict_KEY_TYPE(self))
+                Py_VISIT(entry.key);
+            if (!SparseDict_VALUE_TYPE(self))
+                Py_VISIT(entry.value);
+        SparseDict_ENDFOR(self, 0)
+        return 0;
+    }
+    /* The shared blocks visit their entries themselves. */
+    for (b = 0; b < self->num_blocks; ++b) {
+        sparseblock *block = &self->blocks[b];
+        if (self->shared[b] != NULL) {
+            Py_VISIT(self->shared[b]);
+            continue;
+        }
+        for (j = 0; j < SPARSEBLOCK_NUM_ITEMS(block); ++j) {
+            if (block->items[j].key != NULL) {
+                if (!SparseDict_KEY_TYPE(self))
+                    Py_VISIT(block->items[j].key);
+                if (!SparseDict_VALUE_TYPE(self))
+                    Py_VISIT(block->items[j].value);
+            }
+        }
+    }
+    return 0;
+}
+
+static int
+dict_tp_clear(SparseDictObject *self)
+{
+    /* Actually we only need blocks and num_blocks. */
+    SparseDictObject old_self = *self;
+    if (old_self.blocks == self->static_blocks)
+        old_self.blocks = old_self.static_blocks;
+    SparseDict_INIT(self);
+    if (self->bloom != NULL) {
+        memset(self->bloom, 0, (self->bloom_mask + 1) * sizeof(bitmap_t));
+        self->bloom_added = 0;
+    }
+
+    dict_drop_shared(old_self.blocks, old_self.num_blocks, old_self.shared);
+    SparseDict_FOR(&old_self, entry)
+        KEY_DECREF(SparseDict_KEY_TYPE(&old_self), entry.key);
+        VALUE_DECREF(SparseDict_VALUE_TYPE(&old_self), entry.value);
+    SparseDict_ENDFOR(&old_self, 1)
+    /* Unless an insert has a value in it already. */
+    if (self->arena_pending == 0)
+        Py_CLEAR(self->arena);
+    return 0;
+}
+
+static PyObject *
+dict_tp_iter(SparseDictObject *dict)
+{
+    return dictiter_new(dict, &SparseDictIterKey_Type);
+}
+
+static Py_ssize_t
+dict_mp_length(SparseDictObject *self)
+{
+    return SparseDict_SIZE(self);
+}
+
+static PyObject *
+dict_mp_subscript(SparseDictObject *self, PyObject *key)
+{
+    dictentry *entry = dict_find_key(self, key, -1);
+    if (entry == NULL)
+        return NULL;
+    if (entry->key == NULL) {
+        set_key_error(key);
+        return NULL;
+    }
+    return dict_value_box(self, entry->value);
+}
+
+static int
+dict_mp_ass_subscript(SparseDictObject *self, PyObject *key, PyObject *value)
+{
+    if (value != NULL)
+        return dict_insert(self, key, value);
+    else
+        return dict_delete(self, key);
+}
+
+/* Return 1 if `key` is in dict `op`, 0 if not, and -1 on error. */
+int
+dict_sq_contains(SparseDictObject *self, PyObject *key)
+{
+    dictentry *entry = dict_find_key(self, key, -1);
+    if (entry == NULL)
+        return -1;
+    return (entry->key != NULL);
+}
+
+/* SparseDict public methods */
+
+static PyObject *
+dict_py_keys(SparseDictObject *self)
+{
+    PyObject *list;
+    Py_ssize_t num, i;
+
+Again:
+    num = SparseDict_SIZE(self);
+    list = PyList_New(num);
+    if (list == NULL)
+        return NULL;
+    if (num != SparseDict_SIZE(self)) {
+        /* Durnit. The allocations caused the dict to resize. */
+        Py_DECREF(list);
+        goto Again;
+    }
+
+    /* Boxing typed keys doesn't run Python code. */
+    i = 0;
+    SparseDict_FOR(self, entry)
+        PyObject *key = key_box(SparseDict_KEY_TYPE(self), entry.key);
+        if (key == NULL) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, key);
+        ++i;
+    SparseDict_ENDFOR(self, 0)
+
+    assert(i == num);
+    return list;
+}
+
+static PyObject *
+dict_py_values(SparseDictObject *self)
+{
+    PyObject *list;
+    Py_ssize_t num, i;
+
+Again:
+    num = SparseDict_SIZE(self);
+    list = PyList_New(num);
+    if (list == NULL)
+        return NULL;
+    if (num != SparseDict_SIZE(self)) {
+        /* Durnit. The allocations caused the dict to resize. */
+        Py_DECREF(list);
+        goto Again;
+    }
+
+    /* Boxing typed values doesn't run Python code. */
+    i = 0;
+    SparseDict_FOR(self, entry)
+        PyObject *value = dict_value_box(self, entry.value);
+        if (value == NULL) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, value);
+        ++i;
+    SparseDict_ENDFOR(self, 0)
+
+    assert(i == num);
+    return list;
+}
+
+static PyObject *
+dict_py_items(SparseDictObject *self)
+{
+    PyObject *list, *pair;
+    Py_ssize_t i, num;
+
+    /* Preallocate the list of tuples, to avoid GC during the loop. */
+Again:
+    num = SparseDict_SIZE(self);
+    list = PyList_New(num);
+    if (list == NULL)
+        return NULL;
+    for (i = 0; i < num; i++) {
+        pair = PyTuple_New(2);
+        if (pair == NULL) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, pair);
+    }
+    if (num != SparseDict_SIZE(self)) {
+        Py_DECREF(list);
+        goto Again;
+    }
+    /* Nothing we do below makes any function calls. */
+    i = 0;
+    SparseDict_FOR(self, entry)
+        PyObject *key = key_box(SparseDict_KEY_TYPE(self), entry.key);
+        PyObject *value = dict_value_box(self, entry.value);
+        if (key == NULL || value == NULL) {
+            Py_XDECREF(key);
+            Py_XDECREF(value);
+            Py_DECREF(list);
+            return NULL;
+        }
+        pair = PyList_GET_ITEM(list, i);
+        PyTuple_SET_ITEM(pair, 0, key);
+        PyTuple_SET_ITEM(pair, 1, value);
+        i++;
+    SparseDict_ENDFOR(self, 0)
+
+    assert(i == num);
+    return list;
+}
+
+static PyObject *
+dict_py_fromkeys(PyObject *cls, PyObject *args)
+{
+    /* TODO: prealloc */
+    SparseDictObject *self;
+    PyObject *seq, *it, *key, *value = Py_None;
+
+    if (!PyArg_UnpackTuple(args, "fromkeys", 1, 2, &seq, &value))
+        return NULL;
+
+    self = (SparseDictObject *)PyObject_CallObject(cls, NULL);
+    if (self == NULL)
+        return NULL;
+
+    it = PyObject_GetIter(seq);
+    if (it == NULL){
+        Py_DECREF(self);
+        return NULL;
+    }
+    while ((key = PyIter_Next(it)) != NULL) {
+        int status = PyObject_SetItem((PyObject *)self, key, value);
+        Py_DECREF(key);
+        if (status < 0)
+            break;
+    }
+    if (PyErr_Occurred()) {
+        Py_DECREF(self);
+        Py_DECREF(it);
+        return NULL;
+    }
+    Py_DECREF(it);
+    return (PyObject *)self;
+}
+
+static PyObject *
+dict_py_update(SparseDictObject *self, PyObject *args, PyObject *kwds)
+{
+    if (dict_update_common(self, args, kwds, "update") != -1)
+        Py_RETURN_NONE;
+    return NULL;
+}
+
+static PyObject *
+dict_py_from_arrays(PyObject *cls, PyObject *args)
+{
+    PyObject *self, *keys, *values;
+
+    if (!PyArg_UnpackTuple(args, "from_arrays", 2, 2, &keys, &values))
+        return NULL;
+
+    self = PyObject_CallObject(cls, NULL);
+    if (self == NULL)
+        return NULL;
+    if (!SparseDict_Check(self)) {
+        PyErr_SetString(PyExc_TypeError, "from_arrays(): class must construct a SparseDict");
+        Py_DECREF(self);
+        return NULL;
+    }
+    if (dict_merge_arrays((SparseDictObject *)self, keys, values, "from_arrays") != 0) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return self;
+}
+
+static PyObject *
+dict_py_update_arrays(SparseDictObject *self, PyObject *args)
+{
+    PyObject *keys, *values;
+
+    if (!PyArg_UnpackTuple(args, "update_arrays", 2, 2, &keys, &values))
+        return NULL;
+    if (dict_merge_arrays(self, keys, values, "update_arrays") != 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+/* Fill the empty dict copy with the table of self, block for block: the item arrays are
+   duplicated as they are and the references taken in bulk, nothing is hashed or probed.
+   Deleted entries are copied too (lookups probe past them), then compacted in the copy
+   if there are enough of them to pay for the pass. With share = 1 the item arrays are
+   shared instead, see dict_own_block. */
+Py_LOCAL(int)
+dict_clone(SparseDictObject *copy, SparseDictObject *self, int share)
+{
+    Py_ssize_t b, num_blocks = self->num_blocks;
+    sparseblock *blocks = copy->static_blocks;
+    bitmap_t *bloom = NULL;
+    PyObject **shared = NULL;
+    arenaobject *arena = NULL;
+    int j, num_items, layout = SparseDict_LAYOUT(self), track = _PyObject_GC_IS_TRACKED(self);
+
+    assert(!SparseDict_MIGRATING(self) && SparseDict_SIZE(copy) == 0 && copy->num_items == 0);
+    if (num_blocks > 1) {
+        blocks = PyMem_NEW(sparseblock, num_blocks);
+        if (blocks == NULL)
+            goto NoMemory;
+    }
+    memset(blocks, 0, num_blocks * sizeof(sparseblock));
+    if (self->bloom != NULL) {
+        bloom = PyMem_NEW(bitmap_t, self->bloom_mask + 1);
+        if (bloom == NULL)
+            goto NoMemory;
+        memcpy(bloom, self->bloom, (self->bloom_mask + 1) * sizeof(bitmap_t));
+    }
+    if (self->arena != NULL) {
+        /* The entries keep their offsets. */
+        assert(!share);
+        arena = arena_new(self->arena->used > ARENA_MIN_SIZE ? self->arena->used : ARENA_MIN_SIZE);
+        if (arena == NULL)
+            goto NoMemory;
+        memcpy(arena->data, self->arena->data, self->arena->used);
+        arena->used = self->arena->used;
+    }
+    if (share) {
+        shared = PyMem_NEW(PyObject *, num_blocks);
+        if (shared == NULL)
+            goto NoMemory;
+        memset(shared, 0, num_blocks * sizeof(PyObject *));
+        if (self->shared == NULL) {
+            self->shared = PyMem_NEW(PyObject *, num_blocks);
+            if (self->shared == NULL)
+                goto NoMemory;
+            memset(self->shared, 0, num_blocks * sizeof(PyObject *));
+        }
+    }
+    for (b = 0; b < num_blocks; ++b) {
+        size_t size;
+        num_items = SPARSEBLOCK_NUM_ITEMS(&self->blocks[b]);
+        if (num_items == 0)
+            continue;
+        if (share) {
+            /* The blocks of self that are shared already stay in their sharedblock. */
+            if (self->shared[b] == NULL) {
+                self->shared[b] = sharedblock_new(&self->blocks[b], layout,
+                                                   self->options & (OPTION_KEY_I8 | OPTIONS_VALUE_TYPE), track);
+                if (self->shared[b] == NULL)
+                    goto NoMemory;
+                ++self->num_shared;
+            }
+            Py_INCREF(self->shared[b]);
+            shared[b] = self->shared[b];
+            blocks[b] = self->blocks[b];
+            continue;
+        }
+        size = SPARSEBLOCK_ITEMS_SIZE(num_items, layout);
+        blocks[b].items = (dictentry *)items_alloc(size);
+        if (blocks[b].items == NULL)
+            goto NoMemory;
+        memcpy(blocks[b].items, self->blocks[b].items, size);
+        blocks[b].bitmap = self->blocks[b].bitmap;
+    }
+    /* Nothing can fail from here on. */
+    for (b = 0; b < num_blocks && !share; ++b) {
+        dictentry *items = blocks[b].items;
+        num_items = SPARSEBLOCK_NUM_ITEMS(&blocks[b]);
+        for (j = 0; j < num_items; ++j) {
+            if (items[j].key != NULL) {
+                KEY_INCREF(SparseDict_KEY_TYPE(self), items[j].key);
+                VALUE_INCREF(SparseDict_VALUE_TYPE(self), items[j].value);
+            }
+        }
+    }
+
+    copy->blocks = blocks;
+    copy->num_blocks = num_blocks;
+    copy->_max_items = SparseDict_MAX_ITEMS(self);
+    copy->num_items = self->num_items;
+    copy->num_deleted = self->num_deleted;
+    copy->options = self->options;
+    copy->lookup = self->lookup;
+    copy->bloom = bloom;
+    copy->bloom_mask = self->bloom_mask;
+    copy->bloom_added = self->bloom_added;
+    copy->arena = arena;
+    if (share) {
+        copy->shared = shared;
+        copy->num_shared = self->num_shared; /* Every nonempty block. */
+        if (self->num_shared == 0) {
+            /* Nothing to share in an empty table. */
+            PyMem_FREE(shared);
+            PyMem_FREE(self->shared);
+            copy->shared = self->shared = NULL;
+        }
+    }
+    if (track && !_PyObject_GC_IS_TRACKED(copy))
+        PyObject_GC_Track(copy);
+
+    /* Compaction is an optimization, the copy is complete without it. */
+    if (!share && copy->num_deleted >= COMPACT_MIN_DELETED && dict_compact(copy) < 0)
+        PyErr_Clear();
+    SparseDict_INVARIANT(copy);
+    return 0;
+
+NoMemory:
+    if (share) {
+        /* The blocks of self already in sharedblocks stay there. */
+        if (shared != NULL)
+            for (b = 0; b < num_blocks; ++b)
+                Py_XDECREF(shared[b]);
+        PyMem_FREE(shared);
+        if (self->num_shared == 0) {
+            PyMem_FREE(self->shared);
+            self->shared = NULL;
+        }
+    }
+    else
+        for (b = 0; b < num_blocks; ++b)
+            items_free(blocks[b].items, SPARSEBLOCK_ITEMS_SIZE(SPARSEBLOCK_NUM_ITEMS(&blocks[b]), layout));
+    if (blocks != copy->static_blocks)
+        PyMem_FREE(blocks);
+    else
+        memset(blocks, 0, sizeof(sparseblock));
+    PyMem_FREE(bloom);
+    Py_XDECREF(arena);
+    PyErr_NoMemory();
+    return -1;
+}
+
+static PyObject *
+dict_py_copy(SparseDictObject *self)
+{
+    SparseDictObject *copy = (SparseDictObject *)Py_TYPE(self)->tp_new(Py_TYPE(self), NULL, NULL);
+    if (copy == NULL)
+        return NULL;
+
+    /* With many deleted entries compaction would rehash the clone, reinserting the
+       live items is cheaper than cloning first. */
+    if (!SparseDict_MIGRATING(self) && self->num_deleted <= self->num_items / 8) {
+        if (dict_clone(copy, self, 0) != 0) {
+            Py_DECREF(copy);
+            return NULL;
+        }
+        return (PyObject *)copy;
+    }
+
+    copy->options = self->options;
+    if (copy->options & OPTION_ROBIN_HOOD)
+        copy->lookup = dict_lookup_robinhood;
+    else if (copy->options & OPTION_KEY_I8)
+        copy->lookup = dict_lookup_i8;
+    if (dict_merge(copy, (PyObject *)self) != 0 ||
+            (copy->bloom == NULL && (copy->options & OPTION_BLOOM) && dict_build_bloom(copy) != 0)) {
+        Py_DECREF(copy);
+        return NULL;
+    }
+    return (PyObject *) copy;
+}
+
+static PyObject *
+dict_py_snapshot(SparseDictObject *self)
+{
+    SparseDictObject *copy;
+
+    /* The item arrays of both tables are on the move. */
+    if (SparseDict_MIGRATING(self))
+        return dict_py_copy(self);
+    copy = (SparseDictObject *)Py_TYPE(self)->tp_new(Py_TYPE(self), NULL, NULL);
+    if (copy == NULL)
+        return NULL;
+    /* Entries of the arena of self can't be shared, the copy gets arena and entries of its own. */
+    if (dict_clone(copy, self, SparseDict_VALUE_TYPE(self) != OPTION_VALUE_BYTES) != 0) {
+        Py_DECREF(copy);
+        return NULL;
+    }
+    return (PyObject *)copy;
+}
+
+static PyObject *
+dict_py_contains(SparseDictObject *self, PyObject *key)
+{
+    dictentry *entry = dict_find_key(self, key, -1);
+    if (entry == NULL)
+        return NULL;
+    return PyBool_FromLong(entry->key != NULL);
+}
+
+static PyObject *
+dict_py_get(SparseDictObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    PyObject *value;
+    dictentry *entry;
+
+    if (check_nargs("get", nargs, 1, 2) != 0)
+        return NULL;
+
+    entry = dict_find_key(self, args[0], -1);
+    if (entry == NULL)
+        return NULL;
+    if (entry->key != NULL)
+        return dict_value_box(self, entry->value);
+    value = nargs > 1 ? args[1] : Py_None;
+    Py_INCREF(value);
+    return value;
+}
+FASTCALL_WRAPPER(dict_py_get)
+
+/* Read-only memoryview of a value in the arena, without copying it. */
+static PyObject *
+dict_py_get_view(SparseDictObject *self, PyObject *key)
+{
+    PyObject *view, *result;
+    Py_ssize_t offset, len;
+    dictentry *entry;
+
+    if (SparseDict_VALUE_TYPE(self) != OPTION_VALUE_BYTES) {
+        PyErr_SetString(PyExc_TypeError, "get_view() requires value_type 'bytes'");
+        return NULL;
+    }
+    entry = dict_find_key(self, key, -1);
+    if (entry == NULL)
+        return NULL;
+    if (entry->key == NULL) {
+        set_key_error(key);
+        return NULL;
+    }
+    offset = ARENA_OFFSET(entry->value);
+    len = ARENA_LEN(entry->value);
+    view = PyMemoryView_FromObject((PyObject *)self->arena);
+    if (view == NULL)
+        return NULL;
+    result = PySequence_GetSlice(view, offset, offset + len);
+    Py_DECREF(view);
+    return result;
+}
+
+#define LOOKUP_BATCH 16 /* Keys prefetched ahead of their lookups. */
+
+/* Look up all keys of the sequence and return the list of their values (found is NULL)
+   or of found/missing results. Keys are processed in batches: hash all the keys of a batch,
+   then prefetch the first probed block, item and key of each, so the cache misses of the
+   batch overlap instead of stalling every lookup in turn. The lookups themselves go
+   through dict_find, after all the prefetches of the batch: entries[] are only read
+   before any __eq__ of the batch can mutate the dict. */
+Py_LOCAL(PyObject *)
+dict_lookup_many(SparseDictObject *self, PyObject *keys, PyObject *missing, PyObject *found)
+{
+    PyObject *seq, *result = NULL, **items, *value, *stored[LOOKUP_BATCH];
+    Py_hash_t hashes[LOOKUP_BATCH];
+    size_t slots[LOOKUP_BATCH];
+    dictentry *entries[LOOKUP_BATCH];
+    Py_ssize_t n, start, count, k;
+    sparseblock *blocks, *block;
+    dictentry *entry;
+    size_t max_items_mask;
+    int layout, status;
+
+    /* A private tuple, user's __hash__ and __eq__ can't change it under us. */
+    seq = PySequence_Tuple(keys);
+    if (seq == NULL)
+        return NULL;
+    n = PyTuple_GET_SIZE(seq);
+    items = &PyTuple_GET_ITEM(seq, 0);
+    result = PyList_New(n);
+    if (result == NULL)
+        goto Done;
+
+    for (start = 0; start < n; start += count) {
+        count = n - start < LOOKUP_BATCH ? n - start : LOOKUP_BATCH;
+        for (k = 0; k < count; ++k) {
+            /* Keys a key type can't hold are missing, they are not looked up (stored is NULL). */
+            status = key_unbox(SparseDict_KEY_TYPE(self), items[start + k], &stored[k], 0);
+            if (status < 0)
+                goto Failed;
+            if (status == 0) {
+                stored[k] = NULL;
+                hashes[k] = 0;
+            }
+            else if ((hashes[k] = dict_key_hash(self, stored[k])) == -1)
+                goto Failed;
+        }
+
+        /* Hashing can run arbitrary code, read the table only now. */
+        blocks = self->blocks;
+        max_items_mask = SparseDict_MAX_ITEMS(self) - 1;
+        layout = SparseDict_LAYOUT(self);
+        for (k = 0; k < count; ++k) {
+            slots[k] = hash_mix((size_t)hashes[k]) & max_items_mask;
+            PREFETCH(&blocks[slots[k] / SPARSEBLOCK_SIZE]);
+        }
+        for (k = 0; k < count; ++k) {
+            block = &blocks[slots[k] / SPARSEBLOCK_SIZE];
+            entries[k] = entry = sparseblock_find(block, slots[k] % SPARSEBLOCK_SIZE);
+            if (entry != NULL) {
+                PREFETCH(entry);
+                if (layout) /* its hash or fingerprint */
+                    PREFETCH(SPARSEBLOCK_FINGERPRINTS(block) +
+                             (entry - block->items) * SPARSEBLOCK_TAG_SIZE(layout));
+            }
+        }
+        for (k = 0; k < count && !SparseDict_KEY_TYPE(self); ++k) {
+            if (entries[k] != NULL && entries[k]->key != NULL && entries[k]->key != stored[k])
+                PREFETCH(entries[k]->key);
+        }
+
+        /* From here on __eq__ can run, entries[] may dangle. */
+        for (k = 0; k < count; ++k) {
+            entry = stored[k] == NULL ? &entry_not_found : dict_find(self, stored[k], hashes[k], 0);
+            if (entry == NULL)
+                goto Failed;
+            value = entry->key == NULL ? missing : found != NULL ? found : NULL;
+            if (value == NULL) {
+                value = dict_value_box(self, entry->value);
+                if (value == NULL)
+                    goto Failed;
+            }
+            else
+                Py_INCREF(value);
+            PyList_SET_ITEM(result, start + k, value);
+        }
+    }
+    goto Done;
+
+Failed:
+    Py_CLEAR(result);
+Done:
+    Py_DECREF(seq);
+    return result;
+}
+
+static PyObject *
+dict_py_get_many(SparseDictObject *self, PyObject *args)
+{
+    PyObject *keys, *value = Py_None;
+
+    if (!PyArg_UnpackTuple(args, "get_many", 1, 2, &keys, &value))
+        return NULL;
+    return dict_lookup_many(self, keys, value, NULL);
+}
+
+static PyObject *
+dict_py_contains_many(SparseDictObject *self, PyObject *keys)
+{
+    return dict_lookup_many(self, keys, Py_False, Py_True);
+}
+
+static PyObject *
+dict_py_setdefault(SparseDictObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    PyObject *key, *value, *stored;
+    dictentry *entry;
+    int typed = SparseDict_VALUE_TYPE(self), key_typed = SparseDict_KEY_TYPE(self);
+
+    if (check_nargs("setdefault", nargs, 1, 2) != 0)
+        return NULL;
+    key = args[0];
+    value = nargs > 1 ? args[1] : Py_None;
+    if (key_unbox(key_typed, key, &key, 1) <= 0)
+        return NULL;
+
+    /* A typed default is converted only if it's stored, which can run Python code. */
+    if (typed) {
+        entry = dict_find(self, key, -1, 0);
+        if (entry == NULL)
+            return NULL;
+        if (entry->key != NULL)
+            return dict_value_box(self, entry->value);
+    }
+    if (typed != OPTION_VALUE_BYTES && value_unbox(typed, value, &stored) != 0)
+        return NULL;
+    if (dict_resize_delta(self, 1) != 0)
+        return NULL;
+    /* See dict_insert_hash. */
+    if (typed == OPTION_VALUE_BYTES && dict_value_unbox(self, value, &stored) != 0)
+        return NULL;
+    ++self->arena_pending;
+    entry = dict_find(self, key, -1, 1);
+    --self->arena_pending;
+    if (entry == NULL)
+        return NULL;
+    if (entry->key == NULL) {
+        /* Insert new */
+        MAINTAIN_TRACKING(self, key, stored);
+        KEY_INCREF(key_typed, key);
+        VALUE_INCREF(typed, stored);
+        entry->key = key;
+        entry->value = stored;
+        ++self->num_items;
+    }
+    return dict_value_box(self, entry->value);
+}
+FASTCALL_WRAPPER(dict_py_setdefault)
+
+static PyObject *
+dict_py_clear(SparseDictObject *self)
+{
+    dict_tp_clear(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+dict_py_pop(SparseDictObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    PyObject *key, *value;
+
+    if (check_nargs("pop", nargs, 1, 2) != 0)
+        return NULL;
+    key = args[0];
+    value = nargs > 1 ? args[1] : NULL;
+
+    if (SparseDict_SIZE(self) != 0) {
+        dictentry *entry;
+        PyObject *stored;
+        Py_hash_t hash = 0;
+        int found = key_unbox(SparseDict_KEY_TYPE(self), key, &stored, 0);
+        if (found < 0 || (found && (hash = dict_key_hash(self, stored)) == -1))
+            return NULL;
+        entry = found ? dict_find(self, stored, hash, 0) : &entry_not_found;
+        if (entry == NULL)
+            return NULL;
+        if (entry->key != NULL) {
+            PyObject *old_key = entry->key;
+            PyObject *old_value = dict_value_box(self, entry->value);
+            if (old_value == NULL || dict_erase(self, entry, hash) != 0) {
+                Py_XDECREF(old_value);
+                return NULL;
+            }
+            KEY_DECREF(SparseDict_KEY_TYPE(self), old_key);
+            VALUE_DECREF(SparseDict_VALUE_TYPE(self), old_value); /* the erased entry's reference */
+            dict_after_delete(self);
+            return old_value;
+        }
+    }
+    if (value) {
+        Py_INCREF(value);
+        return value;
+    }
+    set_key_error(key);
+    return NULL;
+
+}
+FASTCALL_WRAPPER(dict_py_pop)
+
+static PyObject *
+dict_py_popitem(SparseDictObject *self)
+{
+    PyObject *pair;
+    dictentry *entry;
+    Py_hash_t hash = -1;
+
+    pair = PyTuple_New(2);
+    if (pair == NULL)
+        return NULL;
+    if (SparseDict_SIZE(self) == 0) {
+        Py_DECREF(pair);
+        PyErr_SetString(PyExc_KeyError, "popitem(): dictionary is empty");
+        return NULL;
+    }
+
+    assert(self->next_index >= 0);
+    entry = dict_next(self, &self->next_index, 1);
+
+    if (SparseDict_HASH_CACHE(self))
+        hash = SPARSEBLOCK_HASHES(dict_block(self, self->next_index >> INDEX_SHIFT))
+                   [(self->next_index & INDEX_MASK) - 1];
+    if (self->num_shared != 0 && self->shared[self->next_index >> INDEX_SHIFT] != NULL &&
+            dict_own_block(self, self->next_index >> INDEX_SHIFT, &entry) != 0) {
+        Py_DECREF(pair);
+        return NULL;
+    }
+    /* Box typed items first, the pair only takes the references of the others on success. */
+    if (SparseDict_KEY_TYPE(self)) {
+        PyObject *key = key_box(SparseDict_KEY_TYPE(self), entry->key);
+        if (key == NULL) {
+            Py_DECREF(pair);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(pair, 0, key);
+    }
+    if (SparseDict_VALUE_TYPE(self)) {
+        PyObject *value = dict_value_box(self, entry->value);
+        if (value == NULL) {
+            Py_DECREF(pair);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(pair, 1, value);
+    }
+    else
+        PyTuple_SET_ITEM(pair, 1, entry->value);
+    if (!SparseDict_KEY_TYPE(self))
+        PyTuple_SET_ITEM(pair, 0, entry->key);
+    if (dict_erase(self, entry, hash) != 0) {
+        /* The pair has taken the references. */
+        KEY_INCREF(SparseDict_KEY_TYPE(self), entry->key);
+        VALUE_INCREF(SparseDict_VALUE_TYPE(self), entry->value);
+        Py_DECREF(pair);
+        return NULL;
+    }
+    dict_after_delete(self);
+    return pair;
+}
+
+static PyObject *
+dict_py_resize(SparseDictObject *self, PyObject *arg)
+{
+    Py_ssize_t size = PyInt_AsSsize_t(arg);
+    if (size < 0) {
+        PyErr_SetString(PyExc_ValueError, "resize(): argument must be a nonnegative integer");
+        return NULL;
+    }
+    if (dict_resize_delta(self, size - SparseDict_SIZE(self)) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+dict_py_compact(SparseDictObject *self)
+{
+    Py_ssize_t arena_bytes = self->arena != NULL ? self->arena->size : 0;
+    Py_ssize_t freed = dict_compact(self);
+    if (freed < 0)
+        return NULL;
+    /* The arena as well, as dict_resize would. */
+    if (!SparseDict_MIGRATING(self) && self->num_shared == 0) {
+        if (dict_compact_arena(self) != 0)
+            return NULL;
+        if (self->arena != NULL)
+            freed += arena_bytes - self->arena->size;
+    }
+    return PyInt_FromSsize_t(freed);
+}
+
+/* Reason why the combination of options is invalid, or NULL. */
+Py_LOCAL(const char *)
+options_error(int options)
+{
+    if ((options & OPTION_INCREMENTAL_RESIZE) && !(options & OPTION_HASH_CACHE))
+        return "incremental_resize requires hash_cache";
+    /* Both take the place after the entries, and the hash makes the fingerprint redundant. */
+    if ((options & OPTION_FINGERPRINTS) && (options & OPTION_HASH_CACHE))
+        return "fingerprints and hash_cache can't be combined";
+    if ((options & OPTION_ROBIN_HOOD) && !(options & OPTION_HASH_CACHE))
+        return "robin_hood requires hash_cache";
+    if ((options & OPTION_ROBIN_HOOD) && (options & OPTION_INCREMENTAL_RESIZE))
+        return "robin_hood and incremental_resize can't be combined";
+    if ((options & OPTIONS_VALUE_TYPE) & ((options & OPTIONS_VALUE_TYPE) - 1))
+        return "only one value_type";
+    return NULL;
+}
+
+static PyObject *
+dict_py_configure(SparseDictObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"hash_cache", "incremental_resize", "auto_compact", "robin_hood", "fingerprints",
+                             "bloom", NULL};
+    PyObject *hash_cache = NULL, *incremental_resize = NULL, *auto_compact = NULL, *robin_hood = NULL;
+    PyObject *fingerprints = NULL, *bloom = NULL;
+    const char *error;
+    int options = self->options;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OOOOOO:configure", kwlist, &hash_cache, &incremental_resize,
+                                     &auto_compact, &robin_hood, &fingerprints, &bloom))
+        return NULL;
+
+    if (robin_hood != NULL) {
+        int enable = PyObject_IsTrue(robin_hood);
+        if (enable < 0)
+            return NULL;
+        /* Displacements are computed from the cached hashes. */
+        options = enable ? (options | OPTION_ROBIN_HOOD | OPTION_HASH_CACHE) :
+                           (options & ~OPTION_ROBIN_HOOD);
+    }
+
+    if (incremental_resize != NULL) {
+        int enable = PyObject_IsTrue(incremental_resize);
+        if (enable < 0)
+            return NULL;
+        /* Migration reads the hashes from the cache. */
+        options = enable ? (options | OPTION_INCREMENTAL_RESIZE | OPTION_HASH_CACHE) :
+                           (options & ~OPTION_INCREMENTAL_RESIZE);
+    }
+    if (hash_cache != NULL) {
+        int enable = PyObject_IsTrue(hash_cache);
+        if (enable < 0)
+            return NULL;
+        options = enable ? (options | OPTION_HASH_CACHE) : (options & ~OPTION_HASH_CACHE);
+    }
+    if (auto_compact != NULL) {
+        int enable = PyObject_IsTrue(auto_compact);
+        if (enable < 0)
+            return NULL;
+        options = enable ? (options | OPTION_AUTO_COMPACT) : (options & ~OPTION_AUTO_COMPACT);
+    }
+    if (fingerprints != NULL) {
+        int enable = PyObject_IsTrue(fingerprints);
+        if (enable < 0)
+            return NULL;
+        options = enable ? (options | OPTION_FINGERPRINTS) : (options & ~OPTION_FINGERPRINTS);
+    }
+    if (bloom != NULL) {
+        int enable = PyObject_IsTrue(bloom);
+        if (enable < 0)
+            return NULL;
+        options = enable ? (options | OPTION_BLOOM) : (options & ~OPTION_BLOOM);
+    }
+    error = options_error(options);
+    if (error != NULL) {
+        PyErr_Format(PyExc_ValueError, "configure(): %s", error);
+        return NULL;
+    }
+
+    /* Layout changes require all blocks to be rebuilt. */
+    if ((options ^ self->options) & OPTIONS_LAYOUT) {
+        if (dict_rebuild(self, SparseDict_MAX_ITEMS(self), options) != 0)
+            return NULL;
+    }
+    else {
+        if (!(options & OPTION_INCREMENTAL_RESIZE) && SparseDict_MIGRATING(self) &&
+            dict_migrate(self, -1) != 0)
+            return NULL;
+        self->options = options;
+    }
+    if (!(options & OPTION_BLOOM))
+        dict_set_bloom(self, NULL, 0, 0);
+    else if (self->bloom == NULL && dict_build_bloom(self) != 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+dict_py_iterkeys(SparseDictObject *dict)
+{
+    return dictiter_new(dict, &SparseDictIterKey_Type);
+}
+
+static PyObject *
+dict_py_itervalues(SparseDictObject *dict)
+{
+    return dictiter_new(dict, &SparseDictIterValue_Type);
+}
+
+static PyObject *
+dict_py_iteritems(SparseDictObject *dict)
+{
+    return dictiter_new(dict, &SparseDictIterItem_Type);
+}
+
+static PyObject *
+dict_py_viewkeys(SparseDictObject *dict)
+{
+    return dictview_new(dict, &SparseDictKeys_Type);
+}
+
+static PyObject *
+dict_py_viewvalues(SparseDictObject *dict)
+{
+    return dictview_new(dict, &SparseDictValues_Type);
+}
+
+static PyObject *
+dict_py_viewitems(SparseDictObject *dict)
+{
+    return dictview_new(dict, &SparseDictItems_Type);
+}
+
+static PyObject *
+dict_py_sizeof(SparseDictObject *self)
+{
+    Py_ssize_t result = sizeof(SparseDictObject);
+    if (self->blocks != self->static_blocks)
+        result += sizeof(sparseblock) * self->num_blocks;
+    result += sizeof(sparseblock) * self->old_num_blocks;
+    result += dict_items_bytes(self, 0);
+    if (self->shared != NULL)
+        result += sizeof(PyObject *) * self->num_blocks;
+    if (self->bloom != NULL)
+        result += (self->bloom_mask + 1) * sizeof(bitmap_t);
+    if (self->arena != NULL)
+        result += sizeof(arenaobject) + self->arena->size;
+    return PyInt_FromSsize_t(result);
+}
+
+Py_LOCAL_INLINE(void)
+pydict_set_and_delete(PyObject *dict, const char *key, PyObject *value) {
+    if (value != NULL) {
+        PyDict_SetItemString(dict, key, value);
+        Py_DECREF(value);
+    }
+}
+
+/* Name of the key type the lookup function is specialized for, None for universal lookup. */
+static PyObject *
+lookup_name(lookupfunc lookup)
+{
+    if (lookup == dict_lookup_string)
+        return PyString_FromString(PyBytes_Type.tp_name);
+#ifdef HAVE_COMPACT_UNICODE
+    if (lookup == dict_lookup_unicode)
+        return PyString_FromString(PyUnicode_Type.tp_name);
+#endif
+#ifdef HAVE_INT_LOOKUP
+    if (lookup == dict_lookup_int)
+        return PyString_FromString(PyInt_Type.tp_name);
+#endif
+    if (lookup == dict_lookup_i8)
+        return PyString_FromString("i8");
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/* Mean and maximum number of slots a successful lookup examines, from the cached hashes.
+   Keys in the old table of an incremental resize are not counted. */
+Py_LOCAL(void)
+dict_probe_lengths(SparseDictObject *self, double *mean, size_t *max)
+{
+    size_t i, slot, num_probes, total = 0, count = 0, max_items_mask = SparseDict_MAX_ITEMS(self) - 1;
+    Py_ssize_t k;
+    int j, n;
+
+    *max = 0;
+    for (k = 0; k < self->num_blocks; ++k) {
+        sparseblock *block = &self->blocks[k];
+        for (j = 0, n = 0; j < SPARSEBLOCK_SIZE; ++j) {
+            if (!BIT_TEST(block->bitmap, j))
+                continue;
+            if (block->items[n].key != NULL) {
+                Py_hash_t hash = SPARSEBLOCK_HASHES(block)[n];
+                slot = k * SPARSEBLOCK_SIZE + j;
+                if (self->options & OPTION_ROBIN_HOOD)
+                    num_probes = RH_DISTANCE(slot, hash, max_items_mask);
+                else {
+                    i = hash_mix((size_t)hash) & max_items_mask;
+                    num_probes = 0;
+                    while (i != slot && num_probes <= max_items_mask) {
+                        ++num_probes;
+                        i = (i + num_probes) & max_items_mask;
+                    }
+                }
+                total += num_probes + 1;
+                ++count;
+                if (num_probes + 1 > *max)
+                    *max = num_probes + 1;
+            }
+            ++n;
+        }
+    }
+    *mean = count ? (double)total / count : 0.0;
+}
+
+/* Expected false positive rate of the filter: the chance that all bits of a missing
+   key are set in its word, averaged over the words. */
+Py_LOCAL(double)
+bloom_error_rate(SparseDictObject *self)
+{
+    size_t i;
+    double fill, total = 0.0;
+
+    if (self->bloom == NULL)
+        return 0.0;
+    for (i = 0; i <= self->bloom_mask; ++i) {
+        fill = popcount(self->bloom[i]) / 64.0;
+        total += fill * fill * fill * fill; /* BLOOM_BITS */
+    }
+    return total / (self->bloom_mask + 1);
+}
+
+static PyObject *
+dict_py_stats(SparseDictObject *self)
+{
+    Py_ssize_t i;
+    double mean_probes;
+    size_t max_probes;
+    Py_ssize_t hist[SPARSEBLOCK_SIZE + 1] = { 0 };
+    PyObject *hist_list, *value;
+    PyObject *result = PyDict_New();
+
+    if (result == NULL)
+        return NULL;
+
+    pydict_set_and_delete(result, "block_size", PyInt_FromLong(SPARSEBLOCK_SIZE));
+    pydict_set_and_delete(result, "num_blocks", PyInt_FromSsize_t(self->num_blocks));
+    pydict_set_and_delete(result, "max_items", PyInt_FromSsize_t(SparseDict_MAX_ITEMS(self)));
+    pydict_set_and_delete(result, "num_items", PyInt_FromSsize_t(self->num_items));
+    pydict_set_and_delete(result, "num_deleted", PyInt_FromSsize_t(self->num_deleted));
+    pydict_set_and_delete(result, "consider_shrink", PyBool_FromLong(self->_max_items & FLAG_CONSIDER_SHRINK));
+    pydict_set_and_delete(result, "disable_resize", PyBool_FromLong(self->_max_items & FLAG_DISABLE_RESIZE));
+    pydict_set_and_delete(result, "string_lookup", lookup_name(self->lookup));
+    pydict_set_and_delete(result, "hash_cache", PyBool_FromLong(SparseDict_HASH_CACHE(self)));
+    pydict_set_and_delete(result, "hash_cache_bytes",
+        PyInt_FromSsize_t(SparseDict_HASH_CACHE(self) ? sizeof(Py_hash_t) * self->num_items : 0));
+    pydict_set_and_delete(result, "fingerprints", PyBool_FromLong(self->options & OPTION_FINGERPRINTS));
+    pydict_set_and_delete(result, "fingerprint_bytes",
+        PyInt_FromSsize_t((self->options & OPTION_FINGERPRINTS) ? self->num_items : 0));
+    pydict_set_and_delete(result, "entry_size",
+        PyInt_FromSize_t(sizeof(dictentry) + SPARSEBLOCK_TAG_SIZE(SparseDict_LAYOUT(self))));
+    pydict_set_and_delete(result, "incremental_resize",
+        PyBool_FromLong(self->options & OPTION_INCREMENTAL_RESIZE));
+    pydict_set_and_delete(result, "migrating_blocks",
+        PyInt_FromSsize_t(self->old_num_blocks - self->migrate_index));
+    pydict_set_and_delete(result, "auto_compact", PyBool_FromLong(self->options & OPTION_AUTO_COMPACT));
+    pydict_set_and_delete(result, "num_compactions", PyInt_FromSsize_t(self->num_compactions));
+    pydict_set_and_delete(result, "compact_bytes_freed", PyInt_FromSsize_t(self->compact_bytes_freed));
+    pydict_set_and_delete(result, "items_bytes", PyInt_FromSsize_t(dict_items_bytes(self, 0)));
+    pydict_set_and_delete(result, "shared_blocks", PyInt_FromSsize_t(self->num_shared));
+    pydict_set_and_delete(result, "shared_items_bytes", PyInt_FromSsize_t(dict_items_bytes(self, 1)));
+    pydict_set_and_delete(result, "robin_hood", PyBool_FromLong(self->options & OPTION_ROBIN_HOOD));
+    pydict_set_and_delete(result, "bloom", PyBool_FromLong(self->options & OPTION_BLOOM));
+    pydict_set_and_delete(result, "key_type", type_name(SparseDict_KEY_TYPE(self)));
+    pydict_set_and_delete(result, "value_type", type_name(SparseDict_VALUE_TYPE(self)));
+    pydict_set_and_delete(result, "bloom_bytes",
+        PyInt_FromSize_t(self->bloom ? (self->bloom_mask + 1) * sizeof(bitmap_t) : 0));
+    pydict_set_and_delete(result, "bloom_false_positive_rate", PyFloat_FromDouble(bloom_error_rate(self)));
+    pydict_set_and_delete(result, "bloom_rejects", PyInt_FromSsize_t(self->bloom_rejects));
+    pydict_set_and_delete(result, "bloom_false_positives", PyInt_FromSsize_t(self->bloom_false_positives));
+    pydict_set_and_delete(result, "arena_bytes", PyInt_FromSsize_t(self->arena ? self->arena->size : 0));
+    pydict_set_and_delete(result, "arena_used_bytes", PyInt_FromSsize_t(self->arena ? self->arena->used : 0));
+    if (SparseDict_HASH_CACHE(self)) {
+        dict_probe_lengths(self, &mean_probes, &max_probes);
+        pydict_set_and_delete(result, "mean_probe_length", PyFloat_FromDouble(mean_probes));
+        pydict_set_and_delete(result, "max_probe_length", PyInt_FromSize_t(max_probes));
+    }
+    else {
+        Py_INCREF(Py_None);
+        pydict_set_and_delete(result, "mean_probe_length", Py_None);
+        Py_INCREF(Py_None);
+        pydict_set_and_delete(result, "max_probe_length", Py_None);
+    }
+#ifdef NO_SLAB_ALLOC
+    pydict_set_and_delete(result, "allocator", PyString_FromString("pymem"));
+#else
+    pydict_set_and_delete(result, "allocator", PyString_FromString("slab"));
+    pydict_set_and_delete(result, "slab_bytes", PyInt_FromSsize_t(num_slabs * SLAB_SIZE));
+#endif
+    pydict_set_and_delete(result, "allocated_items_bytes", PyInt_FromSize_t(items_bytes));
+    EX_STATS(pydict_set_and_delete(result, "total_collisions", PyInt_FromSize_t(self->total_collisions)));
+    EX_STATS(pydict_set_and_delete(result, "total_fingerprint_skips",
+                                   PyInt_FromSize_t(self->total_fingerprint_skips)));
+    EX_STATS(pydict_set_and_delete(result, "total_resizes", PyInt_FromSize_t(self->total_resizes)));
+
+    hist_list = PyList_New(SPARSEBLOCK_SIZE + 1);
+    if (hist_list == NULL) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    for (i = 0; i < self->num_blocks; ++i)
+        ++hist[SPARSEBLOCK_NUM_ITEMS(&self->blocks[i])];
+    for (i = 0; i <= SPARSEBLOCK_SIZE; ++i) {
+        value = PyInt_FromSsize_t(hist[i]);
+        if (value == NULL) {
+            Py_DECREF(result);
+            Py_DECREF(hist_list);
+            return NULL;
+        }
+        PyList_SET_ITEM(hist_list, i, value);
+    }
+    pydict_set_and_delete(result, "blocks_by_size", hist_list);
+
+    return result;
+}
+
+static PyObject *
+dict_py_reduce(SparseDictObject *self)
+{
+    PyObject *result = NULL, *size = NULL, *args = NULL, *state = NULL, *iteritems = NULL;
+
+    size = PyInt_FromSsize_t(SparseDict_SIZE(self));
+    if (size == NULL)
+        goto Done;
+    /* Args to the constructor. A typed dict needs its types before the items, _new_typed
+       passes them as keywords. */
+    if (SparseDict_KEY_TYPE(self))
+        args = Py_BuildValue("(OONN)", Py_TYPE(self), size, type_name(SparseDict_VALUE_TYPE(self)),
+                             type_name(SparseDict_KEY_TYPE(self)));
+    else if (SparseDict_VALUE_TYPE(self))
+        args = Py_BuildValue("(OON)", Py_TYPE(self), size, type_name(SparseDict_VALUE_TYPE(self)));
+    else
+        args = PyTuple_Pack(1, size);
+    if (args == NULL)
+        goto Done;
+    /* Subclass' __dict__ to be restored by object.__setstate__ */
+    state = PyObject_GetAttrString((PyObject *)self, "__dict__");
+    if (state == NULL) {
+        PyErr_Clear();
+        state = Py_None;
+        Py_INCREF(state);
+    }
+    /* Dict item iterator to support batch pickling. */
+    iteritems = dictiter_new(self, &SparseDictIterItem_Type);
+    if (iteritems == NULL)
+        goto Done;
+
+    result = PyTuple_Pack(5, (self->options & (OPTION_KEY_I8 | OPTIONS_VALUE_TYPE)) ? new_typed :
+                                                                                  (PyObject *)Py_TYPE(self),
+                          args, state, Py_None, iteritems);
+Done:
+    Py_XDECREF(size);
+    Py_XDECREF(args);
+    Py_XDECREF(state);
+    Py_XDECREF(iteritems);
+    return result;
+}
+
+#if PY_VERSION_HEX >= 0x03080000
+/* Pickle protocol 5 support. Tables with int keys and int or float values are pickled
+   as two columns of 64-bit numbers wrapped in PickleBuffers, which can be passed
+   out-of-band and are rebuilt by _from_buffers with from_arrays. */
+
+/* Tuple of the 64-bit ints ('q') or doubles ('d') in the bytes of a buffer. */
+Py_LOCAL(PyObject *)
+column_as_tuple(PyObject *obj, char format)
+{
+    Py_buffer view;
+    PyObject *result = NULL, *item;
+    const char *p;
+    Py_ssize_t i, n;
+
+    if (PyObject_GetBuffer(obj, &view, PyBUF_SIMPLE) != 0)
+        return NULL;
+    if (view.len % 8 != 0) {
+        PyErr_SetString(PyExc_ValueError, "_from_buffers(): buffer size is not a multiple of 8");
+        goto Done;
+    }
+    n = view.len / 8;
+    result = PyTuple_New(n);
+    if (result == NULL)
+        goto Done;
+    for (i = 0, p = (const char *)view.buf; i < n; ++i, p += 8) {
+        if (format == 'd') {
+            double value;
+            memcpy(&value, p, 8);
+            item = PyFloat_FromDouble(value);
+        }
+        else {
+            PY_LONG_LONG value;
+            memcpy(&value, p, 8);
+            item = PyLong_FromLongLong(value);
+        }
+        if (item == NULL) {
+            Py_CLEAR(result);
+            break;
+        }
+        PyTuple_SET_ITEM(result, i, item);
+    }
+Done:
+    PyBuffer_Release(&view);
+    return result;
+}
+
+static PyObject *
+dict_py_from_buffers(PyObject *cls, PyObject *args)
+{
+    PyObject *self = NULL, *keys_buffer, *values_buffer, *keys = NULL, *values = NULL;
+    PyObject *value_type = Py_None, *key_type = Py_None;
+    int value_format;
+
+    if (!PyArg_ParseTuple(args, "OOC|OO:_from_buffers", &keys_buffer, &values_buffer, &value_format,
+                          &value_type, &key_type))
+        return NULL;
+    if (value_format != 'q' && value_format != 'd') {
+        PyErr_SetString(PyExc_ValueError, "_from_buffers(): value format must be 'q' or 'd'");
+        return NULL;
+    }
+    keys = column_as_tuple(keys_buffer, 'q');
+    if (keys == NULL)
+        goto Done;
+    values = column_as_tuple(values_buffer, (char)value_format);
+    if (values == NULL)
+        goto Done;
+
+    self = PyObject_CallObject(cls, NULL);
+    if (self == NULL)
+        goto Done;
+    if (!SparseDict_Check(self)) {
+        PyErr_SetString(PyExc_TypeError, "_from_buffers(): class must construct a SparseDict");
+        Py_CLEAR(self);
+        goto Done;
+    }
+    if ((value_type != Py_None && dict_set_type((SparseDictObject *)self, value_type, 0) != 0) ||
+            (key_type != Py_None && dict_set_type((SparseDictObject *)self, key_type, 1) != 0)) {
+        Py_CLEAR(self);
+        goto Done;
+    }
+    if (dict_merge_arrays((SparseDictObject *)self, keys, values, "_from_buffers") != 0)
+        Py_CLEAR(self);
+Done:
+    Py_XDECREF(keys);
+    Py_XDECREF(values);
+    return self;
+}
+
+/* Packs the items into key and value columns, returns 0 if they are not all
+   ints and all ints or all floats (bytes values never are). */
+Py_LOCAL(int)
+dict_columns(SparseDictObject *self, PyObject **keys, PyObject **values, char *value_format)
+{
+    Py_ssize_t n = SparseDict_SIZE(self), k = 0;
+    PY_LONG_LONG *key_column, *value_column;
+    int overflow = 0, result = 0, typed = SparseDict_VALUE_TYPE(self);
+    valuebits bits;
+
+    if (n == 0 || typed == OPTION_VALUE_BYTES)
+        return 0;
+    if (typed)
+        *value_format = typed == OPTION_VALUE_F8 ? 'd' : 'q';
+    else
+        *value_format = PyFloat_CheckExact(dict_next(self, &k, 0)->value) ? 'd' : 'q';
+    *keys = PyByteArray_FromStringAndSize(NULL, n * 8);
+    *values = PyByteArray_FromStringAndSize(NULL, n * 8);
+    if (*keys == NULL || *values == NULL)
+        goto Failed;
+    key_column = (PY_LONG_LONG *)PyByteArray_AS_STRING(*keys);
+    value_column = (PY_LONG_LONG *)PyByteArray_AS_STRING(*values);
+
+    /* Nothing here runs Python code. */
+    k = 0;
+    SparseDict_FOR(self, entry)
+        if (SparseDict_KEY_TYPE(self))
+            key_column[k] = key_i8_value(entry.key);
+        else if (!PyLong_CheckExact(entry.key))
+            goto Unsupported;
+        else {
+            key_column[k] = PyLong_AsLongLongAndOverflow(entry.key, &overflow);
+            if (overflow)
+                goto Unsupported;
+        }
+        if (typed) {
+            bits.object = entry.value;
+            value_column[k] = bits.i8;
+        }
+        else if (*value_format == 'd') {
+            if (!PyFloat_CheckExact(entry.value))
+                goto Unsupported;
+            bits.f8 = PyFloat_AS_DOUBLE(entry.value); /* not an lvalue on 3.12+ */
+            value_column[k] = bits.i8;
+        }
+        else {
+            if (!PyLong_CheckExact(entry.value))
+                goto Unsupported;
+            value_column[k] = PyLong_AsLongLongAndOverflow(entry.value, &overflow);
+            if (overflow)
+                goto Unsupported;
+        }
+        ++k;
+    SparseDict_ENDFOR(self, 0)
+    return 1;
+
+Failed:
+    result = -1;
+Unsupported:
+    Py_CLEAR(*keys);
+    Py_CLEAR(*values);
+    return result;
+}
+
+static PyObject *
+dict_py_reduce_ex(SparseDictObject *self, PyObject *args)
+{
+    PyObject *keys = NULL, *values = NULL, *key_buffer = NULL, *value_buffer = NULL;
+    PyObject *constructor = NULL, *state = NULL, *result = NULL;
+    char value_format;
+    int protocol, status;
+
+    if (!PyArg_ParseTuple(args, "i:__reduce_ex__", &protocol))
+        return NULL;
+    if (protocol < 5)
+        return PyObject_CallMethod((PyObject *)self, "__reduce__", NULL);
+    status = dict_columns(self, &keys, &values, &value_format);
+    if (status < 0)
+        return NULL;
+    if (status == 0)
+        return PyObject_CallMethod((PyObject *)self, "__reduce__", NULL);
+
+    key_buffer = PyPickleBuffer_FromObject(keys);
+    value_buffer = PyPickleBuffer_FromObject(values);
+    constructor = PyObject_GetAttrString((PyObject *)Py_TYPE(self), "_from_buffers");
+    if (key_buffer == NULL || value_buffer == NULL || constructor == NULL)
+        goto Done;
+    /* Subclass' __dict__ to be restored by object.__setstate__ */
+    state = PyObject_GetAttrString((PyObject *)self, "__dict__");
+    if (state == NULL) {
+        PyErr_Clear();
+        state = Py_None;
+        Py_INCREF(state);
+    }
+    if (self->options & (OPTION_KEY_I8 | OPTIONS_VALUE_TYPE))
+        result = Py_BuildValue("O(OOCNN)O", constructor, key_buffer, value_buffer, value_format,
+                               type_name(SparseDict_VALUE_TYPE(self)), type_name(SparseDict_KEY_TYPE(self)),
+                               state);
+    else
+        result = Py_BuildValue("O(OOC)O", constructor, key_buffer, value_buffer, value_format, state);
+Done:
+    Py_XDECREF(keys);
+    Py_XDECREF(values);
+    Py_XDECREF(key_buffer);
+    Py_XDECREF(value_buffer);
+    Py_XDECREF(constructor);
+    Py_XDECREF(state);
+    return result;
+}
+#endif
+
+static PyMethodDef dict_methods[] = {
+    {"__sizeof__",  (PyCFunction)dict_py_sizeof,       METH_NOARGS}, /* sys.getsizeof support */
+    {"__contains__",(PyCFunction)dict_py_contains,     METH_O | METH_COEXIST}, /* shortcut for sq_contains */
+    {"__getitem__", (PyCFunction)dict_mp_subscript,    METH_O | METH_COEXIST}, /* shortcut for mp_getitem */
+    {"__reduce__",  (PyCFunction)dict_py_reduce,       METH_NOARGS}, /* pickling support */
+#if PY_VERSION_HEX >= 0x03080000
+    {"__reduce_ex__",(PyCFunction)dict_py_reduce_ex,   METH_VARARGS},
+    {"_from_buffers",(PyCFunction)dict_py_from_buffers, METH_VARARGS | METH_CLASS},
+#endif
+    {"get",         FASTCALL_METHOD(dict_py_get),      METH_FASTARGS},
+    {"get_many",    (PyCFunction)dict_py_get_many,     METH_VARARGS},
+    {"get_view",    (PyCFunction)dict_py_get_view,     METH_O},
+    {"contains_many",(PyCFunction)dict_py_contains_many, METH_O},
+    {"setdefault",  FASTCALL_METHOD(dict_py_setdefault), METH_FASTARGS},
+    {"pop",         FASTCALL_METHOD(dict_py_pop),      METH_FASTARGS},
+    {"popitem",     (PyCFunction)dict_py_popitem,      METH_NOARGS},
+    {"update",      (PyCFunction)dict_py_update,       METH_VARARGS | METH_KEYWORDS},
+    {"fromkeys",    (PyCFunction)dict_py_fromkeys,     METH_VARARGS | METH_CLASS},
+    {"from_arrays", (PyCFunction)dict_py_from_arrays,  METH_VARARGS | METH_CLASS},
+    {"update_arrays",(PyCFunction)dict_py_update_arrays, METH_VARARGS},
+    {"save_mapped", (PyCFunction)dict_py_save_mapped,  METH_VARARGS},
+    {"open_mapped", (PyCFunction)dict_py_open_mapped,  METH_VARARGS | METH_CLASS},
+    {"dump",        (PyCFunction)dict_py_dump,         METH_O},
+    {"load",        (PyCFunction)dict_py_load,         METH_O | METH_CLASS},
+    {"clear",       (PyCFunction)dict_py_clear,        METH_NOARGS},
+    {"copy",        (PyCFunction)dict_py_copy,         METH_NOARGS},
+    {"snapshot",    (PyCFunction)dict_py_snapshot,     METH_NOARGS},
+    {"resize",      (PyCFunction)dict_py_resize,       METH_O},
+    {"compact",     (PyCFunction)dict_py_compact,      METH_NOARGS},
+    {"configure",   (PyCFunction)dict_py_configure,    METH_VARARGS | METH_KEYWORDS},
+    {"_stats",      (PyCFunction)dict_py_stats,        METH_NOARGS},
+#if PY_MAJOR_VERSION < 3
+    {"has_key",     (PyCFunction)dict_py_contains,     METH_O},
+    {"keys",        (PyCFunction)dict_py_keys,         METH_NOARGS},
+    {"values",      (PyCFunction)dict_py_values,       METH_NOARGS},
+    {"items",       (PyCFunction)dict_py_items,        METH_NOARGS},
+    {"iterkeys",    (PyCFunction)dict_py_iterkeys,     METH_NOARGS},
+    {"itervalues",  (PyCFunction)dict_py_itervalues,   METH_NOARGS},
+    {"iteritems",   (PyCFunction)dict_py_iteritems,    METH_NOARGS},
+    {"viewkeys",    (PyCFunction)dict_py_viewkeys,     METH_NOARGS},
+    {"viewvalues",  (PyCFunction)dict_py_viewvalues,   METH_NOARGS},
+    {"viewitems",   (PyCFunction)dict_py_viewitems,    METH_NOARGS},
+#else
+    {"keys",        (PyCFunction)dict_py_viewkeys,     METH_NOARGS},
+    {"values",      (PyCFunction)dict_py_viewvalues,   METH_NOARGS},
+    {"items",       (PyCFunction)dict_py_viewitems,    METH_NOARGS},
+#endif
+    {NULL}   /* sentinel */
+};
+
+static PySequenceMethods dict_as_sequence = {
+    0,                             /* sq_length */
+    0,                             /* sq_concat */
+    0,                             /* sq_repeat */
+    0,                             /* sq_item */
+    0,                             /* sq_slice */
+    0,                             /* sq_ass_item */
+    0,                             /* sq_ass_slice */
+    (objobjproc)dict_sq_contains,  /* sq_contains */
+    0,                             /* sq_inplace_concat */
+    0,                             /* sq_inplace_repeat */
+};
+
+static PyMappingMethods dict_as_mapping = {
+    (lenfunc)dict_mp_length,               /* mp_length */
+    (binaryfunc)dict_mp_subscript,         /* mp_subscript */
+    (objobjargproc)dict_mp_ass_subscript,  /* mp_ass_subscript */
+};
+
+PyTypeObject SparseDict_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "_sparsedict.SparseDict",
+    sizeof(SparseDictObject),
+    0,
+    (destructor)dict_tp_dealloc,                /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_compare */
+    (reprfunc)dict_tp_repr,                     /* tp_repr */
+    0,                                          /* tp_as_number */
+    &dict_as_sequence,                          /* tp_as_sequence */
+    &dict_as_mapping,                           /* tp_as_mapping */
+    PyObject_HashNotImplemented,                /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    PyObject_GenericGetAttr,                    /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC | Py_TPFLAGS_BASETYPE, /* tp_flags */
+    0,                                          /* tp_doc */
+    (traverseproc)dict_tp_traverse,             /* tp_traverse */
+    (inquiry)dict_tp_clear,                     /* tp_clear */
+    (richcmpfunc)dict_tp_richcompare,           /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    (getiterfunc)dict_tp_iter,                  /* tp_iter */
+    0,                                          /* tp_iternext */
+    dict_methods,                               /* tp_methods */
+    0,                                          /* tp_members */
+    0,                                          /* tp_getset */
+    0,                                          /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    (initproc)dict_tp_init,                     /* tp_init */
+    PyType_GenericAlloc,                        /* tp_alloc */
+    (newfunc)dict_tp_new,                       /* tp_new */
+    PyObject_GC_Del,                            /* tp_free */
+};
+
+
+/* Key, value and item iterators. */
+
+typedef struct {
+    PyObject_HEAD
+    SparseDictObject *sdict; /* set to NULL when iterator is exhausted */
+    Py_ssize_t num_items; /* original size to track modifications */
+    Py_ssize_t remaining_items;
+    Py_ssize_t next_index;
+    PyObject* pair; /* reusable result tuple for iteritems */
+} dictiterobject;
+
+static PyObject *
+dictiter_new(SparseDictObject *sdict, PyTypeObject *itertype)
+{
+    dictiterobject *di = PyObject_GC_New(dictiterobject, itertype);
+    if (di == NULL)
+        return NULL;
+
+    Py_INCREF(sdict);
+    di->sdict = sdict;
+    ++sdict->num_pins; /* Item positions must stay put. */
+    di->num_items = sdict->num_items;
+    di->next_index = 0;
+    di->remaining_items = SparseDict_SIZE(sdict);
+    if (itertype == &SparseDictIterItem_Type) {
+        di->pair = PyTuple_Pack(2, Py_None, Py_None);
+        if (di->pair == NULL) {
+            Py_DECREF(di);
+            return NULL;
+        }
+    }
+    else
+        di->pair = NULL;
+    PyObject_GC_Track(di);
+    return (PyObject *)di;
+}
+
+/* Release the dict, called when the iterator is exhausted or deallocated. */
+Py_LOCAL_INLINE(void)
+dictiter_release(dictiterobject *di)
+{
+    SparseDictObject *sdict = di->sdict;
+    if (sdict != NULL) {
+        di->sdict = NULL;
+        --sdict->num_pins;
+        Py_DECREF(sdict);
+    }
+}
+
+static void
+dictiter_tp_dealloc(dictiterobject *di)
+{
+    dictiter_release(di);
+    Py_XDECREF(di->pair);
+    PyObject_GC_Del(di);
+}
+
+static int
+dictiter_tp_traverse(dictiterobject *di, visitproc visit, void *arg)
+{
+    Py_VISIT(di->sdict);
+    Py_VISIT(di->pair);
+    return 0;
+}
+
+static PyObject *
+dictiter_len_hint(dictiterobject *di)
+{
+    Py_ssize_t len = 0;
+    if (di->sdict != NULL && di->num_items == di->sdict->num_items)
+        len = di->remaining_items;
+    return PyInt_FromSsize_t(len);
+}
+
+static PyObject *dictiter_iternextkey(dictiterobject *di)
+{
+    dictentry *entry;
+    SparseDictObject *sdict = di->sdict;
+
+    if (sdict == NULL)
+        return NULL;
+    SparseDict_INVARIANT(sdict);
+
+    if (di->num_items != sdict->num_items) {
+        PyErr_SetString(PyExc_RuntimeError, "dictionary changed size during iteration");
+        di->num_items = -1; /* Make this state sticky */
+        return NULL;
+    }
+
+    entry = dict_next(sdict, &di->next_index, 0);
+    if (entry == NULL) {
+        dictiter_release(di);
+        return NULL;
+    }
+
+    return key_box(SparseDict_KEY_TYPE(sdict), entry->key);
+}
+
+static PyObject *dictiter_iternextvalue(dictiterobject *di)
+{
+    dictentry *entry;
+    SparseDictObject *sdict = di->sdict;
+
+    if (sdict == NULL)
+        return NULL;
+    SparseDict_INVARIANT(sdict);
+
+    if (di->num_items != sdict->num_items) {
+        PyErr_SetString(PyExc_RuntimeError, "dictionary changed size during iteration");
+        di->num_items = -1; /* Make this state sticky */
+        return NULL;
+    }
+
+    entry = dict_next(sdict, &di->next_index, 0);
+    if (entry == NULL) {
+        dictiter_release(di);
+        return NULL;
+    }
+
+    --di->remaining_items;
+    return dict_value_box(sdict, entry->value);
+}
+
+static PyObject *dictiter_iternextitem(dictiterobject *di)
+{
+    PyObject *pair = di->pair, *key, *value;
+    dictentry *entry;
+    SparseDictObject *sdict = di->sdict;
+
+    if (sdict == NULL)
+        return NULL;
+    SparseDict_INVARIANT(sdict);
+
+     if (di->num_items != sdict->num_items) {
+        PyErr_SetString(PyExc_RuntimeError, "dictionary changed size during iteration");
+        di->num_items = -1; /* Make this state sticky */
+        return NULL;
+    }
+
+    entry = dict_next(sdict, &di->next_index, 0);
+    if (entry == NULL) {
+        dictiter_release(di);
+        return NULL;
+    }
+
+    value = dict_value_box(sdict, entry->value);
+    if (value == NULL)
+        return NULL;
+    key = key_box(SparseDict_KEY_TYPE(sdict), entry->key);
+    if (key == NULL) {
+        Py_DECREF(value);
+        return NULL;
+    }
+    if (pair->ob_refcnt == 1) {
+        Py_INCREF(pair);
+        Py_DECREF(PyTuple_GET_ITEM(pair, 0));
+        Py_DECREF(PyTuple_GET_ITEM(pair, 1));
+    }
+    else {
+        pair = PyTuple_New(2);
+        if (pair == NULL) {
+            Py_DECREF(key);
+            Py_DECREF(value);
+            return NULL;
+        }
+    }
+    --di->remaining_items;
+    PyTuple_SET_ITEM(pair, 0, key);
+    PyTuple_SET_ITEM(pair, 1, value);
+    return pair;
+}
+
+static PyMethodDef dictiter_methods[] = {
+    {"__length_hint__", (PyCFunction)dictiter_len_hint, METH_NOARGS}, /* undocumented, but harmless */
+    {NULL,              NULL}           /* sentinel */
+};
+
+PyTypeObject SparseDictIterKey_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "SparseDict_KeyIter",                       /* tp_name */
+    sizeof(dictiterobject),                     /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor)dictiter_tp_dealloc,            /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_compare */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    PyObject_GenericGetAttr,                    /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,/* tp_flags */
+    0,                                          /* tp_doc */
+    (traverseproc)dictiter_tp_traverse,         /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    PyObject_SelfIter,                          /* tp_iter */
+    (iternextfunc)dictiter_iternextkey,         /* tp_iternext */
+    dictiter_methods,                           /* tp_methods */
+};
+
+PyTypeObject SparseDictIterValue_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "SparseDict_ValueIter",                     /* tp_name */
+    sizeof(dictiterobject),                     /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor)dictiter_tp_dealloc,            /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_compare */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    PyObject_GenericGetAttr,                    /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    0,                                          /* tp_doc */
+    (traverseproc)dictiter_tp_traverse,         /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    PyObject_SelfIter,                          /* tp_iter */
+    (iternextfunc)dictiter_iternextvalue,       /* tp_iternext */
+    dictiter_methods,                           /* tp_methods */
+};
+
+PyTypeObject SparseDictIterItem_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "SparseDict_ItemIter",                      /* tp_name */
+    sizeof(dictiterobject),                     /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor)dictiter_tp_dealloc,            /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_compare */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    PyObject_GenericGetAttr,                    /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    0,                                          /* tp_doc */
+    (traverseproc)dictiter_tp_traverse,         /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    PyObject_SelfIter,                          /* tp_iter */
+    (iternextfunc)dictiter_iternextitem,        /* tp_iternext */
+    dictiter_methods,                           /* tp_methods */
+};
+
+
+/* Key, value and item views. */
+
+typedef struct {
+    PyObject_HEAD
+    SparseDictObject *sdict;
+} dictviewobject;
+
+
+static void
+dictview_tp_dealloc(dictviewobject *dv)
+{
+    Py_XDECREF(dv->sdict);
+    PyObject_GC_Del(dv);
+}
+
+static int
+dictview_tp_traverse(dictviewobject *dv, visitproc visit, void *arg)
+{
+    Py_VISIT(dv->sdict);
+    return 0;
+}
+
+static PyObject *
+dictview_new(SparseDictObject *dict, PyTypeObject *type)
+{
+    dictviewobject *dv = PyObject_GC_New(dictviewobject, type);
+    if (dv == NULL)
+        return NULL;
+    Py_INCREF(dict);
+    dv->sdict = dict;
+    PyObject_GC_Track(dv);
+    return (PyObject *)dv;
+}
+
+static Py_ssize_t
+dictview_sq_len(dictviewobject *dv)
+{
+    Py_ssize_t len = 0;
+    if (dv->sdict != NULL)
+        len = SparseDict_SIZE(dv->sdict);
+    return len;
+}
+
+/* Return 1 if self is a subset of other, iterating over self;
+   0 if not; -1 if an error occurred. */
+static int
+all_contained_in(PyObject *self, PyObject *other)
+{
+    PyObject *iter = PyObject_GetIter(self);
+    int ok = 1;
+
+    if (iter == NULL)
+        return -1;
+    for (;;) {
+        PyObject *next = PyIter_Next(iter);
+        if (next == NULL) {
+            if (PyErr_Occurred())
+                ok = -1;
+            break;
+        }
+        ok = PySequence_Contains(other, next);
+        Py_DECREF(next);
+        if (ok <= 0)
+            break;
+    }
+    Py_DECREF(iter);
+    return ok;
+}
+
+static PyObject *
+dictview_tp_richcompare(PyObject *self, PyObject *other, int op)
+{
+    Py_ssize_t len_self, len_other;
+    int ok;
+    PyObject *result;
+
+    assert(self != NULL);
+    assert(SparseDictViewSet_Check(self));
+    assert(other != NULL);
+
+    if (!PyAnySet_Check(other) && !SparseDictViewSet_Check(other)) {
+        Py_INCREF(Py_NotImplemented);
+        return Py_NotImplemented;
+    }
+
+    len_self = PyObject_Size(self);
+    if (len_self < 0)
+        return NULL;
+    len_other = PyObject_Size(other);
+    if (len_other < 0)
+        return NULL;
+
+    ok = 0;
+    switch(op) {
+
+    case Py_NE:
+    case Py_EQ:
+        if (len_self == len_other)
+            ok = all_contained_in(self, other);
+        if (op == Py_NE && ok >= 0)
+            ok = !ok;
+        break;
+
+    case Py_LT:
+        if (len_self < len_other)
+            ok = all_contained_in(self, other);
+        break;
+
+      case Py_LE:
+          if (len_self <= len_other)
+              ok = all_contained_in(self, other);
+          break;
+
+    case Py_GT:
+        if (len_self > len_other)
+            ok = all_contained_in(other, self);
+        break;
+
+    case Py_GE:
+        if (len_self >= len_other)
+            ok = all_contained_in(other, self);
+        break;
+
+    }
+    if (ok < 0)
+        return NULL;
+    result = ok ? Py_True : Py_False;
+    Py_INCREF(result);
+    return result;
+}
+
+static PyObject *
+dictview_tp_repr(dictviewobject *dv)
+{
+    PyObject *seq;
+    PyObject *seq_str;
+    PyObject *result;
+
+    seq = PySequence_List((PyObject *)dv);
+    if (seq == NULL)
+        return NULL;
+
+#if PY_MAJOR_VERSION < 3
+    seq_str = PyObject_Repr(seq);
+    result = PyString_FromFormat("%s(%s)", Py_TYPE(dv)->tp_name, PyBytes_AS_STRING(seq_str));
+    Py_DECREF(seq_str);
+#else
+    result = PyString_FromFormat("%s(%R)", Py_TYPE(dv)->tp_name, seq);
+#endif
+    Py_DECREF(seq);
+    return result;
+}
+
+static PyObject *
+dictkeys_tp_iter(dictviewobject *dv)
+{
+    if (dv->sdict == NULL)
+        Py_RETURN_NONE;
+    return dictiter_new(dv->sdict, &SparseDictIterKey_Type);
+}
+
+static int
+dictkeys_sq_contains(dictviewobject *dv, PyObject *obj)
+{
+    if (dv->sdict == NULL)
+        return 0;
+    return dict_sq_contains(dv->sdict, obj);
+}
+
+/* Set operations of the keys and items views
+
+   The operands are iterated and probed directly instead of copying the view into a set
+   and calling its methods. Views, sets and dicts (builtin or SparseDict) are probed as they
+   are, other iterables are made into a temporary set if they have to be probed.
+   The result is a set, a SparseSet, or a SparseDict with the elements as keys and None
+   values, as given by result_type of the methods. SparseSet uses these for its own
+   operators, with SparseSet results. */
+
+static int dictitems_sq_contains(dictviewobject *dv, PyObject *obj);
+
+/* Cheap to probe, and with a known size. */
+#define VIEWSET_PROBED(op) \
+    (SparseDictViewSet_Check(op) || PyAnySet_Check(op) || SparseSet_Check(op) || PyDict_Check(op) || \
+     SparseDict_Check(op))
+
+Py_LOCAL_INLINE(int)
+viewset_contains(PyObject *container, PyObject *item)
+{
+    if (Py_TYPE(container) == &SparseDictKeys_Type)
+        return dictkeys_sq_contains((dictviewobject *)container, item);
+    if (Py_TYPE(container) == &SparseDictItems_Type)
+        return dictitems_sq_contains((dictviewobject *)container, item);
+    if (SparseSet_Check(container))
+        return set_find_key((SparseSetObject *)container, item, 0);
+    return PySequence_Contains(container, item);
+}
+
+Py_LOCAL(PyObject *)
+viewset_new(PyObject *result_type)
+{
+    if (result_type == NULL || result_type == (PyObject *)&PySet_Type)
+        return PySet_New(NULL);
+    if (PyType_Check(result_type) && (PyType_IsSubtype((PyTypeObject *)result_type, &SparseSet_Type) ||
+                                      PyType_IsSubtype((PyTypeObject *)result_type, &SparseDict_Type)))
+        return (PyObject *)((PyTypeObject *)result_type)->tp_new((PyTypeObject *)result_type, NULL, NULL);
+    PyErr_SetString(PyExc_TypeError, "result_type must be set, SparseSet or SparseDict");
+    return NULL;
+}
+
+/* Add the items of iterable to result, only those that are in probe if keep = 1, or only
+   those that are not if keep = 0. probe = NULL adds all of them. Returns -1 on error. */
+Py_LOCAL(int)
+viewset_add(PyObject *result, PyObject *iterable, PyObject *probe, int keep)
+{
+    PyObject *it, *item;
+    int status = 0;
+
+    it = PyObject_GetIter(iterable);
+    if (it == NULL)
+        return -1;
+    while ((item = PyIter_Next(it)) != NULL) {
+        int contains = probe != NULL ? viewset_contains(probe, item) : keep;
+        if (contains == keep) {
+            if (PyAnySet_Check(result))
+                contains = PySet_Add(result, item);
+            else if (SparseSet_Check(result))
+                contains = set_add_key((SparseSetObject *)result, item);
+            else
+                contains = dict_insert((SparseDictObject *)result, item, Py_None);
+        }
+        Py_DECREF(item);
+        if (contains < 0) {
+            status = -1;
+            break;
+        }
+    }
+    Py_DECREF(it);
+    return PyErr_Occurred() ? -1 : status;
+}
+
+/* Temporary set of op if it's not cheap to probe, a new reference to op otherwise. */
+Py_LOCAL(PyObject *)
+viewset_probed(PyObject *op)
+{
+    if (VIEWSET_PROBED(op)) {
+        Py_INCREF(op);
+        return op;
+    }
+    return PySet_New(op);
+}
+
+/* Set operation on self and other, one of which is a view. op is one of '&', '|', '-', '^'. */
+Py_LOCAL(PyObject *)
+viewset_operation(PyObject *self, PyObject *other, int op, PyObject *result_type)
+{
+    PyObject *result, *probed = NULL;
+    int status;
+
+    result = viewset_new(result_type);
+    if (result == NULL)
+        return NULL;
+    switch (op) {
+    case '&':
+        /* Iterate the smaller operand, the intersection is at most its size. */
+        if (!VIEWSET_PROBED(self) || (VIEWSET_PROBED(other) && PyObject_Size(self) <= PyObject_Size(other)))
+            status = viewset_add(result, self, other, 1);
+        else
+            status = viewset_add(result, other, self, 1);
+        break;
+    case '|':
+        status = viewset_add(result, self, NULL, 1);
+        if (status == 0)
+            status = viewset_add(result, other, NULL, 1);
+        break;
+    case '-':
+        probed = viewset_probed(other);
+        status = probed == NULL ? -1 : viewset_add(result, self, probed, 0);
+        break;
+    default:
+        assert(op == '^');
+        /* Both operands are probed, the unprobed one is iterated as its set. */
+        if (!VIEWSET_PROBED(self)) {
+            PyObject *tmp = self;
+            self = other;
+            other = tmp;
+        }
+        probed = viewset_probed(other);
+        status = probed == NULL ? -1 : viewset_add(result, self, probed, 0);
+        if (status == 0)
+            status = viewset_add(result, probed, self, 0);
+        break;
+    }
+    Py_XDECREF(probed);
+    if (status != 0) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    return result;
+}
+
+static PyObject*
+dictviews_nb_sub(PyObject* self, PyObject *other)
+{
+    return viewset_operation(self, other, '-', NULL);
+}
+
+static PyObject*
+dictviews_nb_and(PyObject* self, PyObject *other)
+{
+    return viewset_operation(self, other, '&', NULL);
+}
+
+static PyObject*
+dictviews_nb_or(PyObject* self, PyObject *other)
+{
+    return viewset_operation(self, other, '|', NULL);
+}
+
+static PyObject*
+dictviews_nb_xor(PyObject* self, PyObject *other)
+{
+    return viewset_operation(self, other, '^', NULL);
+}
+
+Py_LOCAL(PyObject *)
+dictviews_method(PyObject *self, PyObject *args, PyObject *kwds, int op, char *format)
+{
+    static char *kwlist[] = {"other", "result_type", 0};
+    PyObject *other, *result_type = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, format, kwlist, &other, &result_type))
+        return NULL;
+    return viewset_operation(self, other, op, result_type);
+}
+
+static PyObject *
+dictviews_py_intersection(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    return dictviews_method(self, args, kwds, '&', "O|O:intersection");
+}
+
+static PyObject *
+dictviews_py_union(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    return dictviews_method(self, args, kwds, '|', "O|O:union");
+}
+
+static PyObject *
+dictviews_py_difference(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    return dictviews_method(self, args, kwds, '-', "O|O:difference");
+}
+
+static PyObject *
+dictviews_py_symmetric_difference(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    return dictviews_method(self, args, kwds, '^', "O|O:symmetric_difference");
+}
+
+static PyObject*
+dictviews_py_isdisjoint(PyObject *self, PyObject *other)
+{
+    PyObject *it;
+    PyObject *item = NULL;
+
+    if (self == other)
+        return PyBool_FromLong(dictview_sq_len((dictviewobject *)self) == 0);
+
+    /* Iterate over the smaller operand if both can be probed, other iterables
+       are iterated in any case. */
+    if (VIEWSET_PROBED(other)) {
+        Py_ssize_t len_self = dictview_sq_len((dictviewobject *)self);
+        Py_ssize_t len_other = PyObject_Size(other);
+        if (len_other == -1)
+            return NULL;
+
+        if ((len_other > len_self)) {
+            PyObject *tmp = other;
+            other = self;
+            self = tmp;
+        }
+    }
+
+    it = PyObject_GetIter(other);
+    if (it == NULL)
+        return NULL;
+
+    while ((item = PyIter_Next(it)) != NULL) {
+        int contains = viewset_contains(self, item);
+        Py_DECREF(item);
+        if (contains == -1) {
+            Py_DECREF(it);
+            return NULL;
+        }
+        if (contains) {
+            Py_DECREF(it);
+            Py_RETURN_FALSE;
+        }
+    }
+    Py_DECREF(it);
+    if (PyErr_Occurred())
+        return NULL; /* PyIter_Next raised an exception. */
+    Py_RETURN_TRUE;
+}
+
+static PyObject *
+dictvalues_tp_iter(dictviewobject *dv)
+{
+    if (dv->sdict == NULL)
+        Py_RETURN_NONE;
+    return dictiter_new(dv->sdict, &SparseDictIterValue_Type);
+}
+
+static PyObject *
+dictitems_tp_iter(dictviewobject *dv)
+{
+    if (dv->sdict == NULL)
+        Py_RETURN_NONE;
+    return dictiter_new(dv->sdict, &SparseDictIterItem_Type);
+}
+
+static int
+dictitems_sq_contains(dictviewobject *dv, PyObject *obj)
+{
+    PyObject *key, *value, *stored;
+    dictentry *entry;
+    int result;
+
+    if (dv->sdict == NULL)
+        return 0;
+    if (!PyTuple_Check(obj) || PyTuple_GET_SIZE(obj) != 2)
+        return 0;
+    key = PyTuple_GET_ITEM(obj, 0);
+    value = PyTuple_GET_ITEM(obj, 1);
+
+    entry = dict_find_key(dv->sdict, key, -1);
+    if (entry == NULL)
+        return -1;
+    if (entry->key == NULL)
+        return 0;
+    stored = dict_value_box(dv->sdict, entry->value);
+    if (stored == NULL)
+        return -1;
+    result = PyObject_RichCompareBool(value, stored, Py_EQ);
+    Py_DECREF(stored);
+    return result;
+}
+
+
+static PySequenceMethods dictkeys_as_sequence = {
+    (lenfunc)dictview_sq_len,           /* sq_length */
+    0,                                  /* sq_concat */
+    0,                                  /* sq_repeat */
+    0,                                  /* sq_item */
+    0,                                  /* sq_slice */
+    0,                                  /* sq_ass_item */
+    0,                                  /* sq_ass_slice */
+    (objobjproc)dictkeys_sq_contains,   /* sq_contains */
+};
+
+static PyNumberMethods dictviews_as_number = {
+    0,                                  /*nb_add*/
+    (binaryfunc)dictviews_nb_sub,       /*nb_subtract*/
+    0,                                  /*nb_multiply*/
+#if PY_MAJOR_VERSION < 3
+    0,                                  /*nb_divide*/
+#endif
+    0,                                  /*nb_remainder*/
+    0,                                  /*nb_divmod*/
+    0,                                  /*nb_power*/
+    0,                                  /*nb_negative*/
+    0,                                  /*nb_positive*/
+    0,                                  /*nb_absolute*/
+    0,                                  /*nb_bool*/
+    0,                                  /*nb_invert*/
+    0,                                  /*nb_lshift*/
+    0,                                  /*nb_rshift*/
+    (binaryfunc)dictviews_nb_and,       /*nb_and*/
+    (binaryfunc)dictviews_nb_xor,       /*nb_xor*/
+    (binaryfunc)dictviews_nb_or,        /*nb_or*/
+};
+
+static PyMethodDef dictviews_methods[] = {
+    {"isdisjoint",      (PyCFunction)dictviews_py_isdisjoint,  METH_O},
+    {"intersection",    (PyCFunction)dictviews_py_intersection, METH_VARARGS | METH_KEYWORDS},
+    {"union",           (PyCFunction)dictviews_py_union,       METH_VARARGS | METH_KEYWORDS},
+    {"difference",      (PyCFunction)dictviews_py_difference,  METH_VARARGS | METH_KEYWORDS},
+    {"symmetric_difference", (PyCFunction)dictviews_py_symmetric_difference, METH_VARARGS | METH_KEYWORDS},
+    {NULL,              NULL}           /* sentinel */
+};
+
+PyTypeObject SparseDictKeys_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "SparseDict_Keys",                          /* tp_name */
+    sizeof(dictviewobject),                     /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor)dictview_tp_dealloc,            /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    (reprfunc)dictview_tp_repr,                 /* tp_repr */
+    &dictviews_as_number,                       /* tp_as_number */
+    &dictkeys_as_sequence,                      /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    PyObject_GenericGetAttr,                    /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC | Py_TPFLAGS_CHECKTYPES,    /* tp_flags */
+    0,                                          /* tp_doc */
+    (traverseproc)dictview_tp_traverse,         /* tp_traverse */
+    0,                                          /* tp_clear */
+    dictview_tp_richcompare,                    /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    (getiterfunc)dictkeys_tp_iter,              /* tp_iter */
+    0,                                          /* tp_iternext */
+    dictviews_methods,                          /* tp_methods */
+};
+
+static PySequenceMethods dictitems_as_sequence = {
+    (lenfunc)dictview_sq_len,           /* sq_length */
+    0,                                  /* sq_concat */
+    0,                                  /* sq_repeat */
+    0,                                  /* sq_item */
+    0,                                  /* sq_slice */
+    0,                                  /* sq_ass_item */
+    0,                                  /* sq_ass_slice */
+    (objobjproc)dictitems_sq_contains,  /* sq_contains */
+};
+
+PyTypeObject SparseDictItems_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "SparseDict_Items",                         /* tp_name */
+    sizeof(dictviewobject),                     /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor)dictview_tp_dealloc,            /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    (reprfunc)dictview_tp_repr,                 /* tp_repr */
+    &dictviews_as_number,                       /* tp_as_number */
+    &dictitems_as_sequence,                     /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    PyObject_GenericGetAttr,                    /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC | Py_TPFLAGS_CHECKTYPES,    /* tp_flags */
+    0,                                          /* tp_doc */
+    (traverseproc)dictview_tp_traverse,         /* tp_traverse */
+    0,                                          /* tp_clear */
+    dictview_tp_richcompare,                    /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    (getiterfunc)dictitems_tp_iter,             /* tp_iter */
+    0,                                          /* tp_iternext */
+    dictviews_methods,                          /* tp_methods */
+};
+
+static PySequenceMethods dictvalues_as_sequence = {
+    (lenfunc)dictview_sq_len,           /* sq_length */
+    0,                                  /* sq_concat */
+    0,                                  /* sq_repeat */
+    0,                                  /* sq_item */
+    0,                                  /* sq_slice */
+    0,                                  /* sq_ass_item */
+    0,                                  /* sq_ass_slice */
+    0,                                  /* sq_contains */
+};
+
+PyTypeObject SparseDictValues_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "SparseDict_Values",                        /* tp_name */
+    sizeof(dictviewobject),                     /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor)dictview_tp_dealloc,            /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    (reprfunc)dictview_tp_repr,                 /* tp_repr */
+    0,                                          /* tp_as_number */
+    &dictvalues_as_sequence,                    /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    PyObject_GenericGetAttr,                    /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    0,                                          /* tp_doc */
+    (traverseproc)dictview_tp_traverse,         /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    (getiterfunc)dictvalues_tp_iter,            /* tp_iter */
+};
+
+/* SparseSet
+
+   Keys-only table on the same sparse blocks as SparseDict: item arrays hold just the key
+   pointers, half the size of dictentry arrays. Deleted keys are NULL like in dicts. Lookups,
+   rehashing and the resize policy are the table_* functions SparseDict uses, with entries of
+   one pointer and no tags. There are no options, the table is resized at once. */
+
+struct _sparsesetobject {
+    PyObject_HEAD
+
+    Py_ssize_t num_blocks;
+    Py_ssize_t num_items;   /* Allocated items, deleted ones included. */
+    Py_ssize_t num_deleted;
+    Py_ssize_t _max_items;  /* Lower bits hold the flags, same as in SparseDictObject. */
+    Py_ssize_t next_index;  /* Index in hash space to resume search for nondeleted keys. Used by pop. */
+    size_t version;         /* Changed by inserts, deletes and resizes. Checked by iterators. */
+    sparseblock *blocks;
+    sparseblock static_blocks[1];
+};
+
+#define SparseSet_CheckExact(op) (Py_TYPE(op) == &SparseSet_Type)
+#define SparseSet_MAX_ITEMS(sset) ((sset)->_max_items & ~FLAGS_MASK)
+#define SparseSet_SIZE(sset) ((sset)->num_items - (sset)->num_deleted)
+/* Operands of the operators, like sets they take only sets (methods take any iterable). */
+#define SparseSet_OPERAND(op) (SparseSet_Check(op) || PyAnySet_Check(op))
+
+#define SparseSet_INIT_NONZERO(sset) \
+    do { \
+        (sset)->num_blocks = 1; \
+        (sset)->_max_items = INITIAL_ITEMS; \
+        (sset)->blocks = (sset)->static_blocks; \
+    } while (0)
+
+#define SparseSet_INIT(sset) \
+    do { \
+        (sset)->num_items = 0; \
+        (sset)->num_deleted = 0; \
+        (sset)->next_index = 0; \
+        ++(sset)->version; \
+        memset((sset)->static_blocks, 0, sizeof(sparseblock)); \
+        SparseSet_INIT_NONZERO(sset); \
+    } while (0)
+
+/* Keys of a SparseSet block. */
+#define KEYBLOCK_KEYS(block) ((PyObject **)(block)->items)
+
+/* Key array size for num_items keys. */
+#define KEYBLOCK_ITEMS_SIZE(num_items) SPARSEBLOCK_ARRAY_SIZE(num_items, sizeof(PyObject *), 0)
+
+/* Dummy "deleted" key used by set_lookup to distinguish "not found" from error (NULL). */
+static PyObject *key_not_found = NULL;
+
+/* Release the keys and the key arrays of the blocks (not the blocks array itself). */
+Py_LOCAL(void)
+set_free_blocks(sparseblock *blocks, Py_ssize_t num_blocks)
+{
+    Py_ssize_t i;
+    int j;
+
+    for (i = 0; i < num_blocks; ++i) {
+        int num_items = SPARSEBLOCK_NUM_ITEMS(&blocks[i]);
+        PyObject **keys = KEYBLOCK_KEYS(&blocks[i]);
+        for (j = 0; j < num_items; ++j)
+            Py_XDECREF(keys[j]);
+        items_free(keys, KEYBLOCK_ITEMS_SIZE(num_items));
+    }
+}
+
+/* Same as dict_next, for the keys. */
+Py_LOCAL_INLINE(PyObject **)
+set_next(SparseSetObject *self, Py_ssize_t *index, int wrap)
+{
+    int j = (int)(*index & INDEX_MASK);
+    Py_ssize_t i = *index >> INDEX_SHIFT;
+    do {
+        for (; i < self->num_blocks; ++i) {
+            sparseblock *block = &self->blocks[i];
+            int num_items = SPARSEBLOCK_NUM_ITEMS(block);
+            PyObject **keys = KEYBLOCK_KEYS(block);
+
+            for (; j < num_items; ++j) {
+                if (keys[j] != NULL) {
+                    *index = (i << INDEX_SHIFT) | (j+1);
+                    return &keys[j];
+                }
+            }
+            j = 0;
+        }
+        i = 0;
+    } while (wrap);
+    *index = self->num_blocks << INDEX_SHIFT;
+    return NULL;
+}
+
+/* Search for the slot of the key, same as dict_lookup. If the key is missing and insert = 1,
+   a deleted slot on the probe path or a new one is returned, already counted as a live
+   item, the caller stores the key in it. */
+Py_LOCAL(PyObject **)
+set_lookup(SparseSetObject *self, PyObject *key, Py_hash_t hash, int insert)
+{
+    tableprobe probe;
+    PyObject **slot;
+    int found;
+
+    found = table_probe(&self->blocks, (size_t)SparseSet_MAX_ITEMS(self) - 1, sizeof(PyObject *), 0,
+                        key, hash, &probe);
+    if (found == PROBE_CHANGED)
+        /* richcmp has changed the set, restart */
+        return set_lookup(self, key, hash, insert);
+    if (found < 0)
+        return NULL;
+    if (found)
+        return probe.slot;
+    if (!insert)
+        return &key_not_found;
+    if (probe.freeslot != NULL) {
+        --self->num_deleted;
+        return probe.freeslot;
+    }
+    slot = sparseblock_insert_slot(&self->blocks[probe.index / SPARSEBLOCK_SIZE], probe.index % SPARSEBLOCK_SIZE,
+                                   hash, 0, sizeof(PyObject *));
+    if (slot != NULL) {
+        *slot = NULL;
+        ++self->num_items;
+    }
+    return slot;
+}
+
+/* Reinsert the keys into a table of new_max_items, dropping the deleted ones. */
+Py_LOCAL(int)
+set_resize(SparseSetObject *self, Py_ssize_t new_max_items)
+{
+    Py_ssize_t num_new_blocks = (new_max_items + SPARSEBLOCK_SIZE - 1) / SPARSEBLOCK_SIZE;
+    sparseblock *new_blocks;
+
+    if (self->_max_items & FLAG_DISABLE_RESIZE) {
+        PyErr_SetString(PyExc_RuntimeError, "SparseSet: resize is not reentrant");
+        return -1;
+    }
+    /* key_hash may run Python code. */
+    self->_max_items |= FLAG_DISABLE_RESIZE;
+
+    new_blocks = PyMem_NEW(sparseblock, num_new_blocks);
+    if (new_blocks == NULL) {
+        self->_max_items &= ~FLAG_DISABLE_RESIZE;
+        PyErr_NoMemory();
+        return -1;
+    }
+    memset(new_blocks, 0, num_new_blocks * sizeof(sparseblock));
+
+    if (table_rehash(self->blocks, self->num_blocks, sizeof(PyObject *), 0, 0,
+                     new_blocks, (size_t)new_max_items - 1, 0, NULL, 0) != 0) {
+        table_free_items(new_blocks, num_new_blocks, sizeof(PyObject *), 0);
+        PyMem_FREE(new_blocks);
+        self->_max_items &= ~FLAG_DISABLE_RESIZE;
+        return -1;
+    }
+
+    table_free_items(self->blocks, self->num_blocks, sizeof(PyObject *), 0);
+    table_set_blocks(&self->blocks, self->static_blocks, new_blocks, num_new_blocks);
+    self->_max_items = new_max_items; /* All flags are cleared */
+    self->num_blocks = num_new_blocks;
+    self->num_items -= self->num_deleted;
+    self->num_deleted = 0;
+    self->next_index = 0;
+    ++self->version;
+    return 0;
+}
+
+/* Resize for delta more keys if needed, same policy as dict_resize_delta. */
+Py_LOCAL(int)
+set_resize_delta(SparseSetObject *self, Py_ssize_t delta)
+{
+    Py_ssize_t new_max_items = table_resize_size(&self->_max_items, SparseSet_SIZE(self), self->num_items, delta);
+
+    return new_max_items != 0 ? set_resize(self, new_max_items) : 0;
+}
+
+/* Add the key with the given hash. Returns 1 if it's added, 0 if the set has it, -1 on error. */
+Py_LOCAL(int)
+set_add_key_hash(SparseSetObject *self, PyObject *key, Py_hash_t hash)
+{
+    PyObject **slot;
+
+    if (set_resize_delta(self, 1) != 0)
+        return -1;
+    slot = set_lookup(self, key, hash, 1);
+    if (slot == NULL)
+        return -1;
+    if (*slot != NULL)
+        return 0;
+    Py_INCREF(key);
+    *slot = key;
+    ++self->version;
+    if (!_PyObject_GC_IS_TRACKED(self) && _PyObject_GC_MAY_BE_TRACKED(key))
+        PyObject_GC_Track(self);
+    return 1;
+}
+
+/* Add the key. Returns 0 on success, -1 on error. */
+Py_LOCAL(int)
+set_add_key(SparseSetObject *self, PyObject *key)
+{
+    Py_hash_t hash = key_hash(key);
+    if (hash == -1)
+        return -1;
+    return set_add_key_hash(self, key, hash) < 0 ? -1 : 0;
+}
+
+/* Find the key, deleting it if remove = 1. Returns 1 if found, 0 if not, -1 on error.
+   Like builtin sets, unhashable sets are looked up as frozensets. */
+Py_LOCAL(int)
+set_find_key(SparseSetObject *self, PyObject *key, int remove)
+{
+    PyObject **slot, *old_key;
+    Py_hash_t hash = key_hash(key);
+    int result;
+
+    if (hash == -1) {
+        if (!(PySet_Check(key) || SparseSet_Check(key)) || !PyErr_ExceptionMatches(PyExc_TypeError))
+            return -1;
+        PyErr_Clear();
+        key = PyFrozenSet_New(key);
+        if (key == NULL)
+            return -1;
+        result = set_find_key(self, key, remove);
+        Py_DECREF(key);
+        return result;
+    }
+    slot = set_lookup(self, key, hash, 0);
+    if (slot == NULL)
+        return -1;
+    if (*slot == NULL)
+        return 0;
+    if (remove) {
+        old_key = *slot;
+        *slot = NULL;
+        ++self->num_deleted;
+        ++self->version;
+        self->_max_items |= FLAG_CONSIDER_SHRINK;
+        Py_DECREF(old_key);
+    }
+    return 1;
+}
+
+Py_LOCAL(void)
+set_clear(SparseSetObject *self)
+{
+    sparseblock *blocks = self->blocks, static_block = self->static_blocks[0];
+    Py_ssize_t num_blocks = self->num_blocks;
+
+    if (blocks == self->static_blocks)
+        blocks = &static_block;
+    SparseSet_INIT(self);
+    set_free_blocks(blocks, num_blocks);
+    if (blocks != &static_block)
+        PyMem_FREE(blocks);
+}
+
+/* Exchange the tables of two sets. */
+Py_LOCAL(void)
+set_swap(SparseSetObject *a, SparseSetObject *b)
+{
+    SparseSetObject tmp;
+
+    tmp.num_blocks = a->num_blocks;
+    tmp.num_items = a->num_items;
+    tmp.num_deleted = a->num_deleted;
+    tmp._max_items = a->_max_items;
+    tmp.blocks = a->blocks == a->static_blocks ? b->static_blocks : a->blocks;
+    tmp.static_blocks[0] = a->static_blocks[0];
+
+    a->num_blocks = b->num_blocks;
+    a->num_items = b->num_items;
+    a->num_deleted = b->num_deleted;
+    a->_max_items = b->_max_items;
+    a->blocks = b->blocks == b->static_blocks ? a->static_blocks : b->blocks;
+    a->static_blocks[0] = b->static_blocks[0];
+
+    b->num_blocks = tmp.num_blocks;
+    b->num_items = tmp.num_items;
+    b->num_deleted = tmp.num_deleted;
+    b->_max_items = tmp._max_items;
+    b->blocks = tmp.blocks;
+    b->static_blocks[0] = tmp.static_blocks[0];
+
+    a->next_index = b->next_index = 0;
+    ++a->version;
+    ++b->version;
+    if (_PyObject_GC_IS_TRACKED(b) && !_PyObject_GC_IS_TRACKED(a))
+        PyObject_GC_Track(a);
+}
+
+/* Add the items of iterable. */
+Py_LOCAL(int)
+set_update(SparseSetObject *self, PyObject *iterable)
+{
+    PyObject *it, *key, **slot;
 
-        if (other_size == 0)
+    if (SparseSet_Check(iterable)) {
+        SparseSetObject *other = (SparseSetObject *)iterable;
+        Py_ssize_t index = 0;
+
+        if (other == self)
             return 0;
-        if (dict_resize_delta(self, other_size - SparseDict_SIZE(self)) != 0)
+        if (set_resize_delta(self, SparseSet_SIZE(other)) != 0)
             return -1;
-
-        while (PyDict_Next(arg, &pos, &key, &value)) {
+        while ((slot = set_next(other, &index, 0)) != NULL) {
+            int status;
+            key = *slot;
             Py_INCREF(key);
-            Py_INCREF(value);
-            if (dict_insert(self, key, value) != 0)
+            status = set_add_key(self, key);
+            Py_DECREF(key);
+            if (status != 0)
                 return -1;
         }
+        return 0;
     }
-    else {
-        /* Do it the generic, slower way */
-        PyObject *keys = PyMapping_Keys(arg);
-        PyObject *iter;
-        PyObject *key, *value;
-        int status;
-
-        if (keys == NULL)
+    if (PyAnySet_Check(iterable) || PyDict_Check(iterable) || PyList_CheckExact(iterable) ||
+            PyTuple_CheckExact(iterable)) {
+        /* Room for all, not too much more than the set needs if it has them. */
+        if (set_resize_delta(self, PyObject_Size(iterable)) != 0)
             return -1;
-
-        iter = PyObject_GetIter(keys);
-        Py_DECREF(keys);
-        if (iter == NULL)
+    }
+    it = PyObject_GetIter(iterable);
+    if (it == NULL)
+        return -1;
+    while ((key = PyIter_Next(it)) != NULL) {
+        int status = set_add_key(self, key);
+        Py_DECREF(key);
+        if (status != 0) {
+            Py_DECREF(it);
             return -1;
-
-        while ((key = PyIter_Next(iter)) != NULL) {
-            value = PyObject_GetItem(arg, key);
-            if (value == NULL) {
-                Py_DECREF(iter);
-                Py_DECREF(key);
-                return -1;
-            }
-            status = dict_insert(self, key, value);
-            Py_DECREF(key);
-            Py_DECREF(value);
-            if (status < 0) {
-                Py_DECREF(iter);
-                return -1;
-            }
         }
-        Py_DECREF(iter);
-        if (PyErr_Occurred())
-            /* Iterator completed, via error */
-            return -1;
     }
-    return 0;
+    Py_DECREF(it);
+    return PyErr_Occurred() ? -1 : 0;
 }
 
-Py_LOCAL_INLINE(int)
-dict_update_common(SparseDictObject *self, PyObject *args, PyObject *kwds, char *methname)
+static PyObject *
+set_tp_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
-    PyObject *arg = NULL;
-    int result = 0;
-
-    /* args == NULL means they were consubed by the caller */
-    if (args != NULL && !PyArg_UnpackTuple(args, methname, 0, 1, &arg))
-        return -1;
+    SparseSetObject *self;
 
-    if (arg != NULL) {
-        if (PyObject_HasAttrString(arg, "keys"))
-            result = dict_merge(self, arg);
-        else
-            result = dict_merge_seq2(self, arg);
+    self = (SparseSetObject *)type->tp_alloc(type, 0);
+    if (self != NULL) {
+        /* tp_alloc zero-initialized out struct */
+        SparseSet_INIT_NONZERO(self);
+        /* The object has been implicitely tracked by tp_alloc */
+        if (type == &SparseSet_Type)
+            PyObject_GC_UnTrack(self);
     }
+    return (PyObject *)self;
+}
 
-    if (result == 0 && kwds != NULL) {
-        if (PyArg_ValidateKeywordArguments(kwds))
-            result = dict_merge(self, kwds);
-        else
-            result = -1;
+/* Copy of the table, slot for slot, as a new set of the given type. */
+Py_LOCAL(PyObject *)
+set_copy(SparseSetObject *self, PyTypeObject *type)
+{
+    SparseSetObject *copy = (SparseSetObject *)set_tp_new(type, NULL, NULL);
+    Py_ssize_t b;
+    int j;
+
+    if (copy == NULL)
+        return NULL;
+    if (self->num_blocks > 1) {
+        copy->blocks = PyMem_NEW(sparseblock, self->num_blocks);
+        if (copy->blocks == NULL) {
+            copy->blocks = copy->static_blocks;
+            Py_DECREF(copy);
+            return PyErr_NoMemory();
+        }
+        memset(copy->blocks, 0, self->num_blocks * sizeof(sparseblock));
     }
-    return result;
+    copy->num_blocks = self->num_blocks;
+    copy->_max_items = SparseSet_MAX_ITEMS(self);
+    for (b = 0; b < self->num_blocks; ++b) {
+        sparseblock *block = &self->blocks[b];
+        int num_items = SPARSEBLOCK_NUM_ITEMS(block);
+        PyObject **keys;
+
+        if (num_items == 0)
+            continue;
+        keys = (PyObject **)items_alloc(KEYBLOCK_ITEMS_SIZE(num_items));
+        if (keys == NULL) {
+            Py_DECREF(copy);
+            return PyErr_NoMemory();
+        }
+        memcpy(keys, block->items, num_items * sizeof(PyObject *));
+        for (j = 0; j < num_items; ++j)
+            Py_XINCREF(keys[j]);
+        copy->blocks[b].items = (dictentry *)keys;
+        copy->blocks[b].bitmap = block->bitmap;
+    }
+    copy->num_items = self->num_items;
+    copy->num_deleted = self->num_deleted;
+    if (_PyObject_GC_IS_TRACKED(self) && !_PyObject_GC_IS_TRACKED(copy))
+        PyObject_GC_Track(copy);
+    return (PyObject *)copy;
 }
 
-/* Return 1 if dicts equal, 0 if not, -1 if error.
- * Gets out as soon as any difference is detected.
- * Uses only Py_EQ comparison.
- */
+/* Return 1 if every item of a, which must be a set or a view, is in b. */
 Py_LOCAL(int)
-dict_equal(SparseDictObject *self, PyObject *arg)
+set_issubset(PyObject *a, PyObject *b)
 {
-    SparseDictObject *other = NULL;
+    PyObject *probed, *it, *item;
     int result = 1;
 
-    SparseDict_INVARIANT(self);
-
-    if (SparseDict_Check(arg)) {
-        other = (SparseDictObject *)arg;
-        if (SparseDict_SIZE(self) != SparseDict_SIZE(other))
-            return 0;
+    if (a == b)
+        return 1;
+    probed = viewset_probed(b);
+    if (probed == NULL)
+        return -1;
+    if (PyObject_Size(a) > PyObject_Size(probed)) {
+        Py_DECREF(probed);
+        return 0;
     }
-    else if (PyDict_Check(arg)) {
-        if (SparseDict_SIZE(self) != PyDict_Size(arg))
-            return 0;
+    it = PyObject_GetIter(a);
+    if (it == NULL) {
+        Py_DECREF(probed);
+        return -1;
     }
-    else {
-        /* Unsupported type. */
-        return 0;
+    while ((item = PyIter_Next(it)) != NULL) {
+        result = viewset_contains(probed, item);
+        Py_DECREF(item);
+        if (result != 1)
+            break;
     }
+    Py_DECREF(it);
+    Py_DECREF(probed);
+    return PyErr_Occurred() ? -1 : result;
+}
 
-    self->_max_items |= FLAG_DISABLE_RESIZE;
-    SparseDict_FOR(self, entry)
-        PyObject *key = entry.key;
-        PyObject *value = entry.value;
-        PyObject *value2;
+/* Delete the items of iterable. */
+Py_LOCAL(int)
+set_difference_update(SparseSetObject *self, PyObject *iterable)
+{
+    PyObject *it, *key;
 
-        Py_INCREF(key);
-        Py_INCREF(value);
-        if (other != NULL) {
-            /* comparing with another SparseDict */
-            dictentry *entry2 = (other->lookup)(other, key, -1, 0);
-            Py_DECREF(key);
-            if (entry2 == NULL || entry2->key == NULL) {
-                Py_DECREF(value);
-                result = (entry2 == NULL) ? -1 : 0;
-                break;
-            }
-            value2 = entry2->value;
-        }
-        else {
-            /* comparing with PyDictObject */
-            value2 = PyDict_GetItemWithError(arg, key);
-            Py_DECREF(key);
-            if (value2 == NULL) {
-                Py_DECREF(value);
-                result = PyErr_Occurred() ? -1 : 0;
-                break;
-            }
+    if ((PyObject *)self == iterable) {
+        set_clear(self);
+        return 0;
+    }
+    it = PyObject_GetIter(iterable);
+    if (it == NULL)
+        return -1;
+    while ((key = PyIter_Next(it)) != NULL) {
+        int status = set_find_key(self, key, 1);
+        Py_DECREF(key);
+        if (status < 0) {
+            Py_DECREF(it);
+            return -1;
         }
-
-        result = PyObject_RichCompareBool(value, value2, Py_EQ);
-        Py_DECREF(value);
-        if (result <= 0)  /* error or not equal */
-            break;
-    SparseDict_ENDFOR(self, 0)
-    
-    self->_max_items &= ~FLAG_DISABLE_RESIZE;
-    return result;
+    }
+    Py_DECREF(it);
+    return PyErr_Occurred() ? -1 : 0;
 }
 
-/* SparseDict type methods */
+/* Keep only the items that are also in other. */
+Py_LOCAL(int)
+set_intersection_update(SparseSetObject *self, PyObject *other)
+{
+    PyObject *result;
 
-static SparseDictObject *
-dict_tp_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+    if ((PyObject *)self == other)
+        return 0;
+    result = viewset_operation((PyObject *)self, other, '&', (PyObject *)&SparseSet_Type);
+    if (result == NULL)
+        return -1;
+    set_swap(self, (SparseSetObject *)result);
+    Py_DECREF(result);
+    return 0;
+}
+
+/* Delete the items of iterable that the set has, add the others. */
+Py_LOCAL(int)
+set_symmetric_difference_update(SparseSetObject *self, PyObject *iterable)
 {
-    SparseDictObject *self;
+    PyObject *probed, *it, *key;
+    int status = 0;
 
-    self = (SparseDictObject *)type->tp_alloc(type, 0);
-    if (self != NULL) {
-        /* tp_alloc zero-initialized out struct */
-        SparseDict_INIT_NONZERO(self);
-        self->lookup = dict_lookup_string;
-        /* The object has been implicitely tracked by tp_alloc */
-        if (type == &SparseDict_Type)
-            PyObject_GC_UnTrack(self);
+    if ((PyObject *)self == iterable) {
+        set_clear(self);
+        return 0;
     }
-    return self;
+    /* Each item of iterable once. */
+    probed = viewset_probed(iterable);
+    if (probed == NULL)
+        return -1;
+    it = PyObject_GetIter(probed);
+    if (it == NULL) {
+        Py_DECREF(probed);
+        return -1;
+    }
+    while ((key = PyIter_Next(it)) != NULL) {
+        status = set_find_key(self, key, 1);
+        if (status == 0)
+            status = set_add_key(self, key);
+        Py_DECREF(key);
+        if (status < 0)
+            break;
+    }
+    Py_DECREF(it);
+    Py_DECREF(probed);
+    return status < 0 || PyErr_Occurred() ? -1 : 0;
 }
 
+/* SparseSet type methods */
+
 static int
-dict_tp_init(SparseDictObject *self, PyObject *args, PyObject *kwds)
+set_tp_init(SparseSetObject *self, PyObject *args, PyObject *kwds)
 {
-    if (PyTuple_CheckExact(args) &&
-        PyTuple_GET_SIZE(args) == 1 &&
-        PyInt_Check(PyTuple_GET_ITEM(args, 0))) {
+    PyObject *iterable = NULL;
 
-        Py_ssize_t size_hint = PyInt_AsSsize_t(PyTuple_GET_ITEM(args, 0));
-        if (size_hint == -1 && PyErr_Occurred())
-            return -1;
-        if (dict_resize_delta(self, size_hint) != 0)
-            return -1;
-        args = NULL; /* do not pass args to dict_update_common */
+    if (kwds != NULL && PyDict_Size(kwds) != 0) {
+        PyErr_SetString(PyExc_TypeError, "SparseSet() takes no keyword arguments");
+        return -1;
     }
-
-    return dict_update_common(self, args, kwds, "SparseDict");
+    if (!PyArg_UnpackTuple(args, "SparseSet", 0, 1, &iterable))
+        return -1;
+    if (SparseSet_SIZE(self) != 0 || self->num_items != 0)
+        set_clear(self);
+    if (iterable == NULL)
+        return 0;
+    return set_update(self, iterable);
 }
 
 static void
-dict_tp_dealloc(SparseDictObject *self)
+set_tp_dealloc(SparseSetObject *self)
 {
-    SparseDict_INVARIANT(self);
-
     if (_PyObject_GC_IS_TRACKED(self))
         PyObject_GC_UnTrack(self);
-    /* XXX: Py_TRASHCAN_SAFE_BEGIN ? */
-
-    /* with refcnt of 0 we don't need to protect from modifications. */
-    SparseDict_FOR(self, entry)
-        Py_DECREF(entry.key);
-        Py_DECREF(entry.value);
-        /* destructive FOR frees the blocks for us */
-    SparseDict_ENDFOR(self, 1)
-
+    set_free_blocks(self->blocks, self->num_blocks);
+    if (self->blocks != self->static_blocks)
+        PyMem_FREE(self->blocks);
     Py_TYPE(self)->tp_free((PyObject *)self);
 }
 
 static PyObject *
-dict_tp_repr(SparseDictObject *self)
+set_tp_repr(SparseSetObject *self)
 {
     Py_ssize_t i;
-    PyObject *s, *temp, *colon = NULL;
-    PyObject *pieces = NULL, *result = NULL;
+    PyObject *s, *keys, *result = NULL;
 
     i = Py_ReprEnter((PyObject *)self);
     if (i != 0)
-        return i > 0 ? PyString_FromString("SparseDict(...)") : NULL;
+        return i > 0 ? PyString_FromString("SparseSet(...)") : NULL;
 
-    if (SparseDict_SIZE(self) == 0) {
-        result = PyString_FromString("SparseDict()");
+    if (SparseSet_SIZE(self) == 0) {
+        result = PyString_FromString("SparseSet()");
         goto Done;
     }
-
-    pieces = PyList_New(0);
-    if (pieces == NULL)
-        goto Done;
-
-    colon = PyString_FromString(": ");
-    if (colon == NULL)
-        goto Done;
-
-    /* Do repr() on each key+value pair, and insert ": " between them.
-       Note that repr may mutate the dict. */
-    SparseDict_FOR(self, entry)
-        int status;
-        /* Prevent repr from deleting value during key format. */
-        Py_INCREF(entry.value);
-        s = PyObject_Repr(entry.key);
-        PyString_Concat(&s, colon);
-        temp = PyObject_Repr(entry.value);
-        PyString_Concat(&s, temp);
-        Py_XDECREF(temp);
-        Py_DECREF(entry.value);
-        if (s == NULL)
-            goto Done;
-        status = PyList_Append(pieces, s);
-        Py_DECREF(s);  /* append created a new ref */
-        if (status < 0)
-            goto Done;
-    SparseDict_ENDFOR(self, 0)
-
-    /* Add "{}" decorations to the first and last items. */
-    assert(PyList_GET_SIZE(pieces) > 0);
-    s = PyString_FromString("SparseDict({");
-    if (s == NULL)
-        goto Done;
-    temp = PyList_GET_ITEM(pieces, 0);
-    PyString_Concat(&s, temp);
-    Py_XDECREF(temp);
-    PyList_SET_ITEM(pieces, 0, s);
-    if (s == NULL)
-        goto Done;
-
-    s = PyString_FromString("})");
-    if (s == NULL)
-        goto Done;
-    temp = PyList_GET_ITEM(pieces, PyList_GET_SIZE(pieces) - 1);
-    PyString_Concat(&temp, s);
-    Py_XDECREF(s);
-    PyList_SET_ITEM(pieces, PyList_GET_SIZE(pieces) - 1, temp);
-    if (temp == NULL)
-        goto Done;
-
-    /* Paste them all together with ", " between. */
-    s = PyString_FromString(", ");
+    keys = PySequence_List((PyObject *)self);
+    if (keys == NULL)
+        goto Done;
+    s = PyObject_Repr(keys);
+    Py_DECREF(keys);
     if (s == NULL)
         goto Done;
-    result = _PyString_Join(s, pieces);
+    result = PyString_FromString("SparseSet(");
+    PyString_Concat(&result, s);
     Py_DECREF(s);
+    if (result == NULL)
+        goto Done;
+    s = PyString_FromString(")");
+    PyString_Concat(&result, s);
+    Py_XDECREF(s);
 
 Done:
-    Py_XDECREF(pieces);
-    Py_XDECREF(colon);
     Py_ReprLeave((PyObject *)self);
     return result;
 }
 
 static PyObject *
-dict_tp_richcompare(PyObject *arg1, PyObject *arg2, int op)
+set_tp_richcompare(PyObject *arg1, PyObject *arg2, int op)
 {
+    Py_ssize_t len1, len2;
     int cmp;
-    PyObject *result;
-
-    if (op == Py_EQ || op == Py_NE) {
-        if (SparseDict_Check(arg1))
-            cmp = dict_equal((SparseDictObject *)arg1, arg2);
-        else if (SparseDict_Check(arg2))
-            cmp = dict_equal((SparseDictObject *)arg2, arg1);
-        else
-            cmp = 0;
 
-        if (cmp < 0)
-            return NULL;
-        result = (cmp == (op == Py_EQ)) ? Py_True : Py_False;
+    if (!SparseSet_OPERAND(arg1) || !SparseSet_OPERAND(arg2)) {
+        Py_INCREF(Py_NotImplemented);
+        return Py_NotImplemented;
     }
-    else {
-#if PY_MAJOR_VERSION < 3
-        PyErr_SetString(PyExc_TypeError, "SparseDict does not support order comparison");
-        return NULL;
-#else
-        result = Py_NotImplemented;
-#endif
+    len1 = PyObject_Size(arg1);
+    len2 = PyObject_Size(arg2);
+    switch (op) {
+    case Py_EQ:
+    case Py_NE:
+        cmp = len1 == len2 ? set_issubset(arg1, arg2) : 0;
+        if (cmp >= 0 && op == Py_NE)
+            cmp = !cmp;
+        break;
+    case Py_LT:
+        cmp = len1 < len2 ? set_issubset(arg1, arg2) : 0;
+        break;
+    case Py_LE:
+        cmp = set_issubset(arg1, arg2);
+        break;
+    case Py_GT:
+        cmp = len1 > len2 ? set_issubset(arg2, arg1) : 0;
+        break;
+    default:
+        cmp = set_issubset(arg2, arg1);
+        break;
     }
-    Py_INCREF(result);
-    return result;
+    if (cmp < 0)
+        return NULL;
+    return PyBool_FromLong(cmp);
 }
 
 static int
-dict_tp_traverse(SparseDictObject *self, visitproc visit, void *arg)
+set_tp_traverse(SparseSetObject *self, visitproc visit, void *arg)
 {
-    SparseDict_FOR(self, entry)
-        Py_VISIT(entry.key);
-        Py_VISIT(entry.value);
-    SparseDict_ENDFOR(self, 0)
+    Py_ssize_t b;
+    int j;
+
+    for (b = 0; b < self->num_blocks; ++b) {
+        sparseblock *block = &self->blocks[b];
+        for (j = 0; j < SPARSEBLOCK_NUM_ITEMS(block); ++j)
+            Py_VISIT(KEYBLOCK_KEYS(block)[j]);
+    }
     return 0;
 }
 
 static int
-dict_tp_clear(SparseDictObject *self)
+set_tp_clear(SparseSetObject *self)
 {
-    /* Actually we only need blocks and num_blocks. */
-    SparseDictObject old_self = *self;
-    SparseDict_INIT(self);
-
-    SparseDict_FOR(&old_self, entry)
-        Py_DECREF(entry.key);
-        Py_DECREF(entry.value);
-    SparseDict_ENDFOR(self, 1)
+    set_clear(self);
     return 0;
 }
 
+static PyObject *setiter_new(SparseSetObject *sset);
+
 static PyObject *
-dict_tp_iter(SparseDictObject *dict)
+set_tp_iter(SparseSetObject *self)
 {
-    return dictiter_new(dict, &SparseDictIterKey_Type);
+    return setiter_new(self);
 }
 
 static Py_ssize_t
-dict_mp_length(SparseDictObject *self)
+set_sq_length(SparseSetObject *self)
 {
-    return SparseDict_SIZE(self);
+    return SparseSet_SIZE(self);
+}
+
+static int
+set_sq_contains(SparseSetObject *self, PyObject *key)
+{
+    return set_find_key(self, key, 0);
 }
 
 static PyObject *
-dict_mp_subscript(SparseDictObject *self, PyObject *key)
+set_nb_sub(PyObject *self, PyObject *other)
 {
-    dictentry *entry = (self->lookup)(self, key, -1, 0);
-    if (entry == NULL)
-        return NULL;
-    if (entry->key == NULL) {
-        set_key_error(key);
-        return NULL;
+    if (!SparseSet_OPERAND(self) || !SparseSet_OPERAND(other)) {
+        Py_INCREF(Py_NotImplemented);
+        return Py_NotImplemented;
     }
-    Py_INCREF(entry->value);
-    return entry->value;
+    return viewset_operation(self, other, '-', (PyObject *)&SparseSet_Type);
 }
 
-static int
-dict_mp_ass_subscript(SparseDictObject *self, PyObject *key, PyObject *value)
+static PyObject *
+set_nb_and(PyObject *self, PyObject *other)
 {
-    if (value != NULL)
-        return dict_insert(self, key, value);
-    else
-        return dict_delete(self, key);
+    if (!SparseSet_OPERAND(self) || !SparseSet_OPERAND(other)) {
+        Py_INCREF(Py_NotImplemented);
+        return Py_NotImplemented;
+    }
+    return viewset_operation(self, other, '&', (PyObject *)&SparseSet_Type);
 }
 
-/* Return 1 if `key` is in dict `op`, 0 if not, and -1 on error. */
-int
-dict_sq_contains(SparseDictObject *self, PyObject *key)
+static PyObject *
+set_nb_xor(PyObject *self, PyObject *other)
 {
-    dictentry *entry = (self->lookup)(self, key, -1, 0);
-    if (entry == NULL)
-        return -1;
-    return (entry->key != NULL);
+    if (!SparseSet_OPERAND(self) || !SparseSet_OPERAND(other)) {
+        Py_INCREF(Py_NotImplemented);
+        return Py_NotImplemented;
+    }
+    return viewset_operation(self, other, '^', (PyObject *)&SparseSet_Type);
 }
 
-/* SparseDict public methods */
+static PyObject *
+set_nb_or(PyObject *self, PyObject *other)
+{
+    if (!SparseSet_OPERAND(self) || !SparseSet_OPERAND(other)) {
+        Py_INCREF(Py_NotImplemented);
+        return Py_NotImplemented;
+    }
+    return viewset_operation(self, other, '|', (PyObject *)&SparseSet_Type);
+}
+
+/* In-place operators, update is one of the set_*_update functions. */
+Py_LOCAL(PyObject *)
+set_inplace(SparseSetObject *self, PyObject *other, int (*update)(SparseSetObject *, PyObject *))
+{
+    if (!SparseSet_OPERAND(other)) {
+        Py_INCREF(Py_NotImplemented);
+        return Py_NotImplemented;
+    }
+    if (update(self, other) != 0)
+        return NULL;
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
 
 static PyObject *
-dict_py_keys(SparseDictObject *self)
+set_nb_isub(SparseSetObject *self, PyObject *other)
 {
-    PyObject *list;
-    Py_ssize_t num, i;
+    return set_inplace(self, other, set_difference_update);
+}
 
-Again:
-    num = SparseDict_SIZE(self);
-    list = PyList_New(num);
-    if (list == NULL)
+static PyObject *
+set_nb_iand(SparseSetObject *self, PyObject *other)
+{
+    return set_inplace(self, other, set_intersection_update);
+}
+
+static PyObject *
+set_nb_ixor(SparseSetObject *self, PyObject *other)
+{
+    return set_inplace(self, other, set_symmetric_difference_update);
+}
+
+static PyObject *
+set_nb_ior(SparseSetObject *self, PyObject *other)
+{
+    return set_inplace(self, other, set_update);
+}
+
+/* SparseSet public methods */
+
+static PyObject *
+set_py_add(SparseSetObject *self, PyObject *key)
+{
+    if (set_add_key(self, key) != 0)
         return NULL;
-    if (num != SparseDict_SIZE(self)) {
-        /* Durnit. The allocations caused the dict to resize. */
-        Py_DECREF(list);
-        goto Again;
-    }
+    Py_RETURN_NONE;
+}
 
-    i = 0;
-    SparseDict_FOR(self, entry)
-        Py_INCREF(entry.key);
-        PyList_SET_ITEM(list, i, entry.key);
-        ++i;
-    SparseDict_ENDFOR(self, 0)
+static PyObject *
+set_py_discard(SparseSetObject *self, PyObject *key)
+{
+    if (set_find_key(self, key, 1) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
 
-    assert(i == num);
-    return list;
+static PyObject *
+set_py_remove(SparseSetObject *self, PyObject *key)
+{
+    int found = set_find_key(self, key, 1);
+    if (found < 0)
+        return NULL;
+    if (found == 0) {
+        set_key_error(key);
+        return NULL;
+    }
+    Py_RETURN_NONE;
 }
 
 static PyObject *
-dict_py_values(SparseDictObject *self)
+set_py_contains(SparseSetObject *self, PyObject *key)
 {
-    PyObject *list;
-    Py_ssize_t num, i;
+    int found = set_find_key(self, key, 0);
+    if (found < 0)
+        return NULL;
+    return PyBool_FromLong(found);
+}
 
-Again:
-    num = SparseDict_SIZE(self);
-    list = PyList_New(num);
-    if (list == NULL)
+static PyObject *
+set_py_pop(SparseSetObject *self)
+{
+    PyObject **slot, *key;
+
+    if (SparseSet_SIZE(self) == 0) {
+        PyErr_SetString(PyExc_KeyError, "pop from an empty SparseSet");
         return NULL;
-    if (num != SparseDict_SIZE(self)) {
-        /* Durnit. The allocations caused the dict to resize. */
-        Py_DECREF(list);
-        goto Again;
     }
+    slot = set_next(self, &self->next_index, 1);
+    key = *slot;
+    *slot = NULL;
+    ++self->num_deleted;
+    ++self->version;
+    self->_max_items |= FLAG_CONSIDER_SHRINK;
+    return key;
+}
 
-    i = 0;
-    SparseDict_FOR(self, entry)
-        Py_INCREF(entry.value);
-        PyList_SET_ITEM(list, i, entry.value);
-        ++i;
-    SparseDict_ENDFOR(self, 0)
+static PyObject *
+set_py_clear(SparseSetObject *self)
+{
+    set_clear(self);
+    Py_RETURN_NONE;
+}
 
-    assert(i == num);
-    return list;
+static PyObject *
+set_py_copy(SparseSetObject *self)
+{
+    return set_copy(self, &SparseSet_Type);
 }
 
 static PyObject *
-dict_py_items(SparseDictObject *self)
+set_py_update(SparseSetObject *self, PyObject *args)
 {
-    PyObject *list, *pair;
-    Py_ssize_t i, num;
+    Py_ssize_t i;
 
-    /* Preallocate the list of tuples, to avoid GC during the loop. */
-Again:
-    num = SparseDict_SIZE(self);
-    list = PyList_New(num);
-    if (list == NULL)
-        return NULL;
-    for (i = 0; i < num; i++) {
-        pair = PyTuple_New(2);
-        if (pair == NULL) {
-            Py_DECREF(list);
+    for (i = 0; i < PyTuple_GET_SIZE(args); ++i)
+        if (set_update(self, PyTuple_GET_ITEM(args, i)) != 0)
             return NULL;
-        }
-        PyList_SET_ITEM(list, i, pair);
-    }
-    if (num != SparseDict_SIZE(self)) {
-        Py_DECREF(list);
-        goto Again;
-    }
-    /* Nothing we do below makes any function calls. */
-    i = 0;
-    SparseDict_FOR(self, entry)
-        pair = PyList_GET_ITEM(list, i);
-        Py_INCREF(entry.key);
-        Py_INCREF(entry.value);
-        PyTuple_SET_ITEM(pair, 0, entry.key);
-        PyTuple_SET_ITEM(pair, 1, entry.value);
-        i++;
-    SparseDict_ENDFOR(self, 0)
+    Py_RETURN_NONE;
+}
 
-    assert(i == num);
-    return list;
+static PyObject *
+set_py_intersection_update(SparseSetObject *self, PyObject *args)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < PyTuple_GET_SIZE(args); ++i)
+        if (set_intersection_update(self, PyTuple_GET_ITEM(args, i)) != 0)
+            return NULL;
+    Py_RETURN_NONE;
 }
 
 static PyObject *
-dict_py_fromkeys(PyObject *cls, PyObject *args)
+set_py_difference_update(SparseSetObject *self, PyObject *args)
 {
-    /* TODO: prealloc */
-    SparseDictObject *self;
-    PyObject *seq, *it, *key, *value = Py_None;
+    Py_ssize_t i;
 
-    if (!PyArg_UnpackTuple(args, "fromkeys", 1, 2, &seq, &value))
-        return NULL;
+    for (i = 0; i < PyTuple_GET_SIZE(args); ++i)
+        if (set_difference_update(self, PyTuple_GET_ITEM(args, i)) != 0)
+            return NULL;
+    Py_RETURN_NONE;
+}
 
-    self = (SparseDictObject *)PyObject_CallObject(cls, NULL);
-    if (self == NULL)
+static PyObject *
+set_py_symmetric_difference_update(SparseSetObject *self, PyObject *other)
+{
+    if (set_symmetric_difference_update(self, other) != 0)
         return NULL;
+    Py_RETURN_NONE;
+}
 
-    it = PyObject_GetIter(seq);
-    if (it == NULL){
-        Py_DECREF(self);
-        return NULL;
-    }
-    while ((key = PyIter_Next(it)) != NULL) {
-        int status = PyObject_SetItem((PyObject *)self, key, value);
-        Py_DECREF(key);
-        if (status < 0)
-            break;
-    }
-    if (PyErr_Occurred()) {
-        Py_DECREF(self);
-        Py_DECREF(it);
-        return NULL;
+/* Copy of self updated with each of the args by update. */
+Py_LOCAL(PyObject *)
+set_updated_copy(SparseSetObject *self, PyObject *args, int (*update)(SparseSetObject *, PyObject *))
+{
+    Py_ssize_t i;
+    PyObject *result = set_copy(self, &SparseSet_Type);
+
+    for (i = 0; result != NULL && i < PyTuple_GET_SIZE(args); ++i) {
+        if (update((SparseSetObject *)result, PyTuple_GET_ITEM(args, i)) != 0) {
+            Py_DECREF(result);
+            return NULL;
+        }
     }
-    Py_DECREF(it);
-    return (PyObject *)self;
+    return result;
 }
 
 static PyObject *
-dict_py_update(SparseDictObject *self, PyObject *args, PyObject *kwds)
+set_py_union(SparseSetObject *self, PyObject *args)
 {
-    if (dict_update_common(self, args, kwds, "update") != -1)
-        Py_RETURN_NONE;
-    return NULL;
+    return set_updated_copy(self, args, set_update);
 }
 
 static PyObject *
-dict_py_copy(SparseDictObject *self)
+set_py_intersection(SparseSetObject *self, PyObject *args)
 {
-    /* XXX: this is probably wrong */
-    SparseDictObject *copy = (SparseDictObject *)Py_TYPE(self)->tp_new(Py_TYPE(self), NULL, NULL);
-    if (copy == NULL)
-        return NULL;
+    PyObject *result, *other;
+    Py_ssize_t i;
 
-    if (dict_merge(copy, (PyObject *)self) != 0) {
-        Py_DECREF(copy);
-        return NULL;
+    if (PyTuple_GET_SIZE(args) == 0)
+        return set_copy(self, &SparseSet_Type);
+    /* Only the first intersection is built from self, the rest from the smaller result. */
+    result = viewset_operation((PyObject *)self, PyTuple_GET_ITEM(args, 0), '&', (PyObject *)&SparseSet_Type);
+    for (i = 1; result != NULL && i < PyTuple_GET_SIZE(args); ++i) {
+        other = result;
+        result = viewset_operation(other, PyTuple_GET_ITEM(args, i), '&', (PyObject *)&SparseSet_Type);
+        Py_DECREF(other);
     }
-    return (PyObject *) copy;
+    return result;
 }
 
 static PyObject *
-dict_py_contains(SparseDictObject *self, PyObject *key)
+set_py_difference(SparseSetObject *self, PyObject *args)
 {
-    dictentry *entry = (self->lookup)(self, key, -1, 0);
-    if (entry == NULL)
-        return NULL;
-    return PyBool_FromLong(entry->key != NULL);
+    return set_updated_copy(self, args, set_difference_update);
 }
 
 static PyObject *
-dict_py_get(SparseDictObject *self, PyObject *args)
+set_py_symmetric_difference(SparseSetObject *self, PyObject *other)
 {
-    PyObject *key;
-    PyObject *value = Py_None;
-    dictentry *entry;
-
-    if (!PyArg_UnpackTuple(args, "get", 1, 2, &key, &value))
-        return NULL;
+    return viewset_operation((PyObject *)self, other, '^', (PyObject *)&SparseSet_Type);
+}
 
-    entry = (self->lookup)(self, key, -1, 0);
-    if (entry == NULL)
+static PyObject *
+set_py_issubset(SparseSetObject *self, PyObject *other)
+{
+    int result = set_issubset((PyObject *)self, other);
+    if (result < 0)
         return NULL;
-    if (entry->key != NULL)
-        value = entry->value;
-    Py_INCREF(value);
-    return value;
+    return PyBool_FromLong(result);
 }
 
 static PyObject *
-dict_py_setdefault(SparseDictObject *self, PyObject *args)
+set_py_issuperset(SparseSetObject *self, PyObject *other)
 {
-    PyObject *key, *value = Py_None;
-    dictentry *entry;
+    PyObject *probed = viewset_probed(other);
+    int result;
 
-    if (!PyArg_UnpackTuple(args, "setdefault", 1, 2, &key, &value))
+    if (probed == NULL)
         return NULL;
-
-    entry = (self->lookup)(self, key, -1, 1);
-    if (entry == NULL)
+    result = set_issubset(probed, (PyObject *)self);
+    Py_DECREF(probed);
+    if (result < 0)
         return NULL;
-    if (entry->key == NULL) {
-        /* Insert new */
-        MAINTAIN_TRACKING(self, key, value);
-        Py_INCREF(key);
-        Py_INCREF(value);
-        entry->key = key;
-        entry->value = value;
+    return PyBool_FromLong(result);
+}
+
+static PyObject *
+set_py_isdisjoint(SparseSetObject *self, PyObject *other)
+{
+    PyObject *it, *item;
+    PyObject *iterated = other, *probed = (PyObject *)self;
+
+    if ((PyObject *)self == other)
+        return PyBool_FromLong(SparseSet_SIZE(self) == 0);
+    /* Iterate over the smaller operand if both can be probed. */
+    if (VIEWSET_PROBED(other) && PyObject_Size(other) > SparseSet_SIZE(self)) {
+        iterated = (PyObject *)self;
+        probed = other;
     }
-    else {
-        /* Return existing */
-        value = entry->value;
+    it = PyObject_GetIter(iterated);
+    if (it == NULL)
+        return NULL;
+    while ((item = PyIter_Next(it)) != NULL) {
+        int contains = viewset_contains(probed, item);
+        Py_DECREF(item);
+        if (contains != 0) {
+            Py_DECREF(it);
+            return contains < 0 ? NULL : PyBool_FromLong(0);
+        }
     }
-    Py_INCREF(value);
-    return value;
+    Py_DECREF(it);
+    if (PyErr_Occurred())
+        return NULL;
+    Py_RETURN_TRUE;
 }
 
 static PyObject *
-dict_py_clear(SparseDictObject *self)
+set_py_sizeof(SparseSetObject *self)
 {
-    dict_tp_clear(self);
-    Py_RETURN_NONE;
+    Py_ssize_t result = sizeof(SparseSetObject), b;
+
+    if (self->blocks != self->static_blocks)
+        result += sizeof(sparseblock) * self->num_blocks;
+    for (b = 0; b < self->num_blocks; ++b)
+        if (self->blocks[b].items != NULL)
+            result += items_alloc_size(KEYBLOCK_ITEMS_SIZE(SPARSEBLOCK_NUM_ITEMS(&self->blocks[b])));
+    return PyInt_FromSsize_t(result);
 }
 
 static PyObject *
-dict_py_pop(SparseDictObject *self, PyObject *args)
+set_py_reduce(SparseSetObject *self)
 {
-    PyObject *key, *value = NULL;
+    PyObject *keys, *args, *state, *result = NULL;
 
-    if (!PyArg_UnpackTuple(args, "pop", 1, 2, &key, &value))
+    keys = PySequence_List((PyObject *)self);
+    if (keys == NULL)
         return NULL;
-
-    if (SparseDict_SIZE(self) != 0) {
-        dictentry *entry = (self->lookup)(self, key, -1, 0);
-        if (entry == NULL)
-            return NULL;
-        if (entry->key != NULL) {
-            PyObject *old_key = entry->key;
-            PyObject *old_value = entry->value;
-            entry->key = NULL;
-            ++self->num_deleted;
-            Py_DECREF(old_key);
-            return old_value;
-        }
-    }
-    if (value) {
-        Py_INCREF(value);
-        return value;
+    args = PyTuple_Pack(1, keys);
+    Py_DECREF(keys);
+    if (args == NULL)
+        return NULL;
+    /* Subclass' __dict__ to be restored by object.__setstate__ */
+    state = PyObject_GetAttrString((PyObject *)self, "__dict__");
+    if (state == NULL) {
+        PyErr_Clear();
+        state = Py_None;
+        Py_INCREF(state);
     }
-    set_key_error(key);
-    return NULL;
+    result = PyTuple_Pack(3, Py_TYPE(self), args, state);
+    Py_DECREF(args);
+    Py_DECREF(state);
+    return result;
+}
+
+static PyMethodDef set_methods[] = {
+    {"__sizeof__",  (PyCFunction)set_py_sizeof,        METH_NOARGS}, /* sys.getsizeof support */
+    {"__contains__",(PyCFunction)set_py_contains,      METH_O | METH_COEXIST}, /* shortcut for sq_contains */
+    {"__reduce__",  (PyCFunction)set_py_reduce,        METH_NOARGS}, /* pickling support */
+    {"add",         (PyCFunction)set_py_add,           METH_O},
+    {"discard",     (PyCFunction)set_py_discard,       METH_O},
+    {"remove",      (PyCFunction)set_py_remove,        METH_O},
+    {"pop",         (PyCFunction)set_py_pop,           METH_NOARGS},
+    {"clear",       (PyCFunction)set_py_clear,         METH_NOARGS},
+    {"copy",        (PyCFunction)set_py_copy,          METH_NOARGS},
+    {"update",      (PyCFunction)set_py_update,        METH_VARARGS},
+    {"intersection_update", (PyCFunction)set_py_intersection_update, METH_VARARGS},
+    {"difference_update", (PyCFunction)set_py_difference_update, METH_VARARGS},
+    {"symmetric_difference_update", (PyCFunction)set_py_symmetric_difference_update, METH_O},
+    {"union",       (PyCFunction)set_py_union,         METH_VARARGS},
+    {"intersection",(PyCFunction)set_py_intersection,  METH_VARARGS},
+    {"difference",  (PyCFunction)set_py_difference,    METH_VARARGS},
+    {"symmetric_difference", (PyCFunction)set_py_symmetric_difference, METH_O},
+    {"issubset",    (PyCFunction)set_py_issubset,      METH_O},
+    {"issuperset",  (PyCFunction)set_py_issuperset,    METH_O},
+    {"isdisjoint",  (PyCFunction)set_py_isdisjoint,    METH_O},
+    {NULL}   /* sentinel */
+};
+
+static PySequenceMethods set_as_sequence = {
+    (lenfunc)set_sq_length,        /* sq_length */
+    0,                             /* sq_concat */
+    0,                             /* sq_repeat */
+    0,                             /* sq_item */
+    0,                             /* sq_slice */
+    0,                             /* sq_ass_item */
+    0,                             /* sq_ass_slice */
+    (objobjproc)set_sq_contains,   /* sq_contains */
+};
+
+static PyNumberMethods set_as_number = {
+    0,                                  /*nb_add*/
+    (binaryfunc)set_nb_sub,             /*nb_subtract*/
+    0,                                  /*nb_multiply*/
+#if PY_MAJOR_VERSION < 3
+    0,                                  /*nb_divide*/
+#endif
+    0,                                  /*nb_remainder*/
+    0,                                  /*nb_divmod*/
+    0,                                  /*nb_power*/
+    0,                                  /*nb_negative*/
+    0,                                  /*nb_positive*/
+    0,                                  /*nb_absolute*/
+    0,                                  /*nb_bool*/
+    0,                                  /*nb_invert*/
+    0,                                  /*nb_lshift*/
+    0,                                  /*nb_rshift*/
+    (binaryfunc)set_nb_and,             /*nb_and*/
+    (binaryfunc)set_nb_xor,             /*nb_xor*/
+    (binaryfunc)set_nb_or,              /*nb_or*/
+#if PY_MAJOR_VERSION < 3
+    0,                                  /*nb_coerce*/
+#endif
+    0,                                  /*nb_int*/
+    0,                                  /*nb_long (nb_reserved)*/
+    0,                                  /*nb_float*/
+#if PY_MAJOR_VERSION < 3
+    0,                                  /*nb_oct*/
+    0,                                  /*nb_hex*/
+#endif
+    0,                                  /*nb_inplace_add*/
+    (binaryfunc)set_nb_isub,            /*nb_inplace_subtract*/
+    0,                                  /*nb_inplace_multiply*/
+#if PY_MAJOR_VERSION < 3
+    0,                                  /*nb_inplace_divide*/
+#endif
+    0,                                  /*nb_inplace_remainder*/
+    0,                                  /*nb_inplace_power*/
+    0,                                  /*nb_inplace_lshift*/
+    0,                                  /*nb_inplace_rshift*/
+    (binaryfunc)set_nb_iand,            /*nb_inplace_and*/
+    (binaryfunc)set_nb_ixor,            /*nb_inplace_xor*/
+    (binaryfunc)set_nb_ior,             /*nb_inplace_or*/
+};
+
+PyTypeObject SparseSet_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "_sparsedict.SparseSet",
+    sizeof(SparseSetObject),
+    0,
+    (destructor)set_tp_dealloc,                 /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_compare */
+    (reprfunc)set_tp_repr,                      /* tp_repr */
+    &set_as_number,                             /* tp_as_number */
+    &set_as_sequence,                           /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    PyObject_HashNotImplemented,                /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    PyObject_GenericGetAttr,                    /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_CHECKTYPES, /* tp_flags */
+    0,                                          /* tp_doc */
+    (traverseproc)set_tp_traverse,              /* tp_traverse */
+    (inquiry)set_tp_clear,                      /* tp_clear */
+    (richcmpfunc)set_tp_richcompare,            /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    (getiterfunc)set_tp_iter,                   /* tp_iter */
+    0,                                          /* tp_iternext */
+    set_methods,                                /* tp_methods */
+    0,                                          /* tp_members */
+    0,                                          /* tp_getset */
+    0,                                          /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    (initproc)set_tp_init,                      /* tp_init */
+    PyType_GenericAlloc,                        /* tp_alloc */
+    set_tp_new,                                 /* tp_new */
+    PyObject_GC_Del,                            /* tp_free */
+};
+
+/* Key iterator of SparseSet. */
+
+typedef struct {
+    PyObject_HEAD
+    SparseSetObject *sset; /* set to NULL when iterator is exhausted */
+    size_t version;        /* of the set, to track modifications */
+    Py_ssize_t remaining_items;
+    Py_ssize_t next_index;
+} setiterobject;
+
+static PyObject *
+setiter_new(SparseSetObject *sset)
+{
+    setiterobject *si = PyObject_GC_New(setiterobject, &SparseSetIter_Type);
+    if (si == NULL)
+        return NULL;
+
+    Py_INCREF(sset);
+    si->sset = sset;
+    si->version = sset->version;
+    si->remaining_items = SparseSet_SIZE(sset);
+    si->next_index = 0;
+    PyObject_GC_Track(si);
+    return (PyObject *)si;
+}
+
+static void
+setiter_tp_dealloc(setiterobject *si)
+{
+    Py_XDECREF(si->sset);
+    PyObject_GC_Del(si);
+}
 
+static int
+setiter_tp_traverse(setiterobject *si, visitproc visit, void *arg)
+{
+    Py_VISIT(si->sset);
+    return 0;
 }
 
 static PyObject *
-dict_py_popitem(SparseDictObject *self)
+setiter_len_hint(setiterobject *si)
 {
-    PyObject *pair;
-    dictentry *entry;
+    Py_ssize_t len = 0;
+    if (si->sset != NULL && si->version == si->sset->version)
+        len = si->remaining_items;
+    return PyInt_FromSsize_t(len);
+}
 
-    pair = PyTuple_New(2);
-    if (pair == NULL)
+static PyObject *
+setiter_iternext(setiterobject *si)
+{
+    PyObject **slot;
+    SparseSetObject *sset = si->sset;
+
+    if (sset == NULL)
         return NULL;
-    if (SparseDict_SIZE(self) == 0) {
-        Py_DECREF(pair);
-        PyErr_SetString(PyExc_KeyError, "popitem(): dictionary is empty");
+    if (si->version != sset->version) {
+        PyErr_SetString(PyExc_RuntimeError, "SparseSet changed size during iteration");
+        si->version = sset->version - 1; /* Make this state sticky */
         return NULL;
     }
+    slot = set_next(sset, &si->next_index, 0);
+    if (slot == NULL) {
+        si->sset = NULL;
+        Py_DECREF(sset);
+        return NULL;
+    }
+    --si->remaining_items;
+    Py_INCREF(*slot);
+    return *slot;
+}
 
-    assert(self->next_index >= 0);
-    entry = dict_next(self, &self->next_index, 1);
+static PyMethodDef setiter_methods[] = {
+    {"__length_hint__", (PyCFunction)setiter_len_hint, METH_NOARGS},
+    {NULL}   /* sentinel */
+};
 
-    PyTuple_SET_ITEM(pair, 0, entry->key);
-    PyTuple_SET_ITEM(pair, 1, entry->value);
-    entry->key = NULL;
-    ++self->num_deleted;
-    return pair;
-}
+PyTypeObject SparseSetIter_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "SparseSet_Iter",                           /* tp_name */
+    sizeof(setiterobject),                      /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor)setiter_tp_dealloc,             /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_compare */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    PyObject_GenericGetAttr,                    /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    0,                                          /* tp_doc */
+    (traverseproc)setiter_tp_traverse,          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    PyObject_SelfIter,                          /* tp_iter */
+    (iternextfunc)setiter_iternext,             /* tp_iternext */
+    setiter_methods,                            /* tp_methods */
+};
 
-static PyObject *
-dict_py_resize(SparseDictObject *self, PyObject *arg)
+/* Memory-mapped tables
+
+   save_mapped writes a read-only table to a file: a header, the blocks (bitmap and index of
+   the first item), the items in slot order and the string data. Keys and values are stored
+   inline. open_mapped maps the file and probes it in place, creating Python objects only
+   for the items it returns, so opening takes constant time and the page cache is shared
+   by every process that maps the file.
+
+   str and bytes hashes are randomized per process, the file has its own hash (mapped_hash)
+   mixed and probed like the heap table. Blocks always have 64 slots and numbers use
+   native byte order. */
+
+#define MAPPED_MAGIC "SPDMAP1"
+#define MAPPED_BYTE_ORDER 0x0102030405060708ull
+#define MAPPED_BLOCK_SIZE 64
+
+/* hash_mix done in 64 bits on every platform, so that 32 and 64-bit builds agree. */
+#define MAPPED_SLOT(hash, mask) ((size_t)((2862933555777941757ull * (hash) + 3037000493ull) & (mask)))
+
+/* Space taken in the data area by a string of the given size: length and padded contents. */
+#define MAPPED_DATA_SIZE(size) (8 + (((unsigned PY_LONG_LONG)(size) + 7) & ~7ull))
+
+enum { MAPPED_NONE, MAPPED_FALSE, MAPPED_TRUE, MAPPED_INT, MAPPED_FLOAT, MAPPED_BYTES, MAPPED_STR };
+
+typedef struct {
+    char magic[8];
+    unsigned PY_LONG_LONG byte_order;
+    unsigned PY_LONG_LONG max_items; /* power of 2, at least MAPPED_BLOCK_SIZE */
+    unsigned PY_LONG_LONG num_items;
+    unsigned PY_LONG_LONG data_size;
+} mappedheader;
+
+typedef struct {
+    bitmap_t bitmap;
+    unsigned PY_LONG_LONG first; /* index of the first item of the block */
+} mappedblock;
+
+typedef struct {
+    unsigned PY_LONG_LONG hash;
+    PY_LONG_LONG key; /* int value, float bits or data offset of a string */
+    PY_LONG_LONG value;
+    unsigned int key_type;
+    unsigned int value_type;
+} mappeditem;
+
+/* Stored form of a key or value. */
+typedef struct {
+    unsigned int type;
+    PY_LONG_LONG payload;
+    const char *data;
+    Py_ssize_t size;
+    PyObject *utf8; /* encoded copy of a unicode string (Py2) */
+} mappedobj;
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *map; /* mmap object */
+#if PY_MAJOR_VERSION >= 3
+    Py_buffer view;
+#endif
+    const mappedblock *blocks;
+    const mappeditem *items;
+    const char *data;
+    unsigned PY_LONG_LONG data_size;
+    size_t mask;
+    Py_ssize_t num_items;
+} SparseDictMappedObject;
+
+/* Encodes obj, returns 1 on success, 0 if it can't be stored and -1 on error.
+   Equal keys encode alike: bools and integral floats are stored as ints. */
+Py_LOCAL(int)
+mapped_encode(PyObject *obj, mappedobj *m, int is_key)
 {
-    Py_ssize_t size = PyInt_AsSsize_t(arg);
-    if (size < 0) {
-        PyErr_SetString(PyExc_ValueError, "resize(): argument must be a nonnegative integer");
-        return NULL;
+    m->payload = 0;
+    m->data = NULL;
+    m->size = 0;
+    m->utf8 = NULL;
+    if (obj == Py_None) {
+        m->type = MAPPED_NONE;
+        return !is_key;
+    }
+    if (PyBool_Check(obj) && !is_key) {
+        m->type = obj == Py_True ? MAPPED_TRUE : MAPPED_FALSE;
+        return 1;
+    }
+#if PY_MAJOR_VERSION < 3
+    if (PyInt_CheckExact(obj) || PyBool_Check(obj)) {
+        m->type = MAPPED_INT;
+        m->payload = PyInt_AS_LONG(obj);
+        return 1;
+    }
+#endif
+    if (PyLong_CheckExact(obj) || PyBool_Check(obj)) {
+        int overflow;
+        m->type = MAPPED_INT;
+        m->payload = PyLong_AsLongLongAndOverflow(obj, &overflow);
+        if (m->payload == -1 && PyErr_Occurred())
+            return -1;
+        return !overflow;
+    }
+    if (PyFloat_CheckExact(obj)) {
+        double d = PyFloat_AS_DOUBLE(obj);
+        if (is_key && d == floor(d) && d >= -9223372036854775808.0 && d < 9223372036854775808.0) {
+            m->type = MAPPED_INT;
+            m->payload = (PY_LONG_LONG)d;
+        }
+        else {
+            m->type = MAPPED_FLOAT;
+            memcpy(&m->payload, &d, sizeof(d));
+        }
+        return 1;
+    }
+    if (PyBytes_CheckExact(obj)) {
+        m->type = MAPPED_BYTES;
+        m->data = PyBytes_AS_STRING(obj);
+        m->size = PyBytes_GET_SIZE(obj);
+        return 1;
+    }
+    if (PyUnicode_CheckExact(obj)) {
+        m->type = MAPPED_STR;
+#if PY_MAJOR_VERSION < 3
+        m->utf8 = PyUnicode_AsUTF8String(obj);
+        if (m->utf8 == NULL)
+            return -1;
+        m->data = PyBytes_AS_STRING(m->utf8);
+        m->size = PyBytes_GET_SIZE(m->utf8);
+#else
+        m->data = PyUnicode_AsUTF8AndSize(obj, &m->size);
+        if (m->data == NULL)
+            return -1;
+#endif
+        return 1;
     }
-    if (dict_resize_delta(self, size - SparseDict_SIZE(self)) < 0)
-        return NULL;
-    Py_RETURN_NONE;
+    return 0;
 }
 
-static PyObject *
-dict_py_iterkeys(SparseDictObject *dict)
+/* mapped_encode for save_mapped, which refuses what it can't store. */
+Py_LOCAL(int)
+mapped_encode_checked(PyObject *obj, mappedobj *m, int is_key)
 {
-    return dictiter_new(dict, &SparseDictIterKey_Type);
+    int ok = mapped_encode(obj, m, is_key);
+    if (ok == 0) {
+        if (PyLong_Check(obj))
+            PyErr_SetString(PyExc_OverflowError, "int too large to store in a mapped file");
+        else
+            PyErr_Format(PyExc_TypeError, "can't store %s of type '%.200s' in a mapped file",
+                         is_key ? "key" : "value", Py_TYPE(obj)->tp_name);
+    }
+    return ok > 0 ? 0 : -1;
 }
 
-static PyObject *
-dict_py_itervalues(SparseDictObject *dict)
+/* mapped_encode (or mapped_encode_checked) of the value in an entry of a table with value
+   type typed. Typed values are scalars already, or bytes in arena. */
+Py_LOCAL(int)
+mapped_encode_value(int typed, arenaobject *arena, PyObject *stored, mappedobj *m, int checked)
 {
-    return dictiter_new(dict, &SparseDictIterValue_Type);
+    valuebits bits;
+
+    if (!typed)
+        return checked ? mapped_encode_checked(stored, m, 0) : mapped_encode(stored, m, 0);
+    bits.object = stored;
+    m->type = typed == OPTION_VALUE_I8 ? MAPPED_INT : MAPPED_FLOAT;
+    m->payload = bits.i8;
+    m->data = NULL;
+    m->size = 0;
+    m->utf8 = NULL;
+    if (typed == OPTION_VALUE_BYTES) {
+        m->type = MAPPED_BYTES;
+        m->payload = 0;
+        m->data = arena->data + ARENA_OFFSET(stored);
+        m->size = ARENA_LEN(stored);
+    }
+    return checked ? 0 : 1;
 }
 
-static PyObject *
-dict_py_iteritems(SparseDictObject *dict)
+/* Same as mapped_encode_value, for a key stored with key type typed. */
+Py_LOCAL(int)
+mapped_encode_key(int typed, PyObject *stored, mappedobj *m, int checked)
 {
-    return dictiter_new(dict, &SparseDictIterItem_Type);
-}
+    valuebits bits;
 
-static PyObject *
-dict_py_viewkeys(SparseDictObject *dict)
-{
-    return dictview_new(dict, &SparseDictKeys_Type);
+    if (!typed)
+        return checked ? mapped_encode_checked(stored, m, 1) : mapped_encode(stored, m, 1);
+    bits.i8 = key_i8_value(stored);
+    return mapped_encode_value(OPTION_VALUE_I8, NULL, bits.object, m, checked);
 }
 
-static PyObject *
-dict_py_viewvalues(SparseDictObject *dict)
+#define MAPPED_IS_STRING(type) ((type) == MAPPED_BYTES || (type) == MAPPED_STR)
+
+/* FNV-1a of the string contents, value of ints and bits of floats. */
+Py_LOCAL_INLINE(unsigned PY_LONG_LONG)
+mapped_hash(const mappedobj *m)
 {
-    return dictview_new(dict, &SparseDictValues_Type);
+    unsigned PY_LONG_LONG hash = 14695981039346656037ull;
+    const unsigned char *p = (const unsigned char *)m->data, *end = p + m->size;
+
+    if (!MAPPED_IS_STRING(m->type))
+        return (unsigned PY_LONG_LONG)m->payload;
+    for (; p < end; ++p)
+        hash = (hash ^ *p) * 1099511628211ull;
+    return hash;
 }
 
-static PyObject *
-dict_py_viewitems(SparseDictObject *dict)
+/* Stored payload of m, strings take the next offset of the data area. */
+Py_LOCAL_INLINE(PY_LONG_LONG)
+mapped_store(const mappedobj *m, unsigned PY_LONG_LONG *offset)
 {
-    return dictview_new(dict, &SparseDictItems_Type);
+    PY_LONG_LONG stored = m->payload;
+    if (MAPPED_IS_STRING(m->type)) {
+        stored = (PY_LONG_LONG)*offset;
+        *offset += MAPPED_DATA_SIZE(m->size);
+    }
+    return stored;
 }
 
-static PyObject *
-dict_py_sizeof(SparseDictObject *self)
+Py_LOCAL(int)
+mapped_write_data(FILE *fp, const mappedobj *m)
 {
-    Py_ssize_t result = sizeof(SparseDictObject);
-    if (self->blocks != self->static_blocks)
-        result += sizeof(sparseblock) * self->num_blocks;
-    result += sizeof(dictentry) * self->num_items;
-    return PyInt_FromSsize_t(result);
-}
+    static const char padding[8] = {0};
+    unsigned PY_LONG_LONG size = (unsigned PY_LONG_LONG)m->size;
+    size_t padding_size = (size_t)(-m->size & 7);
 
-Py_LOCAL_INLINE(void)
-pydict_set_and_delete(PyObject *dict, const char *key, PyObject *value) {
-    if (value != NULL) {
-        PyDict_SetItemString(dict, key, value);
-        Py_DECREF(value);
-    }
+    if (!MAPPED_IS_STRING(m->type))
+        return 0;
+    if (fwrite(&size, sizeof(size), 1, fp) != 1 ||
+        fwrite(m->data, 1, (size_t)m->size, fp) != (size_t)m->size ||
+        fwrite(padding, 1, padding_size, fp) != padding_size)
+        return -1;
+    return 0;
 }
 
 static PyObject *
-dict_py_stats(SparseDictObject *self)
+dict_py_save_mapped(SparseDictObject *self, PyObject *args)
 {
-    Py_ssize_t i;
-    Py_ssize_t hist[SPARSEBLOCK_SIZE + 1] = { 0 };
-    PyObject *hist_list, *value;
-    PyObject *result = PyDict_New();
+    PyObject *result = NULL;
+    const char *filename;
+#if PY_MAJOR_VERSION >= 3
+    PyObject *path = NULL;
+#endif
+    FILE *fp = NULL;
+    dictentry *entries = NULL;
+    unsigned PY_LONG_LONG *hashes = NULL;
+    unsigned int *owners = NULL;
+    mappedblock *blocks = NULL;
+    mappedheader header;
+    mappeditem item;
+    mappedobj key, value;
+    Py_ssize_t num_items = SparseDict_SIZE(self), k;
+    size_t max_items = MAPPED_BLOCK_SIZE, num_blocks, mask, i, num_probes;
+    unsigned PY_LONG_LONG data_size = 0, offset = 0, first = 0;
+    int typed = SparseDict_VALUE_TYPE(self), key_typed = SparseDict_KEY_TYPE(self);
 
-    if (result == NULL)
+#if PY_MAJOR_VERSION < 3
+    if (!PyArg_ParseTuple(args, "s:save_mapped", &filename))
         return NULL;
+#else
+    if (!PyArg_ParseTuple(args, "O&:save_mapped", PyUnicode_FSConverter, &path))
+        return NULL;
+    filename = PyBytes_AS_STRING(path);
+#endif
 
-    pydict_set_and_delete(result, "block_size", PyInt_FromLong(SPARSEBLOCK_SIZE));
-    pydict_set_and_delete(result, "num_blocks", PyInt_FromSsize_t(self->num_blocks));
-    pydict_set_and_delete(result, "max_items", PyInt_FromSsize_t(SparseDict_MAX_ITEMS(self)));
-    pydict_set_and_delete(result, "num_items", PyInt_FromSsize_t(self->num_items));
-    pydict_set_and_delete(result, "num_deleted", PyInt_FromSsize_t(self->num_deleted));
-    pydict_set_and_delete(result, "consider_shrink", PyBool_FromLong(self->_max_items & FLAG_CONSIDER_SHRINK));
-    pydict_set_and_delete(result, "disable_resize", PyBool_FromLong(self->_max_items & FLAG_DISABLE_RESIZE));
-    pydict_set_and_delete(result, "string_lookup", PyInt_FromLong(self->lookup == dict_lookup_string));
-    EX_STATS(pydict_set_and_delete(result, "total_collisions", PyInt_FromSize_t(self->total_collisions)));
-    EX_STATS(pydict_set_and_delete(result, "total_resizes", PyInt_FromSize_t(self->total_resizes)));
+    if ((size_t)num_items > UINT_MAX / 2) {
+        PyErr_SetString(PyExc_OverflowError, "too many items for a mapped file");
+        goto Done;
+    }
+    while (max_items / 4 * 3 < (size_t)num_items)
+        max_items *= 2;
+    mask = max_items - 1;
+    num_blocks = max_items / MAPPED_BLOCK_SIZE;
+
+    entries = PyMem_NEW(dictentry, num_items + 1);
+    hashes = PyMem_NEW(unsigned PY_LONG_LONG, num_items + 1);
+    owners = PyMem_NEW(unsigned int, max_items);
+    blocks = PyMem_NEW(mappedblock, num_blocks);
+    if (!entries || !hashes || !owners || !blocks) {
+        PyErr_NoMemory();
+        goto Done;
+    }
 
-    hist_list = PyList_New(SPARSEBLOCK_SIZE + 1);
-    if (hist_list == NULL) {
-        Py_DECREF(result);
-        return NULL;
+    /* Check the types and hash the keys. Exact builtin types run no Python code,
+       the dict can't change until the file is written. */
+    k = 0;
+    SparseDict_FOR(self, entry)
+        if (mapped_encode_key(key_typed, entry.key, &key, 1) != 0)
+            goto Done;
+        hashes[k] = mapped_hash(&key);
+        if (MAPPED_IS_STRING(key.type))
+            data_size += MAPPED_DATA_SIZE(key.size);
+        Py_XDECREF(key.utf8);
+        if (mapped_encode_value(typed, self->arena, entry.value, &value, 1) != 0)
+            goto Done;
+        if (MAPPED_IS_STRING(value.type))
+            data_size += MAPPED_DATA_SIZE(value.size);
+        Py_XDECREF(value.utf8);
+        entries[k++] = entry;
+    SparseDict_ENDFOR(self, 0)
+    assert(k == num_items);
+
+    memset(blocks, 0, num_blocks * sizeof(mappedblock));
+    for (k = 0; k < num_items; ++k) {
+        num_probes = 0;
+        i = MAPPED_SLOT(hashes[k], mask);
+        while (blocks[i / MAPPED_BLOCK_SIZE].bitmap & ((bitmap_t)1 << (i % MAPPED_BLOCK_SIZE)))
+            i = (i + ++num_probes) & mask;
+        blocks[i / MAPPED_BLOCK_SIZE].bitmap |= (bitmap_t)1 << (i % MAPPED_BLOCK_SIZE);
+        owners[i] = (unsigned int)k;
     }
-    for (i = 0; i < self->num_blocks; ++i)
-        ++hist[self->blocks[i].num_items];
-    for (i = 0; i <= SPARSEBLOCK_SIZE; ++i) {
-        value = PyInt_FromSsize_t(hist[i]);
-        if (value == NULL) {
-            Py_DECREF(result);
-            Py_DECREF(hist_list);
-            return NULL;
+    for (i = 0; i < num_blocks; ++i) {
+        blocks[i].first = first;
+        first += popcount(blocks[i].bitmap);
+    }
+
+    fp = fopen(filename, "wb");
+    if (fp == NULL)
+        goto IOError;
+    memcpy(header.magic, MAPPED_MAGIC, sizeof(header.magic));
+    header.byte_order = MAPPED_BYTE_ORDER;
+    header.max_items = max_items;
+    header.num_items = (unsigned PY_LONG_LONG)num_items;
+    header.data_size = data_size;
+    if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+        fwrite(blocks, sizeof(mappedblock), num_blocks, fp) != num_blocks)
+        goto IOError;
+
+    /* Items, then the strings they refer to, in slot order. */
+    for (i = 0; i < max_items; ++i) {
+        if (!(blocks[i / MAPPED_BLOCK_SIZE].bitmap & ((bitmap_t)1 << (i % MAPPED_BLOCK_SIZE))))
+            continue;
+        k = owners[i];
+        if (mapped_encode_key(key_typed, entries[k].key, &key, 0) < 0)
+            goto Done;
+        if (mapped_encode_value(typed, self->arena, entries[k].value, &value, 0) < 0) {
+            Py_XDECREF(key.utf8);
+            goto Done;
         }
-        PyList_SET_ITEM(hist_list, i, value);
+        memset(&item, 0, sizeof(item));
+        item.hash = hashes[k];
+        item.key_type = key.type;
+        item.key = mapped_store(&key, &offset);
+        item.value_type = value.type;
+        item.value = mapped_store(&value, &offset);
+        Py_XDECREF(key.utf8);
+        Py_XDECREF(value.utf8);
+        if (fwrite(&item, sizeof(item), 1, fp) != 1)
+            goto IOError;
     }
-    pydict_set_and_delete(result, "blocks_by_size", hist_list);
+    for (i = 0; i < max_items; ++i) {
+        int failed;
+        if (!(blocks[i / MAPPED_BLOCK_SIZE].bitmap & ((bitmap_t)1 << (i % MAPPED_BLOCK_SIZE))))
+            continue;
+        k = owners[i];
+        if (mapped_encode_key(key_typed, entries[k].key, &key, 0) < 0)
+            goto Done;
+        if (mapped_encode_value(typed, self->arena, entries[k].value, &value, 0) < 0) {
+            Py_XDECREF(key.utf8);
+            goto Done;
+        }
+        failed = mapped_write_data(fp, &key) != 0 || mapped_write_data(fp, &value) != 0;
+        Py_XDECREF(key.utf8);
+        Py_XDECREF(value.utf8);
+        if (failed)
+            goto IOError;
+    }
+    assert(offset == data_size);
+
+    if (fclose(fp) != 0) {
+        fp = NULL;
+        goto IOError;
+    }
+    fp = NULL;
+    Py_INCREF(Py_None);
+    result = Py_None;
+    goto Done;
 
+IOError:
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)filename);
+Done:
+    if (fp != NULL)
+        fclose(fp);
+    PyMem_FREE(entries);
+    PyMem_FREE(hashes);
+    PyMem_FREE(owners);
+    PyMem_FREE(blocks);
+#if PY_MAJOR_VERSION >= 3
+    Py_XDECREF(path);
+#endif
     return result;
 }
 
-static PyObject *
-dict_py_reduce(SparseDictObject *self)
+Py_LOCAL(int)
+mapped_corrupt(void)
 {
-    PyObject *result = NULL, *size = NULL, *args = NULL, *state = NULL, *iteritems = NULL;
-
-    size = PyInt_FromSsize_t(SparseDict_SIZE(self));
-    if (size == NULL)
-        goto Done;
-    /* Args to the constructor. */
-    args = PyTuple_Pack(1, size);
-    if (args == NULL)
-        goto Done;
-    /* Subclass' __dict__ to be restored by object.__setstate__ */
-    state = PyObject_GetAttrString((PyObject *)self, "__dict__");
-    if (state == NULL) {
-        PyErr_Clear();
-        state = Py_None;
-        Py_INCREF(state);
-    }
-    /* Dict item iterator to support batch pickling. */
-    iteritems = dictiter_new(self, &SparseDictIterItem_Type);
-    if (iteritems == NULL)
-        goto Done;
+    PyErr_SetString(PyExc_ValueError, "corrupt mapped SparseDict file");
+    return -1;
+}
 
-    result = PyTuple_Pack(5, Py_TYPE(self), args, state, Py_None, iteritems);
-Done:
-    Py_XDECREF(size);
-    Py_XDECREF(args);
-    Py_XDECREF(state);
-    Py_XDECREF(iteritems);
-    return result;
+/* Bounds checked string at offset of the data area. */
+Py_LOCAL(int)
+mapped_string(SparseDictMappedObject *self, PY_LONG_LONG offset, const char **data, Py_ssize_t *size)
+{
+    unsigned PY_LONG_LONG start = (unsigned PY_LONG_LONG)offset, length;
+
+    if ((start & 7) || self->data_size < 8 || start > self->data_size - 8)
+        return mapped_corrupt();
+    memcpy(&length, self->data + start, sizeof(length));
+    if (length > self->data_size - 8 - start)
+        return mapped_corrupt();
+    *data = self->data + start + 8;
+    *size = (Py_ssize_t)length;
+    return 0;
 }
 
-static PyMethodDef dict_methods[] = {
-    {"__sizeof__",  (PyCFunction)dict_py_sizeof,       METH_NOARGS}, /* sys.getsizeof support */
-    {"__contains__",(PyCFunction)dict_py_contains,     METH_O | METH_COEXIST}, /* shortcut for sq_contains */
-    {"__getitem__", (PyCFunction)dict_mp_subscript,    METH_O | METH_COEXIST}, /* shortcut for mp_getitem */
-    {"__reduce__",  (PyCFunction)dict_py_reduce,       METH_NOARGS}, /* pickling support */
-    {"get",         (PyCFunction)dict_py_get,          METH_VARARGS},
-    {"setdefault",  (PyCFunction)dict_py_setdefault,   METH_VARARGS},
-    {"pop",         (PyCFunction)dict_py_pop,          METH_VARARGS},
-    {"popitem",     (PyCFunction)dict_py_popitem,      METH_NOARGS},
-    {"update",      (PyCFunction)dict_py_update,       METH_VARARGS | METH_KEYWORDS},
-    {"fromkeys",    (PyCFunction)dict_py_fromkeys,     METH_VARARGS | METH_CLASS},
-    {"clear",       (PyCFunction)dict_py_clear,        METH_NOARGS},
-    {"copy",        (PyCFunction)dict_py_copy,         METH_NOARGS},
-    {"resize",      (PyCFunction)dict_py_resize,       METH_O},
-    {"_stats",      (PyCFunction)dict_py_stats,        METH_NOARGS},
+/* None, bool, int or float stored as type and payload. */
+static PyObject *
+mapped_scalar(unsigned int type, PY_LONG_LONG payload)
+{
+    double d;
+
+    switch (type) {
+    case MAPPED_NONE:
+        Py_RETURN_NONE;
+    case MAPPED_FALSE:
+        Py_RETURN_FALSE;
+    case MAPPED_TRUE:
+        Py_RETURN_TRUE;
+    case MAPPED_INT:
 #if PY_MAJOR_VERSION < 3
-    {"has_key",     (PyCFunction)dict_py_contains,     METH_O},
-    {"keys",        (PyCFunction)dict_py_keys,         METH_NOARGS},
-    {"values",      (PyCFunction)dict_py_values,       METH_NOARGS},
-    {"items",       (PyCFunction)dict_py_items,        METH_NOARGS},
-    {"iterkeys",    (PyCFunction)dict_py_iterkeys,     METH_NOARGS},
-    {"itervalues",  (PyCFunction)dict_py_itervalues,   METH_NOARGS},
-    {"iteritems",   (PyCFunction)dict_py_iteritems,    METH_NOARGS},
-    {"viewkeys",    (PyCFunction)dict_py_viewkeys,     METH_NOARGS},
-    {"viewvalues",  (PyCFunction)dict_py_viewvalues,   METH_NOARGS},
-    {"viewitems",   (PyCFunction)dict_py_viewitems,    METH_NOARGS},
-#else
-    {"keys",        (PyCFunction)dict_py_viewkeys,     METH_NOARGS},
-    {"values",      (PyCFunction)dict_py_viewvalues,   METH_NOARGS},
-    {"items",       (PyCFunction)dict_py_viewitems,    METH_NOARGS},
+        if (payload >= LONG_MIN && payload <= LONG_MAX)
+            return PyInt_FromLong((long)payload);
 #endif
-    {NULL}   /* sentinel */
-};
+        return PyLong_FromLongLong(payload);
+    case MAPPED_FLOAT:
+        memcpy(&d, &payload, sizeof(d));
+        return PyFloat_FromDouble(d);
+    }
+    mapped_corrupt();
+    return NULL;
+}
 
-static PySequenceMethods dict_as_sequence = {
-    0,                             /* sq_length */
-    0,                             /* sq_concat */
-    0,                             /* sq_repeat */
-    0,                             /* sq_item */
-    0,                             /* sq_slice */
-    0,                             /* sq_ass_item */
-    0,                             /* sq_ass_slice */
-    (objobjproc)dict_sq_contains,  /* sq_contains */
-    0,                             /* sq_inplace_concat */
-    0,                             /* sq_inplace_repeat */
-};
+/* Creates the object stored as type and payload. */
+static PyObject *
+mapped_object(SparseDictMappedObject *self, unsigned int type, PY_LONG_LONG payload)
+{
+    const char *data;
+    Py_ssize_t size;
 
-static PyMappingMethods dict_as_mapping = {
-    (lenfunc)dict_mp_length,               /* mp_length */
-    (binaryfunc)dict_mp_subscript,         /* mp_subscript */
-    (objobjargproc)dict_mp_ass_subscript,  /* mp_ass_subscript */
-};
+    if (!MAPPED_IS_STRING(type))
+        return mapped_scalar(type, payload);
+    if (mapped_string(self, payload, &data, &size) != 0)
+        return NULL;
+    if (type == MAPPED_BYTES)
+        return PyBytes_FromStringAndSize(data, size);
+    return PyUnicode_DecodeUTF8(data, size, NULL);
+}
 
-PyTypeObject SparseDict_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "_sparsedict.SparseDict",
-    sizeof(SparseDictObject),
-    0,
-    (destructor)dict_tp_dealloc,                /* tp_dealloc */
-    0,                                          /* tp_print */
-    0,                                          /* tp_getattr */
-    0,                                          /* tp_setattr */
-    0,                                          /* tp_compare */
-    (reprfunc)dict_tp_repr,                     /* tp_repr */
-    0,                                          /* tp_as_number */
-    &dict_as_sequence,                          /* tp_as_sequence */
-    &dict_as_mapping,                           /* tp_as_mapping */
-    PyObject_HashNotImplemented,                /* tp_hash */
-    0,                                          /* tp_call */
-    0,                                          /* tp_str */
-    PyObject_GenericGetAttr,                    /* tp_getattro */
-    0,                                          /* tp_setattro */
-    0,                                          /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC | Py_TPFLAGS_BASETYPE, /* tp_flags */
-    0,                                          /* tp_doc */
-    (traverseproc)dict_tp_traverse,             /* tp_traverse */
-    (inquiry)dict_tp_clear,                     /* tp_clear */
-    (richcmpfunc)dict_tp_richcompare,           /* tp_richcompare */
-    0,                                          /* tp_weaklistoffset */
-    (getiterfunc)dict_tp_iter,                  /* tp_iter */
-    0,                                          /* tp_iternext */
-    dict_methods,                               /* tp_methods */
-    0,                                          /* tp_members */
-    0,                                          /* tp_getset */
-    0,                                          /* tp_base */
-    0,                                          /* tp_dict */
-    0,                                          /* tp_descr_get */
-    0,                                          /* tp_descr_set */
-    0,                                          /* tp_dictoffset */
-    (initproc)dict_tp_init,                     /* tp_init */
-    PyType_GenericAlloc,                        /* tp_alloc */
-    (newfunc)dict_tp_new,                       /* tp_new */
-    PyObject_GC_Del,                            /* tp_free */
-};
+/* Finds the item of key. Returns 1 if found, 0 if not and -1 on error. */
+Py_LOCAL(int)
+mapped_lookup(SparseDictMappedObject *self, PyObject *key, const mappeditem **result)
+{
+    const mappedblock *block;
+    const mappeditem *item;
+    const char *data;
+    Py_ssize_t size;
+    mappedobj m;
+    bitmap_t bit;
+    unsigned PY_LONG_LONG hash, index;
+    size_t i, num_probes = 0;
+    int found = 0, ok;
+
+    ok = mapped_encode(key, &m, 1);
+    if (ok <= 0) {
+        if (ok < 0 && PyErr_ExceptionMatches(PyExc_UnicodeEncodeError)) {
+            PyErr_Clear(); /* lone surrogates, not stored */
+            return 0;
+        }
+        /* Unhashable keys raise as they do with dicts. */
+        return ok < 0 || PyObject_Hash(key) == -1 ? -1 : 0;
+    }
+    hash = mapped_hash(&m);
+    i = MAPPED_SLOT(hash, self->mask);
+    for (;;) {
+        block = &self->blocks[i / MAPPED_BLOCK_SIZE];
+        bit = (bitmap_t)1 << (i % MAPPED_BLOCK_SIZE);
+        if (!(block->bitmap & bit) || num_probes > self->mask)
+            break;
+        index = block->first + popcount(block->bitmap & (bit - 1));
+        if (index >= (unsigned PY_LONG_LONG)self->num_items) {
+            found = mapped_corrupt();
+            break;
+        }
+        item = &self->items[index];
+        if (item->hash == hash && item->key_type == m.type) {
+            if (!MAPPED_IS_STRING(m.type)) {
+                found = item->key == m.payload;
+            }
+            else if (mapped_string(self, item->key, &data, &size) != 0) {
+                found = -1;
+                break;
+            }
+            else {
+                found = size == m.size && memcmp(data, m.data, size) == 0;
+            }
+            if (found) {
+                *result = item;
+                break;
+            }
+        }
+        /* Quadratic probing */
+        ++num_probes;
+        i = (i + num_probes) & self->mask;
+    }
+    Py_XDECREF(m.utf8);
+    return found;
+}
 
+/* Wraps a read-only buffer mapping of a save_mapped file. */
+static PyObject *
+mapped_new(PyObject *map)
+{
+    SparseDictMappedObject *self;
+    const mappedheader *header;
+    const char *base;
+    Py_ssize_t size;
+    unsigned PY_LONG_LONG remaining, num_blocks;
 
-/* Key, value and item iterators. */
+    self = PyObject_New(SparseDictMappedObject, &SparseDictMapped_Type);
+    if (self == NULL)
+        return NULL;
+    self->map = NULL;
+#if PY_MAJOR_VERSION < 3
+    if (PyObject_AsReadBuffer(map, (const void **)&base, &size) != 0)
+        goto Failed;
+#else
+    if (PyObject_GetBuffer(map, &self->view, PyBUF_SIMPLE) != 0)
+        goto Failed;
+    base = (const char *)self->view.buf;
+    size = self->view.len;
+#endif
+    Py_INCREF(map);
+    self->map = map;
+
+    header = (const mappedheader *)base;
+    if ((size_t)size < sizeof(mappedheader) || memcmp(header->magic, MAPPED_MAGIC, sizeof(header->magic)) != 0 ||
+            header->byte_order != MAPPED_BYTE_ORDER) {
+        PyErr_SetString(PyExc_ValueError, "not a mapped SparseDict file");
+        goto Failed;
+    }
+    /* Only the sizes are checked here, items are checked as they are read. */
+    remaining = (unsigned PY_LONG_LONG)size - sizeof(mappedheader);
+    num_blocks = header->max_items / MAPPED_BLOCK_SIZE;
+    if (header->max_items < MAPPED_BLOCK_SIZE || (header->max_items & (header->max_items - 1)) != 0 ||
+            num_blocks > remaining / sizeof(mappedblock))
+        goto Corrupt;
+    remaining -= num_blocks * sizeof(mappedblock);
+    if (header->num_items > header->max_items || header->num_items > remaining / sizeof(mappeditem))
+        goto Corrupt;
+    remaining -= header->num_items * sizeof(mappeditem);
+    if (header->data_size > remaining)
+        goto Corrupt;
+
+    self->blocks = (const mappedblock *)(base + sizeof(mappedheader));
+    self->items = (const mappeditem *)(self->blocks + num_blocks);
+    self->data = (const char *)(self->items + header->num_items);
+    self->data_size = header->data_size;
+    self->mask = (size_t)header->max_items - 1;
+    self->num_items = (Py_ssize_t)header->num_items;
+    return (PyObject *)self;
 
-typedef struct {
-    PyObject_HEAD
-    SparseDictObject *sdict; /* set to NULL when iterator is exhausted */
-    Py_ssize_t num_items; /* original size to track modifications */
-    Py_ssize_t remaining_items;
-    Py_ssize_t next_index;
-    PyObject* pair; /* reusable result tuple for iteritems */
-} dictiterobject;
+Corrupt:
+    mapped_corrupt();
+Failed:
+    Py_DECREF(self);
+    return NULL;
+}
 
 static PyObject *
-dictiter_new(SparseDictObject *sdict, PyTypeObject *itertype)
+dict_py_open_mapped(PyObject *cls, PyObject *args)
 {
-    dictiterobject *di = PyObject_GC_New(dictiterobject, itertype);
-    if (di == NULL)
-        return NULL;
+    PyObject *path, *io = NULL, *mmap = NULL, *file = NULL, *fileno = NULL, *map = NULL, *result = NULL, *tmp;
 
-    Py_INCREF(sdict);
-    di->sdict = sdict;
-    di->num_items = sdict->num_items;
-    di->next_index = 0;
-    di->remaining_items = SparseDict_SIZE(sdict);
-    if (itertype == &SparseDictIterItem_Type) {
-        di->pair = PyTuple_Pack(2, Py_None, Py_None);
-        if (di->pair == NULL) {
-            Py_DECREF(di);
-            return NULL;
-        }
+    if (!PyArg_ParseTuple(args, "O:open_mapped", &path))
+        return NULL;
+    io = PyImport_ImportModule("io");
+    mmap = PyImport_ImportModule("mmap");
+    if (io == NULL || mmap == NULL)
+        goto Done;
+    file = PyObject_CallMethod(io, "open", "Os", path, "rb");
+    if (file == NULL)
+        goto Done;
+    fileno = PyObject_CallMethod(file, "fileno", NULL);
+    if (fileno != NULL) {
+        /* mmap.mmap(fileno, 0, access=mmap.ACCESS_READ) */
+        PyObject *type = PyObject_GetAttrString(mmap, "mmap");
+        PyObject *access = PyObject_GetAttrString(mmap, "ACCESS_READ");
+        PyObject *call_args = Py_BuildValue("(Oi)", fileno, 0);
+        PyObject *kwargs = access ? Py_BuildValue("{sO}", "access", access) : NULL;
+        if (type && call_args && kwargs)
+            map = PyObject_Call(type, call_args, kwargs);
+        Py_XDECREF(type);
+        Py_XDECREF(access);
+        Py_XDECREF(call_args);
+        Py_XDECREF(kwargs);
     }
-    else
-        di->pair = NULL;
-    PyObject_GC_Track(di);
-    return (PyObject *)di;
+    /* The mapping stays valid after the file is closed. */
+    tmp = PyObject_CallMethod(file, "close", NULL);
+    if (tmp == NULL)
+        goto Done;
+    Py_DECREF(tmp);
+    if (map != NULL)
+        result = mapped_new(map);
+
+Done:
+    Py_XDECREF(io);
+    Py_XDECREF(mmap);
+    Py_XDECREF(file);
+    Py_XDECREF(fileno);
+    Py_XDECREF(map);
+    return result;
 }
 
 static void
-dictiter_tp_dealloc(dictiterobject *di)
+mapped_tp_dealloc(SparseDictMappedObject *self)
 {
-    Py_XDECREF(di->sdict);
-    Py_XDECREF(di->pair);
-    PyObject_GC_Del(di);
+    if (self->map != NULL) {
+#if PY_MAJOR_VERSION >= 3
+        PyBuffer_Release(&self->view);
+#endif
+        Py_DECREF(self->map);
+    }
+    PyObject_Del(self);
 }
 
-static int
-dictiter_tp_traverse(dictiterobject *di, visitproc visit, void *arg)
+static Py_ssize_t
+mapped_mp_length(SparseDictMappedObject *self)
 {
-    Py_VISIT(di->sdict);
-    Py_VISIT(di->pair);
-    return 0;
+    return self->num_items;
 }
 
 static PyObject *
-dictiter_len_hint(dictiterobject *di)
+mapped_mp_subscript(SparseDictMappedObject *self, PyObject *key)
 {
-    Py_ssize_t len = 0;
-    if (di->sdict != NULL && di->num_items == di->sdict->num_items)
-        len = di->remaining_items;
-    return PyInt_FromSsize_t(len);
+    const mappeditem *item;
+    int found = mapped_lookup(self, key, &item);
+    if (found <= 0) {
+        if (found == 0)
+            set_key_error(key);
+        return NULL;
+    }
+    return mapped_object(self, item->value_type, item->value);
 }
 
-static PyObject *dictiter_iternextkey(dictiterobject *di)
+static int
+mapped_sq_contains(SparseDictMappedObject *self, PyObject *key)
 {
-    dictentry *entry;
-    SparseDictObject *sdict = di->sdict;
+    const mappeditem *item;
+    return mapped_lookup(self, key, &item);
+}
 
-    if (sdict == NULL)
+static PyObject *
+mapped_py_contains(SparseDictMappedObject *self, PyObject *key)
+{
+    int found = mapped_sq_contains(self, key);
+    if (found < 0)
         return NULL;
-    SparseDict_INVARIANT(sdict);
+    return PyBool_FromLong(found);
+}
 
-    if (di->num_items != sdict->num_items) {
-        PyErr_SetString(PyExc_RuntimeError, "dictionary changed size during iteration");
-        di->num_items = -1; /* Make this state sticky */
-        return NULL;
-    }
+static PyObject *
+mapped_py_get(SparseDictMappedObject *self, PyObject *args)
+{
+    PyObject *key, *failobj = Py_None;
+    const mappeditem *item;
+    int found;
 
-    entry = dict_next(sdict, &di->next_index, 0);
-    if (entry == NULL) {
-        Py_DECREF(sdict);
-        di->sdict = NULL;
+    if (!PyArg_UnpackTuple(args, "get", 1, 2, &key, &failobj))
+        return NULL;
+    found = mapped_lookup(self, key, &item);
+    if (found < 0)
         return NULL;
+    if (found == 0) {
+        Py_INCREF(failobj);
+        return failobj;
     }
-
-    Py_INCREF(entry->key);
-    return entry->key;
+    return mapped_object(self, item->value_type, item->value);
 }
 
-static PyObject *dictiter_iternextvalue(dictiterobject *di)
+enum { MAPPED_KEYS, MAPPED_VALUES, MAPPED_ITEMS };
+
+/* Key, value or (key, value) of the item at index. */
+static PyObject *
+mapped_item_object(SparseDictMappedObject *self, Py_ssize_t index, int kind)
 {
-    dictentry *entry;
-    SparseDictObject *sdict = di->sdict;
+    const mappeditem *item = &self->items[index];
+    PyObject *key, *value;
 
-    if (sdict == NULL)
+    if (kind == MAPPED_KEYS)
+        return mapped_object(self, item->key_type, item->key);
+    if (kind == MAPPED_VALUES)
+        return mapped_object(self, item->value_type, item->value);
+    key = mapped_object(self, item->key_type, item->key);
+    if (key == NULL)
         return NULL;
-    SparseDict_INVARIANT(sdict);
-
-    if (di->num_items != sdict->num_items) {
-        PyErr_SetString(PyExc_RuntimeError, "dictionary changed size during iteration");
-        di->num_items = -1; /* Make this state sticky */
+    value = mapped_object(self, item->value_type, item->value);
+    if (value == NULL) {
+        Py_DECREF(key);
         return NULL;
     }
+    return Py_BuildValue("(NN)", key, value);
+}
 
-    entry = dict_next(sdict, &di->next_index, 0);
-    if (entry == NULL) {
-        Py_DECREF(sdict);
-        di->sdict = NULL;
+static PyObject *
+mapped_list(SparseDictMappedObject *self, int kind)
+{
+    PyObject *list, *obj;
+    Py_ssize_t i;
+
+    list = PyList_New(self->num_items);
+    if (list == NULL)
         return NULL;
+    for (i = 0; i < self->num_items; ++i) {
+        obj = mapped_item_object(self, i, kind);
+        if (obj == NULL) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, obj);
     }
+    return list;
+}
 
-    --di->remaining_items;
-    Py_INCREF(entry->value);
-    return entry->value;
+static PyObject *
+mapped_py_keys(SparseDictMappedObject *self)
+{
+    return mapped_list(self, MAPPED_KEYS);
 }
 
-static PyObject *dictiter_iternextitem(dictiterobject *di)
+static PyObject *
+mapped_py_values(SparseDictMappedObject *self)
 {
-    PyObject *pair = di->pair;
-    dictentry *entry;
-    SparseDictObject *sdict = di->sdict;
+    return mapped_list(self, MAPPED_VALUES);
+}
 
-    if (sdict == NULL)
-        return NULL;
-    SparseDict_INVARIANT(sdict);
+static PyObject *
+mapped_py_items(SparseDictMappedObject *self)
+{
+    return mapped_list(self, MAPPED_ITEMS);
+}
 
-     if (di->num_items != sdict->num_items) {
-        PyErr_SetString(PyExc_RuntimeError, "dictionary changed size during iteration");
-        di->num_items = -1; /* Make this state sticky */
+typedef struct {
+    PyObject_HEAD
+    SparseDictMappedObject *map;
+    Py_ssize_t next_index;
+    int kind;
+} mappediterobject;
+
+static PyObject *
+mappediter_new(SparseDictMappedObject *map, int kind)
+{
+    mappediterobject *mi = PyObject_New(mappediterobject, &SparseDictMappedIter_Type);
+    if (mi == NULL)
         return NULL;
-    }
+    Py_INCREF(map);
+    mi->map = map;
+    mi->next_index = 0;
+    mi->kind = kind;
+    return (PyObject *)mi;
+}
 
-    entry = dict_next(sdict, &di->next_index, 0);
-    if (entry == NULL) {
-        Py_DECREF(sdict);
-        di->sdict = NULL;
+static void
+mappediter_tp_dealloc(mappediterobject *mi)
+{
+    Py_DECREF(mi->map);
+    PyObject_Del(mi);
+}
+
+static PyObject *
+mappediter_iternext(mappediterobject *mi)
+{
+    if (mi->next_index >= mi->map->num_items)
         return NULL;
-    }
+    return mapped_item_object(mi->map, mi->next_index++, mi->kind);
+}
 
-    if (pair->ob_refcnt == 1) {
-        Py_INCREF(pair);
-        Py_DECREF(PyTuple_GET_ITEM(pair, 0));
-        Py_DECREF(PyTuple_GET_ITEM(pair, 1));
-    }
-    else {
-        pair = PyTuple_New(2);
-        if (pair == NULL)
-            return NULL;
-    }
-    --di->remaining_items;
-    Py_INCREF(entry->key);
-    Py_INCREF(entry->value);
-    PyTuple_SET_ITEM(pair, 0, entry->key);
-    PyTuple_SET_ITEM(pair, 1, entry->value);
-    return pair;
+static PyObject *
+mappediter_len_hint(mappediterobject *mi)
+{
+    Py_ssize_t len = mi->map->num_items - mi->next_index;
+    return PyInt_FromSsize_t(len > 0 ? len : 0);
 }
 
-static PyMethodDef dictiter_methods[] = {
-    {"__length_hint__", (PyCFunction)dictiter_len_hint, METH_NOARGS}, /* undocumented, but harmless */
-    {NULL,              NULL}           /* sentinel */
+static PyObject *
+mapped_tp_iter(SparseDictMappedObject *self)
+{
+    return mappediter_new(self, MAPPED_KEYS);
+}
+
+static PyObject *
+mapped_py_iterkeys(SparseDictMappedObject *self)
+{
+    return mappediter_new(self, MAPPED_KEYS);
+}
+
+static PyObject *
+mapped_py_itervalues(SparseDictMappedObject *self)
+{
+    return mappediter_new(self, MAPPED_VALUES);
+}
+
+static PyObject *
+mapped_py_iteritems(SparseDictMappedObject *self)
+{
+    return mappediter_new(self, MAPPED_ITEMS);
+}
+
+static PyObject *
+mapped_tp_repr(SparseDictMappedObject *self)
+{
+    return PyUnicode_FromFormat("<%s with %zd items>", Py_TYPE(self)->tp_name, self->num_items);
+}
+
+static PyMethodDef mapped_methods[] = {
+    {"__contains__",(PyCFunction)mapped_py_contains,   METH_O | METH_COEXIST},
+    {"__getitem__", (PyCFunction)mapped_mp_subscript,  METH_O | METH_COEXIST},
+    {"get",         (PyCFunction)mapped_py_get,        METH_VARARGS},
+    {"keys",        (PyCFunction)mapped_py_keys,       METH_NOARGS},
+    {"values",      (PyCFunction)mapped_py_values,     METH_NOARGS},
+    {"items",       (PyCFunction)mapped_py_items,      METH_NOARGS},
+    {"iterkeys",    (PyCFunction)mapped_py_iterkeys,   METH_NOARGS},
+    {"itervalues",  (PyCFunction)mapped_py_itervalues, METH_NOARGS},
+    {"iteritems",   (PyCFunction)mapped_py_iteritems,  METH_NOARGS},
+#if PY_MAJOR_VERSION < 3
+    {"has_key",     (PyCFunction)mapped_py_contains,   METH_O},
+#endif
+    {NULL}   /* sentinel */
 };
 
-PyTypeObject SparseDictIterKey_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "SparseDict_KeyIter",                       /* tp_name */
-    sizeof(dictiterobject),                     /* tp_basicsize */
-    0,                                          /* tp_itemsize */
-    (destructor)dictiter_tp_dealloc,            /* tp_dealloc */
-    0,                                          /* tp_print */
-    0,                                          /* tp_getattr */
-    0,                                          /* tp_setattr */
-    0,                                          /* tp_compare */
-    0,                                          /* tp_repr */
-    0,                                          /* tp_as_number */
-    0,                                          /* tp_as_sequence */
-    0,                                          /* tp_as_mapping */
-    0,                                          /* tp_hash */
-    0,                                          /* tp_call */
-    0,                                          /* tp_str */
-    PyObject_GenericGetAttr,                    /* tp_getattro */
-    0,                                          /* tp_setattro */
-    0,                                          /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,/* tp_flags */
-    0,                                          /* tp_doc */
-    (traverseproc)dictiter_tp_traverse,         /* tp_traverse */
-    0,                                          /* tp_clear */
-    0,                                          /* tp_richcompare */
-    0,                                          /* tp_weaklistoffset */
-    PyObject_SelfIter,                          /* tp_iter */
-    (iternextfunc)dictiter_iternextkey,         /* tp_iternext */
-    dictiter_methods,                           /* tp_methods */
+static PySequenceMethods mapped_as_sequence = {
+    0,                                /* sq_length */
+    0,                                /* sq_concat */
+    0,                                /* sq_repeat */
+    0,                                /* sq_item */
+    0,                                /* sq_slice */
+    0,                                /* sq_ass_item */
+    0,                                /* sq_ass_slice */
+    (objobjproc)mapped_sq_contains,   /* sq_contains */
 };
 
-PyTypeObject SparseDictIterValue_Type = {
+static PyMappingMethods mapped_as_mapping = {
+    (lenfunc)mapped_mp_length,        /* mp_length */
+    (binaryfunc)mapped_mp_subscript,  /* mp_subscript */
+    0,                                /* mp_ass_subscript */
+};
+
+PyTypeObject SparseDictMapped_Type = {
     PyVarObject_HEAD_INIT(NULL, 0)
-    "SparseDict_ValueIter",                     /* tp_name */
-    sizeof(dictiterobject),                     /* tp_basicsize */
-    0,                                          /* tp_itemsize */
-    (destructor)dictiter_tp_dealloc,            /* tp_dealloc */
+    "_sparsedict.SparseDictMapped",
+    sizeof(SparseDictMappedObject),
+    0,
+    (destructor)mapped_tp_dealloc,              /* tp_dealloc */
     0,                                          /* tp_print */
     0,                                          /* tp_getattr */
     0,                                          /* tp_setattr */
     0,                                          /* tp_compare */
-    0,                                          /* tp_repr */
+    (reprfunc)mapped_tp_repr,                   /* tp_repr */
     0,                                          /* tp_as_number */
-    0,                                          /* tp_as_sequence */
-    0,                                          /* tp_as_mapping */
-    0,                                          /* tp_hash */
+    &mapped_as_sequence,                        /* tp_as_sequence */
+    &mapped_as_mapping,                         /* tp_as_mapping */
+    PyObject_HashNotImplemented,                /* tp_hash */
     0,                                          /* tp_call */
     0,                                          /* tp_str */
     PyObject_GenericGetAttr,                    /* tp_getattro */
     0,                                          /* tp_setattro */
     0,                                          /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    Py_TPFLAGS_DEFAULT,                         /* tp_flags */
     0,                                          /* tp_doc */
-    (traverseproc)dictiter_tp_traverse,         /* tp_traverse */
+    0,                                          /* tp_traverse */
     0,                                          /* tp_clear */
     0,                                          /* tp_richcompare */
     0,                                          /* tp_weaklistoffset */
-    PyObject_SelfIter,                          /* tp_iter */
-    (iternextfunc)dictiter_iternextvalue,       /* tp_iternext */
-    dictiter_methods,                           /* tp_methods */
+    (getiterfunc)mapped_tp_iter,                /* tp_iter */
+    0,                                          /* tp_iternext */
+    mapped_methods,                             /* tp_methods */
 };
 
-PyTypeObject SparseDictIterItem_Type = {
+static PyMethodDef mappediter_methods[] = {
+    {"__length_hint__", (PyCFunction)mappediter_len_hint, METH_NOARGS},
+    {NULL,              NULL}           /* sentinel */
+};
+
+PyTypeObject SparseDictMappedIter_Type = {
     PyVarObject_HEAD_INIT(NULL, 0)
-    "SparseDict_ItemIter",                      /* tp_name */
-    sizeof(dictiterobject),                     /* tp_basicsize */
+    "SparseDictMapped_Iter",                    /* tp_name */
+    sizeof(mappediterobject),                   /* tp_basicsize */
     0,                                          /* tp_itemsize */
-    (destructor)dictiter_tp_dealloc,            /* tp_dealloc */
+    (destructor)mappediter_tp_dealloc,          /* tp_dealloc */
     0,                                          /* tp_print */
     0,                                          /* tp_getattr */
     0,                                          /* tp_setattr */
@@ -1867,508 +8427,843 @@ PyTypeObject SparseDictIterItem_Type = {
     PyObject_GenericGetAttr,                    /* tp_getattro */
     0,                                          /* tp_setattro */
     0,                                          /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    Py_TPFLAGS_DEFAULT,                         /* tp_flags */
     0,                                          /* tp_doc */
-    (traverseproc)dictiter_tp_traverse,         /* tp_traverse */
+    0,                                          /* tp_traverse */
     0,                                          /* tp_clear */
     0,                                          /* tp_richcompare */
     0,                                          /* tp_weaklistoffset */
     PyObject_SelfIter,                          /* tp_iter */
-    (iternextfunc)dictiter_iternextitem,        /* tp_iternext */
-    dictiter_methods,                           /* tp_methods */
+    (iternextfunc)mappediter_iternext,          /* tp_iternext */
+    mappediter_methods,                         /* tp_methods */
 };
 
+/* Binary dump
+
+   dump writes the table to a file object as a stream of frames (64-bit length and data,
+   ended by an empty frame), so that load reads exactly what was written. The stream has
+   a header, then the bitmap of every block followed by its items: hash, key and value.
+   Scalars are stored as in mapped files, other objects are pickled.
+
+   load allocates the blocks of the recorded geometry and fills the item arrays in place.
+   The hashes are recalculated and checked against the recorded ones: str and bytes hashes
+   differ between processes, int and float hashes between Python versions, so if any key
+   doesn't match the table is rehashed. A dict in the middle of an incremental resize
+   (or a Robin Hood dict with deleted entries) is written as a list of items. */
 
-/* Key, value and item views. */
+#define DUMP_MAGIC "SPDDUMP1"
+#define DUMP_FRAME_SIZE 65536
+
+/* Tags besides the mapped scalar types. */
+#define DUMP_PICKLE 16
+#define DUMP_DELETED 17
+
+#define DUMP_GEOMETRY 1 /* Items are grouped by block, deleted ones included. */
 
 typedef struct {
-    PyObject_HEAD
-    SparseDictObject *sdict;
-} dictviewobject;
+    char magic[8];
+    unsigned PY_LONG_LONG byte_order;
+    unsigned PY_LONG_LONG flags;
+    unsigned PY_LONG_LONG options;
+    unsigned PY_LONG_LONG block_size;
+    unsigned PY_LONG_LONG max_items;
+    unsigned PY_LONG_LONG num_blocks;
+    unsigned PY_LONG_LONG num_items; /* including the deleted ones */
+} dumpheader;
 
+typedef struct {
+    PyObject *write; /* bound write method of the file object */
+    PyObject *dumps; /* pickle.dumps */
+    char *buf;
+    size_t size;
+} dumpwriter;
 
-static void
-dictview_tp_dealloc(dictviewobject *dv)
+typedef struct {
+    PyObject *read;
+    PyObject *loads;
+    char *buf; /* buf[pos:size] is read from the file but not consumed */
+    size_t pos, size, capacity;
+    unsigned PY_LONG_LONG frame_left; /* bytes of the current frame still in the file */
+} dumpreader;
+
+Py_LOCAL(int)
+dumpwriter_flush(dumpwriter *w)
 {
-    Py_XDECREF(dv->sdict);
-    PyObject_GC_Del(dv);
+    PyObject *frame, *result;
+    unsigned PY_LONG_LONG size = w->size;
+
+    frame = PyBytes_FromStringAndSize(NULL, sizeof(size) + w->size);
+    if (frame == NULL)
+        return -1;
+    memcpy(PyBytes_AS_STRING(frame), &size, sizeof(size));
+    memcpy(PyBytes_AS_STRING(frame) + sizeof(size), w->buf, w->size);
+    result = PyObject_CallFunctionObjArgs(w->write, frame, NULL);
+    Py_DECREF(frame);
+    if (result == NULL)
+        return -1;
+    Py_DECREF(result);
+    w->size = 0;
+    return 0;
 }
 
-static int
-dictview_tp_traverse(dictviewobject *dv, visitproc visit, void *arg)
+Py_LOCAL(int)
+dumpwriter_write(dumpwriter *w, const void *data, size_t size)
 {
-    Py_VISIT(dv->sdict);
+    const char *p = (const char *)data;
+    size_t chunk;
+
+    while (size > 0) {
+        chunk = DUMP_FRAME_SIZE - w->size;
+        if (chunk > size)
+            chunk = size;
+        memcpy(w->buf + w->size, p, chunk);
+        w->size += chunk;
+        p += chunk;
+        size -= chunk;
+        if (w->size == DUMP_FRAME_SIZE && dumpwriter_flush(w) != 0)
+            return -1;
+    }
     return 0;
 }
 
-static PyObject *
-dictview_new(SparseDictObject *dict, PyTypeObject *type)
+Py_LOCAL(int)
+dumpwriter_write_object(dumpwriter *w, PyObject *obj)
 {
-    dictviewobject *dv = PyObject_GC_New(dictviewobject, type);
-    if (dv == NULL)
-        return NULL;
-    Py_INCREF(dict);
-    dv->sdict = dict;
-    PyObject_GC_Track(dv);
-    return (PyObject *)dv;
+    PyObject *pickled;
+    mappedobj m;
+    unsigned char tag;
+    unsigned PY_LONG_LONG size;
+    int ok, result = -1;
+
+    ok = mapped_encode(obj, &m, 0);
+#if PY_MAJOR_VERSION < 3
+    if (ok > 0 && PyLong_CheckExact(obj))
+        ok = 0; /* would be loaded as int */
+#endif
+    if (ok < 0) {
+        if (!PyErr_ExceptionMatches(PyExc_UnicodeEncodeError))
+            return -1;
+        PyErr_Clear(); /* lone surrogates */
+    }
+    if (ok <= 0) {
+        pickled = PyObject_CallFunction(w->dumps, "Oi", obj, -1);
+        if (pickled == NULL)
+            return -1;
+        tag = DUMP_PICKLE;
+        size = PyBytes_GET_SIZE(pickled);
+        if (dumpwriter_write(w, &tag, 1) == 0 && dumpwriter_write(w, &size, sizeof(size)) == 0 &&
+                dumpwriter_write(w, PyBytes_AS_STRING(pickled), (size_t)size) == 0)
+            result = 0;
+        Py_DECREF(pickled);
+        return result;
+    }
+
+    tag = (unsigned char)m.type;
+    size = (unsigned PY_LONG_LONG)m.size;
+    if (dumpwriter_write(w, &tag, 1) != 0)
+        goto Done;
+    if (MAPPED_IS_STRING(m.type)) {
+        if (dumpwriter_write(w, &size, sizeof(size)) != 0 || dumpwriter_write(w, m.data, (size_t)m.size) != 0)
+            goto Done;
+    }
+    else if (m.type == MAPPED_INT || m.type == MAPPED_FLOAT) {
+        if (dumpwriter_write(w, &m.payload, sizeof(m.payload)) != 0)
+            goto Done;
+    }
+    result = 0;
+Done:
+    Py_XDECREF(m.utf8);
+    return result;
 }
 
-static Py_ssize_t
-dictview_sq_len(dictviewobject *dv)
+/* Writes the value of an entry of a table with value type typed. */
+Py_LOCAL(int)
+dumpwriter_write_value(dumpwriter *w, int typed, PyObject *stored)
 {
-    Py_ssize_t len = 0;
-    if (dv->sdict != NULL)
-        len = SparseDict_SIZE(dv->sdict);
-    return len;
+    unsigned char tag = typed == OPTION_VALUE_I8 ? MAPPED_INT : MAPPED_FLOAT;
+    valuebits bits;
+
+    if (!typed)
+        return dumpwriter_write_object(w, stored);
+    bits.object = stored;
+    if (dumpwriter_write(w, &tag, 1) != 0 || dumpwriter_write(w, &bits.i8, sizeof(bits.i8)) != 0)
+        return -1;
+    return 0;
 }
 
-/* Return 1 if self is a subset of other, iterating over self;
-   0 if not; -1 if an error occurred. */
-static int
-all_contained_in(PyObject *self, PyObject *other)
+/* Writes the key of an entry of a table with key type typed. */
+Py_LOCAL(int)
+dumpwriter_write_key(dumpwriter *w, int typed, PyObject *stored)
 {
-    PyObject *iter = PyObject_GetIter(self);
-    int ok = 1;
+    valuebits bits;
 
-    if (iter == NULL)
-        return -1;
-    for (;;) {
-        PyObject *next = PyIter_Next(iter);
-        if (next == NULL) {
-            if (PyErr_Occurred())
-                ok = -1;
-            break;
-        }
-        ok = PySequence_Contains(other, next);
-        Py_DECREF(next);
-        if (ok <= 0)
-            break;
-    }
-    Py_DECREF(iter);
-    return ok;
+    if (!typed)
+        return dumpwriter_write_object(w, stored);
+    bits.i8 = key_i8_value(stored);
+    return dumpwriter_write_value(w, OPTION_VALUE_I8, bits.object);
 }
 
 static PyObject *
-dictview_tp_richcompare(PyObject *self, PyObject *other, int op)
+dict_py_dump(SparseDictObject *self, PyObject *fileobj)
 {
-    Py_ssize_t len_self, len_other;
-    int ok;
-    PyObject *result;
-
-    assert(self != NULL);
-    assert(SparseDictViewSet_Check(self));
-    assert(other != NULL);
+    PyObject *pickle = NULL, *result = NULL;
+    dumpwriter w = {NULL, NULL, NULL, 0};
+    dumpheader header;
+    dictentry *entries = NULL;
+    Py_hash_t *hashes = NULL;
+    bitmap_t *bitmaps = NULL;
+    Py_ssize_t num_entries = 0, num_blocks = self->num_blocks, b, k;
+    int geometry, j, num_items, typed = SparseDict_VALUE_TYPE(self), key_typed = SparseDict_KEY_TYPE(self);
+    unsigned char tag = DUMP_DELETED;
+
+    /* Bytes values are copied out of the arena and written as objects. */
+    if (typed == OPTION_VALUE_BYTES)
+        typed = 0;
+
+    geometry = !SparseDict_MIGRATING(self) && !((self->options & OPTION_ROBIN_HOOD) && self->num_deleted);
+    if (!geometry)
+        num_blocks = 0;
+
+    w.write = PyObject_GetAttrString(fileobj, "write");
+    if (w.write == NULL)
+        goto Done;
+    pickle = PyImport_ImportModule("pickle");
+    if (pickle == NULL)
+        goto Done;
+    w.dumps = PyObject_GetAttrString(pickle, "dumps");
+    if (w.dumps == NULL)
+        goto Done;
 
-    if (!PyAnySet_Check(other) && !SparseDictViewSet_Check(other)) {
-        Py_INCREF(Py_NotImplemented);
-        return Py_NotImplemented;
+    /* Take a snapshot: writes and pickling run Python code, which could change the dict. */
+    w.buf = PyMem_MALLOC(DUMP_FRAME_SIZE);
+    entries = PyMem_NEW(dictentry, self->num_items + 1);
+    hashes = PyMem_NEW(Py_hash_t, self->num_items + 1);
+    bitmaps = PyMem_NEW(bitmap_t, num_blocks + 1);
+    if (w.buf == NULL || entries == NULL || hashes == NULL || bitmaps == NULL) {
+        PyErr_NoMemory();
+        goto Done;
     }
-
-    len_self = PyObject_Size(self);
-    if (len_self < 0)
-        return NULL;
-    len_other = PyObject_Size(other);
-    if (len_other < 0)
-        return NULL;
-
-    ok = 0;
-    switch(op) {
-
-    case Py_NE:
-    case Py_EQ:
-        if (len_self == len_other)
-            ok = all_contained_in(self, other);
-        if (op == Py_NE && ok >= 0)
-            ok = !ok;
-        break;
-
-    case Py_LT:
-        if (len_self < len_other)
-            ok = all_contained_in(self, other);
-        break;
-
-      case Py_LE:
-          if (len_self <= len_other)
-              ok = all_contained_in(self, other);
-          break;
-
-    case Py_GT:
-        if (len_self > len_other)
-            ok = all_contained_in(other, self);
-        break;
-
-    case Py_GE:
-        if (len_self >= len_other)
-            ok = all_contained_in(other, self);
-        break;
-
+    if (geometry) {
+        for (b = 0; b < num_blocks; ++b) {
+            sparseblock *block = &self->blocks[b];
+            bitmaps[b] = block->bitmap;
+            num_items = SPARSEBLOCK_NUM_ITEMS(block);
+            for (j = 0; j < num_items; ++j) {
+                entries[num_entries] = block->items[j];
+                if (entries[num_entries].key == NULL)
+                    entries[num_entries].value = NULL; /* stale */
+                hashes[num_entries++] = SparseDict_HASH_CACHE(self) ? SPARSEBLOCK_HASHES(block)[j] : -1;
+            }
+        }
+    }
+    else {
+        SparseDict_FOR(self, entry)
+            entries[num_entries] = entry;
+            hashes[num_entries++] = -1;
+        SparseDict_ENDFOR(self, 0)
+    }
+    for (k = 0; k < num_entries; ++k) {
+        if (!key_typed)
+            Py_XINCREF(entries[k].key);
+        if (SparseDict_VALUE_TYPE(self) == OPTION_VALUE_BYTES && entries[k].key != NULL) {
+            entries[k].value = arena_box(self->arena, entries[k].value);
+            if (entries[k].value == NULL) {
+                num_entries = k + 1;
+                goto Done;
+            }
+        }
+        else if (!typed)
+            Py_XINCREF(entries[k].value);
+    }
+    for (k = 0; geometry && k < num_entries; ++k) {
+        if (hashes[k] == -1 && entries[k].key != NULL) {
+            hashes[k] = key_typed ? key_i8_hash(entries[k].key) : key_hash(entries[k].key);
+            if (hashes[k] == -1)
+                goto Done;
+        }
     }
-    if (ok < 0)
-        return NULL;
-    result = ok ? Py_True : Py_False;
-    Py_INCREF(result);
-    return result;
-}
 
-static PyObject *
-dictview_tp_repr(dictviewobject *dv)
-{
-    PyObject *seq;
-    PyObject *seq_str;
-    PyObject *result;
+    memcpy(header.magic, DUMP_MAGIC, sizeof(header.magic));
+    header.byte_order = MAPPED_BYTE_ORDER;
+    header.flags = geometry ? DUMP_GEOMETRY : 0;
+    header.options = self->options;
+    header.block_size = SPARSEBLOCK_SIZE;
+    header.max_items = SparseDict_MAX_ITEMS(self);
+    header.num_blocks = num_blocks;
+    header.num_items = num_entries;
+    if (dumpwriter_write(&w, &header, sizeof(header)) != 0)
+        goto Done;
 
-    seq = PySequence_List((PyObject *)dv);
-    if (seq == NULL)
-        return NULL;
+    k = 0;
+    for (b = 0; b < num_blocks || (!geometry && b == 0); ++b) {
+        Py_ssize_t end = geometry ? k + popcount(bitmaps[b]) : num_entries;
+        if (geometry && dumpwriter_write(&w, &bitmaps[b], sizeof(bitmap_t)) != 0)
+            goto Done;
+        for (; k < end; ++k) {
+            PY_LONG_LONG hash = hashes[k];
+            if (dumpwriter_write(&w, &hash, sizeof(hash)) != 0)
+                goto Done;
+            if (entries[k].key == NULL) {
+                if (dumpwriter_write(&w, &tag, 1) != 0)
+                    goto Done;
+            }
+            else if (dumpwriter_write_key(&w, key_typed, entries[k].key) != 0 ||
+                     dumpwriter_write_value(&w, typed, entries[k].value) != 0)
+                goto Done;
+        }
+    }
+    /* The last frame, then the empty one. */
+    if ((w.size > 0 && dumpwriter_flush(&w) != 0) || dumpwriter_flush(&w) != 0)
+        goto Done;
+    Py_INCREF(Py_None);
+    result = Py_None;
 
-#if PY_MAJOR_VERSION < 3
-    seq_str = PyObject_Repr(seq);
-    result = PyString_FromFormat("%s(%s)", Py_TYPE(dv)->tp_name, PyBytes_AS_STRING(seq_str));
-    Py_DECREF(seq_str);
-#else
-    result = PyString_FromFormat("%s(%R)", Py_TYPE(dv)->tp_name, seq);
-#endif
-    Py_DECREF(seq);
+Done:
+    if (entries != NULL) {
+        for (k = 0; k < num_entries; ++k) {
+            if (!key_typed)
+                Py_XDECREF(entries[k].key);
+            if (!typed)
+                Py_XDECREF(entries[k].value);
+        }
+    }
+    PyMem_FREE(entries);
+    PyMem_FREE(hashes);
+    PyMem_FREE(bitmaps);
+    PyMem_FREE(w.buf);
+    Py_XDECREF(w.write);
+    Py_XDECREF(w.dumps);
+    Py_XDECREF(pickle);
     return result;
 }
 
-static PyObject *
-dictkeys_tp_iter(dictviewobject *dv)
-{
-    if (dv->sdict == NULL)
-        Py_RETURN_NONE;
-    return dictiter_new(dv->sdict, &SparseDictIterKey_Type);
-}
-
-static int
-dictkeys_sq_contains(dictviewobject *dv, PyObject *obj)
+Py_LOCAL(int)
+dump_corrupt(void)
 {
-    if (dv->sdict == NULL)
-        return 0;
-    return dict_sq_contains(dv->sdict, obj);
+    PyErr_SetString(PyExc_ValueError, "corrupt or truncated SparseDict dump");
+    return -1;
 }
 
-static PyObject*
-dictviews_nb_sub(PyObject* self, PyObject *other)
+/* Reads exactly size bytes of the file. */
+Py_LOCAL(int)
+dumpreader_read_file(dumpreader *r, char *dst, size_t size)
 {
-    PyObject *result = PySet_New(self);
-    PyObject *tmp;
-    if (result == NULL)
-        return NULL;
+    PyObject *data;
+    size_t len;
 
-    tmp = PyObject_CallMethod(result, "difference_update", "O", other);
-    if (tmp == NULL) {
-        Py_DECREF(result);
-        return NULL;
+    while (size > 0) {
+        data = PyObject_CallFunction(r->read, "n", (Py_ssize_t)size);
+        if (data == NULL)
+            return -1;
+        if (!PyBytes_Check(data)) {
+            Py_DECREF(data);
+            PyErr_SetString(PyExc_TypeError, "load(): read() must return bytes");
+            return -1;
+        }
+        len = (size_t)PyBytes_GET_SIZE(data);
+        if (len == 0 || len > size) {
+            Py_DECREF(data);
+            return dump_corrupt();
+        }
+        memcpy(dst, PyBytes_AS_STRING(data), len);
+        Py_DECREF(data);
+        dst += len;
+        size -= len;
     }
-
-    Py_DECREF(tmp);
-    return result;
+    return 0;
 }
 
-static PyObject*
-dictviews_nb_and(PyObject* self, PyObject *other)
+/* Next size bytes of the stream, valid until the next call. */
+Py_LOCAL(const char *)
+dumpreader_get(dumpreader *r, size_t size)
 {
-    PyObject *result = PySet_New(self);
-    PyObject *tmp;
-    if (result == NULL)
-        return NULL;
+    const char *p;
+    size_t chunk;
 
-    tmp = PyObject_CallMethod(result, "intersection_update", "O", other);
-    if (tmp == NULL) {
-        Py_DECREF(result);
-        return NULL;
+    while (r->size - r->pos < size) {
+        if (r->frame_left == 0) {
+            if (dumpreader_read_file(r, (char *)&r->frame_left, sizeof(r->frame_left)) != 0)
+                return NULL;
+            /* Ended too early, or longer than the frames dump writes: the buffer only grows
+               by the frames actually read, not by the sizes the file claims. */
+            if (r->frame_left == 0 || r->frame_left > DUMP_FRAME_SIZE) {
+                dump_corrupt();
+                return NULL;
+            }
+        }
+        if (r->pos > 0) {
+            memmove(r->buf, r->buf + r->pos, r->size - r->pos);
+            r->size -= r->pos;
+            r->pos = 0;
+        }
+        chunk = (size_t)r->frame_left;
+        if (r->size + chunk > r->capacity) {
+            size_t capacity = r->size + chunk > 2 * r->capacity ? r->size + chunk : 2 * r->capacity;
+            char *buf = PyMem_REALLOC(r->buf, capacity);
+            if (buf == NULL) {
+                PyErr_NoMemory();
+                return NULL;
+            }
+            r->buf = buf;
+            r->capacity = capacity;
+        }
+        if (dumpreader_read_file(r, r->buf + r->size, chunk) != 0)
+            return NULL;
+        r->size += chunk;
+        r->frame_left -= chunk;
     }
-
-    Py_DECREF(tmp);
-    return result;
+    p = r->buf + r->pos;
+    r->pos += size;
+    return p;
 }
 
-static PyObject*
-dictviews_nb_or(PyObject* self, PyObject *other)
+Py_LOCAL(int)
+dumpreader_read(dumpreader *r, void *dst, size_t size)
 {
-    PyObject *result = PySet_New(self);
-    PyObject *tmp;
-    if (result == NULL)
-        return NULL;
-
-    tmp = PyObject_CallMethod(result, "update", "O", other);
-    if (tmp == NULL) {
-        Py_DECREF(result);
-        return NULL;
-    }
-
-    Py_DECREF(tmp);
-    return result;
+    const char *p = dumpreader_get(r, size);
+    if (p == NULL)
+        return -1;
+    memcpy(dst, p, size);
+    return 0;
 }
 
-static PyObject*
-dictviews_nb_xor(PyObject* self, PyObject *other)
+/* Reads an object, sets *obj to NULL for deleted entries. */
+Py_LOCAL(int)
+dumpreader_read_object(dumpreader *r, PyObject **obj)
 {
-    PyObject *result = PySet_New(self);
-    PyObject *tmp;
-    if (result == NULL)
-        return NULL;
-
-    tmp = PyObject_CallMethod(result, "symmetric_difference_update", "O", other);
-    if (tmp == NULL) {
-        Py_DECREF(result);
-        return NULL;
+    unsigned char tag;
+    unsigned PY_LONG_LONG size;
+    PY_LONG_LONG payload;
+    const char *data;
+    PyObject *pickled;
+
+    *obj = NULL;
+    if (dumpreader_read(r, &tag, 1) != 0)
+        return -1;
+    switch (tag) {
+    case DUMP_DELETED:
+        return 0;
+    case MAPPED_NONE:
+    case MAPPED_FALSE:
+    case MAPPED_TRUE:
+        *obj = mapped_scalar(tag, 0);
+        return 0;
+    case MAPPED_INT:
+    case MAPPED_FLOAT:
+        if (dumpreader_read(r, &payload, sizeof(payload)) != 0)
+            return -1;
+        *obj = mapped_scalar(tag, payload);
+        return *obj != NULL ? 0 : -1;
+    case MAPPED_BYTES:
+    case MAPPED_STR:
+    case DUMP_PICKLE:
+        if (dumpreader_read(r, &size, sizeof(size)) != 0)
+            return -1;
+        if (size > PY_SSIZE_T_MAX / 2)
+            return dump_corrupt();
+        data = dumpreader_get(r, (size_t)size);
+        if (data == NULL)
+            return -1;
+        if (tag == MAPPED_BYTES) {
+            *obj = PyBytes_FromStringAndSize(data, (Py_ssize_t)size);
+        }
+        else if (tag == MAPPED_STR) {
+            *obj = PyUnicode_DecodeUTF8(data, (Py_ssize_t)size, NULL);
+        }
+        else {
+            pickled = PyBytes_FromStringAndSize(data, (Py_ssize_t)size);
+            if (pickled == NULL)
+                return -1;
+            *obj = PyObject_CallFunctionObjArgs(r->loads, pickled, NULL);
+            Py_DECREF(pickled);
+        }
+        return *obj != NULL ? 0 : -1;
     }
-
-    Py_DECREF(tmp);
-    return result;
+    return dump_corrupt();
 }
 
-static PyObject*
-dictviews_py_isdisjoint(PyObject *self, PyObject *other)
+/* Reads the value of an entry of a table with value type typed. */
+Py_LOCAL(int)
+dumpreader_read_value(dumpreader *r, int typed, PyObject **stored)
 {
-    PyObject *it;
-    PyObject *item = NULL;
+    unsigned char tag;
+    valuebits bits;
 
-    if (self == other)
-        return PyBool_FromLong(dictview_sq_len((dictviewobject *)self) == 0);
+    if (!typed)
+        return dumpreader_read_object(r, stored);
+    *stored = NULL;
+    if (dumpreader_read(r, &tag, 1) != 0)
+        return -1;
+    if (tag != (typed == OPTION_VALUE_I8 ? MAPPED_INT : MAPPED_FLOAT))
+        return dump_corrupt();
+    if (dumpreader_read(r, &bits.i8, sizeof(bits.i8)) != 0)
+        return -1;
+    *stored = bits.object;
+    return 0;
+}
 
-    /* Iterate over the shorter object (only if other is a set,
-     * because PySequence_Contains may be expensive otherwise): */
-    if (PyAnySet_Check(other) || SparseDictViewSet_Check(other)) {
-        Py_ssize_t len_self = dictview_sq_len((dictviewobject *)self);
-        Py_ssize_t len_other = PyObject_Size(other);
-        if (len_other == -1)
-            return NULL;
+/* Reads the key of an entry of a table with key type typed, NULL for deleted entries. */
+Py_LOCAL(int)
+dumpreader_read_key(dumpreader *r, int typed, PyObject **stored)
+{
+    unsigned char tag;
+    PY_LONG_LONG value;
 
-        if ((len_other > len_self)) {
-            PyObject *tmp = other;
-            other = self;
-            self = tmp;
-        }
-    }
+    if (!typed)
+        return dumpreader_read_object(r, stored);
+    *stored = NULL;
+    if (dumpreader_read(r, &tag, 1) != 0)
+        return -1;
+    if (tag == DUMP_DELETED)
+        return 0;
+    if (tag != MAPPED_INT)
+        return dump_corrupt();
+    if (dumpreader_read(r, &value, sizeof(value)) != 0)
+        return -1;
+    *stored = key_i8_stored(value);
+    return *stored != NULL ? 0 : dump_corrupt();
+}
 
-    it = PyObject_GetIter(other);
-    if (it == NULL)
-        return NULL;
+/* Places the entries of block b read by load. Returns 1 if the recorded hashes match. */
+Py_LOCAL(int)
+dict_load_block(SparseDictObject *self, Py_ssize_t b, bitmap_t bitmap, dictentry *entries, Py_hash_t *hashes,
+                Py_hash_t *recorded, int num_items, lookupfunc *lookup)
+{
+    sparseblock *block = &self->blocks[b];
+    int j, layout = SparseDict_LAYOUT(self), match = 1;
 
-    while ((item = PyIter_Next(it)) != NULL) {
-        int contains = PySequence_Contains(self, item);
-        Py_DECREF(item);
-        if (contains == -1) {
-            Py_DECREF(it);
-            return NULL;
+    block->items = (dictentry *)items_alloc(SPARSEBLOCK_ITEMS_SIZE(num_items, layout));
+    if (block->items == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    block->bitmap = bitmap;
+    for (j = 0; j < num_items; ++j) {
+        PyObject *key = entries[j].key;
+        block->items[j] = entries[j];
+        if (layout & OPTION_HASH_CACHE)
+            SPARSEBLOCK_HASHES(block)[j] = hashes[j];
+        else if (layout & OPTION_FINGERPRINTS)
+            SPARSEBLOCK_FINGERPRINTS(block)[j] = FINGERPRINT(hashes[j]);
+        ++self->num_items;
+        if (key == NULL) {
+            ++self->num_deleted;
+            continue;
         }
-        if (contains) {
-            Py_DECREF(it);
-            Py_RETURN_FALSE;
+        match &= hashes[j] == recorded[j];
+        MAINTAIN_TRACKING(self, key, entries[j].value);
+        if (self->bloom != NULL) {
+            bloom_add(self->bloom, self->bloom_mask, hashes[j]);
+            ++self->bloom_added;
         }
+        if (SparseDict_KEY_TYPE(self))
+            *lookup = dict_lookup_i8;
+        else if (*lookup == NULL)
+            *lookup = key_lookup(key);
+        else if (*lookup != dict_lookup && key_lookup(key) != *lookup)
+            *lookup = dict_lookup;
     }
-    Py_DECREF(it);
-    if (PyErr_Occurred())
-        return NULL; /* PyIter_Next raised an exception. */
-    Py_RETURN_TRUE;
+    return match;
 }
 
 static PyObject *
-dictvalues_tp_iter(dictviewobject *dv)
+dict_py_load(PyObject *cls, PyObject *fileobj)
 {
-    if (dv->sdict == NULL)
-        Py_RETURN_NONE;
-    return dictiter_new(dv->sdict, &SparseDictIterValue_Type);
-}
+    PyObject *self = NULL, *pickle = NULL, *result = NULL;
+    SparseDictObject *sdict;
+    dumpreader r = {NULL, NULL, NULL, 0, 0, 0, 0};
+    dumpheader header;
+    dictentry entries[SPARSEBLOCK_SIZE];
+    Py_hash_t hashes[SPARSEBLOCK_SIZE], recorded[SPARSEBLOCK_SIZE];
+    sparseblock *blocks = NULL;
+    lookupfunc lookup = NULL;
+    bitmap_t bitmap = 0;
+    unsigned PY_LONG_LONG b, num_groups, remaining, terminator, slots;
+    Py_ssize_t max_items;
+    int j, num_items = 0, direct, match = 1, options, typed = 0, key_typed = 0, bytes_values;
+
+    self = PyObject_CallObject(cls, NULL);
+    if (self == NULL)
+        return NULL;
+    if (!SparseDict_Check(self)) {
+        PyErr_SetString(PyExc_TypeError, "load(): class must construct a SparseDict");
+        goto Done;
+    }
+    sdict = (SparseDictObject *)self;
+    r.read = PyObject_GetAttrString(fileobj, "read");
+    if (r.read == NULL)
+        goto Done;
+    pickle = PyImport_ImportModule("pickle");
+    if (pickle == NULL)
+        goto Done;
+    r.loads = PyObject_GetAttrString(pickle, "loads");
+    if (r.loads == NULL)
+        goto Done;
 
-static PyObject *
-dictitems_tp_iter(dictviewobject *dv)
-{
-    if (dv->sdict == NULL)
-        Py_RETURN_NONE;
-    return dictiter_new(dv->sdict, &SparseDictIterItem_Type);
-}
+    if (dumpreader_read(&r, &header, sizeof(header)) != 0)
+        goto Done;
+    if (memcmp(header.magic, DUMP_MAGIC, sizeof(header.magic)) != 0 || header.byte_order != MAPPED_BYTE_ORDER) {
+        PyErr_SetString(PyExc_ValueError, "load(): not a SparseDict dump");
+        goto Done;
+    }
+    options = (int)header.options;
+    if ((header.options & ~(unsigned PY_LONG_LONG)OPTIONS_ALL) != 0 || options_error(options) != NULL ||
+            header.max_items < INITIAL_ITEMS || (header.max_items & (header.max_items - 1)) != 0 ||
+            header.max_items > PY_SSIZE_T_MAX / 2 || header.num_items > header.max_items) {
+        dump_corrupt();
+        goto Done;
+    }
+    max_items = (Py_ssize_t)header.max_items;
+    typed = options & OPTIONS_VALUE_TYPE;
+    if (typed != SparseDict_VALUE_TYPE(sdict) && SparseDict_SIZE(sdict) != 0) {
+        PyErr_SetString(PyExc_ValueError, "load(): the dump has another value_type than the nonempty dict");
+        goto Done;
+    }
+    /* Bytes values are objects in the dump, inserting them puts them in the arena. */
+    bytes_values = typed == OPTION_VALUE_BYTES;
+    if (bytes_values)
+        typed = 0;
+    key_typed = options & OPTION_KEY_I8;
+    if (key_typed != SparseDict_KEY_TYPE(sdict) && SparseDict_SIZE(sdict) != 0) {
+        PyErr_SetString(PyExc_ValueError, "load(): the dump has another key_type than the nonempty dict");
+        goto Done;
+    }
 
-static int
-dictitems_sq_contains(dictviewobject *dv, PyObject *obj)
-{
-    PyObject *key, *value;
-    dictentry *entry;
+    /* Place the items as they were if the dump is of a table with the same blocks. */
+    direct = (header.flags & DUMP_GEOMETRY) && header.block_size == SPARSEBLOCK_SIZE &&
+             header.num_blocks == (header.max_items + SPARSEBLOCK_SIZE - 1) / SPARSEBLOCK_SIZE &&
+             SparseDict_SIZE(sdict) == 0 && !bytes_values;
+    if (dict_rebuild(sdict, direct ? max_items : SparseDict_MAX_ITEMS(sdict), options) != 0)
+        goto Done;
+    if (!direct && dict_resize_delta(sdict, (Py_ssize_t)header.num_items) != 0)
+        goto Done;
+    blocks = sdict->blocks;
+
+    /* Groups of items: blocks, or all the items. */
+    num_groups = (header.flags & DUMP_GEOMETRY) ? header.num_blocks : 1;
+    remaining = header.num_items;
+    for (b = 0; b < num_groups; ++b) {
+        unsigned PY_LONG_LONG count = remaining;
+        if (header.flags & DUMP_GEOMETRY) {
+            if (dumpreader_read(&r, &bitmap, sizeof(bitmap)) != 0)
+                goto Done;
+            count = popcount(bitmap);
+            /* No slots past the end of the block or of the table. */
+            slots = header.max_items - b * header.block_size;
+            if (slots > header.block_size)
+                slots = header.block_size;
+            if (count > remaining || (slots < 64 && (bitmap >> slots) != 0)) {
+                dump_corrupt();
+                goto Done;
+            }
+        }
+        remaining -= count;
+        /* Code run by unpickling or __hash__ could change the dict, then insert the rest. */
+        if (direct && (sdict->blocks != blocks || SparseDict_MAX_ITEMS(sdict) != max_items ||
+                       SparseDict_MIGRATING(sdict) || blocks[b].bitmap != 0 ||
+                       SparseDict_VALUE_TYPE(sdict) != typed || SparseDict_KEY_TYPE(sdict) != key_typed)) {
+            if (!match && dict_rebuild(sdict, SparseDict_MAX_ITEMS(sdict), sdict->options) != 0)
+                goto Done;
+            direct = 0;
+            match = 1;
+        }
+        while (count > 0) {
+            PY_LONG_LONG hash;
+            dictentry *entry = &entries[num_items];
+
+            entry->value = NULL;
+            if (dumpreader_read(&r, &hash, sizeof(hash)) != 0 || dumpreader_read_key(&r, key_typed, &entry->key) != 0)
+                goto Done;
+            recorded[num_items] = hashes[num_items] = (Py_hash_t)hash;
+            ++num_items;
+            --count;
+            if (entry->key != NULL) {
+                if (dumpreader_read_value(&r, typed, &entry->value) != 0)
+                    goto Done;
+                hashes[num_items - 1] = key_typed ? key_i8_hash(entry->key) : key_hash(entry->key);
+                if (hashes[num_items - 1] == -1)
+                    goto Done;
+            }
+            if (!direct) {
+                int status = 0;
+                if (entry->key != NULL) {
+                    PyObject *key = key_box(key_typed, entry->key), *value = value_box(typed, entry->value);
+                    status = key == NULL || value == NULL ? -1 : dict_insert_hash(sdict, key, hashes[0], value);
+                    Py_XDECREF(key);
+                    Py_XDECREF(value);
+                }
+                if (!key_typed)
+                    Py_XDECREF(entry->key);
+                entry->key = NULL;
+                if (!typed)
+                    Py_CLEAR(entry->value);
+                num_items = 0;
+                if (status != 0)
+                    goto Done;
+            }
+        }
+        if (direct) {
+            int status = num_items ? dict_load_block(sdict, (Py_ssize_t)b, bitmap, entries, hashes, recorded,
+                                                     num_items, &lookup) : 1;
+            if (status < 0)
+                goto Done;
+            match &= status;
+            num_items = 0; /* the block took the references */
+        }
+    }
+    if (remaining != 0 || r.pos != r.size || r.frame_left != 0 ||
+            dumpreader_read_file(&r, (char *)&terminator, sizeof(terminator)) != 0 || terminator != 0) {
+        if (!PyErr_Occurred())
+            dump_corrupt();
+        goto Done;
+    }
 
-    if (dv->sdict == NULL)
-        return 0;
-    if (!PyTuple_Check(obj) || PyTuple_GET_SIZE(obj) != 2)
-        return 0;
-    key = PyTuple_GET_ITEM(obj, 0);
-    value = PyTuple_GET_ITEM(obj, 1);
+    if (direct) {
+        if (lookup != NULL && !(sdict->options & OPTION_ROBIN_HOOD))
+            sdict->lookup = lookup;
+        /* Hashes have changed since the dump, place the items again. */
+        if (!match && dict_rebuild(sdict, max_items, sdict->options) != 0)
+            goto Done;
+    }
+    result = self;
+    self = NULL;
 
-    entry = (dv->sdict->lookup)(dv->sdict, key, -1, 0);
-    if (entry == NULL)
-        return -1;
-    if (entry->key == NULL)
-        return 0;
-    return PyObject_RichCompareBool(value, entry->value, Py_EQ);
+Done:
+    for (j = 0; j < num_items; ++j) {
+        if (!key_typed)
+            Py_XDECREF(entries[j].key);
+        if (!typed)
+            Py_XDECREF(entries[j].value);
+    }
+    PyMem_FREE(r.buf);
+    Py_XDECREF(r.read);
+    Py_XDECREF(r.loads);
+    Py_XDECREF(pickle);
+    Py_XDECREF(self);
+    return result;
 }
 
+/*  Module functions */
 
-static PySequenceMethods dictkeys_as_sequence = {
-    (lenfunc)dictview_sq_len,           /* sq_length */
-    0,                                  /* sq_concat */
-    0,                                  /* sq_repeat */
-    0,                                  /* sq_item */
-    0,                                  /* sq_slice */
-    0,                                  /* sq_ass_item */
-    0,                                  /* sq_ass_slice */
-    (objobjproc)dictkeys_sq_contains,   /* sq_contains */
-};
-
-static PyNumberMethods dictviews_as_number = {
-    0,                                  /*nb_add*/
-    (binaryfunc)dictviews_nb_sub,       /*nb_subtract*/
-    0,                                  /*nb_multiply*/
-    0,                                  /*nb_divide*/
-    0,                                  /*nb_remainder*/
-    0,                                  /*nb_divmod*/
-    0,                                  /*nb_power*/
-    0,                                  /*nb_negative*/
-    0,                                  /*nb_positive*/
-    0,                                  /*nb_absolute*/
-    0,                                  /*nb_bool*/
-    0,                                  /*nb_invert*/
-    0,                                  /*nb_lshift*/
-    0,                                  /*nb_rshift*/
-    (binaryfunc)dictviews_nb_and,       /*nb_and*/
-    (binaryfunc)dictviews_nb_xor,       /*nb_xor*/
-    (binaryfunc)dictviews_nb_or,        /*nb_or*/
-};
+/* Reconstructor of pickled typed dicts: cls(size, value_type=value_type, key_type=key_type). */
+static PyObject *
+module_new_typed(PyObject *module, PyObject *args)
+{
+    PyObject *cls, *size, *value_type, *key_type = Py_None, *cls_args, *kwds = NULL, *result = NULL;
 
-static PyMethodDef dictviews_methods[] = {
-    {"isdisjoint",      (PyCFunction)dictviews_py_isdisjoint,  METH_O},
-    {NULL,              NULL}           /* sentinel */
-};
+    if (!PyArg_ParseTuple(args, "OOO|O:_new_typed", &cls, &size, &value_type, &key_type))
+        return NULL;
+    cls_args = PyTuple_Pack(1, size);
+    if (cls_args == NULL)
+        return NULL;
+    kwds = Py_BuildValue("{sOsO}", "value_type", value_type, "key_type", key_type);
+    if (kwds != NULL)
+        result = PyObject_Call(cls, cls_args, kwds);
+    Py_DECREF(cls_args);
+    Py_XDECREF(kwds);
+    return result;
+}
 
-PyTypeObject SparseDictKeys_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "SparseDict_Keys",                          /* tp_name */
-    sizeof(dictviewobject),                     /* tp_basicsize */
-    0,                                          /* tp_itemsize */
-    (destructor)dictview_tp_dealloc,            /* tp_dealloc */
-    0,                                          /* tp_print */
-    0,                                          /* tp_getattr */
-    0,                                          /* tp_setattr */
-    0,                                          /* tp_reserved */
-    (reprfunc)dictview_tp_repr,                 /* tp_repr */
-    &dictviews_as_number,                       /* tp_as_number */
-    &dictkeys_as_sequence,                      /* tp_as_sequence */
-    0,                                          /* tp_as_mapping */
-    0,                                          /* tp_hash */
-    0,                                          /* tp_call */
-    0,                                          /* tp_str */
-    PyObject_GenericGetAttr,                    /* tp_getattro */
-    0,                                          /* tp_setattro */
-    0,                                          /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC | Py_TPFLAGS_CHECKTYPES,    /* tp_flags */
-    0,                                          /* tp_doc */
-    (traverseproc)dictview_tp_traverse,         /* tp_traverse */
-    0,                                          /* tp_clear */
-    dictview_tp_richcompare,                    /* tp_richcompare */
-    0,                                          /* tp_weaklistoffset */
-    (getiterfunc)dictkeys_tp_iter,              /* tp_iter */
-    0,                                          /* tp_iternext */
-    dictviews_methods,                          /* tp_methods */
+static PyMethodDef module_methods[] = {
+    {"_new_typed",  (PyCFunction)module_new_typed,     METH_VARARGS},
+    {NULL,          NULL}
 };
 
-static PySequenceMethods dictitems_as_sequence = {
-    (lenfunc)dictview_sq_len,           /* sq_length */
-    0,                                  /* sq_concat */
-    0,                                  /* sq_repeat */
-    0,                                  /* sq_item */
-    0,                                  /* sq_slice */
-    0,                                  /* sq_ass_item */
-    0,                                  /* sq_ass_slice */
-    (objobjproc)dictitems_sq_contains,  /* sq_contains */
-};
+/*  Module initialization */
 
-PyTypeObject SparseDictItems_Type = {
+PyTypeObject SparseDictSharedBlock_Type = {
     PyVarObject_HEAD_INIT(NULL, 0)
-    "SparseDict_Items",                         /* tp_name */
-    sizeof(dictviewobject),                     /* tp_basicsize */
+    "SparseDict_SharedBlock",                   /* tp_name */
+    sizeof(sharedblockobject),                  /* tp_basicsize */
     0,                                          /* tp_itemsize */
-    (destructor)dictview_tp_dealloc,            /* tp_dealloc */
+    (destructor)sharedblock_tp_dealloc,         /* tp_dealloc */
     0,                                          /* tp_print */
     0,                                          /* tp_getattr */
     0,                                          /* tp_setattr */
-    0,                                          /* tp_reserved */
-    (reprfunc)dictview_tp_repr,                 /* tp_repr */
-    &dictviews_as_number,                       /* tp_as_number */
-    &dictitems_as_sequence,                     /* tp_as_sequence */
+    0,                                          /* tp_compare */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
     0,                                          /* tp_as_mapping */
     0,                                          /* tp_hash */
     0,                                          /* tp_call */
     0,                                          /* tp_str */
-    PyObject_GenericGetAttr,                    /* tp_getattro */
+    0,                                          /* tp_getattro */
     0,                                          /* tp_setattro */
     0,                                          /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC | Py_TPFLAGS_CHECKTYPES,    /* tp_flags */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
     0,                                          /* tp_doc */
-    (traverseproc)dictview_tp_traverse,         /* tp_traverse */
-    0,                                          /* tp_clear */
-    dictview_tp_richcompare,                    /* tp_richcompare */
-    0,                                          /* tp_weaklistoffset */
-    (getiterfunc)dictitems_tp_iter,             /* tp_iter */
-    0,                                          /* tp_iternext */
-    dictviews_methods,                          /* tp_methods */
+    (traverseproc)sharedblock_tp_traverse,      /* tp_traverse */
+    0,                                          /* tp_clear (the dicts holding it clear) */
 };
 
-static PySequenceMethods dictvalues_as_sequence = {
-    (lenfunc)dictview_sq_len,           /* sq_length */
-    0,                                  /* sq_concat */
-    0,                                  /* sq_repeat */
-    0,                                  /* sq_item */
-    0,                                  /* sq_slice */
-    0,                                  /* sq_ass_item */
-    0,                                  /* sq_ass_slice */
-    0,                                  /* sq_contains */
+static PyBufferProcs arena_as_buffer = {
+#if PY_MAJOR_VERSION < 3
+    0,                                          /* bf_getreadbuffer */
+    0,                                          /* bf_getwritebuffer */
+    0,                                          /* bf_getsegcount */
+    0,                                          /* bf_getcharbuffer */
+#endif
+    (getbufferproc)arena_getbuffer,             /* bf_getbuffer */
+    (releasebufferproc)arena_releasebuffer,     /* bf_releasebuffer */
 };
 
-PyTypeObject SparseDictValues_Type = {
+PyTypeObject SparseDictArena_Type = {
     PyVarObject_HEAD_INIT(NULL, 0)
-    "SparseDict_Values",                        /* tp_name */
-    sizeof(dictviewobject),                     /* tp_basicsize */
+    "SparseDict_Arena",                         /* tp_name */
+    sizeof(arenaobject),                        /* tp_basicsize */
     0,                                          /* tp_itemsize */
-    (destructor)dictview_tp_dealloc,            /* tp_dealloc */
+    (destructor)arena_tp_dealloc,               /* tp_dealloc */
     0,                                          /* tp_print */
     0,                                          /* tp_getattr */
     0,                                          /* tp_setattr */
-    0,                                          /* tp_reserved */
-    (reprfunc)dictview_tp_repr,                 /* tp_repr */
+    0,                                          /* tp_compare */
+    0,                                          /* tp_repr */
     0,                                          /* tp_as_number */
-    &dictvalues_as_sequence,                    /* tp_as_sequence */
+    0,                                          /* tp_as_sequence */
     0,                                          /* tp_as_mapping */
     0,                                          /* tp_hash */
     0,                                          /* tp_call */
     0,                                          /* tp_str */
-    PyObject_GenericGetAttr,                    /* tp_getattro */
+    0,                                          /* tp_getattro */
     0,                                          /* tp_setattro */
-    0,                                          /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
-    0,                                          /* tp_doc */
-    (traverseproc)dictview_tp_traverse,         /* tp_traverse */
-    0,                                          /* tp_clear */
-    0,                                          /* tp_richcompare */
-    0,                                          /* tp_weaklistoffset */
-    (getiterfunc)dictvalues_tp_iter,            /* tp_iter */
+    &arena_as_buffer,                           /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /* tp_flags */
 };
 
-/*  Module initialization */
-
 Py_LOCAL(int)
 sparsedict_register(PyObject *module)
 {
+    popcount_init();
+#ifdef HAVE_TYPE_VECTORCALL
+    SparseDict_Type.tp_vectorcall = dict_vectorcall;
+#endif
+
     if (PyType_Ready(&SparseDict_Type) != 0 ||
         PyType_Ready(&SparseDictIterKey_Type) != 0 ||
         PyType_Ready(&SparseDictIterValue_Type) != 0 ||
         PyType_Ready(&SparseDictIterItem_Type) != 0 ||
         PyType_Ready(&SparseDictKeys_Type) != 0 ||
         PyType_Ready(&SparseDictValues_Type) != 0 ||
-        PyType_Ready(&SparseDictItems_Type) != 0)
+        PyType_Ready(&SparseDictItems_Type) != 0 ||
+        PyType_Ready(&SparseDictMapped_Type) != 0 ||
+        PyType_Ready(&SparseDictMappedIter_Type) != 0 ||
+        PyType_Ready(&SparseDictSharedBlock_Type) != 0 ||
+        PyType_Ready(&SparseDictArena_Type) != 0 ||
+        PyType_Ready(&SparseSet_Type) != 0 ||
+        PyType_Ready(&SparseSetIter_Type) != 0)
         return -1;
 
     Py_INCREF(&SparseDict_Type);
     PyModule_AddObject(module, "SparseDict", (PyObject *)&SparseDict_Type);
+    Py_INCREF(&SparseDictMapped_Type);
+    PyModule_AddObject(module, "SparseDictMapped", (PyObject *)&SparseDictMapped_Type);
+    Py_INCREF(&SparseSet_Type);
+    PyModule_AddObject(module, "SparseSet", (PyObject *)&SparseSet_Type);
+
+    new_typed = PyObject_GetAttrString(module, "_new_typed");
+    if (new_typed == NULL)
+        return -1;
 
     return 0;
 }
@@ -2376,7 +9271,7 @@ sparsedict_register(PyObject *module)
 #if PY_MAJOR_VERSION < 3
 PyMODINIT_FUNC init_sparsedict(void)
 {
-    PyObject *module = Py_InitModule("_sparsedict", NULL);
+    PyObject *module = Py_InitModule("_sparsedict", module_methods);
     if (module == NULL)
         return;
 
@@ -2389,6 +9284,9 @@ PyMODINIT_FUNC PyInit__sparsedict()
     static PyModuleDef module_def = {
         PyModuleDef_HEAD_INIT,
         "_sparsedict",
+        NULL,
+        0,
+        module_methods,
     };
     PyObject *module = PyModule_Create(&module_def);
     if (module == NULL)
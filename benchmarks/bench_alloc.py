@@ -0,0 +1,60 @@
+"""Insert throughput and memory of the item array allocator.
+
+usage: python benchmarks/bench_alloc.py [num_items ...]
+
+Run it against both allocators and compare the output:
+
+    python setup.py build_ext --inplace --force
+    python benchmarks/bench_alloc.py 1e6 1e7
+    CFLAGS=-DNO_SLAB_ALLOC python setup.py build_ext --inplace --force
+    python benchmarks/bench_alloc.py 1e6 1e7
+
+Every measurement runs in a fresh process, so the RSS numbers are not
+affected by memory kept by the allocators from the previous runs.
+"""
+import os
+import subprocess
+import sys
+
+from common import print_table, timer, xrange
+from sparsedict import SparseDict
+
+
+def rss():
+    """Current resident set size in bytes (Linux only)."""
+    with open('/proc/self/statm') as f:
+        return int(f.read().split()[1]) * os.sysconf('SC_PAGE_SIZE')
+
+
+def child(n, presize):
+    import gc
+    gc.disable()
+    keys = list(xrange(n))
+    before = rss()
+    start = timer()
+    d = SparseDict(n) if presize else SparseDict()
+    for k in keys:
+        d[k] = None
+    elapsed = timer() - start
+    after = rss()
+    stats = d._stats()
+    print('%s %f %d %d' % (stats['allocator'], elapsed, after - before, stats['items_bytes']))
+
+
+def main():
+    if sys.argv[1:2] == ['--child']:
+        child(int(sys.argv[2]), sys.argv[3] == 'presized')
+        return
+    sizes = [int(float(arg)) for arg in sys.argv[1:]] or [10 ** 6, 10 ** 7]
+    rows = []
+    for n in sizes:
+        for mode in ('presized', 'growing'):
+            output = subprocess.check_output([sys.executable, os.path.abspath(__file__), '--child', str(n), mode])
+            allocator, elapsed, rss_delta, items_bytes = output.decode().split()
+            rows.append(['%.0e' % n, mode, allocator, '%.2f' % (n / float(elapsed) / 1e6),
+                         '%.1f' % (int(rss_delta) / 1048576.0), '%.1f' % (int(items_bytes) / 1048576.0)])
+    print_table(('items', 'table', 'allocator', 'Minserts/s', 'RSS MB', 'items MB'), rows)
+
+
+if __name__ == '__main__':
+    main()
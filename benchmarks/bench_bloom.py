@@ -0,0 +1,64 @@
+"""Miss-heavy lookups with and without the Bloom filter.
+
+usage: python benchmarks/bench_bloom.py [num_items ...]
+
+Probes a dict with a stream of keys of which MISS_RATIO are absent, the way
+a dedup pipeline checks incoming records against the ones it has seen.
+Reports `in` and get() throughput, the measured and the estimated false
+positive rates of the filter and its memory next to the item arrays'.
+"""
+import random
+
+from common import best_of, make_keys, print_table, xrange
+from sparsedict import SparseDict
+
+MISS_RATIO = 0.95
+LOOKUPS = 10 ** 6
+
+
+def bench(key_type, n, bloom):
+    keys = make_keys(key_type, 2 * n)
+    d = SparseDict()
+    d.configure(bloom=bloom)
+    for k in keys[:n]:
+        d[k] = k
+    random.seed(0)
+    sample = [keys[n + random.randrange(n)] if random.random() < MISS_RATIO else keys[random.randrange(n)]
+              for _ in xrange(LOOKUPS)]
+    get = d.get
+
+    def contains():
+        for k in sample:
+            k in d
+
+    def get_loop():
+        for k in sample:
+            get(k)
+
+    times = [best_of(contains), best_of(get_loop)]
+    stats = d._stats()
+    checked = stats['bloom_rejects'] + stats['bloom_false_positives']
+    # misses with an empty home slot are answered without the filter
+    measured = checked and '%.4f' % (float(stats['bloom_false_positives']) / checked) or '-'
+    return times, measured, stats['bloom_false_positive_rate'], stats['bloom_bytes'], stats['items_bytes']
+
+
+def main():
+    import sys
+    sizes = [int(float(arg)) for arg in sys.argv[1:]] or [10 ** 5, 10 ** 6, 10 ** 7]
+    rows = []
+    for n in sizes:
+        for key_type in ('int', 'str'):
+            for bloom in (False, True):
+                times, measured, estimated, bloom_bytes, items_bytes = bench(key_type, n, bloom)
+                rows.append(['%.0e' % n, key_type, bloom and 'bloom' or 'off'] +
+                            ['%.2f' % (LOOKUPS / t / 1e6) for t in times] +
+                            [measured, '%.4f' % estimated, '%.1f' % (bloom_bytes / 1048576.0),
+                             '%.1f' % (items_bytes / 1048576.0)])
+    print('Mlookups/s, %d%% misses' % (MISS_RATIO * 100))
+    print_table(('items', 'keys', 'filter', 'k in d', 'd.get(k)', 'FP rate', 'est. FP rate', 'filter MB',
+                 'items MB'), rows)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,51 @@
+"""Building a SparseDict from parallel key and value lists.
+
+usage: python benchmarks/bench_bulk_build.py [num_items ...]
+
+Compares from_arrays with the constructor and an insert loop, and with
+dict(zip()) for reference.
+"""
+import array
+
+from common import best_of, make_keys, print_table, xrange
+from sparsedict import SparseDict
+
+
+def bench(key_type, n):
+    keys = make_keys(key_type, n)
+    values = list(xrange(n))
+
+    def insert_loop():
+        d = SparseDict()
+        for k, v in zip(keys, values):
+            d[k] = v
+
+    def from_arrays_int_array():
+        SparseDict.from_arrays(int_keys, values)
+
+    tests = [
+        ('SparseDict(zip())', lambda: SparseDict(zip(keys, values))),
+        ('insert loop', insert_loop),
+        ('from_arrays', lambda: SparseDict.from_arrays(keys, values)),
+        ('dict(zip())', lambda: dict(zip(keys, values))),
+    ]
+    if key_type == 'int':
+        int_keys = array.array('q' if hasattr(array, 'typecodes') and 'q' in array.typecodes else 'l', keys)
+        tests.insert(3, ('from_arrays(array)', from_arrays_int_array))
+    repeat = 1 if n >= 10 ** 7 else 3
+    return [(name, best_of(func, repeat)) for name, func in tests]
+
+
+def main():
+    import sys
+    sizes = [int(float(arg)) for arg in sys.argv[1:]] or [10 ** 5, 10 ** 6, 10 ** 7]
+    rows = []
+    for n in sizes:
+        for key_type in ('int', 'str'):
+            for name, t in bench(key_type, n):
+                rows.append(['%.0e' % n, key_type, name, '%.3f' % t, '%.2f' % (n / t / 1e6)])
+    print_table(('items', 'keys', 'build', 'seconds', 'Mitems/s'), rows)
+
+
+if __name__ == '__main__':
+    main()
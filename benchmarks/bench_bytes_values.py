@@ -0,0 +1,82 @@
+"""Tables of short bytes values with object values and with value_type='bytes'.
+
+usage: python benchmarks/bench_bytes_values.py [num_items ...]
+
+Builds a table of int keys to bytes values of VALUE_LENGTHS with plain object
+values and with value_type='bytes', then reports the build time, get() and
+get_view() throughput, the table memory (__sizeof__, the item arrays and the
+arena) and the Python heap memory the build allocates (the int keys, and the
+value objects or the arena), measured with tracemalloc (Python 3.4+, '-'
+otherwise).
+"""
+import random
+
+from common import best_of, print_table, timer, xrange
+from sparsedict import SparseDict
+
+try:
+    import tracemalloc
+except ImportError:
+    tracemalloc = None
+
+VALUE_LENGTHS = (8, 64)
+
+
+def build(n, value_type, length):
+    d = SparseDict(n, value_type=value_type) if value_type else SparseDict(n)
+    value = b'x' * (length - 8)
+    for i in xrange(n):
+        d[i] = value + ('%08x' % i).encode('ascii')
+    return d
+
+
+def bench(n, value_type, length):
+    start = timer()
+    d = build(n, value_type, length)
+    build_time = timer() - start
+    heap_bytes = '-'
+    if tracemalloc is not None:
+        d = None
+        tracemalloc.start()
+        before = tracemalloc.get_traced_memory()[0]
+        d = build(n, value_type, length)
+        heap_bytes = '%.1f' % ((tracemalloc.get_traced_memory()[0] - before) / 1048576.0)
+        tracemalloc.stop()
+    random.seed(0)
+    sample = [random.randrange(n) for _ in xrange(min(n, 10 ** 5))]
+    get = d.get
+
+    def get_loop():
+        for k in sample:
+            get(k)
+
+    get_rate = len(sample) / best_of(get_loop)
+    view_rate = '-'
+    if value_type:
+        get_view = d.get_view
+
+        def view_loop():
+            for k in sample:
+                get_view(k)
+
+        view_rate = '%.2f' % (len(sample) / best_of(view_loop) / 1e6)
+    return build_time, get_rate, view_rate, d.__sizeof__(), heap_bytes
+
+
+def main():
+    import sys
+    sizes = [int(float(arg)) for arg in sys.argv[1:]] or [10 ** 5, 10 ** 6]
+    rows = []
+    for n in sizes:
+        for length in VALUE_LENGTHS:
+            for value_type in (None, 'bytes'):
+                build_time, get_rate, view_rate, table_bytes, heap_bytes = bench(n, value_type, length)
+                rows.append(['%.0e' % n, length, value_type or 'object', '%.1f' % (build_time * 1e3),
+                             '%.2f' % (get_rate / 1e6), view_rate, '%.1f' % (table_bytes / 1048576.0),
+                             heap_bytes])
+    print_table(('items', 'value len', 'value_type', 'build ms', 'Mget/s', 'Mget_view/s', 'table MB',
+                 'heap MB'), rows)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,51 @@
+"""Memory held by deleted entries, with and without compaction.
+
+usage: python benchmarks/bench_compact.py [num_items ...]
+
+Builds a dict, deletes a random 90% of the keys and reports the delete
+throughput and the item array memory: as is, after an explicit compact()
+and with the auto_compact option on during the deletes.
+"""
+import random
+
+from common import print_table, timer, xrange
+from sparsedict import SparseDict
+
+
+def bench(n, auto_compact):
+    d = SparseDict()
+    d.configure(auto_compact=auto_compact)
+    for i in xrange(n):
+        d[i] = i
+    built = d._stats()['items_bytes']
+    keys = list(xrange(n))
+    random.seed(0)
+    random.shuffle(keys)
+    start = timer()
+    for k in keys[:n * 9 // 10]:
+        del d[k]
+    elapsed = timer() - start
+    after = d._stats()['items_bytes']
+    start = timer()
+    d.compact()
+    compact_time = timer() - start
+    stats = d._stats()
+    return built, elapsed, after, stats['items_bytes'], compact_time, stats['num_compactions']
+
+
+def main():
+    import sys
+    sizes = [int(float(arg)) for arg in sys.argv[1:]] or [10 ** 5, 10 ** 6]
+    rows = []
+    for n in sizes:
+        for auto_compact in (False, True):
+            built, elapsed, after, compacted, compact_time, num = bench(n, auto_compact)
+            rows.append(['%.0e' % n, auto_compact and 'auto' or 'off', '%.2f' % (n * 0.9 / elapsed / 1e6),
+                         '%.1f' % (built / 1048576.0), '%.1f' % (after / 1048576.0),
+                         '%.1f' % (compacted / 1048576.0), '%.1f' % (compact_time * 1e3), num])
+    print_table(('items', 'compact', 'Mdeletes/s', 'built MB', 'deleted MB', 'compact() MB', 'compact() ms',
+                 'compactions'), rows)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,40 @@
+"""copy() versus rebuilding the dict from its items.
+
+usage: python benchmarks/bench_copy.py [num_items ...]
+
+copy() duplicates the item arrays block by block; SparseDict(d) inserts
+every item into a new table, which is what copy() used to do. dict.copy()
+is given for reference. Deleted entries are copied along and compacted in
+the copy; once there are enough of them that compaction would rehash it,
+copy() reinserts the items like SparseDict(d).
+"""
+from common import best_of, print_table, xrange
+from sparsedict import SparseDict
+
+DELETED = [0, 16, 3]
+
+
+def bench(key_type, n, every):
+    keys = [('key%d' % i if key_type == 'str' else i) for i in xrange(n)]
+    d = SparseDict((k, None) for k in keys)
+    if every:
+        for k in keys[::every]:
+            del d[k]
+    plain = dict(d)
+    return [best_of(d.copy), best_of(lambda: SparseDict(d)), best_of(plain.copy)]
+
+
+def main():
+    import sys
+    sizes = [int(float(arg)) for arg in sys.argv[1:]] or [10 ** 4, 10 ** 5, 10 ** 6]
+    rows = []
+    for n in sizes:
+        for key_type in ('int', 'str'):
+            for every in DELETED:
+                rows.append(['%.0e' % n, key_type, every and '1/%d' % every or '0'] +
+                            ['%.2f' % (t * 1e3) for t in bench(key_type, n, every)])
+    print_table(('items', 'keys', 'deleted', 'copy() ms', 'SparseDict(d) ms', 'dict.copy() ms'), rows)
+
+
+if __name__ == '__main__':
+    main()
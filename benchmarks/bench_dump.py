@@ -0,0 +1,53 @@
+"""dump()/load() versus pickle.
+
+usage: python benchmarks/bench_dump.py [num_items ...]
+
+Saves a dict to an in-memory file with dump() and with the highest pickle
+protocol, then loads it back in the same process, where load() places the
+items at their recorded slots. Reports dump and load times and the sizes of
+both formats.
+"""
+import io
+import pickle
+
+from common import best_of, print_table, xrange
+from sparsedict import SparseDict
+
+
+def make_dict(key_type, n):
+    if key_type == 'str':
+        return SparseDict((u'key%d' % i, i) for i in xrange(n))
+    return SparseDict((i * 2654435761 % 2 ** 61, float(i)) for i in xrange(n))
+
+
+def bench(key_type, n):
+    d = make_dict(key_type, n)
+
+    def dump():
+        f = io.BytesIO()
+        d.dump(f)
+        return f.getvalue()
+
+    def dumps():
+        return pickle.dumps(d, pickle.HIGHEST_PROTOCOL)
+
+    data, pickled = dump(), dumps()
+    times = [best_of(dump), best_of(dumps),
+             best_of(lambda: SparseDict.load(io.BytesIO(data))), best_of(lambda: pickle.loads(pickled))]
+    return times, len(data), len(pickled)
+
+
+def main():
+    import sys
+    sizes = [int(float(arg)) for arg in sys.argv[1:]] or [10 ** 4, 10 ** 5, 10 ** 6]
+    rows = []
+    for n in sizes:
+        for key_type in ('int', 'str'):
+            times, dump_size, pickle_size = bench(key_type, n)
+            rows.append(['%.0e' % n, key_type] + ['%.1f' % (t * 1e3) for t in times] +
+                        ['%.1f' % (dump_size / 1048576.0), '%.1f' % (pickle_size / 1048576.0)])
+    print_table(('items', 'keys', 'dump ms', 'pickle ms', 'load ms', 'unpickle ms', 'dump MB', 'pickle MB'), rows)
+
+
+if __name__ == '__main__':
+    main()
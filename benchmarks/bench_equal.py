@@ -0,0 +1,37 @@
+"""Equality of dicts with the same table size.
+
+usage: python benchmarks/bench_equal.py [num_items ...]
+
+Compares a table with its snapshot (shared blocks are skipped), with its
+copy (same keys at the same places) and with a dict built from the same
+items in reverse order, where the keys that collided land elsewhere and are
+looked up. dict == dict is given for reference.
+"""
+from common import best_of, print_table, xrange
+from sparsedict import SparseDict
+
+
+def bench(key_type, n):
+    keys = [('key%d' % i if key_type == 'str' else i * 7919) for i in xrange(n)]
+    d = SparseDict((k, k) for k in keys)
+    snapshot = d.snapshot()
+    copy = d.copy()
+    reverse = SparseDict((k, k) for k in reversed(keys))
+    plain = dict(d)
+    plain_copy = dict(d)
+    return [best_of(lambda: d == snapshot), best_of(lambda: d == copy), best_of(lambda: d == reverse),
+            best_of(lambda: plain == plain_copy)]
+
+
+def main():
+    import sys
+    sizes = [int(float(arg)) for arg in sys.argv[1:]] or [10 ** 5, 10 ** 6]
+    rows = []
+    for n in sizes:
+        for key_type in ('int', 'str'):
+            rows.append(['%.0e' % n, key_type] + ['%.2f' % (t * 1e3) for t in bench(key_type, n)])
+    print_table(('items', 'keys', 'snapshot ms', 'copy ms', 'reversed ms', 'dict ms'), rows)
+
+
+if __name__ == '__main__':
+    main()
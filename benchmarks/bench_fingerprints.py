@@ -0,0 +1,74 @@
+"""Lookups of keys with a Python level __eq__, with and without fingerprints.
+
+usage: python benchmarks/bench_fingerprints.py [num_items ...]
+
+Every probe that lands on another key calls its __eq__ unless the entry
+layout can tell the keys apart: fingerprints store a byte of the hash per
+entry, the hash cache all of it. Reports lookup throughput for present and
+missing keys, __eq__ calls per lookup and the item array memory.
+"""
+import random
+
+from common import best_of, print_table, xrange
+from sparsedict import SparseDict
+
+CONFIGS = [
+    ('plain', dict()),
+    ('fingerprints', dict(fingerprints=True)),
+    ('hash_cache', dict(hash_cache=True)),
+]
+
+
+class Key(object):
+    __slots__ = ('value', 'hash')
+    eq_calls = 0
+
+    def __init__(self, value):
+        self.value = value
+        self.hash = hash('key%d' % value)
+
+    def __hash__(self):
+        return self.hash
+
+    def __eq__(self, other):
+        Key.eq_calls += 1
+        return self.value == other.value
+
+
+def bench(n, options):
+    keys = [Key(i) for i in xrange(n)]
+    d = SparseDict()
+    d.configure(**options)
+    for k in keys:
+        d[k] = k.value
+    random.seed(0)
+    hits = [Key(random.randrange(n)) for _ in xrange(min(n, 10 ** 5))]
+    misses = [Key(n + i) for i in xrange(len(hits))]
+    get = d.get
+
+    def lookup(sample):
+        return lambda: [get(k) for k in sample]
+
+    hit_time = best_of(lookup(hits))
+    miss_time = best_of(lookup(misses))
+    Key.eq_calls = 0
+    lookup(hits)()
+    lookup(misses)()
+    eq_per_lookup = float(Key.eq_calls) / (2 * len(hits))
+    return len(hits) / hit_time, len(misses) / miss_time, eq_per_lookup, d._stats()['items_bytes']
+
+
+def main():
+    import sys
+    sizes = [int(float(arg)) for arg in sys.argv[1:]] or [10 ** 4, 10 ** 5, 10 ** 6]
+    rows = []
+    for n in sizes:
+        for name, options in CONFIGS:
+            hit, miss, eq_per_lookup, items_bytes = bench(n, options)
+            rows.append(['%.0e' % n, name, '%.2f' % (hit / 1e6), '%.2f' % (miss / 1e6), '%.3f' % eq_per_lookup,
+                         '%.1f' % (items_bytes / 1048576.0)])
+    print_table(('items', 'layout', 'Mhits/s', 'Mmisses/s', '__eq__/lookup', 'items MB'), rows)
+
+
+if __name__ == '__main__':
+    main()
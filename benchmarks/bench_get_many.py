@@ -0,0 +1,68 @@
+"""Batched lookups with get_many/contains_many vs a Python loop of d.get.
+
+usage: python benchmarks/bench_get_many.py [num_items ...]
+
+Looks up a random sample of keys (half of them missing) in batches of
+BATCH keys, the way a caller joining two data sets would. Large tables
+don't fit in the CPU caches, which is where the prefetching of get_many
+pays off.
+"""
+import random
+
+from common import best_of, make_keys, print_table, xrange
+from sparsedict import SparseDict
+
+BATCH = 1000
+LOOKUPS = 10 ** 6
+
+
+def bench(key_type, n):
+    keys = make_keys(key_type, 2 * n)
+    d = SparseDict()
+    for k in keys[:n]:
+        d[k] = k
+    random.seed(0)
+    sample = [keys[random.randrange(2 * n)] for _ in xrange(LOOKUPS)]
+    batches = [sample[i:i + BATCH] for i in xrange(0, LOOKUPS, BATCH)]
+    get = d.get
+
+    def loop():
+        for batch in batches:
+            [get(k) for k in batch]
+
+    def map_get():
+        for batch in batches:
+            list(map(get, batch))
+
+    def get_many():
+        for batch in batches:
+            d.get_many(batch)
+
+    def contains_loop():
+        for batch in batches:
+            [k in d for k in batch]
+
+    def contains_many():
+        for batch in batches:
+            d.contains_many(batch)
+
+    assert d.get_many(sample) == [get(k) for k in sample]
+    return [best_of(f) for f in (loop, map_get, get_many, contains_loop, contains_many)]
+
+
+def main():
+    import sys
+    sizes = [int(float(arg)) for arg in sys.argv[1:]] or [10 ** 4, 10 ** 6, 10 ** 7]
+    rows = []
+    for n in sizes:
+        for key_type in ('int', 'str'):
+            times = bench(key_type, n)
+            rows.append(['%.0e' % n, key_type] + ['%.2f' % (LOOKUPS / t / 1e6) for t in times] +
+                        ['%.2fx' % (times[0] / times[2])])
+    print('Mlookups/s, batches of %d keys' % BATCH)
+    print_table(('items', 'keys', '[d.get(k)]', 'map(d.get)', 'get_many', '[k in d]', 'contains_many',
+                 'speedup'), rows)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,67 @@
+"""Resize time and lookup throughput with and without the hash cache.
+
+usage: python benchmarks/bench_hash_cache.py [num_items]
+"""
+from common import best_of, size_arg, print_table, xrange
+from sparsedict import SparseDict
+
+
+class Key(object):
+    """Key with a Python level __hash__ and __eq__."""
+    __slots__ = ('value',)
+
+    def __init__(self, value):
+        self.value = value
+
+    def __hash__(self):
+        return hash(self.value)
+
+    def __eq__(self, other):
+        return self.value == other.value
+
+
+def key_sets(n):
+    return [
+        ('str', [str(i) for i in xrange(n)]),
+        ('tuple', [(i, str(i)) for i in xrange(n)]),
+        ('object', [Key(i) for i in xrange(n)]),
+    ]
+
+
+def build(keys, hash_cache):
+    d = SparseDict()
+    d.configure(hash_cache=hash_cache)
+    for key in keys:
+        d[key] = None
+    return d
+
+
+def bench(keys, hash_cache):
+    d = build(keys, hash_cache)
+
+    def resize(d):
+        d.resize(len(d) * 4)
+
+    def lookup():
+        for key in keys:
+            d[key]
+
+    resize_time = best_of(resize, setup=lambda: build(keys, hash_cache))
+    lookup_time = best_of(lookup)
+    return resize_time, len(keys) / lookup_time, d._stats()['entry_size']
+
+
+def main():
+    n = size_arg(200000)
+    rows = []
+    for name, keys in key_sets(n):
+        for hash_cache in (False, True):
+            resize_time, lookups, entry_size = bench(keys, hash_cache)
+            rows.append((name, hash_cache, '%.1f' % (resize_time * 1000),
+                         '%.2f' % (lookups / 1e6), entry_size))
+    print('%d items' % n)
+    print_table(('keys', 'hash_cache', 'resize ms', 'Mlookups/s', 'entry bytes'), rows)
+
+
+if __name__ == '__main__':
+    main()
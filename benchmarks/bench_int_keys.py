@@ -0,0 +1,64 @@
+"""get/set/contains on int keyed tables, int special case vs universal lookup.
+
+usage: python benchmarks/bench_int_keys.py [num_items ...]
+
+Default sizes are 1e6 and 1e8, the latter needs about 8GB of memory.
+"""
+import sys
+
+from common import best_of, print_table, xrange
+from sparsedict import SparseDict
+
+
+def universal(d):
+    """Switch d to the universal lookup by inserting a non-int key.
+    The key is kept: deleting it would make the next insert shrink the table."""
+    d[None] = None
+    return d
+
+
+def bench(n, prepare):
+    d = prepare(SparseDict(n))
+    keys = xrange(n)
+    missing = xrange(n, 2 * n)
+
+    def set_new():
+        for k in keys:
+            d[k] = k
+
+    def set_existing():
+        for k in keys:
+            d[k] = k
+
+    def get():
+        for k in keys:
+            d[k]
+
+    def contains():
+        for k in keys:
+            k in d
+
+    def contains_missing():
+        for k in missing:
+            k in d
+
+    results = [best_of(set_new, 1)]
+    for func in (set_existing, get, contains, contains_missing):
+        results.append(best_of(func))
+    lookup = d._stats()['string_lookup']
+    return lookup, [n / t / 1e6 for t in results]
+
+
+def main():
+    sizes = [int(float(arg)) for arg in sys.argv[1:]] or [10 ** 6, 10 ** 8]
+    rows = []
+    for n in sizes:
+        for prepare in (lambda d: d, universal):
+            lookup, rates = bench(n, prepare)
+            rows.append(['%.0e' % n, lookup or 'universal'] + ['%.2f' % r for r in rates])
+    print('million operations per second')
+    print_table(('items', 'lookup', 'set new', 'set', 'get', 'contains', 'missing'), rows)
+
+
+if __name__ == '__main__':
+    main()
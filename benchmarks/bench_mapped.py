@@ -0,0 +1,64 @@
+"""Opening a mapped file versus loading a pickle of the same dictionary.
+
+usage: python benchmarks/bench_mapped.py [num_items ...]
+
+Saves a dict of string keys and int values with save_mapped() and pickle,
+then reports the time to open each, the throughput of random lookups of
+present keys against the mapped file and the loaded dict, and file sizes.
+"""
+import os
+import pickle
+import random
+import tempfile
+
+from common import best_of, print_table, xrange
+from sparsedict import SparseDict
+
+LOOKUPS = 10 ** 5
+
+
+def bench(n):
+    d = SparseDict((u'key%d' % i, i) for i in xrange(n))
+    fd, mapped_path = tempfile.mkstemp()
+    os.close(fd)
+    fd, pickle_path = tempfile.mkstemp()
+    os.close(fd)
+    try:
+        d.save_mapped(mapped_path)
+        with open(pickle_path, 'wb') as f:
+            pickle.dump(d, f, pickle.HIGHEST_PROTOCOL)
+        del d
+
+        def load():
+            with open(pickle_path, 'rb') as f:
+                return pickle.load(f)
+
+        open_time = best_of(lambda: SparseDict.open_mapped(mapped_path))
+        load_time = best_of(load)
+        random.seed(0)
+        sample = [u'key%d' % random.randrange(n) for _ in xrange(LOOKUPS)]
+        times = []
+        for m in (SparseDict.open_mapped(mapped_path), load()):
+            get = m.get
+            times.append(best_of(lambda: [get(k) for k in sample]))
+        return (open_time, load_time, times, os.path.getsize(mapped_path), os.path.getsize(pickle_path))
+    finally:
+        os.remove(mapped_path)
+        os.remove(pickle_path)
+
+
+def main():
+    import sys
+    sizes = [int(float(arg)) for arg in sys.argv[1:]] or [10 ** 4, 10 ** 5, 10 ** 6]
+    rows = []
+    for n in sizes:
+        open_time, load_time, times, mapped_size, pickle_size = bench(n)
+        rows.append(['%.0e' % n, '%.3f' % (open_time * 1e3), '%.1f' % (load_time * 1e3)] +
+                    ['%.2f' % (LOOKUPS / t / 1e6) for t in times] +
+                    ['%.1f' % (mapped_size / 1048576.0), '%.1f' % (pickle_size / 1048576.0)])
+    print_table(('items', 'open ms', 'unpickle ms', 'mapped Mget/s', 'dict Mget/s', 'mapped MB', 'pickle MB'),
+                rows)
+
+
+if __name__ == '__main__':
+    main()
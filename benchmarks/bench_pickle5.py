@@ -0,0 +1,53 @@
+"""Pickling numeric tables with protocol 4 and with protocol 5 buffers.
+
+usage: python benchmarks/bench_pickle5.py [num_items ...]
+
+Protocol 5 pickles a dict of int keys and int or float values as two
+PickleBuffer columns. Reports dumps and loads times with protocol 4, with
+protocol 5 in-band and with the buffers passed out-of-band (the way
+multiprocessing or shared memory would carry them), and the pickle sizes.
+Requires Python 3.8 or later.
+"""
+import pickle
+
+from common import best_of, print_table, xrange
+from sparsedict import SparseDict
+
+
+def bench(n, value_type):
+    d = SparseDict((i * 2654435761 % 2 ** 61, value_type(i)) for i in xrange(n))
+    rows = []
+    for name, protocol, out_of_band in (('4', 4, False), ('5', 5, False), ('5 out-of-band', 5, True)):
+        buffers = []
+        callback = buffers.append if out_of_band else None
+
+        def dumps():
+            del buffers[:]
+            return pickle.dumps(d, protocol, buffer_callback=callback) if protocol >= 5 else \
+                pickle.dumps(d, protocol)
+
+        dump_time = best_of(dumps)
+        data = dumps()
+        load_time = best_of(lambda: pickle.loads(data, buffers=buffers))
+        size = len(data) + sum(memoryview(b).nbytes for b in buffers)
+        rows.append([name, dump_time, load_time, len(data), size])
+    return rows
+
+
+def main():
+    import sys
+    if pickle.HIGHEST_PROTOCOL < 5:
+        sys.exit('pickle protocol 5 requires Python 3.8')
+    sizes = [int(float(arg)) for arg in sys.argv[1:]] or [10 ** 4, 10 ** 5, 10 ** 6]
+    rows = []
+    for n in sizes:
+        for value_type in (int, float):
+            for name, dump_time, load_time, pickle_size, total_size in bench(n, value_type):
+                rows.append(['%.0e' % n, value_type.__name__, name, '%.1f' % (dump_time * 1e3),
+                             '%.1f' % (load_time * 1e3), '%.1f' % (pickle_size / 1048576.0),
+                             '%.1f' % (total_size / 1048576.0)])
+    print_table(('items', 'values', 'protocol', 'dumps ms', 'loads ms', 'pickle MB', 'with buffers MB'), rows)
+
+
+if __name__ == '__main__':
+    main()
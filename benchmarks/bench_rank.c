@@ -0,0 +1,139 @@
+/* Per-probe cost of sparseblock rank queries: byte bitmap with popcnt8 table
+   (layout before the 64-bit bitmap) vs 64-bit bitmap with SWAR and POPCNT popcount.
+
+   cc -O2 -o bench_rank benchmarks/bench_rank.c && ./bench_rank [num_blocks]
+
+   Blocks are 3/4 full like a table at the growth limit. Every probe tests the bit
+   and computes the item offset of a pseudo-random index, as sparseblock_find does.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+#define SPARSEBLOCK_SIZE 48
+#define NUM_PROBES 50000000
+
+typedef unsigned long long bitmap_t;
+
+typedef struct {
+    void *items;
+    unsigned short num_items;
+    unsigned char bitmap[(SPARSEBLOCK_SIZE + 7) / 8];
+} byteblock;
+
+typedef struct {
+    void *items;
+    bitmap_t bitmap;
+} wordblock;
+
+static unsigned char popcnt8[256];
+
+static int
+rank_bytes(byteblock *block, int index)
+{
+    int i, offset = 0;
+    if (!(block->bitmap[index / 8] & (1 << (index % 8))))
+        return -1;
+    for (i = 0; index > 8; ++i, index -= 8)
+        offset += popcnt8[block->bitmap[i]];
+    offset += popcnt8[block->bitmap[i] & ((1 << index)-1)];
+    return offset;
+}
+
+static int
+popcount_swar(bitmap_t x)
+{
+    x = x - ((x >> 1) & 0x5555555555555555ull);
+    x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0full;
+    return (int)((x * 0x0101010101010101ull) >> 56);
+}
+
+static int
+rank_swar(wordblock *block, int index)
+{
+    if (!(block->bitmap & ((bitmap_t)1 << index)))
+        return -1;
+    return popcount_swar(block->bitmap & (((bitmap_t)1 << index) - 1));
+}
+
+#if defined(__x86_64__)
+static int
+rank_popcnt(wordblock *block, int index)
+{
+    bitmap_t count;
+    if (!(block->bitmap & ((bitmap_t)1 << index)))
+        return -1;
+    __asm__ ("popcnt %1, %0" : "=r" (count) : "r" (block->bitmap & (((bitmap_t)1 << index) - 1)));
+    return (int)count;
+}
+#endif
+
+static unsigned long long rng_state = 88172645463325252ull;
+
+static unsigned int
+rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (unsigned int)(rng_state >> 32);
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#define BENCH(name, blocks, rank) \
+    do { \
+        long i, sum = 0; \
+        double start = now(); \
+        for (i = 0; i < NUM_PROBES; ++i) { \
+            size_t pos = probes[i & (num_indexes - 1)]; \
+            sum += rank(&blocks[pos / SPARSEBLOCK_SIZE], (int)(pos % SPARSEBLOCK_SIZE)); \
+        } \
+        printf("%-28s %6.2f ns/probe  (checksum %ld)\n", name, (now() - start) * 1e9 / NUM_PROBES, sum); \
+    } while (0)
+
+int
+main(int argc, char **argv)
+{
+    size_t i, num_blocks = argc > 1 ? (size_t)atol(argv[1]) : 4096;
+    size_t num_indexes = 1 << 16;
+    byteblock *byteblocks = calloc(num_blocks, sizeof(byteblock));
+    wordblock *wordblocks = calloc(num_blocks, sizeof(wordblock));
+    size_t *probes = malloc(num_indexes * sizeof(size_t));
+
+    for (i = 0; i < 256; ++i)
+        popcnt8[i] = (unsigned char)popcount_swar(i);
+    for (i = 0; i < num_blocks * SPARSEBLOCK_SIZE; ++i) {
+        if (rng() % 4 != 0) {
+            byteblocks[i / SPARSEBLOCK_SIZE].bitmap[i % SPARSEBLOCK_SIZE / 8] |= 1 << (i % 8);
+            wordblocks[i / SPARSEBLOCK_SIZE].bitmap |= (bitmap_t)1 << (i % SPARSEBLOCK_SIZE);
+        }
+    }
+    for (i = 0; i < num_indexes; ++i)
+        probes[i] = rng() % (num_blocks * SPARSEBLOCK_SIZE);
+
+    printf("%lu blocks of %d items\n", (unsigned long)num_blocks, SPARSEBLOCK_SIZE);
+    BENCH("byte bitmap, popcnt8 table", byteblocks, rank_bytes);
+    BENCH("64-bit bitmap, SWAR", wordblocks, rank_swar);
+#if defined(__x86_64__)
+    {
+        unsigned int eax, ebx, ecx, edx;
+        if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx >> 23) & 1)
+            BENCH("64-bit bitmap, POPCNT", wordblocks, rank_popcnt);
+    }
+#endif
+    free(byteblocks);
+    free(wordblocks);
+    free(probes);
+    return 0;
+}
@@ -0,0 +1,46 @@
+"""Worst-case insert latency with stop-the-world and incremental resize.
+
+usage: python benchmarks/bench_resize_latency.py [num_items ...]
+
+Every insert is timed separately, the table grows from empty so it goes
+through all the resizes.
+"""
+import gc
+import sys
+
+from common import print_table, timer, xrange
+from sparsedict import SparseDict
+
+
+def bench(n, incremental):
+    d = SparseDict()
+    d.configure(hash_cache=True, incremental_resize=incremental)
+    keys = [str(i) for i in xrange(n)]
+    latencies = [0.0] * n
+    gc.disable()
+    try:
+        total = timer()
+        for i in xrange(n):
+            start = timer()
+            d[keys[i]] = i
+            latencies[i] = timer() - start
+        total = timer() - total
+    finally:
+        gc.enable()
+    latencies.sort()
+    return total, latencies[n // 2], latencies[int(n * 0.999)], latencies[-1]
+
+
+def main():
+    sizes = [int(float(arg)) for arg in sys.argv[1:]] or [10 ** 6, 10 ** 7]
+    rows = []
+    for n in sizes:
+        for incremental in (False, True):
+            total, median, p999, worst = bench(n, incremental)
+            rows.append(['%.0e' % n, incremental and 'incremental' or 'at once', '%.2f' % total,
+                         '%.2f' % (median * 1e6), '%.2f' % (p999 * 1e6), '%.0f' % (worst * 1e6)])
+    print_table(('items', 'resize', 'total s', 'median us', 'p99.9 us', 'max us'), rows)
+
+
+if __name__ == '__main__':
+    main()
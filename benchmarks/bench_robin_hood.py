@@ -0,0 +1,69 @@
+"""Probe lengths and throughput of the Robin Hood engine under churn.
+
+usage: python benchmarks/bench_robin_hood.py [num_items ...]
+
+Builds a dict, then runs a churn workload at constant size: every step
+deletes a random key and inserts a new one. Reports the churn throughput,
+lookup throughput for present and missing keys afterwards, and the probe
+length statistics (slots examined by a successful lookup) and deleted entries
+left in the table. Quadratic probing is measured with the hash cache on,
+the layout the Robin Hood engine uses, and with auto_compact.
+"""
+import random
+
+from common import best_of, print_table, timer, xrange
+from sparsedict import SparseDict
+
+CONFIGS = [
+    ('quadratic', dict(hash_cache=True)),
+    ('quadratic+auto_compact', dict(hash_cache=True, auto_compact=True)),
+    ('robin_hood', dict(robin_hood=True)),
+]
+
+
+def bench(n, options):
+    random.seed(0)
+    d = SparseDict()
+    d.configure(**options)
+    live = list(xrange(n))
+    for k in live:
+        d[k] = k
+    steps = 2 * n
+    victims = [random.randrange(n) for _ in xrange(steps)]
+    start = timer()
+    for step in xrange(steps):
+        i = victims[step]
+        del d[live[i]]
+        live[i] = k = n + step
+        d[k] = k
+    churn = timer() - start
+
+    hits = random.sample(live, min(n, 10 ** 5))
+    misses = [-k - 1 for k in hits]
+    get = d.get
+
+    def lookup(keys):
+        return lambda: [get(k) for k in keys]
+
+    hit_time = best_of(lookup(hits))
+    miss_time = best_of(lookup(misses))
+    stats = d._stats()
+    return (steps / churn, len(hits) / hit_time, len(misses) / miss_time,
+            stats['mean_probe_length'], stats['max_probe_length'], stats['num_deleted'])
+
+
+def main():
+    import sys
+    sizes = [int(float(arg)) for arg in sys.argv[1:]] or [10 ** 4, 10 ** 5, 10 ** 6]
+    rows = []
+    for n in sizes:
+        for name, options in CONFIGS:
+            churn, hit, miss, mean_probes, max_probes, deleted = bench(n, options)
+            rows.append(['%.0e' % n, name, '%.2f' % (churn / 1e6), '%.2f' % (hit / 1e6), '%.2f' % (miss / 1e6),
+                         '%.2f' % mean_probes, max_probes, deleted])
+    print_table(('items', 'engine', 'Mchurn/s', 'Mhits/s', 'Mmisses/s', 'mean probes', 'max probes',
+                 'deleted'), rows)
+
+
+if __name__ == '__main__':
+    main()
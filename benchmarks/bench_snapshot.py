@@ -0,0 +1,53 @@
+"""snapshot() versus copy() of a table that keeps changing.
+
+usage: python benchmarks/bench_snapshot.py [num_items ...]
+
+A config table is snapshotted on every reload, then a fraction of its keys
+is updated. Reports the time to take the snapshot and to copy the table,
+the time of the updates after a snapshot (the first write to a block
+copies it) and the item array memory the snapshot and the table take
+beyond one shared table, next to what copy() takes. Not counted: the block
+arrays of both dicts and a sharedblock object per shared block (about 50
+bytes per 48 slots).
+"""
+import random
+
+from common import best_of, print_table, timer, xrange
+from sparsedict import SparseDict
+
+UPDATED = [0.001, 0.01, 0.1]
+
+
+def bench(n, fraction):
+    random.seed(0)
+    d = SparseDict(('key%d' % i, i) for i in xrange(n))
+    updates = ['key%d' % random.randrange(n) for _ in xrange(int(n * fraction))]
+    snapshot_time = best_of(d.snapshot)
+    copy_time = best_of(d.copy)
+
+    s = d.snapshot()
+    start = timer()
+    for k in updates:
+        d[k] = -1
+    update_time = timer() - start
+    extra = d._stats()['items_bytes'] + s._stats()['items_bytes']
+    full = d.copy()._stats()['items_bytes']
+    return snapshot_time, copy_time, update_time, extra, full
+
+
+def main():
+    import sys
+    sizes = [int(float(arg)) for arg in sys.argv[1:]] or [10 ** 5, 10 ** 6]
+    rows = []
+    for n in sizes:
+        for fraction in UPDATED:
+            snapshot_time, copy_time, update_time, extra, full = bench(n, fraction)
+            rows.append(['%.0e' % n, '%g%%' % (fraction * 100), '%.2f' % (snapshot_time * 1e3),
+                         '%.2f' % (copy_time * 1e3), '%.2f' % (update_time * 1e3),
+                         '%.2f' % (extra / 1048576.0), '%.2f' % (full / 1048576.0)])
+    print_table(('items', 'updated', 'snapshot() ms', 'copy() ms', 'updates ms', 'snapshot MB', 'copy MB'),
+                rows)
+
+
+if __name__ == '__main__':
+    main()
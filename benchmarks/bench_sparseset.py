@@ -0,0 +1,61 @@
+"""SparseSet against SparseDict.fromkeys and set.
+
+usage: python benchmarks/bench_sparseset.py [num_items ...]
+
+Builds each container from a list of keys, then reports lookup throughput for
+present and missing keys, the time of an intersection with a container of a
+tenth of the size and the memory of the table per key (__sizeof__, which
+counts the item arrays).
+"""
+import random
+
+from common import best_of, keys_view, make_keys, print_table, timer, xrange
+from sparsedict import SparseDict, SparseSet
+
+CONTAINERS = [
+    ('set', set, lambda keys: set(keys)),
+    ('SparseDict.fromkeys', SparseDict.fromkeys, lambda keys: keys_view(SparseDict.fromkeys(keys))),
+    ('SparseSet', SparseSet, lambda keys: SparseSet(keys)),
+]
+
+
+def bench(key_type, n, build, small_build):
+    keys = make_keys(key_type, 2 * n)
+    present = keys[:n]
+    start = timer()
+    s = build(present)
+    build_time = timer() - start
+    random.seed(0)
+    hits = [present[random.randrange(n)] for _ in xrange(min(n, 10 ** 5))]
+    misses = keys[n:n + len(hits)]
+    small = small_build(keys[::20])
+
+    def lookup(sample):
+        def run():
+            for k in sample:
+                k in s
+        return run
+
+    if isinstance(s, SparseDict):
+        and_time = best_of(lambda: keys_view(s) & small)
+    else:
+        and_time = best_of(lambda: s & small)
+    return (build_time, len(hits) / best_of(lookup(hits)), len(misses) / best_of(lookup(misses)), and_time,
+            float(s.__sizeof__()) / n)
+
+
+def main():
+    import sys
+    sizes = [int(float(arg)) for arg in sys.argv[1:]] or [10 ** 5, 10 ** 6]
+    rows = []
+    for n in sizes:
+        for key_type in ('int', 'str'):
+            for name, build, small_build in CONTAINERS:
+                build_time, hit, miss, and_time, per_key = bench(key_type, n, build, small_build)
+                rows.append(['%.0e' % n, key_type, name, '%.1f' % (build_time * 1e3), '%.2f' % (hit / 1e6),
+                             '%.2f' % (miss / 1e6), '%.1f' % (and_time * 1e3), '%.1f' % per_key])
+    print_table(('items', 'keys', 'container', 'build ms', 'Mhits/s', 'Mmisses/s', '& ms', 'bytes/key'), rows)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,89 @@
+"""Int keyed tables with object keys and with key_type='i8'.
+
+usage: python benchmarks/bench_typed_keys.py [num_items ...]
+
+Builds a table of int keys (sequential ids and scattered 64-bit ids) to int
+values with plain object keys and with key_type='i8', alone and together
+with value_type='i8', then reports the build time, get() throughput for
+present and missing keys, iteration throughput (which creates the key
+objects of typed tables), the table memory (__sizeof__) and the memory of
+the objects the table keeps alive, measured with tracemalloc (Python 3.4+,
+'-' otherwise).
+"""
+import random
+
+from common import best_of, print_table, timer, xrange
+from sparsedict import SparseDict
+
+try:
+    import tracemalloc
+except ImportError:
+    tracemalloc = None
+
+KEYS = [
+    ('seq', lambda i: i),
+    ('scattered', lambda i: (i * 2654435761 + 12345) % 9223372036854775783 - 2 ** 62),
+]
+
+CONFIGS = [
+    ('object', dict()),
+    ('i8', dict(key_type='i8')),
+    ('i8+i8', dict(key_type='i8', value_type='i8')),
+]
+
+
+def build(keys, kwds):
+    d = SparseDict(len(keys), **kwds)
+    for i, k in enumerate(keys):
+        d[k] = i
+    return d
+
+
+def bench(n, make_key, kwds):
+    keys = [make_key(i) for i in xrange(n)]
+    start = timer()
+    d = build(keys, kwds)
+    build_time = timer() - start
+    objects_bytes = '-'
+    if tracemalloc is not None:
+        d = None
+        tracemalloc.start()
+        before = tracemalloc.get_traced_memory()[0]
+        # fresh key objects, the table keeps them alive unless typed
+        d = build([make_key(i) for i in xrange(n)], kwds)
+        objects_bytes = '%.1f' % ((tracemalloc.get_traced_memory()[0] - before) / 1048576.0)
+        tracemalloc.stop()
+    random.seed(0)
+    hits = [make_key(random.randrange(n)) for _ in xrange(min(n, 10 ** 5))]
+    misses = [make_key(n + random.randrange(n)) for _ in xrange(len(hits))]
+    get = d.get
+
+    def lookup(sample):
+        def loop():
+            for k in sample:
+                get(k)
+        return loop
+
+    hit_rate = len(hits) / best_of(lookup(hits))
+    miss_rate = len(misses) / best_of(lookup(misses))
+    iter_rate = n / best_of(lambda: sum(d))
+    return build_time, hit_rate, miss_rate, iter_rate, d.__sizeof__(), objects_bytes
+
+
+def main():
+    import sys
+    sizes = [int(float(arg)) for arg in sys.argv[1:]] or [10 ** 5, 10 ** 6]
+    rows = []
+    for n in sizes:
+        for key_name, make_key in KEYS:
+            for name, kwds in CONFIGS:
+                build_time, hit_rate, miss_rate, iter_rate, table_bytes, objects_bytes = bench(n, make_key, kwds)
+                rows.append(['%.0e' % n, key_name, name, '%.1f' % (build_time * 1e3), '%.2f' % (hit_rate / 1e6),
+                             '%.2f' % (miss_rate / 1e6), '%.2f' % (iter_rate / 1e6),
+                             '%.1f' % (table_bytes / 1048576.0), objects_bytes])
+    print_table(('items', 'keys', 'types', 'build ms', 'Mhits/s', 'Mmisses/s', 'Miter/s', 'table MB', 'objects MB'),
+                rows)
+
+
+if __name__ == '__main__':
+    main()
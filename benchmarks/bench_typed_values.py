@@ -0,0 +1,76 @@
+"""Counter and score tables with object values and with value_type.
+
+usage: python benchmarks/bench_typed_values.py [num_items ...]
+
+Builds a table of int keys to int (counters) or float (scores) values with
+plain object values and with value_type='i8' / 'f8', then reports the build
+time, get() and sum(values()) throughput, the table memory (__sizeof__, the
+item arrays) and the memory of the objects the table keeps alive (the int
+keys, and the values unless typed), measured with tracemalloc (Python 3.4+,
+'-' otherwise).
+"""
+import random
+
+from common import best_of, print_table, timer, xrange
+from sparsedict import SparseDict
+
+try:
+    import tracemalloc
+except ImportError:
+    tracemalloc = None
+
+CONFIGS = [
+    ('int', None, lambda i: i * 7 + 1000),
+    ('int', 'i8', lambda i: i * 7 + 1000),
+    ('float', None, lambda i: i / 3.0),
+    ('float', 'f8', lambda i: i / 3.0),
+]
+
+
+def build(n, value_type, make_value):
+    d = SparseDict(n, value_type=value_type) if value_type else SparseDict(n)
+    for i in xrange(n):
+        d[i] = make_value(i)
+    return d
+
+
+def bench(n, value_type, make_value):
+    start = timer()
+    d = build(n, value_type, make_value)
+    build_time = timer() - start
+    values_bytes = '-'
+    if tracemalloc is not None:
+        d = None
+        tracemalloc.start()
+        before = tracemalloc.get_traced_memory()[0]
+        d = build(n, value_type, make_value)
+        values_bytes = '%.1f' % ((tracemalloc.get_traced_memory()[0] - before) / 1048576.0)
+        tracemalloc.stop()
+    random.seed(0)
+    sample = [random.randrange(n) for _ in xrange(min(n, 10 ** 5))]
+    get = d.get
+
+    def get_loop():
+        for k in sample:
+            get(k)
+
+    get_rate = len(sample) / best_of(get_loop)
+    sum_rate = n / best_of(lambda: sum(d.values()))
+    return build_time, get_rate, sum_rate, d.__sizeof__(), values_bytes
+
+
+def main():
+    import sys
+    sizes = [int(float(arg)) for arg in sys.argv[1:]] or [10 ** 5, 10 ** 6]
+    rows = []
+    for n in sizes:
+        for kind, value_type, make_value in CONFIGS:
+            build_time, get_rate, sum_rate, table_bytes, values_bytes = bench(n, value_type, make_value)
+            rows.append(['%.0e' % n, kind, value_type or 'object', '%.1f' % (build_time * 1e3),
+                         '%.2f' % (get_rate / 1e6), '%.2f' % (sum_rate / 1e6),
+                         '%.1f' % (table_bytes / 1048576.0), values_bytes])
+    print_table(('items', 'values', 'value_type', 'build ms', 'Mget/s', 'Msum/s', 'table MB', 'objects MB'), rows)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,44 @@
+"""Set operations on keys views.
+
+usage: python benchmarks/bench_view_ops.py [num_items ...]
+
+Intersects a dict's keys with the keys of a dict a tenth of its size, with a
+small list of keys and with a large one, subtracts a small list and checks
+disjointness, directly on the view and on set(view) (what the operators did
+before, every operation copied the view into a set first).
+"""
+from common import best_of, keys_view, print_table, xrange
+from sparsedict import SparseDict
+
+
+def bench(n):
+    d = SparseDict((i * 7919, i) for i in xrange(n))
+    small = SparseDict((i * 7919 * 3, i) for i in xrange(n // 10))
+    disjoint = SparseDict((i * 7919 + 1, i) for i in xrange(n // 10))
+    probe_list = [i * 7919 * 5 for i in xrange(1000)]
+    large_list = [i * 7919 * 5 for i in xrange(n)]
+    keys, small_keys, disjoint_keys = keys_view(d), keys_view(small), keys_view(disjoint)
+    ops = [
+        ('keys & small keys', lambda: keys & small_keys, lambda: set(keys) & small_keys),
+        ('keys & 1e3 list', lambda: keys & probe_list, lambda: set(keys) & set(probe_list)),
+        ('keys & large list', lambda: keys & large_list, lambda: set(keys) & set(large_list)),
+        ('keys - 1e3 list', lambda: keys - probe_list, lambda: set(keys) - set(probe_list)),
+        ('isdisjoint small keys', lambda: keys.isdisjoint(disjoint_keys),
+         lambda: set(keys).isdisjoint(disjoint_keys)),
+    ]
+    return [(name, best_of(native), best_of(via_set)) for name, native, via_set in ops]
+
+
+def main():
+    import sys
+    sizes = [int(float(arg)) for arg in sys.argv[1:]] or [10 ** 5, 10 ** 6]
+    rows = []
+    for n in sizes:
+        for name, native, via_set in bench(n):
+            rows.append(['%.0e' % n, name, '%.2f' % (native * 1e3), '%.2f' % (via_set * 1e3),
+                         '%.1f' % (via_set / native)])
+    print_table(('items', 'operation', 'view ms', 'set(view) ms', 'speedup'), rows)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,80 @@
+"""Shared helpers for SparseDict benchmarks.
+
+Benchmarks import sparsedict from the source tree, so build the extension
+in place first: python setup.py build_ext --inplace
+"""
+import gc
+import os
+import sys
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+
+try:
+    timer = time.perf_counter
+except AttributeError:
+    timer = time.clock if sys.platform == 'win32' else time.time
+
+try:
+    xrange = xrange
+except NameError:
+    xrange = range
+
+
+def keys_view(d):
+    """The keys view of a mapping: d.viewkeys() on Python 2, d.keys() on Python 3."""
+    if sys.version_info[0] < 3:
+        return d.viewkeys()
+    return d.keys()
+
+
+def best_of(func, repeat=3, setup=None):
+    """Call func() repeat times with GC disabled, return the best time in seconds.
+    If setup is given, func is called with the (untimed) result of setup()."""
+    best = None
+    gc_enabled = gc.isenabled()
+    gc.disable()
+    try:
+        for _ in xrange(repeat):
+            if setup is not None:
+                arg = setup()
+                start = timer()
+                func(arg)
+            else:
+                start = timer()
+                func()
+            elapsed = timer() - start
+            if best is None or elapsed < best:
+                best = elapsed
+    finally:
+        if gc_enabled:
+            gc.enable()
+    return best
+
+
+def make_keys(key_type, n):
+    """n distinct keys of key_type: 'int', 'str', 'bytes' or 'tuple'.
+    The ints are spread out, their hashes are the values themselves."""
+    ints = [i * 2654435761 % 2305843009213693951 for i in xrange(n)]
+    if key_type == 'int':
+        return ints
+    if key_type == 'str':
+        return ['%x' % i for i in ints]
+    if key_type == 'bytes':
+        return [('%x' % i).encode('ascii') for i in ints]
+    if key_type == 'tuple':
+        return [(i, i >> 7) for i in ints]
+    raise ValueError(key_type)
+
+
+def size_arg(default):
+    """Number of items from the first command line argument (accepts 1e6 notation)."""
+    if len(sys.argv) > 1:
+        return int(float(sys.argv[1]))
+    return default
+
+
+def print_table(header, rows):
+    widths = [max(len(str(row[i])) for row in [header] + rows) for i in xrange(len(header))]
+    for row in [header] + rows:
+        print('  '.join(str(cell).rjust(width) for cell, width in zip(row, widths)))
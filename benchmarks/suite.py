@@ -0,0 +1,296 @@
+"""SparseDict vs dict benchmark suite.
+
+usage: python benchmarks/suite.py [options]
+       python benchmarks/suite.py --compare BASE.json NEW.json [--threshold 0.1]
+
+Runs get, set, delete, iterate, resize, copy, pickle and update workloads
+for every combination of implementation, key type and size, and reports
+throughput, latency percentiles and memory. Each combination runs in a
+separate process so that peak RSS is not affected by the previous ones.
+
+Results are printed as a table and, with --output, written as JSON:
+
+    {"meta": {...}, "results": [{"impl": "SparseDict", "keys": "int", "size": 1000000,
+      "memory": {"rss_peak": ..., "rss_build": ..., "tracemalloc": ..., "sizeof": ...},
+      "workloads": {"get": {"ops_per_sec": ..., "latency_us": {"p50": ..., ...}}, ...}}]}
+
+Memory values are in bytes, null where the platform or Python version does
+not provide them. tracemalloc (Python 3.4+) does not see the item arrays of
+SparseDict allocated from slabs, sizeof (sys.getsizeof) includes them.
+
+--compare matches two such files and exits with status 1 if any throughput
+dropped or any memory value grew by more than the threshold.
+"""
+import gc
+import json
+import os
+import platform
+import subprocess
+import sys
+import time
+
+from common import best_of, make_keys, print_table, timer, xrange
+from sparsedict import SparseDict
+
+try:
+    import cPickle as pickle
+except ImportError:
+    import pickle
+try:
+    import resource
+except ImportError:
+    resource = None
+try:
+    import tracemalloc
+except ImportError:
+    tracemalloc = None
+
+IMPLS = {'dict': dict, 'SparseDict': SparseDict}
+KEY_TYPES = ('int', 'str', 'bytes', 'tuple')
+SIZES = (10 ** 3, 10 ** 4, 10 ** 5, 10 ** 6)
+WORKLOADS = ('set', 'get', 'delete', 'iterate', 'resize', 'copy', 'pickle', 'update')
+PERCENTILES = (50, 90, 99, 99.9)
+LATENCY_SAMPLES = 100000
+
+
+def rss():
+    """Current resident set size in bytes, None if unknown."""
+    try:
+        with open('/proc/self/statm') as f:
+            return int(f.read().split()[1]) * os.sysconf('SC_PAGE_SIZE')
+    except (IOError, OSError, AttributeError, ValueError):
+        return None
+
+
+def rss_peak():
+    if resource is None:
+        return None
+    peak = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    # Kilobytes on Linux, bytes on macOS.
+    return peak if sys.platform == 'darwin' else peak * 1024
+
+
+def latency(op, args):
+    """Time op(arg) for a sample of args, return percentiles in microseconds."""
+    step = max(1, len(args) // LATENCY_SAMPLES)
+    samples = []
+    for i in xrange(0, len(args), step):
+        arg = args[i]
+        start = timer()
+        op(arg)
+        samples.append(timer() - start)
+    samples.sort()
+    result = dict(('p%g' % p, samples[min(len(samples) - 1, int(len(samples) * p / 100.0))] * 1e6)
+                  for p in PERCENTILES)
+    result['max'] = samples[-1] * 1e6
+    return result
+
+
+def run_workloads(impl, keys, repeat, workloads):
+    """Returns ({workload: result}, container memory)."""
+    cls = IMPLS[impl]
+    n = len(keys)
+    results = {}
+    memory = {}
+
+    def build():
+        d = cls()
+        for k in keys:
+            d[k] = k
+        return d
+
+    # set: inserts into an empty container, including its resizes.
+    if tracemalloc is not None:
+        tracemalloc.start()
+    before = rss()
+    start = timer()
+    d = build()
+    elapsed = timer() - start
+    after = rss()
+    if tracemalloc is not None:
+        memory['tracemalloc'] = tracemalloc.get_traced_memory()[0]
+        tracemalloc.stop()
+    else:
+        memory['tracemalloc'] = None
+    memory['rss_build'] = after - before if before is not None and after is not None else None
+    memory['sizeof'] = sys.getsizeof(d)
+
+    def timed(name, func, ops, setup=None, lat=None):
+        if name not in workloads:
+            return
+        t = best_of(func, repeat, setup)
+        results[name] = {'ops_per_sec': ops / t if t else None, 'seconds': t,
+                         'latency_us': lat() if lat is not None else None}
+
+    if 'set' in workloads:
+        def set_latency():
+            e = cls()
+            def insert(k):
+                e[k] = k
+            return latency(insert, keys)
+        t = min([elapsed] + [best_of(build, 1) for _ in xrange(repeat - 1)])
+        results['set'] = {'ops_per_sec': n / t if t else None, 'seconds': t, 'latency_us': set_latency()}
+
+    def get():
+        for k in keys:
+            d[k]
+    timed('get', get, n, lat=lambda: latency(d.__getitem__, keys))
+
+    def delete(e):
+        for k in keys:
+            del e[k]
+    def delete_latency():
+        e = d.copy()
+        return latency(e.__delitem__, keys)
+    timed('delete', delete, n, setup=d.copy, lat=delete_latency)
+
+    def iterate():
+        for k, v in d.items():
+            pass
+    timed('iterate', iterate, n)
+
+    if impl == 'SparseDict':
+        # Rehash into a table twice as large (dict has no explicit resize).
+        timed('resize', lambda e: e.resize(4 * n), n, setup=d.copy)
+
+    timed('copy', d.copy, n)
+
+    protocol = pickle.HIGHEST_PROTOCOL
+    timed('pickle', lambda: pickle.loads(pickle.dumps(d, protocol)), n)
+
+    def update():
+        cls().update(d)
+    timed('update', update, n)
+
+    return results, memory
+
+
+def child(impl, key_type, size, repeat, workloads):
+    keys = make_keys(key_type, size)
+    gc.collect()
+    gc.disable()
+    results, memory = run_workloads(impl, keys, repeat, workloads)
+    memory['rss_peak'] = rss_peak()
+    json.dump({'impl': impl, 'keys': key_type, 'size': size,
+               'memory': memory, 'workloads': results}, sys.stdout)
+
+
+def meta():
+    stats = SparseDict()._stats()
+    rev = None
+    try:
+        rev = subprocess.check_output(['git', 'rev-parse', 'HEAD'], stderr=subprocess.STDOUT,
+                                      cwd=os.path.dirname(os.path.abspath(__file__))).decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        pass
+    return {'timestamp': time.strftime('%Y-%m-%dT%H:%M:%S'), 'python': platform.python_version(),
+            'implementation': platform.python_implementation(), 'platform': platform.platform(),
+            'machine': platform.machine(), 'git_rev': rev, 'block_size': stats['block_size'],
+            'allocator': stats.get('allocator')}
+
+
+def fmt(value, scale=1.0, spec='%.2f'):
+    return '-' if value is None else spec % (value / scale)
+
+
+def print_results(results):
+    rows = []
+    for r in results:
+        for name in WORKLOADS:
+            w = r['workloads'].get(name)
+            if w is None:
+                continue
+            lat = w['latency_us'] or {}
+            rows.append([r['impl'], r['keys'], '%.0e' % r['size'], name, fmt(w['ops_per_sec'], 1e6),
+                         fmt(lat.get('p50')), fmt(lat.get('p99')), fmt(lat.get('p99.9')), fmt(lat.get('max'))])
+    print_table(('impl', 'keys', 'size', 'workload', 'Mops/s', 'p50 us', 'p99 us', 'p99.9 us', 'max us'), rows)
+    print('')
+    rows = []
+    for r in results:
+        m = r['memory']
+        rows.append([r['impl'], r['keys'], '%.0e' % r['size'], fmt(m['rss_peak'], 2 ** 20, '%.1f'),
+                     fmt(m['rss_build'], 2 ** 20, '%.1f'), fmt(m['tracemalloc'], 2 ** 20, '%.1f'),
+                     fmt(m['sizeof'], 2 ** 20, '%.1f')])
+    print_table(('impl', 'keys', 'size', 'peak RSS MB', 'build RSS MB', 'tracemalloc MB', 'sizeof MB'), rows)
+
+
+def compare(base_path, new_path, threshold):
+    with open(base_path) as f:
+        base = json.load(f)
+    with open(new_path) as f:
+        new = json.load(f)
+    index = dict(((r['impl'], r['keys'], r['size']), r) for r in base['results'])
+    rows = []
+    regressions = 0
+    for r in new['results']:
+        b = index.get((r['impl'], r['keys'], r['size']))
+        if b is None:
+            continue
+        pairs = []
+        for name, w in sorted(r['workloads'].items()):
+            bw = b['workloads'].get(name)
+            if bw and bw['ops_per_sec'] and w['ops_per_sec']:
+                pairs.append((name + ' ops/s', w['ops_per_sec'] / bw['ops_per_sec'], 1))
+        for name, value in sorted(r['memory'].items()):
+            if value and b['memory'].get(name):
+                pairs.append((name, float(value) / b['memory'][name], -1))
+        for name, ratio, better in pairs:
+            # better = 1: higher is better, -1: lower is better.
+            change = (ratio - 1) * better
+            flag = ''
+            if change < -threshold:
+                flag = 'REGRESSION'
+                regressions += 1
+            elif change > threshold:
+                flag = 'improved'
+            if flag:
+                rows.append([r['impl'], r['keys'], '%.0e' % r['size'], name, '%.3f' % ratio, flag])
+    if rows:
+        print_table(('impl', 'keys', 'size', 'metric', 'new/base', ''), rows)
+    print('%d regressions above %.0f%%' % (regressions, threshold * 100))
+    return 1 if regressions else 0
+
+
+def parse_list(value, convert=str):
+    return [convert(item) for item in value.split(',') if item]
+
+
+def main():
+    import argparse
+    parser = argparse.ArgumentParser(description='SparseDict vs dict benchmark suite.')
+    parser.add_argument('--impls', default=','.join(sorted(IMPLS)), help='comma separated, default: %(default)s')
+    parser.add_argument('--keys', default=','.join(KEY_TYPES), help='comma separated, default: %(default)s')
+    parser.add_argument('--sizes', default=','.join('%.0e' % s for s in SIZES),
+                        help='comma separated, up to 1e8, default: %(default)s')
+    parser.add_argument('--workloads', default=','.join(WORKLOADS), help='comma separated, default: %(default)s')
+    parser.add_argument('--repeat', type=int, default=3, help='best of, default: %(default)s')
+    parser.add_argument('-o', '--output', help='write JSON results to this file')
+    parser.add_argument('--compare', nargs=2, metavar=('BASE', 'NEW'), help='compare two JSON result files')
+    parser.add_argument('--threshold', type=float, default=0.1, help='relative change to report, default: %(default)s')
+    parser.add_argument('--child', nargs=3, help=argparse.SUPPRESS)
+    args = parser.parse_args()
+
+    workloads = parse_list(args.workloads)
+    if args.compare:
+        sys.exit(compare(args.compare[0], args.compare[1], args.threshold))
+    if args.child:
+        impl, key_type, size = args.child
+        child(impl, key_type, int(size), args.repeat, workloads)
+        return
+
+    results = []
+    for size in parse_list(args.sizes, lambda s: int(float(s))):
+        for key_type in parse_list(args.keys):
+            for impl in parse_list(args.impls):
+                command = [sys.executable, os.path.abspath(__file__), '--child', impl, key_type, str(size),
+                           '--repeat', str(size >= 10 ** 7 and 1 or args.repeat), '--workloads', args.workloads]
+                sys.stderr.write('%s %s %.0e\n' % (impl, key_type, size))
+                results.append(json.loads(subprocess.check_output(command).decode()))
+    print_results(results)
+    if args.output:
+        with open(args.output, 'w') as f:
+            json.dump({'meta': meta(), 'results': results}, f, indent=1, sort_keys=True)
+
+
+if __name__ == '__main__':
+    main()
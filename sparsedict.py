@@ -1,10 +1,12 @@
 
-from _sparsedict import SparseDict
+from _sparsedict import SparseDict, SparseDictMapped, SparseSet
 
 try:
-    from collections import MutableMapping
+    from collections import Mapping, MutableMapping, MutableSet
 except ImportError:
     pass
 else:
     MutableMapping.register(SparseDict)
-    del MutableMapping
+    Mapping.register(SparseDictMapped)
+    MutableSet.register(SparseSet)
+    del Mapping, MutableMapping, MutableSet
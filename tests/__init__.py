@@ -1,7 +1,10 @@
 
 import sys
 import os.path
-from unittest2.loader import defaultTestLoader
+try:
+    from unittest2.loader import defaultTestLoader
+except ImportError:
+    from unittest.loader import defaultTestLoader
 
 
 def collector():
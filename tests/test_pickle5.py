@@ -0,0 +1,72 @@
+# tests for pickling with protocol 5 (Python 3.8+), runs without the py2-only suite:
+#   python -m unittest tests.test_pickle5
+
+try:
+    import unittest2 as unittest
+except ImportError:
+    import unittest
+import math
+import pickle
+from sparsedict import SparseDict
+
+
+class SparseDictSubclass(SparseDict):
+
+    def __init__(self, *args, **kwargs):
+        SparseDict.__init__(self, *args, **kwargs)
+        self.a = 'aval' # to test unpickling
+
+
+def pickle_out_of_band(d):
+    buffers = []
+    data = pickle.dumps(d, 5, buffer_callback=buffers.append)
+    return data, buffers, pickle.loads(data, buffers=[memoryview(b).tobytes() for b in buffers])
+
+
+@unittest.skipIf(pickle.HIGHEST_PROTOCOL < 5, 'missing pickle protocol 5')
+class TestPickleBuffers(unittest.TestCase):
+
+    def test_columns(self):
+        for values in (lambda i: i * 3 - 2 ** 40, lambda i: i / 4.0):
+            d = SparseDictSubclass((i * 7919 - 2 ** 40, values(i)) for i in range(10000))
+            data, buffers, pd = pickle_out_of_band(d)
+            self.assertEqual(len(buffers), 2)
+            self.assertTrue(len(data) < 1000)
+            self.assertEqual(pd, d)
+            self.assertEqual(type(pd), SparseDictSubclass)
+            self.assertEqual(pd.a, 'aval')
+            self.assertEqual(set(map(type, pd.values())), set(map(type, d.values())))
+            self.assertEqual(pickle.loads(pickle.dumps(d, 5)), d)
+
+    def test_float_bits(self):
+        d = SparseDict({1: float('nan'), 2: -0.0, 3: float('inf'), 4: 1e-310})
+        pd = pickle_out_of_band(d)[2]
+        self.assertTrue(math.isnan(pd[1]))
+        self.assertEqual(math.copysign(1.0, pd[2]), -1.0)
+        self.assertEqual((pd[3], pd[4]), (float('inf'), 1e-310))
+
+    def test_typed(self):
+        for key_type in (None, 'i8'):
+            for value_type, value in (('i8', lambda i: -i), ('f8', lambda i: i / 8.0)):
+                d = SparseDict(((i - 500, value(i)) for i in range(1000)), key_type=key_type,
+                               value_type=value_type)
+                del d[0]
+                data, buffers, pd = pickle_out_of_band(d)
+                self.assertEqual(len(buffers), 2)
+                self.assertEqual(pd, d)
+                self.assertEqual(pd._stats()['value_type'], value_type)
+                self.assertEqual(pd._stats()['key_type'], key_type)
+
+    def test_other_tables(self):
+        # mixed, big or non-int items take the usual path
+        for d in (SparseDict(), SparseDict({1: 'a'}), SparseDict({1: 1, 2: 2.0}), SparseDict({2 ** 64: 1}),
+                  SparseDict({1: 2 ** 64}), SparseDict({True: 1}), SparseDict({1: b'x'}, value_type='bytes')):
+            data, buffers, pd = pickle_out_of_band(d)
+            self.assertEqual(buffers, [])
+            self.assertEqual(pd, d)
+            self.assertEqual(list(map(type, pd)), list(map(type, d)))
+        self.assertRaises(ValueError, SparseDict._from_buffers, b'1234567', b'', 'q')
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -8,8 +8,13 @@ import weakref
 import gc
 import random
 import pickle
+import array
+import io
+import os
+import struct
+import tempfile
 from . import mapping_tests
-from sparsedict import SparseDict
+from sparsedict import SparseDict, SparseDictMapped
 
 
 class SparseDictSubclass(SparseDict):
@@ -20,6 +25,98 @@ class SparseDictSubclass(SparseDict):
         self.b = 'bval'
 
 
+class SaltedKey(object):
+    """Key with a hash that can be changed, like str hashes between processes."""
+    salt = 0
+
+    def __init__(self, value):
+        self.value = value
+
+    def __hash__(self):
+        return hash((SaltedKey.salt, self.value))
+
+    def __eq__(self, other):
+        return self.value == other.value
+
+
+class ReentrantKey(object):
+    """Colliding key, its __eq__ runs the callback once (to change the dict mid-lookup)."""
+
+    def __init__(self, name, callback=None):
+        self.name = name
+        self.callback = callback
+
+    def __hash__(self):
+        return 1
+
+    def __eq__(self, other):
+        callback, self.callback = self.callback, None
+        if callback is not None:
+            callback()
+        return isinstance(other, ReentrantKey) and self.name == other.name
+
+
+REENTRANT_OPTIONS = ({}, dict(hash_cache=True), dict(fingerprints=True), dict(bloom=True),
+                     dict(incremental_resize=True), dict(hash_cache=True, incremental_resize=True),
+                     dict(auto_compact=True), dict(auto_compact=True, hash_cache=True))
+
+
+def home_slot(hash, max_items):
+    """Slot a hash starts probing from, hash_mix of _sparsedict.c (64-bit)."""
+    return ((2862933555777941757 * hash + 3037000493) % 2 ** 64) & (max_items - 1)
+
+
+def probe_slots(hashes, max_items):
+    """Slots of the keys with these hashes inserted in order, without resizes."""
+    taken, slots = set(), []
+    for h in hashes:
+        i, n = home_slot(h, max_items), 0
+        while i in taken:
+            n += 1
+            i = (i + n) & (max_items - 1)
+        taken.add(i)
+        slots.append(i)
+    return slots
+
+
+def set_new(d, key):
+    d[key] = 'new'
+
+
+REENTRANT_OPS = (lambda d, key: d.get(key), lambda d, key: d.setdefault(key, 'new'), set_new,
+                 lambda d, key: d.get_many([key]))
+
+
+def reentrant_lookups(test, mutate, ops=REENTRANT_OPS):
+    """Runs each op(d, key) on a dict where key probes past a deleted entry, then (in another
+    block) a key whose __eq__ calls mutate(d, ints), ints being keys that go to the block of
+    the deleted entry. Yields the dicts."""
+    for options in REENTRANT_OPTIONS:
+        for op in ops:
+            d = SparseDict(2000)
+            d.configure(**options)
+            chain = [ReentrantKey(i) for i in xrange(12)]
+            d.update((i, i) for i in xrange(2000))
+            for key in chain:
+                d[key] = key.name
+            del d[chain[0]]
+            max_items, block_size = d._stats()['max_items'], d._stats()['block_size']
+            slots = probe_slots(list(xrange(2000)) + [1] * len(chain), max_items)
+            taken, block = set(slots), slots[2000] // block_size
+            test.assertNotEqual(slots[-1] // block_size, block)
+            ints = [i for i in xrange(10 ** 6, 10 ** 6 + 20 * max_items)
+                    if home_slot(i, max_items) // block_size == block and
+                    home_slot(i, max_items) not in taken][:8]
+            chain[-1].callback = lambda: mutate(d, ints)
+            op(d, ReentrantKey('new'))
+            keys = list(d)
+            test.assertEqual(len(keys), len(d))
+            names = [k.name for k in keys if isinstance(k, ReentrantKey)]
+            test.assertEqual(len(names), len(set(names)))
+            test.assertEqual(d.get(chain[-1], 11), 11)  # unless cleared
+            yield d
+
+
 class TestGeneralMapping(mapping_tests.TestHashMappingProtocol):
 
     type2test = SparseDict
@@ -36,6 +133,26 @@ class TestSubclassMapping(mapping_tests.TestHashMappingProtocol):
         return self.type2test(data)
 
 
+def configured_mapping_test(name, **options):
+    """Mapping protocol tests of a SparseDict subclass that calls configure(**options)."""
+
+    class ConfiguredSparseDict(SparseDict):
+
+        def __init__(self, *args, **kwargs):
+            SparseDict.__init__(self)
+            self.configure(**options)
+            self.update(*args, **kwargs)
+
+    ConfiguredSparseDict.__name__ = name + 'SparseDict'
+    return type('Test%sMapping' % name, (TestGeneralMapping,), {'type2test': ConfiguredSparseDict})
+
+
+TestHashCacheMapping = configured_mapping_test('HashCache', hash_cache=True)
+TestRobinHoodMapping = configured_mapping_test('RobinHood', robin_hood=True)
+TestFingerprintMapping = configured_mapping_test('Fingerprint', fingerprints=True)
+TestBloomMapping = configured_mapping_test('Bloom', bloom=True)
+
+
 class TestSparseDictAsDict(unittest.TestCase):
 
     def test_tuple_keyerror(self):
@@ -254,6 +371,24 @@ class TestSparseDictAsDict(unittest.TestCase):
         Key.resize = True
         self.assertRaises(RuntimeError, lambda: d.resize(64))
 
+    def test_lookup_reentrancy(self):
+        # __eq__ inserts while the lookup holds the deleted entry it passed: the entry
+        # moves with its item array or gets the inserted key
+        def fill(d, ints):
+            for i in ints:
+                d[i] = i
+
+        def refill(d, ints):
+            d[ReentrantKey('refill')] = 'refill'
+
+        for mutate in (fill, refill, lambda d, ints: d.clear()):
+            for d in reentrant_lookups(self, mutate):
+                self.assertIn(d.get(ReentrantKey('new')), (None, 'new'))
+                if mutate is refill:
+                    self.assertEqual(d[ReentrantKey('refill')], 'refill')
+                d[ReentrantKey('new')] = 'again'
+                self.assertEqual(d[ReentrantKey('new')], 'again')
+
     def test_shrink_to_static(self):
         d = SparseDict()
         d[0] = 0
@@ -272,3 +407,979 @@ class TestSparseDictAsDict(unittest.TestCase):
         for key in ["block_size", "num_blocks", "max_items", "num_items", "num_deleted",
                     "consider_shrink", "disable_resize", "string_lookup"]:
             self.assertIn(key, stats, key)
+
+    def test_setdefault_size(self):
+        d = SparseDict()
+        for i in xrange(100):
+            self.assertEqual(d.setdefault(i, -i), -i)
+        self.assertEqual(len(d), 100)
+        self.assertEqual(d, dict((i, -i) for i in xrange(100)))
+
+    def test_call_arguments(self):
+        d = SparseDict([(1, 2)], a=3)
+        self.assertEqual(d, {1: 2, 'a': 3})
+        self.assertEqual(SparseDict(100, value_type='i8', b=1), {'b': 1})
+        self.assertRaises(TypeError, SparseDict, {}, {})
+        for method in (d.get, d.pop, d.setdefault):
+            self.assertRaises(TypeError, method)
+            self.assertRaises(TypeError, method, 1, 2, 3)
+            self.assertRaises(TypeError, method, key=1)
+        self.assertEqual((d.get(1), d.get(2), d.get(2, 4)), (2, None, 4))
+        self.assertEqual((d.pop(2, 4), d.setdefault(2), d.setdefault(5, 6)), (4, None, 6))
+        self.assertEqual(d.pop(1), 2)
+        self.assertRaises(KeyError, d.pop, 1)
+        s = SparseDictSubclass({1: 2})
+        self.assertEqual((s, s.a), ({1: 2}, 'aval'))
+
+    def test_hash_cache(self):
+        class Key(object):
+            num_hashes = 0
+            def __init__(self, value):
+                self.value = value
+            def __hash__(self):
+                Key.num_hashes += 1
+                return hash(self.value)
+            def __eq__(self, other):
+                return self.value == other.value
+
+        d = SparseDict()
+        d.configure(hash_cache=True)
+        keys = [Key(i) for i in xrange(1000)]
+        for key in keys:
+            d[key] = key.value
+        self.assertEqual(Key.num_hashes, len(keys))
+        d.resize(100000)
+        self.assertEqual(Key.num_hashes, len(keys))
+        self.assertEqual(d[Key(999)], 999)
+
+        stats = d._stats()
+        self.assertTrue(stats['hash_cache'])
+        self.assertEqual(stats['hash_cache_bytes'], stats['num_items'] * (stats['entry_size'] // 3))
+
+        plain = SparseDict((key, key.value) for key in keys)
+        self.assertEqual(d, plain)
+        d.configure(hash_cache=False)
+        self.assertFalse(d._stats()['hash_cache'])
+        self.assertEqual(d, plain)
+        self.assertEqual(d.copy(), plain)
+
+    def test_incremental_resize(self):
+        def grow_until_migrating(d, n):
+            while not d._stats()['migrating_blocks']:
+                d[n] = n
+                n += 1
+            return n
+
+        d = SparseDict()
+        d.configure(incremental_resize=True)
+        self.assertTrue(d._stats()['hash_cache'])
+        n = grow_until_migrating(d, 0)
+        self.assertEqual(len(d), n)
+        self.assertEqual(d, dict((i, i) for i in xrange(n)))
+
+        # iterators pause the migration, lookups advance it
+        blocks = d._stats()['migrating_blocks']
+        keys = []
+        for key in d:
+            self.assertEqual(d[key], key)
+            keys.append(key)
+        self.assertEqual(sorted(keys), list(xrange(n)))
+        self.assertEqual(d._stats()['migrating_blocks'], blocks)
+        for i in xrange(n):
+            self.assertIn(i, d)
+        self.assertEqual(d._stats()['migrating_blocks'], 0)
+
+        n = grow_until_migrating(d, n)
+        key, value = d.popitem()
+        self.assertEqual(key, value)
+        self.assertNotIn(key, d)
+        del d[n - 1]
+        d['a'] = 'a'
+        expected = dict((i, i) for i in xrange(n - 1) if i != key)
+        expected['a'] = 'a'
+        self.assertEqual(d.copy(), expected)
+        self.assertEqual(pickle.loads(pickle.dumps(d, 2)), expected)
+
+        # shrink
+        for i in xrange(n - 1):
+            if i != key:
+                del d[i]
+        d['b'] = 'b'
+        self.assertEqual(d, {'a': 'a', 'b': 'b'})
+
+        self.assertRaises(ValueError, d.configure, hash_cache=False)
+        d.configure(incremental_resize=False)
+        self.assertEqual(d._stats()['migrating_blocks'], 0)
+        d.clear()
+        self.assertEqual(d, {})
+
+    def test_equal_mismatch(self):
+        d = SparseDict((i, i) for i in xrange(1000))
+        for i in xrange(0, 1000, 7):
+            other = dict((j, j) for j in xrange(1000))
+            other[i] = -1
+            self.assertNotEqual(d, other)
+            self.assertNotEqual(d, SparseDict(other))
+
+    def test_equal_same_geometry(self):
+        class Mutating(object):
+            def __init__(self, d):
+                self.d = d
+
+            def __eq__(self, other):
+                self.d.clear()
+                return True
+
+            __hash__ = object.__hash__
+
+        for options in ({}, dict(hash_cache=True), dict(robin_hood=True)):
+            d = SparseDict()
+            d.configure(**options)
+            for i in xrange(3000):
+                d['k%d' % i] = i
+            # same keys in another order, other key objects, deleted entries
+            e = SparseDict()
+            e.configure(**options)
+            for i in xrange(2999, -1, -1):
+                e[''.join(['k', str(i)])] = i
+            e['x'] = 1
+            del e['x']
+            self.assertEqual(d._stats()['max_items'], e._stats()['max_items'])
+            self.assertEqual(d, e)
+            s = d.snapshot()
+            self.assertEqual(d, s)
+            s['k5'] = 'five'
+            self.assertNotEqual(d, s)
+            self.assertNotEqual(s, e)
+            s['k5'] = 5
+            del s['k7']
+            s['k7x'] = 7
+            self.assertNotEqual(d, s)
+
+            d['k1'] = Mutating(e)
+            e['k1'] = 1
+            self.assertNotEqual(d, e)
+            self.assertEqual(len(e), 0)
+
+    def test_items_allocator(self):
+        base = SparseDict()._stats()['allocated_items_bytes']
+        d = SparseDict()
+        for i in xrange(10000):
+            d[i] = i
+        stats = d._stats()
+        self.assertTrue(stats['items_bytes'] >= stats['num_items'] * stats['entry_size'])
+        self.assertEqual(stats['allocated_items_bytes'] - base, stats['items_bytes'])
+        self.assertTrue(d.__sizeof__() > SparseDict().__sizeof__() + stats['items_bytes'])
+        d.configure(hash_cache=True)
+        stats = d._stats()
+        self.assertEqual(stats['allocated_items_bytes'] - base, stats['items_bytes'])
+        d.clear()
+        self.assertEqual(d._stats()['allocated_items_bytes'], base)
+        d.update((i, i) for i in xrange(100))
+        del d
+        self.assertEqual(SparseDict()._stats()['allocated_items_bytes'], base)
+
+    def test_string_lookup(self):
+        self.assertEqual(SparseDict({'a': 1})._stats()['string_lookup'], type('a').__name__)
+        self.assertEqual(SparseDict({b'a': 1})._stats()['string_lookup'], type(b'a').__name__)
+        # empty dict switches to the special case for the first key
+        d = SparseDict()
+        self.assertIn(b'a', SparseDict({b'a': 1}))
+        d[b'a'] = 1
+        self.assertEqual(d._stats()['string_lookup'], type(b'a').__name__)
+        d[('a',)] = 2
+        self.assertIs(d._stats()['string_lookup'], None)
+        self.assertEqual(d, {b'a': 1, ('a',): 2})
+
+    def test_int_lookup(self):
+        keys = [0, 1, -1, -2, 2 ** 31, -2 ** 31 - 1, 2 ** 61 - 2, 2 ** 61 - 1, 2 ** 61,
+                -2 ** 61 + 1, 2 ** 62 + 5, 2 ** 63 - 1, -2 ** 63, 2 ** 64 + 3, -2 ** 100]
+        keys = [k for k in keys if type(k) is int] + list(range(-500, 500, 7))
+        d = SparseDict()
+        for k in keys:
+            d[k] = k
+        self.assertEqual(d._stats()['string_lookup'], int.__name__)
+        for k in keys:
+            self.assertEqual(d[k], k)
+        self.assertNotIn(3, d)
+        # universal lookup must find the keys by their hash()
+        d['x'] = 'x'
+        self.assertIs(d._stats()['string_lookup'], None)
+        d.resize(len(d) * 8)
+        for k in keys:
+            self.assertEqual(d[k], k)
+        self.assertEqual(d.get(1.0), 1)
+
+    def test_get_many(self):
+        d = SparseDict((i, str(i)) for i in xrange(0, 1000, 2))
+        keys = list(xrange(-10, 1010)) + [1.0, 'x', (2,)]
+        self.assertEqual(d.get_many(keys), [d.get(k) for k in keys])
+        self.assertEqual(d.get_many(keys, 0), [d.get(k, 0) for k in keys])
+        self.assertEqual(d.contains_many(k for k in keys), [k in d for k in keys])
+        self.assertEqual(d.get_many(()), [])
+        self.assertRaises(TypeError, d.get_many, 1)
+        self.assertRaises(TypeError, d.get_many, [1, [], 2])
+        # lookups into a migrating table and with keys that mutate the dict
+        d.configure(incremental_resize=True)
+        n = 1000
+        while not d._stats()['migrating_blocks']:
+            d[n] = str(n)
+            n += 1
+        self.assertEqual(d.get_many(keys), [d.get(k) for k in keys])
+
+        class Mutating(object):
+            def __hash__(self):
+                return 4
+            def __eq__(self, other):
+                d.clear()
+                return False
+        self.assertEqual(d.get_many([4, Mutating()] + keys), ['4', None] + [None] * len(keys))
+
+    def test_get_many_reentrancy(self):
+        # __eq__ of a key in the middle of the batch mutates the dict, the rest of the batch
+        # is looked up afresh
+        def fill(d, ints):
+            for i in ints:
+                d[i] = i
+
+        def delete(d, ints):
+            del d[ReentrantKey(5)]
+
+        results = []
+        ops = (lambda d, key: results.append(d.get_many([1, key, 2, ReentrantKey(5), key], 'x')),
+               lambda d, key: results.append(d.contains_many([1, key, 2, ReentrantKey(5), key])))
+        for mutate, found in ((fill, True), (delete, False)):
+            del results[:]
+            for d in reentrant_lookups(self, mutate, ops):
+                self.assertEqual(ReentrantKey(5) in d, found)
+            self.assertEqual(results, [[1, 'x', 2, 5 if found else 'x', 'x'],
+                                       [True, False, True, found, False]] * len(REENTRANT_OPTIONS))
+
+    def test_from_arrays(self):
+        keys = list(xrange(5000)) + ['a', (1,), 7.0, 3]
+        values = [str(k) for k in keys]
+        expected = dict(zip(keys, values))
+        d = SparseDict.from_arrays(keys, values)
+        self.assertEqual(d, expected)
+        self.assertEqual(len(d), len(expected))
+        self.assertEqual(d[3], '3')  # last value of equal keys wins
+        self.assertEqual([type(k) for k in d if k == 7], [int])  # first equal key is kept
+        self.assertIs(type(SparseDictSubclass.from_arrays([1], [2])), SparseDictSubclass)
+        self.assertEqual(SparseDict.from_arrays(['x', 'y'], iter([1, 2]))._stats()['string_lookup'],
+                         type('x').__name__)
+        self.assertEqual(SparseDict.from_arrays(array.array('l', [-1, 2]), array.array('b', [3, 4])),
+                         {-1: 3, 2: 4})
+        self.assertEqual(SparseDict.from_arrays((), ()), {})
+        self.assertRaises(ValueError, SparseDict.from_arrays, [1, 2], [1])
+        self.assertRaises(TypeError, SparseDict.from_arrays, [1, []], [1, 2])
+        self.assertRaises(TypeError, SparseDict.from_arrays, 1, [1])
+
+        d = SparseDict()
+        d.configure(hash_cache=True)
+        d.update_arrays(keys[:100], values[:100])
+        self.assertTrue(d._stats()['hash_cache'])
+        d.update_arrays(keys, [None] * len(keys))
+        self.assertEqual(d, dict.fromkeys(keys))
+        for k in keys:
+            self.assertIn(k, d)
+
+        class Mutating(object):
+            def __hash__(self):
+                return 1
+            def __eq__(self, other):
+                d[other] = 'eq'
+                return False
+        d = SparseDict()
+        d.update_arrays([1, Mutating(), 2], [1, 2, 3])
+        self.assertEqual(len(d), 3)
+        self.assertEqual(d[2], 3)
+
+    def test_compact(self):
+        for hash_cache in (False, True):
+            d = SparseDict((i, i) for i in xrange(10000))
+            d.configure(hash_cache=hash_cache)
+            for i in xrange(0, 10000, 10):
+                d[str(i)] = i
+            self.assertEqual(d.compact(), 0)
+            for i in xrange(10000):
+                if i % 7:
+                    del d[i]
+            expected = dict(d)
+            before = d._stats()
+            it = iter(d)
+            self.assertEqual(d.compact(), 0)  # iterators pin the items
+            self.assertEqual(len(list(it)), len(expected))
+            freed = d.compact()
+            stats = d._stats()
+            self.assertTrue(freed > 0)
+            self.assertEqual(stats['items_bytes'], before['items_bytes'] - freed)
+            self.assertEqual(stats['compact_bytes_freed'], freed)
+            self.assertEqual(stats['num_compactions'], 1)
+            self.assertTrue(stats['num_deleted'] <= stats['num_items'] / 8)
+            self.assertEqual(d, expected)
+            for k in expected:
+                self.assertIn(k, d)
+            d.update((i, i) for i in xrange(10000))
+            self.assertEqual(len(d), 11000)
+
+    def test_compact_reentrancy(self):
+        # compaction frees deleted entries, it waits while a lookup (running __eq__) holds one
+        freed = []
+
+        def compact(d, ints):
+            for i in xrange(0, 2000, 2):
+                del d[i]  # also due for auto_compact
+            freed.append(d.compact())
+
+        for d in reentrant_lookups(self, compact):
+            self.assertEqual(freed, [0])
+            del freed[:]
+            self.assertEqual(d._stats()['num_compactions'], 0)
+            self.assertTrue(d.compact() > 0)
+            self.assertTrue(all(d[i] == i for i in xrange(1, 2000, 2)))
+
+    def test_auto_compact(self):
+        d = SparseDict((i, i) for i in xrange(10000))
+        d.configure(auto_compact=True)
+        self.assertTrue(d._stats()['auto_compact'])
+        for i in xrange(9000):
+            del d[i]
+        stats = d._stats()
+        self.assertTrue(stats['num_compactions'] > 0)
+        self.assertTrue(stats['num_deleted'] < 1000)
+        while d:
+            d.popitem()
+        self.assertEqual(d._stats()['num_items'], d._stats()['num_deleted'])
+        self.assertTrue(d._stats()['num_deleted'] < 2 * d._stats()['block_size'])
+
+    def test_robin_hood(self):
+        d = SparseDict((i, i) for i in xrange(1000))
+        d.configure(robin_hood=True)
+        stats = d._stats()
+        self.assertTrue(stats['robin_hood'] and stats['hash_cache'])
+        self.assertEqual(d, dict((i, i) for i in xrange(1000)))
+        self.assertRaises(ValueError, d.configure, hash_cache=False)
+        self.assertRaises(ValueError, d.configure, incremental_resize=True)
+
+        # churn at constant size: deletes leave no deleted entries behind
+        random.seed(0)
+        model = dict(d)
+        live = list(range(1000))
+        for step in xrange(20000):
+            i = random.randrange(1000)
+            del d[live[i]]
+            del model[live[i]]
+            live[i] = k = 1000 + step
+            d[k] = model[k] = step
+        stats = d._stats()
+        self.assertEqual(stats['num_deleted'], 0)
+        self.assertEqual(stats['num_items'], 1000)
+        self.assertEqual(d, model)
+        self.assertTrue(1 <= stats['mean_probe_length'] <= stats['max_probe_length'])
+        self.assertEqual(d.pop(live[0]), model.pop(live[0]))
+        key, value = d.popitem()
+        self.assertEqual(model.pop(key), value)
+        self.assertEqual(d, model)
+        self.assertEqual(d.copy(), model)
+
+        class Mutating(object):
+            def __hash__(self):
+                return 1
+            def __eq__(self, other):
+                d.clear()
+                return False
+        d = SparseDict()
+        d.configure(robin_hood=True)
+        d[1] = 1
+        d[Mutating()] = 2
+        self.assertEqual(len(d), 1)
+
+        d.configure(robin_hood=False)
+        self.assertFalse(d._stats()['robin_hood'])
+        self.assertEqual(SparseDict()._stats()['mean_probe_length'], None)
+
+    def test_fingerprints(self):
+        class Key(object):
+            eq_calls = 0
+            def __init__(self, value):
+                self.value = value
+            def __hash__(self):
+                return hashes[self.value]
+            def __eq__(self, other):
+                Key.eq_calls += 1
+                return self.value == other.value
+
+        random.seed(0)
+        hashes = [random.getrandbits(30) for i in xrange(1000)]
+        keys = [Key(i) for i in xrange(1000)]
+        d = SparseDict((k, k.value) for k in keys)
+        d.configure(fingerprints=True)
+        stats = d._stats()
+        self.assertTrue(stats['fingerprints'])
+        self.assertEqual(stats['fingerprint_bytes'], stats['num_items'])
+        self.assertEqual(stats['entry_size'], SparseDict()._stats()['entry_size'] + 1)
+        self.assertRaises(ValueError, d.configure, hash_cache=True)
+        self.assertRaises(ValueError, d.configure, robin_hood=True)
+
+        # colliding keys are told apart without __eq__ (but for 1/256 of them)
+        Key.eq_calls = 0
+        for k in keys:
+            self.assertEqual(d[Key(k.value)], k.value)
+        self.assertTrue(Key.eq_calls < 1.05 * len(keys))
+        for i in xrange(0, 1000, 2):
+            del d[keys[i]]
+        self.assertEqual(d.compact() > 0, True)
+        d[keys[0]] = 0
+        self.assertEqual(sorted(d.values()), [0] + list(range(1, 1000, 2)))
+
+        d.configure(fingerprints=False)
+        self.assertFalse(d._stats()['fingerprints'])
+        self.assertEqual(sorted(d.values()), [0] + list(range(1, 1000, 2)))
+
+    def test_bloom(self):
+        d = SparseDict((i, i) for i in xrange(10000))
+        self.assertEqual(d._stats()['bloom_bytes'], 0)
+        d.configure(bloom=True)
+        stats = d._stats()
+        self.assertTrue(stats['bloom'])
+        self.assertTrue(stats['bloom_bytes'] > 0)
+        self.assertTrue(0 < stats['bloom_false_positive_rate'] < 0.05)
+        self.assertTrue(d.__sizeof__() >= stats['bloom_bytes'])
+
+        misses = [k for k in xrange(10000, 20000) if k not in d]
+        self.assertEqual(len(misses), 10000)
+        self.assertEqual(d.get(-1), None)
+        self.assertEqual(d.get_many(range(9990, 10010)), list(range(9990, 10000)) + [None] * 10)
+        stats = d._stats()
+        # misses with an empty home slot don't get to the filter
+        self.assertTrue(stats['bloom_rejects'] > 1000)
+        self.assertTrue(stats['bloom_rejects'] + stats['bloom_false_positives'] <= 10011)
+
+        # churn past the filter capacity: deleted keys are dropped when it's rebuilt
+        for i in xrange(10000):
+            del d[i]
+            d[i + 10000] = i
+        self.assertEqual(sorted(d), list(range(10000, 20000)))
+        self.assertTrue(d._stats()['bloom_false_positive_rate'] < 0.05)
+        self.assertTrue(all(k in d for k in xrange(10000, 20000)))
+        self.assertEqual(d.copy(), d)
+        d.clear()
+        self.assertEqual(d._stats()['bloom_false_positive_rate'], 0)
+        self.assertFalse(10000 in d)
+
+        d.configure(bloom=False)
+        self.assertEqual(d._stats()['bloom_bytes'], 0)
+
+    def test_mapped(self):
+        items = [(i, i * 2) for i in xrange(-500, 500)]
+        items += [(b'b%d' % i if str is bytes else ('b%d' % i).encode(), float(i) / 4) for i in xrange(500)]
+        items += [(u'\u044e%d' % i, u'v\xe9%d' % i) for i in xrange(500)]
+        items += [(2 ** 62, None), (-2 ** 63, True), (0.5, False), (b'empty', u''), (u'', b'\0' * 100)]
+        d = SparseDict(items)
+        fd, path = tempfile.mkstemp()
+        os.close(fd)
+        try:
+            d.save_mapped(path)
+            m = SparseDict.open_mapped(path)
+            self.assertTrue(isinstance(m, SparseDictMapped))
+            self.assertEqual(len(m), len(d))
+            for k, v in items:
+                self.assertEqual(m[k], v)
+                self.assertEqual(type(m[k]), type(v))
+                self.assertTrue(k in m)
+            self.assertEqual(sorted(m.items(), key=repr), sorted(d.items(), key=repr))
+            self.assertEqual(sorted(m, key=repr), sorted(m.keys(), key=repr))
+            self.assertEqual(len(list(m.itervalues())), len(d))
+            self.assertEqual(dict(m.iteritems()), dict(d.items()))
+            # equal keys of other types find the same items
+            self.assertEqual(m[3.0], 6)
+            self.assertEqual(m[True], 2)
+            for k in (500, 2 ** 64, 0.25, b'b500', u'b0', u'\ud800', (1, 2), None):
+                self.assertFalse(k in m)
+                self.assertEqual(m.get(k, 'x'), 'x')
+                self.assertRaises(KeyError, m.__getitem__, k)
+            self.assertRaises(TypeError, m.get, [])
+            self.assertRaises(TypeError, hash, m)
+            self.assertRaises(TypeError, SparseDictMapped)
+
+            self.assertRaises(TypeError, SparseDict({(1, 2): 1}).save_mapped, path)
+            self.assertRaises(TypeError, SparseDict({1: [1]}).save_mapped, path)
+            self.assertRaises(OverflowError, SparseDict({2 ** 64: 1}).save_mapped, path)
+            SparseDict().save_mapped(path)
+            self.assertEqual(len(SparseDict.open_mapped(path)), 0)
+            self.assertEqual(list(SparseDict.open_mapped(path)), [])
+            m = None
+
+            with open(path, 'wb') as f:
+                f.write(b'not a sparsedict file' * 10)
+            self.assertRaises(ValueError, SparseDict.open_mapped, path)
+            self.assertRaises(IOError, SparseDict.open_mapped, path + '.missing')
+        finally:
+            os.remove(path)
+
+    def test_dump(self):
+        for options in ({}, dict(hash_cache=True), dict(robin_hood=True), dict(fingerprints=True),
+                        dict(bloom=True)):
+            d = SparseDict()
+            d.configure(**options)
+            for i in xrange(1000):
+                d[i] = i * 1.5
+                d[u'\u044e%d' % i] = None
+                d[b'b%d' % i if str is bytes else ('b%d' % i).encode()] = [i]
+                d[(i, i)] = 2 ** 70 + i
+            for i in xrange(0, 1000, 3):
+                del d[i]
+            f = io.BytesIO()
+            d.dump(f)
+            f.write(b'tail')
+            f.seek(0)
+            e = SparseDict.load(f)
+            self.assertEqual(f.read(), b'tail')
+            self.assertEqual(e, d)
+            self.assertEqual(e._stats()['max_items'], d._stats()['max_items'])
+            for key in options:
+                self.assertTrue(e._stats()[key])
+            e[-1] = 1
+            self.assertEqual(e.pop(1), 1.5)
+            self.assertEqual(len(e), len(d))
+
+        # keys hashed differently when loaded are placed again
+        d = SparseDictSubclass((SaltedKey(i), i) for i in xrange(1000))
+        f = io.BytesIO()
+        d.dump(f)
+        SaltedKey.salt = 1
+        try:
+            e = SparseDictSubclass.load(io.BytesIO(f.getvalue()))
+            self.assertEqual(type(e), SparseDictSubclass)
+            self.assertTrue(all(e[SaltedKey(i)] == i for i in xrange(1000)))
+            self.assertEqual(len(e), 1000)
+        finally:
+            SaltedKey.salt = 0
+
+        data = f.getvalue()
+        self.assertRaises(ValueError, SparseDict.load, io.BytesIO(data[:-20]))
+        self.assertRaises(ValueError, SparseDict.load, io.BytesIO(b'not a dump' * 10))
+        # frame lengths are bounded, a corrupt one doesn't size the read buffer
+        for length in (2 ** 16 + 1, 2 ** 40, 2 ** 64 - 1):
+            self.assertRaises(ValueError, SparseDict.load, io.BytesIO(struct.pack('=Q', length) + data[8:]))
+        self.assertRaises(AttributeError, d.dump, None)
+
+    def test_copy_structure(self):
+        import sys
+        key, value = object(), object()
+        refs = sys.getrefcount(key), sys.getrefcount(value)
+        for options in ({}, dict(hash_cache=True), dict(robin_hood=True), dict(fingerprints=True),
+                        dict(bloom=True), dict(incremental_resize=True)):
+            d = SparseDict()
+            d.configure(**options)
+            d[key] = value
+            for i in xrange(5000):
+                d[i] = str(i)
+            for i in xrange(0, 5000, 10):
+                del d[i]
+            c = d.copy()
+            self.assertEqual(c, d)
+            self.assertEqual(c._stats()['max_items'], d._stats()['max_items'])
+            for name in options:
+                self.assertTrue(c._stats()[name])
+            self.assertTrue(c._stats()['num_deleted'] <= d._stats()['num_deleted'])
+            c[-1] = -1
+            del c[1]
+            self.assertEqual(d[1], '1')
+            self.assertFalse(-1 in d)
+            self.assertTrue(all(c[i] == str(i) for i in xrange(2, 5000) if i % 10))
+            c = d = None
+        self.assertEqual((sys.getrefcount(key), sys.getrefcount(value)), refs)
+        d = SparseDict({key: value})
+        e = SparseDict(d)
+        f = SparseDict({key: value})
+        del d, e, f
+        self.assertEqual((sys.getrefcount(key), sys.getrefcount(value)), refs)
+
+    def test_snapshot(self):
+        import sys
+        key, value = object(), object()
+        refs = sys.getrefcount(key), sys.getrefcount(value)
+        for options in ({}, dict(hash_cache=True), dict(robin_hood=True), dict(fingerprints=True),
+                        dict(bloom=True), dict(incremental_resize=True)):
+            d = SparseDict()
+            d.configure(**options)
+            d[key] = value
+            for i in xrange(5000):
+                d[i] = [i]
+            s = d.snapshot()
+            stats = s._stats()
+            self.assertEqual(s, d)
+            self.assertEqual(stats['shared_blocks'], d._stats()['shared_blocks'])
+            self.assertEqual(stats['items_bytes'], 0)
+            for name in options:
+                self.assertTrue(stats[name])
+            for i in xrange(0, 5000, 2):
+                del d[i]
+            d[-1] = -1
+            s[1] = 'one'
+            t = s.snapshot()
+            del s[3]
+            self.assertEqual(len(s), 5000)
+            self.assertEqual(s[1], 'one')
+            self.assertEqual(s[0], [0])
+            self.assertFalse(-1 in s)
+            self.assertEqual(d[1], [1])
+            self.assertEqual(t[3], [3])
+            self.assertTrue(all(d[i] == [i] for i in xrange(3, 5000, 2)))
+            self.assertTrue(all(t[i] == [i] for i in xrange(2, 5000)))
+            self.assertTrue(0 < s._stats()['shared_blocks'] < stats['shared_blocks'])
+            d.resize(20000)
+            self.assertEqual(d._stats()['shared_blocks'], 0)
+            self.assertEqual(s.pop(key), value)
+            s.clear()
+            self.assertEqual(t[key], value)
+            d = s = t = None
+        self.assertEqual((sys.getrefcount(key), sys.getrefcount(value)), refs)
+
+    def test_snapshot_reentrancy(self):
+        # __eq__ takes a snapshot, then inserts: the blocks the lookup probed get copied
+        snapshots = []
+
+        def snapshot_fill(d, ints):
+            snapshots.append((d.snapshot(), dict(d)))
+            for i in ints:
+                d[i] = i
+
+        for d in reentrant_lookups(self, snapshot_fill):
+            s, items = snapshots.pop()
+            self.assertEqual(s, items)
+            self.assertEqual(len(s), len(items))
+            self.assertNotIn(ReentrantKey('new'), s)
+            self.assertTrue(all(d[i] == i for i in xrange(2000)))
+
+    def test_snapshot_cycles(self):
+        class C(object):
+            pass
+        obj = C()
+        ref = weakref.ref(obj)
+        obj.d = SparseDict([(obj, 1)])
+        obj.s = obj.d.snapshot()
+        obj.s[1] = obj.s
+        del obj
+        gc.collect()
+        self.assertIs(ref(), None, "Cycle was not collected")
+
+    def test_iter_deleted_last(self):
+        d = SparseDict((i, i) for i in xrange(100))
+        last = list(d)[-1]
+        del d[last]
+        self.assertEqual(len(list(d)), 99)
+        self.assertEqual(len(list(d.itervalues())), 99)
+        self.assertEqual(len(list(d.iteritems())), 99)
+
+    def test_typed_values(self):
+        import sys
+        key = object()
+        refs = sys.getrefcount(key)
+        for options in ({}, dict(hash_cache=True), dict(robin_hood=True), dict(fingerprints=True),
+                        dict(bloom=True), dict(incremental_resize=True)):
+            d = SparseDict(value_type='i8')
+            d.configure(**options)
+            expected = {}
+            for i in xrange(5000):
+                d[i] = expected[i] = i * 3 - 2 ** 40
+            d[key] = expected[key] = True
+            for i in xrange(0, 5000, 4):
+                del d[i]
+                del expected[i]
+            self.assertEqual(d, expected)
+            self.assertEqual(d._stats()['value_type'], 'i8')
+            self.assertEqual(d[1], 3 - 2 ** 40)
+            self.assertEqual(d[key], 1)
+            self.assertEqual(type(d[key]), type(1))
+            self.assertEqual(sorted(d.values(), key=repr), sorted(expected.values(), key=repr))
+            self.assertEqual(dict(d.iteritems()), expected)
+            self.assertEqual(d.get_many([1, -1], 'x'), [3 - 2 ** 40, 'x'])
+            self.assertTrue((2, 6 - 2 ** 40) in d.viewitems())
+            self.assertEqual(d.pop(2), 6 - 2 ** 40)
+            self.assertEqual(d.setdefault(3), 9 - 2 ** 40)
+            self.assertEqual(d.setdefault(-1, 7), 7)
+            k, v = d.popitem()
+            self.assertEqual(d.get(k, v + 1), v + 1)
+            for c in (d.copy(), d.snapshot(), SparseDict(d)):
+                self.assertEqual(c, d)
+            s = d.snapshot()
+            s[1] = 0
+            self.assertEqual(d[1], 3 - 2 ** 40)
+            d.clear()
+            self.assertEqual(d._stats()['value_type'], 'i8')
+            d = s = c = k = expected = None
+        self.assertEqual(sys.getrefcount(key), refs)
+
+        # values with the same bits are equal, in shared blocks or not
+        nan = float('nan')
+        for size in (10, 1000):
+            d = SparseDict(((i, i / 2.0) for i in xrange(size)), value_type='f8')
+            d[5] = nan
+            for c in (d, d.snapshot(), d.copy(), SparseDict(d, value_type='f8')):
+                self.assertEqual(c, d)
+                self.assertEqual(d, c)
+            self.assertNotEqual(d, dict(d))
+            self.assertNotEqual(d, SparseDict(d))
+            c = d.copy()
+            c[5] = -nan
+            self.assertNotEqual(c, d)
+            c[5] = 2.5
+            self.assertNotEqual(c, d)
+        d = SparseDict({1: 0.0}, value_type='f8')
+        self.assertEqual(d, SparseDict({1: -0.0}, value_type='f8'))
+        self.assertEqual(d, SparseDict({1: 0}, value_type='i8'))
+
+        d = SparseDict({1: 2}, value_type='f8', a=3)
+        self.assertEqual(d, {1: 2.0, 'a': 3.0})
+        self.assertEqual(type(d[1]), float)
+        self.assertEqual(repr(d), repr(SparseDict({1: 2.0, 'a': 3.0})))
+        d.update_arrays(list(xrange(100)), [i / 4.0 for i in xrange(100)])
+        self.assertEqual(d[99], 24.75)
+        self.assertEqual(SparseDict(value_type=None, value_type2=1), {'value_type2': 1})
+
+        # values must convert to the type
+        d = SparseDict(value_type='i8')
+        self.assertRaises(TypeError, d.__setitem__, 1, 1.5)
+        self.assertRaises(TypeError, d.__setitem__, 1, '1')
+        self.assertRaises(OverflowError, d.__setitem__, 1, 2 ** 63)
+        self.assertRaises(TypeError, d.update_arrays, [1, 2], [1, None])
+        self.assertRaises(TypeError, SparseDict(value_type='f8').__setitem__, 1, '1.5')
+        self.assertEqual(len(d), 0)
+        self.assertRaises(TypeError, d.setdefault, 1)
+        self.assertRaises(ValueError, SparseDict, value_type='i4')
+        d[1] = 1
+        self.assertRaises(ValueError, d.__init__, value_type='f8')
+        d.__init__({2: 2}, value_type='i8')
+        self.assertEqual(d, {1: 1, 2: 2})
+
+        # nothing to track with scalar values
+        if hasattr(gc, 'is_tracked'):
+            self.assertFalse(gc.is_tracked(SparseDict({1: 1}, value_type='i8')))
+            self.assertTrue(gc.is_tracked(SparseDict({SaltedKey(1): 1}, value_type='i8')))
+
+    def test_typed_values_persistence(self):
+        d = SparseDictSubclass(((i, i / 8.0) for i in xrange(1000)), value_type='f8')
+        for proto in range(pickle.HIGHEST_PROTOCOL + 1):
+            pd = pickle.loads(pickle.dumps(d, proto))
+            self.assertEqual(pd, d)
+            self.assertEqual(type(pd), SparseDictSubclass)
+            self.assertEqual(pd._stats()['value_type'], 'f8')
+            self.assertEqual(pd.a, 'aval')
+
+        for value_type in ('i8', 'f8'):
+            d = SparseDict(((i, i * 3) for i in xrange(1000)), value_type=value_type)
+            for i in xrange(0, 1000, 3):
+                del d[i]
+            f = io.BytesIO()
+            d.dump(f)
+            e = SparseDict.load(io.BytesIO(f.getvalue()))
+            self.assertEqual(e, d)
+            self.assertEqual(e._stats()['value_type'], value_type)
+
+            fd, path = tempfile.mkstemp()
+            os.close(fd)
+            try:
+                d.save_mapped(path)
+                m = SparseDict.open_mapped(path)
+                self.assertEqual(dict(m.iteritems()), dict(d.items()))
+                m = None
+            finally:
+                os.remove(path)
+
+    def test_bytes_values(self):
+        def value(i):
+            return b'v' + str(i).encode('ascii') * (i % 5)
+
+        for options in ({}, dict(hash_cache=True), dict(robin_hood=True), dict(incremental_resize=True),
+                        dict(bloom=True)):
+            d = SparseDict(value_type='bytes')
+            d.configure(**options)
+            expected = {}
+            for i in xrange(5000):
+                d[i] = expected[i] = value(i)
+            for i in xrange(0, 5000, 3):
+                d[i] = expected[i] = value(i + 1)
+            for i in xrange(0, 5000, 4):
+                del d[i]
+                del expected[i]
+            self.assertEqual(d, expected)
+            self.assertEqual(d._stats()['value_type'], 'bytes')
+            self.assertEqual(type(d[1]), bytes)
+            self.assertEqual(dict(d.iteritems()), expected)
+            self.assertEqual(d.get_many([1, -1], 'x'), [expected[1], 'x'])
+            self.assertEqual(d.pop(2), expected.pop(2))
+            self.assertEqual(d.setdefault(3), expected[3])
+            self.assertEqual(d.setdefault(-1, b''), b'')
+            view = d.get_view(1)
+            self.assertTrue(view.readonly)
+            self.assertEqual(view.tobytes(), expected[1])
+            d.update((i, value(i)) for i in xrange(5000, 20000))
+            self.assertEqual(view.tobytes(), expected[1])  # views outlive the arena
+            d.update_arrays([5, 5, 6], [b'a', b'b', b'c'])
+            self.assertEqual((d[5], d[6]), (b'b', b'c'))
+            for c in (d.copy(), d.snapshot(), SparseDict(d)):
+                self.assertEqual(c, d)
+            s = d.snapshot()
+            s[1] = b''
+            self.assertEqual(d[1], expected[1])
+            d.clear()
+            self.assertEqual(d._stats()['arena_bytes'], 0)
+            d = s = c = view = None
+
+        # overwritten and deleted values are dropped when the arena is compacted
+        d = SparseDict(((i, b'x' * 100) for i in xrange(10000)), value_type='bytes')
+        for i in xrange(9000):
+            del d[i]
+        self.assertEqual(d._stats()['arena_used_bytes'], 10 ** 6)
+        self.assertTrue(d.compact() >= 900000)
+        stats = d._stats()
+        self.assertEqual(stats['arena_used_bytes'], 100000)
+        self.assertTrue(d.__sizeof__() > stats['arena_bytes'] >= 100000)
+        self.assertEqual(d, dict.fromkeys(xrange(9000, 10000), b'x' * 100))
+
+        d = SparseDict(value_type='bytes')
+        self.assertRaises(TypeError, d.__setitem__, 1, 1)
+        self.assertRaises(TypeError, d.__setitem__, 1, u'x')
+        self.assertRaises(TypeError, d.update_arrays, [1, 2], [b'1', None])
+        self.assertEqual(len(d), 0)
+        self.assertRaises(KeyError, d.get_view, 1)
+        self.assertRaises(TypeError, SparseDict().get_view, 1)
+        self.assertRaises(TypeError, SparseDict(value_type='i8').get_view, 1)
+        if hasattr(gc, 'is_tracked'):
+            self.assertFalse(gc.is_tracked(SparseDict({1: b'1'}, value_type='bytes')))
+
+    def test_bytes_values_persistence(self):
+        d = SparseDictSubclass(((i, b'v' * (i % 7)) for i in xrange(1000)), value_type='bytes')
+        for i in xrange(0, 1000, 3):
+            del d[i]
+        for proto in range(pickle.HIGHEST_PROTOCOL + 1):
+            pd = pickle.loads(pickle.dumps(d, proto))
+            self.assertEqual(pd, d)
+            self.assertEqual(type(pd), SparseDictSubclass)
+            self.assertEqual(pd._stats()['value_type'], 'bytes')
+            self.assertEqual(pd.a, 'aval')
+
+        f = io.BytesIO()
+        d.dump(f)
+        e = SparseDict.load(io.BytesIO(f.getvalue()))
+        self.assertEqual(e, d)
+        self.assertEqual(e._stats()['value_type'], 'bytes')
+
+        fd, path = tempfile.mkstemp()
+        os.close(fd)
+        try:
+            d.save_mapped(path)
+            m = SparseDict.open_mapped(path)
+            self.assertEqual(dict(m.iteritems()), dict(d.items()))
+            m = None
+        finally:
+            os.remove(path)
+
+    def test_typed_keys(self):
+        import sys
+        value = object()
+        refs = sys.getrefcount(value)
+        for options in ({}, dict(hash_cache=True), dict(robin_hood=True), dict(fingerprints=True),
+                        dict(bloom=True), dict(incremental_resize=True)):
+            for value_type in (None, 'i8'):
+                d = SparseDict(key_type='i8', value_type=value_type)
+                d.configure(**options)
+                expected = {}
+                for i in xrange(-2500, 2500):
+                    d[i * 7919] = expected[i * 7919] = i
+                d[2 ** 63 - 1] = expected[2 ** 63 - 1] = 1
+                d[1 - 2 ** 63] = expected[1 - 2 ** 63] = -1
+                for i in xrange(-2500, 2500, 4):
+                    del d[i * 7919]
+                    del expected[i * 7919]
+                self.assertEqual(d, expected)
+                self.assertEqual(expected, dict(d.items()))
+                self.assertEqual(d._stats()['key_type'], 'i8')
+                self.assertEqual(d[7919], 1)
+                self.assertEqual(type(next(iter(d))), type(1))
+                self.assertEqual(sorted(d), sorted(expected))
+                self.assertEqual(dict(d.iteritems()), expected)
+                # keys that are not representable are never present
+                self.assertEqual(d.get_many([7919, 'a', 1.5, 2 ** 64, -2 ** 63], 'x'), [1, 'x', 'x', 'x', 'x'])
+                self.assertNotIn('a', d)
+                self.assertRaises(KeyError, d.__delitem__, 'a')
+                self.assertEqual(d.pop(2 ** 64, 'x'), 'x')
+                self.assertTrue((7919, 1) in d.viewitems())
+                self.assertEqual(d.pop(7919 * 2), 2)
+                self.assertEqual(d.setdefault(7919 * 3), 3)
+                self.assertEqual(d.setdefault(-1, 7), 7)
+                k, v = d.popitem()
+                self.assertNotIn(k, d)
+                for c in (d.copy(), d.snapshot(), SparseDict(d), SparseDict(dict(d), key_type='i8')):
+                    self.assertEqual(c, d)
+                    self.assertEqual(d, c)
+                s = d.snapshot()
+                s[7919] = 0
+                self.assertEqual(d[7919], 1)
+                self.assertEqual(SparseDict(d), dict(d.items()))
+                if value_type is None:
+                    d[0] = value
+                d.compact()
+                d.clear()
+                self.assertEqual(d._stats()['key_type'], 'i8')
+                d = s = c = expected = None
+        self.assertEqual(sys.getrefcount(value), refs)
+
+        d = SparseDict({1: 'a'}, key_type='i8')
+        d.update_arrays([2, 3], 'bc')
+        d[2 ** 64 // 2 ** 62] = 'd'
+        d[True] = 'e'
+        self.assertEqual(d, {1: 'e', 2: 'b', 3: 'c', 4: 'd'})
+        self.assertEqual(repr(d), repr(SparseDict({1: 'e', 2: 'b', 3: 'c', 4: 'd'})))
+        self.assertEqual(d, SparseDict(d, key_type=None))
+
+        # keys must convert to the type
+        d = SparseDict(key_type='i8')
+        self.assertRaises(TypeError, d.__setitem__, 'a', 1)
+        self.assertRaises(TypeError, d.__setitem__, 1.0, 1)
+        self.assertRaises(OverflowError, d.__setitem__, 2 ** 63, 1)
+        self.assertRaises(OverflowError, d.__setitem__, -2 ** 63, 1)
+        self.assertRaises(TypeError, d.setdefault, 'a')
+        self.assertRaises(TypeError, d.update_arrays, [1, 'b'], [1, 2])
+        self.assertEqual(len(d), 0)
+        self.assertRaises(ValueError, SparseDict, key_type='f8')
+        d[1] = 1
+        self.assertRaises(ValueError, d.__init__, key_type=None)
+        d.__init__({2: 2}, key_type='i8')
+        self.assertEqual(d, {1: 1, 2: 2})
+
+        # nothing to track with scalar keys
+        if hasattr(gc, 'is_tracked'):
+            self.assertFalse(gc.is_tracked(SparseDict({1: 1}, key_type='i8', value_type='i8')))
+            self.assertTrue(gc.is_tracked(SparseDict({1: []}, key_type='i8')))
+
+    def test_typed_keys_persistence(self):
+        d = SparseDictSubclass(((i * 7919 - 2 ** 40, i) for i in xrange(1000)), key_type='i8')
+        for proto in range(pickle.HIGHEST_PROTOCOL + 1):
+            pd = pickle.loads(pickle.dumps(d, proto))
+            self.assertEqual(pd, d)
+            self.assertEqual(type(pd), SparseDictSubclass)
+            self.assertEqual(pd._stats()['key_type'], 'i8')
+            self.assertEqual(pd.a, 'aval')
+
+        for value_type in (None, 'i8', 'f8'):
+            d = SparseDict(((i - 500, i * 3) for i in xrange(1000)), key_type='i8', value_type=value_type)
+            for i in xrange(0, 1000, 3):
+                del d[i - 500]
+            f = io.BytesIO()
+            d.dump(f)
+            e = SparseDict.load(io.BytesIO(f.getvalue()))
+            self.assertEqual(e, d)
+            self.assertEqual(e._stats()['key_type'], 'i8')
+
+            fd, path = tempfile.mkstemp()
+            os.close(fd)
+            try:
+                d.save_mapped(path)
+                m = SparseDict.open_mapped(path)
+                self.assertEqual(dict(m.iteritems()), dict(d.items()))
+                m = None
+            finally:
+                os.remove(path)
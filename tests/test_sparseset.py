@@ -0,0 +1,262 @@
+# tests for SparseSet, checked against the builtin set
+
+import unittest2 as unittest
+import gc
+import operator
+import pickle
+import random
+from sparsedict import SparseDict, SparseSet
+
+
+class SparseSetSubclass(SparseSet):
+    pass
+
+
+class BadCmp(object):
+
+    def __hash__(self):
+        return 1
+
+    def __eq__(self, other):
+        raise RuntimeError
+
+
+class TestSparseSet(unittest.TestCase):
+
+    def test_constructor(self):
+        self.assertEqual(len(SparseSet()), 0)
+        self.assertEqual(set(SparseSet([1, 2, 2, 3])), set([1, 2, 3]))
+        self.assertEqual(set(SparseSet('abc')), set('abc'))
+        self.assertEqual(set(SparseSet(SparseDict.fromkeys('ab'))), set('ab'))
+        s = SparseSet([1, 2])
+        s.__init__([3])
+        self.assertEqual(set(s), set([3]))
+        self.assertRaises(TypeError, SparseSet, 1)
+        self.assertRaises(TypeError, SparseSet, [[]])
+        self.assertRaises(TypeError, SparseSet, [], [])
+        self.assertRaises(TypeError, SparseSet, iterable=[])
+
+    def test_add_remove(self):
+        s = SparseSet()
+        keys = list(range(1000)) + ['k%d' % i for i in range(1000)]
+        for k in keys:
+            s.add(k)
+        s.add(5)
+        self.assertEqual(len(s), 2000)
+        for k in keys:
+            self.assertIn(k, s)
+        self.assertNotIn(-1, s)
+        for k in keys[::2]:
+            s.remove(k)
+        for k in keys[::3]:
+            s.discard(k)
+        expected = set(keys[1::2]) - set(keys[::3])
+        self.assertEqual(set(s), expected)
+        self.assertEqual(len(s), len(expected))
+        self.assertRaises(KeyError, s.remove, 0)
+        self.assertRaises(TypeError, s.add, [])
+        self.assertRaises(TypeError, s.__contains__, [])
+
+    def test_set_keys(self):
+        s = SparseSet([frozenset([1, 2])])
+        self.assertIn(set([1, 2]), s)
+        self.assertIn(SparseSet([1, 2]), s)
+        s.discard(set([1, 2]))
+        self.assertEqual(len(s), 0)
+        self.assertRaises(KeyError, s.remove, set([3]))
+
+    def test_pop_clear(self):
+        s = SparseSet(range(100))
+        popped = set(s.pop() for _ in range(100))
+        self.assertEqual(popped, set(range(100)))
+        self.assertRaises(KeyError, s.pop)
+        s.update(range(10))
+        s.clear()
+        self.assertEqual(len(s), 0)
+        self.assertEqual(list(s), [])
+        s.add(1)
+        self.assertEqual(list(s), [1])
+
+    def test_shrink(self):
+        s = SparseSet(range(10000))
+        big = s.__sizeof__()
+        for i in range(9990):
+            s.remove(i)
+        s.add(-1)
+        self.assertLess(s.__sizeof__(), big // 10)
+        self.assertEqual(set(s), set(range(9990, 10000)) | set([-1]))
+
+    def test_resize_policy(self):
+        # same probing and resize points as SparseDict (present keys included), so the same order
+        s, d = SparseSet(), SparseDict()
+        for i in range(2000):
+            s.add(i * 7919)
+            d[i * 7919] = None
+            s.add(0)
+            d[0] = None
+            if i % 3 == 0:
+                s.discard(i * 7919 // 2)
+                d.pop(i * 7919 // 2, None)
+            self.assertEqual(list(s), list(d))
+
+    def test_operators(self):
+        random.seed(1)
+        for _ in range(20):
+            a = set(random.randrange(200) for _ in range(random.randrange(150)))
+            b = set(random.randrange(200) for _ in range(random.randrange(150)))
+            sa, sb = SparseSet(a), SparseSet(b)
+            for other in (sb, b, frozenset(b)):
+                self.assertEqual(set(sa & other), a & b)
+                self.assertEqual(set(sa | other), a | b)
+                self.assertEqual(set(sa - other), a - b)
+                self.assertEqual(set(sa ^ other), a ^ b)
+                self.assertEqual(sa <= other, a <= b)
+                self.assertEqual(sa < other, a < b)
+                self.assertEqual(sa >= other, a >= b)
+                self.assertEqual(sa > other, a > b)
+                self.assertEqual(sa == other, a == b)
+                self.assertEqual(sa != other, a != b)
+            for result in (sa & b, b & sa, b | sa, b - sa, b ^ sa):
+                self.assertIs(type(result), SparseSet)
+            self.assertEqual(set(b - sa), b - a)
+            self.assertEqual(set(b ^ sa), a ^ b)
+            self.assertEqual(b <= sa, b <= a)
+            self.assertEqual(b == sa, a == b)
+        s = SparseSet([1])
+        self.assertEqual(s, s)
+        self.assertEqual(s, set([1]))
+        self.assertNotEqual(s, [1])
+        self.assertNotEqual(s, SparseSet([2]))
+        self.assertRaises(TypeError, lambda: s & [1])
+        self.assertRaises(TypeError, lambda: s | [1])
+        self.assertRaises(TypeError, hash, s)
+
+    def test_inplace_operators(self):
+        a, b = set(range(0, 60, 2)), set(range(0, 60, 3))
+        for op in (operator.iand, operator.ior, operator.isub, operator.ixor):
+            for other in (b, SparseSet(b)):
+                s = SparseSet(a)
+                self.assertIs(op(s, other), s)
+                self.assertEqual(set(s), op(set(a), b))
+        s = SparseSet(a)
+        self.assertEqual(s.__ior__([1]), NotImplemented)
+        s &= s
+        self.assertEqual(set(s), a)
+        s ^= s
+        self.assertEqual(len(s), 0)
+
+    def test_methods(self):
+        a, b, c = set(range(0, 60, 2)), set(range(0, 60, 3)), set(range(0, 60, 5))
+        s = SparseSet(a)
+        self.assertEqual(set(s.union(b, list(c))), a | b | c)
+        self.assertEqual(set(s.intersection(b, iter(c))), a & b & c)
+        self.assertEqual(set(s.difference(b, list(c))), a - b - c)
+        self.assertEqual(set(s.symmetric_difference(list(b) * 2)), a ^ b)
+        self.assertEqual(set(s.union()), a)
+        self.assertIsNot(s.intersection(), s)
+        self.assertTrue(s.issubset(range(60)))
+        self.assertFalse(s.issubset(list(b)))
+        self.assertTrue(s.issuperset(iter([0, 2])))
+        self.assertFalse(s.isdisjoint(iter(b)))
+        self.assertTrue(s.isdisjoint(SparseSet([1, 3])))
+        self.assertTrue(s.isdisjoint([]))
+        self.assertEqual(s, a)
+
+        for name in ('update', 'intersection_update', 'difference_update', 'symmetric_difference_update'):
+            expected, s = set(a), SparseSet(a)
+            getattr(s, name)(iter(b))
+            getattr(expected, name)(b)
+            self.assertEqual(set(s), expected, name)
+        s = SparseSet(a)
+        s.update(b, c)
+        self.assertEqual(set(s), a | b | c)
+        s.difference_update(b, c)
+        self.assertEqual(set(s), a - b - c)
+        s.symmetric_difference_update([1, 1])
+        self.assertIn(1, s)
+
+    def test_copy(self):
+        s = SparseSetSubclass(range(100))
+        for i in range(0, 100, 3):
+            s.remove(i)
+        c = s.copy()
+        self.assertIs(type(c), SparseSet)
+        self.assertEqual(c, s)
+        c.add(1000)
+        s.discard(1)
+        self.assertNotIn(1000, s)
+        self.assertIn(1, c)
+        self.assertEqual(len(c), len(s) + 2)
+
+    def test_iteration(self):
+        s = SparseSet(range(100))
+        it = iter(s)
+        self.assertEqual(it.__length_hint__(), 100)
+        next(it)
+        self.assertEqual(it.__length_hint__(), 99)
+        s.add(1000)
+        self.assertRaises(RuntimeError, next, it)
+        self.assertRaises(RuntimeError, next, it)
+
+        def remove_while_iterating():
+            for k in s:
+                s.discard(k)
+        self.assertRaises(RuntimeError, remove_while_iterating)
+        s = SparseSet(range(100))
+        for k in s:
+            s.add(k) # adding present keys is fine
+        self.assertEqual(sorted(s), list(range(100)))
+
+    def test_repr(self):
+        self.assertEqual(repr(SparseSet()), 'SparseSet()')
+        self.assertEqual(repr(SparseSet([1])), 'SparseSet([1])')
+
+    def test_pickle(self):
+        s = SparseSet(range(50))
+        t = SparseSetSubclass('ab')
+        t.x = 1
+        for proto in range(pickle.HIGHEST_PROTOCOL + 1):
+            ps = pickle.loads(pickle.dumps(s, proto))
+            self.assertEqual(ps, s)
+            self.assertIs(type(ps), SparseSet)
+            pt = pickle.loads(pickle.dumps(t, proto))
+            self.assertEqual(pt, t)
+            self.assertIs(type(pt), SparseSetSubclass)
+            self.assertEqual(pt.x, 1)
+
+    def test_compare_errors(self):
+        s = SparseSet([BadCmp()])
+        self.assertRaises(RuntimeError, s.__contains__, BadCmp())
+        self.assertRaises(RuntimeError, s.add, BadCmp())
+
+    def test_sizeof(self):
+        keys = list(range(10000))
+        s = SparseSet(keys)
+        d = SparseDict.fromkeys(keys)
+        self.assertLess(s.__sizeof__(), d.__sizeof__() * 0.6)
+
+    def test_cycles(self):
+        class Node(object):
+            pass
+        n = Node()
+        n.s = SparseSet([n])
+        del n
+        gc.collect()
+        s = SparseSet([1, 2])
+        if hasattr(gc, 'is_tracked'):
+            self.assertFalse(gc.is_tracked(s))
+            s.add(Node())
+            self.assertTrue(gc.is_tracked(s))
+
+    def test_view_result_type(self):
+        d = SparseDict.fromkeys('abc')
+        keys = d.viewkeys() if hasattr(d, 'viewkeys') else d.keys()  # a view on Python 3
+        result = keys.union('cd', result_type=SparseSet)
+        self.assertIs(type(result), SparseSet)
+        self.assertEqual(result, set('abcd'))
+        self.assertEqual(keys & SparseSet('bx'), set('b'))
+        self.assertEqual(keys - SparseSet('bx'), set('ac'))
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -171,3 +171,49 @@ class SparseDictSetTest(unittest.TestCase):
         self.assertFalse(d1.viewitems().isdisjoint(set(d2.viewitems())))
         self.assertTrue(d1.viewitems().isdisjoint(d3.viewitems()))
         self.assertTrue(d1.viewitems().isdisjoint(set(d3.viewitems())))
+
+    def test_set_operations_other_iterables(self):
+        d1 = SparseDict({'a': 1, 'b': 2, 'c': 3})
+        keys = d1.viewkeys()
+        self.assertEqual(keys & ['b', 'c', 'd'], set(['b', 'c']))
+        self.assertEqual(['b', 'c', 'd'] & keys, set(['b', 'c']))
+        self.assertEqual(keys & iter('bd'), set(['b']))
+        self.assertEqual(keys & {'a': 0, 'z': 0}, set(['a']))
+        self.assertEqual(keys & frozenset('ab'), set(['a', 'b']))
+        self.assertEqual(keys | ('c', 'd'), set(['a', 'b', 'c', 'd']))
+        self.assertEqual(('c', 'd') | keys, set(['a', 'b', 'c', 'd']))
+        self.assertEqual(keys - iter('ad'), set(['b', 'c']))
+        self.assertEqual(['a', 'd'] - keys, set(['d']))
+        self.assertEqual(keys ^ iter('ad'), set(['b', 'c', 'd']))
+        self.assertEqual(['a', 'd'] ^ keys, set(['b', 'c', 'd']))
+        self.assertEqual(keys & dict.fromkeys('cx').keys(), set(['c']))
+        self.assertEqual(d1.viewitems() & [('a', 1), ('b', 0)], set([('a', 1)]))
+        self.assertEqual(d1.viewitems() - iter([('a', 1), ('b', 0)]), set([('b', 2), ('c', 3)]))
+        self.assertTrue(keys.isdisjoint(iter('xyz')))
+        self.assertFalse(keys.isdisjoint(['x', 'c']))
+        self.assertTrue(keys.isdisjoint(SparseDict({'x': 1})))
+        self.assertRaises(TypeError, lambda: keys & 1)
+        self.assertRaises(TypeError, lambda: keys & [[]])
+
+    def test_set_methods_result_type(self):
+        d1 = SparseDict({'a': 1, 'b': 2})
+        d2 = SparseDict({'b': 3, 'c': 2})
+        keys = d1.viewkeys()
+        self.assertEqual(keys.intersection(d2.viewkeys()), set(['b']))
+        self.assertEqual(keys.union(d2), set(['a', 'b', 'c']))
+        self.assertEqual(keys.difference(d2.viewkeys()), set(['a']))
+        self.assertEqual(keys.symmetric_difference(d2.viewkeys()), set(['a', 'c']))
+
+        result = keys.union(d2.viewkeys(), result_type=SparseDict)
+        self.assertIsInstance(result, SparseDict)
+        self.assertEqual(result, SparseDict.fromkeys('abc'))
+        result = keys.intersection(['b', 'x'], SparseDict)
+        self.assertEqual(result, SparseDict({'b': None}))
+        result = d1.viewitems().symmetric_difference(d2.viewitems(), result_type=SparseDict)
+        self.assertEqual(sorted(result.keys()), [('a', 1), ('b', 2), ('b', 3), ('c', 2)])
+
+        class Sub(SparseDict):
+            pass
+        self.assertIs(type(keys.difference('b', result_type=Sub)), Sub)
+        self.assertRaises(TypeError, keys.union, d2, result_type=list)
+        self.assertRaises(TypeError, keys.union)